@@ -17,57 +17,269 @@ limitations under the License.
 #include "../../fbclock/fbclock.h"
 
 #include <ctype.h> // for isprint
+#include <errno.h> // for errno, ERANGE
 #include <fcntl.h> // For O_* constants
+#include <stdint.h> // for fixed width types
 #include <stdio.h> // for printf and perror
 #include <stdlib.h> // for EXIT_* constants
+#include <string.h> // for strcmp
+#include <time.h> // for clock_nanosleep
 #include <unistd.h> // for sleep, getopt
 
+#define NSEC_PER_SEC 1000000000ULL
+// stdout buffer in streaming mode, so writes don't pace the sampling
+#define STREAM_BUF_SIZE (1 << 20)
+// longest -s interval, keeps interval and sleep deadlines far from overflow
+#define MAX_INTERVAL_US 3600000000ULL
+
+enum stream_format {
+  STREAM_CSV,
+  STREAM_BINARY,
+};
+
+// binary output record, host byte order
+typedef struct stream_record {
+  uint64_t earliest_ns;
+  uint64_t latest_ns;
+  uint32_t call_ns; // duration of fbclock_gettime call
+  int32_t err; // FBCLOCK_E_* code
+} stream_record;
+
 void show_error(int err_code) {
   puts(fbclock_strerror(err_code));
 }
 
+static uint64_t now_ns(clockid_t clk) {
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+// parse decimal option value, exits on garbage, sign or values above max
+static uint64_t parse_uint64(char opt, const char* arg, uint64_t max) {
+  char* end;
+  errno = 0;
+  uint64_t v = strtoull(arg, &end, 10);
+  // strtoull happily negates "-1"
+  if (!isdigit((unsigned char)arg[0]) || *end != '\0' || errno == ERANGE ||
+      v > max) {
+    fprintf(stderr, "-%c needs a number from 0 to %lu, got %s\n", opt, max, arg);
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+static int cmp_uint64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return (x > y) - (x < y);
+}
+
+// sorts values in place
+static void print_stats(const char* name, uint64_t* values, uint64_t n) {
+  if (n == 0) {
+    fprintf(stderr, "%s: no samples\n", name);
+    return;
+  }
+  qsort(values, n, sizeof(*values), cmp_uint64);
+  fprintf(
+      stderr,
+      "%s: min=%lu p50=%lu p99=%lu max=%lu ns\n",
+      name,
+      values[0],
+      values[n / 2],
+      values[n * 99 / 100],
+      values[n - 1]);
+}
+
+// Read TrueTime every interval_ns (back to back if 0) and write each sample
+// to stdout. Errors are recorded, not fatal, so the stream shows them.
+static int stream(
+    fbclock_lib* lib,
+    uint64_t interval_ns,
+    uint64_t count,
+    enum stream_format format,
+    int stats) {
+  uint64_t* call_ns = NULL;
+  uint64_t* wou_ns = NULL;
+  uint64_t n_ok = 0;
+  uint64_t n_err = 0;
+  uint64_t overruns = 0;
+
+  if (stats) {
+    call_ns = malloc(count * sizeof(*call_ns));
+    wou_ns = malloc(count * sizeof(*wou_ns));
+    if (call_ns == NULL || wou_ns == NULL) {
+      perror("malloc");
+      return -1;
+    }
+  }
+  setvbuf(stdout, NULL, _IOFBF, STREAM_BUF_SIZE);
+  if (format == STREAM_CSV) {
+    printf("earliest_ns,latest_ns,wou_ns,call_ns,error\n");
+  }
+
+  uint64_t next = now_ns(CLOCK_MONOTONIC);
+  for (uint64_t i = 0; count == 0 || i < count; i++) {
+    if (interval_ns > 0) {
+      struct timespec ts = {
+          .tv_sec = next / NSEC_PER_SEC, .tv_nsec = next % NSEC_PER_SEC};
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)) {
+      }
+      next += interval_ns;
+      // don't burst to catch up after a stall, just skip missed ticks
+      uint64_t now = now_ns(CLOCK_MONOTONIC);
+      if (now > next) {
+        overruns += (now - next) / interval_ns + 1;
+        next = now + interval_ns - (now - next) % interval_ns;
+      }
+    }
+
+    fbclock_truetime tt = {0, 0};
+    uint64_t before = now_ns(CLOCK_MONOTONIC_RAW);
+    int err = fbclock_gettime(lib, &tt);
+    uint64_t call = now_ns(CLOCK_MONOTONIC_RAW) - before;
+
+    if (err == 0) {
+      if (stats) {
+        call_ns[n_ok] = call;
+        wou_ns[n_ok] = tt.latest_ns - tt.earliest_ns;
+      }
+      n_ok++;
+    } else {
+      n_err++;
+    }
+    if (format == STREAM_BINARY) {
+      stream_record r = {
+          .earliest_ns = tt.earliest_ns,
+          .latest_ns = tt.latest_ns,
+          .call_ns = call > UINT32_MAX ? UINT32_MAX : (uint32_t)call,
+          .err = err};
+      fwrite(&r, sizeof(r), 1, stdout);
+    } else {
+      printf(
+          "%lu,%lu,%lu,%lu,%d\n",
+          tt.earliest_ns,
+          tt.latest_ns,
+          tt.latest_ns - tt.earliest_ns,
+          call,
+          err);
+    }
+  }
+  fflush(stdout);
+
+  if (stats) {
+    fprintf(
+        stderr,
+        "samples: %lu ok, %lu errors, %lu missed ticks\n",
+        n_ok,
+        n_err,
+        overruns);
+    print_stats("call", call_ns, n_ok);
+    print_stats("wou", wou_ns, n_ok);
+    free(call_ns);
+    free(wou_ns);
+  }
+  return 0;
+}
+
 int main(int argc, char* argv[]) {
   fbclock_truetime truetime;
   fbclock_lib lib;
   int err;
 
   int fflag = 0;
+  int sflag = 0;
+  int stats = 0;
+  uint64_t interval_ns = 0;
+  uint64_t count = 0;
+  enum stream_format format = STREAM_CSV;
+  char* iface = NULL;
   int c;
 
-  while ((c = getopt(argc, argv, "f")) != -1)
+  while ((c = getopt(argc, argv, "fi:s:n:o:S")) != -1)
     switch (c) {
       case 'f':
         fflag = 1;
         break;
+      case 'i':
+        iface = optarg;
+        break;
+      case 's':
+        sflag = 1;
+        interval_ns = parse_uint64(c, optarg, MAX_INTERVAL_US) * 1000;
+        break;
+      case 'n':
+        count = parse_uint64(c, optarg, UINT64_MAX);
+        break;
+      case 'o':
+        if (strcmp(optarg, "csv") == 0) {
+          format = STREAM_CSV;
+        } else if (strcmp(optarg, "bin") == 0) {
+          format = STREAM_BINARY;
+        } else {
+          fprintf(stderr, "unknown output format %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'S':
+        stats = 1;
+        break;
       default:
         fprintf(
             stderr,
-            "Usage: %s [-f]\n  -f will print TrueTime in a loop\n",
+            "Usage: %s [-f] [-i iface] [-s interval_us [-n count] [-o csv|bin] [-S]]\n"
+            "  -f will print TrueTime in a loop\n"
+            "  -i will use data and PHC of a per-interface daemon\n"
+            "  -s will stream TrueTime every interval_us (0 for back to back)\n"
+            "  -n will stop after count samples (0 for no limit)\n"
+            "  -o sets streaming output format, csv (default) or binary records\n"
+            "  -S will print call duration and WOU stats to stderr, needs -n\n",
             argv[0]);
         exit(EXIT_FAILURE);
     }
 
-  err = fbclock_init(&lib, FBCLOCK_PATH);
+  if (stats && count == 0) {
+    fprintf(stderr, "-S needs a sample count (-n)\n");
+    exit(EXIT_FAILURE);
+  }
+  // per-sample stats are kept in memory
+  if (stats && count > SIZE_MAX / sizeof(uint64_t)) {
+    fprintf(stderr, "-S can't keep stats of %lu samples\n", count);
+    exit(EXIT_FAILURE);
+  }
+
+  if (iface != NULL) {
+    err = fbclock_init_iface(&lib, iface);
+  } else {
+    err = fbclock_init(&lib, FBCLOCK_PATH);
+  }
   if (err != 0) {
     show_error(err);
     exit(EXIT_FAILURE);
   };
 
-  while (1) {
-    err = fbclock_gettime(&lib, &truetime);
-    if (err != 0) {
-      show_error(err);
+  if (sflag) {
+    if (stream(&lib, interval_ns, count, format, stats) != 0) {
       exit(EXIT_FAILURE);
     }
-    printf("TrueTime:\n");
-    printf("\tEarliest: %lu\n", truetime.earliest_ns);
-    printf("\tLatest: %lu\n", truetime.latest_ns);
-    printf("\tWOU=%lu ns\n", truetime.latest_ns - truetime.earliest_ns);
-    // if not asked to loop - stop
-    if (!fflag) {
-      break;
+  } else {
+    for (uint64_t i = 0; count == 0 || i < count; i++) {
+      err = fbclock_gettime(&lib, &truetime);
+      if (err != 0) {
+        show_error(err);
+        exit(EXIT_FAILURE);
+      }
+      printf("TrueTime:\n");
+      printf("\tEarliest: %lu\n", truetime.earliest_ns);
+      printf("\tLatest: %lu\n", truetime.latest_ns);
+      printf("\tWOU=%lu ns\n", truetime.latest_ns - truetime.earliest_ns);
+      // if not asked to loop - stop
+      if (!fflag) {
+        break;
+      }
+      sleep(1);
     }
-    sleep(1);
   }
 
   err = fbclock_destroy(&lib);
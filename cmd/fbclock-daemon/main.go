@@ -68,6 +68,9 @@ func main() {
 	flag.StringVar(&csvPath, "csvpath", "", "write CSV log into this file")
 	flag.IntVar(&logSampleRate, "logsamplerate", 1, "Sample metrics logs at this rate. 0 means metrics logging is turned off. 1 means every sample is logged, 100 means roughly one in 100 samples will be logged")
 	flag.BoolVar(&verbose, "verbose", false, "Verbose logging")
+	flag.BoolVar(&cfg.PerIface, "periface", false, "Publish to per-interface shm and managed device paths (suffixed with .<iface>), to run a daemon per NIC on multi-NIC hosts")
+	flag.IntVar(&cfg.JournalCapacity, "journal", 0, "Number of records kept in the journal of published data, for lookups of data in effect at a past PHC time (128 bytes each, 65536 keep 18 hours of 1s updates). 0 means disabled")
+	flag.DurationVar(&cfg.PHCRingInterval, "phcring", 0, "Sample PHC at this interval into per-NUMA-node rings, so clients in FBCLOCK_READ_SERVICE mode don't read PHC themselves. 0 means disabled")
 
 	flag.Parse()
 
@@ -89,7 +92,7 @@ func main() {
 		log.Fatal(err)
 	}
 	if manageDevice {
-		if err := daemon.SetupDeviceDir(cfg.Iface); err != nil {
+		if err := daemon.SetupDeviceDirCustom(cfg.Iface, cfg.DevicePath()); err != nil {
 			log.Fatal(err)
 		}
 	}
@@ -0,0 +1,460 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+#include <benchmark/benchmark.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../fbclock.h"
+#include "../fbclock_inline.h"
+
+static const int64_t kPHCTime = 1647269091803102957;
+
+static fbclock_clockdata bench_data() {
+  fbclock_clockdata data = {
+      .ingress_time_ns = kPHCTime - 1000000,
+      .error_bound_ns = 172,
+      .holdover_multiplier_ns = 50,
+      .clock_smearing_start_s = 1641081600,
+      .clock_smearing_end_s = 1641144600,
+      .utc_offset_pre_s = 37,
+      .utc_offset_post_s = 38,
+  };
+  return data;
+}
+
+static inline uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// per-op latency recorder, reports p50/p99/p999 as benchmark counters.
+// Latencies include the cost of one clock_gettime(CLOCK_MONOTONIC) call.
+class Latencies {
+ public:
+  explicit Latencies(benchmark::State& state) : state_(state) {
+    samples_.reserve(state.max_iterations);
+  }
+
+  void add(uint64_t ns) {
+    samples_.push_back(ns);
+  }
+
+  ~Latencies() {
+    if (samples_.empty()) {
+      return;
+    }
+    std::sort(samples_.begin(), samples_.end());
+    report("p50_ns", 0.5);
+    report("p99_ns", 0.99);
+    report("p999_ns", 0.999);
+  }
+
+ private:
+  void report(const char* name, double q) {
+    size_t i = (size_t)(q * (samples_.size() - 1));
+    state_.counters[name] = benchmark::Counter(
+        (double)samples_[i], benchmark::Counter::kAvgThreads);
+  }
+
+  benchmark::State& state_;
+  std::vector<uint64_t> samples_;
+};
+
+// writer publishing data in a loop to make readers retry
+class BackgroundWriter {
+ public:
+  BackgroundWriter(void* shmp, int version) {
+    writer_.shmp = shmp;
+    writer_.size = 0;
+    writer_.version = version;
+    thread_ = std::thread([this] {
+      fbclock_clockdata data = bench_data();
+      while (!stop_.load(std::memory_order_relaxed)) {
+        data.ingress_time_ns++;
+        fbclock_writer_store(&writer_, &data);
+      }
+    });
+  }
+
+  ~BackgroundWriter() {
+    stop_.store(true);
+    thread_.join();
+  }
+
+ private:
+  fbclock_writer writer_;
+  std::atomic<bool> stop_{false};
+  std::thread thread_;
+};
+
+static fbclock_shmdata shm_v1;
+static fbclock_shmdata_v2 shm_v2;
+
+static void BM_LoadData(benchmark::State& state) {
+  BackgroundWriter* writer = nullptr;
+  if (state.thread_index() == 0 && state.range(0)) {
+    writer = new BackgroundWriter(&shm_v1, 1);
+  }
+  fbclock_clockdata data;
+  for (auto _ : state) {
+    fbclock_clockdata_load_data(&shm_v1, &data);
+    benchmark::DoNotOptimize(data);
+  }
+  delete writer;
+}
+BENCHMARK(BM_LoadData)->ArgName("writer")->Arg(0)->Arg(1)->ThreadRange(1, 8);
+
+static void BM_LoadDataV2(benchmark::State& state) {
+  BackgroundWriter* writer = nullptr;
+  if (state.thread_index() == 0 && state.range(0)) {
+    writer = new BackgroundWriter(&shm_v2, 2);
+  }
+  fbclock_clockdata data;
+  for (auto _ : state) {
+    fbclock_clockdata_load_data_v2(&shm_v2, &data);
+    benchmark::DoNotOptimize(data);
+  }
+  delete writer;
+}
+BENCHMARK(BM_LoadDataV2)->ArgName("writer")->Arg(0)->Arg(1)->ThreadRange(1, 8);
+
+static void BM_CalculateTime(benchmark::State& state) {
+  fbclock_clockdata data = bench_data();
+  fbclock_truetime truetime;
+  int64_t phc = kPHCTime;
+  for (auto _ : state) {
+    fbclock_calculate_time(
+        172.0, 50.0 / 65536.0, &data, phc++, &truetime, state.range(0));
+    benchmark::DoNotOptimize(truetime);
+  }
+}
+BENCHMARK(BM_CalculateTime)
+    ->ArgName("tz")
+    ->Arg(FBCLOCK_TAI)
+    ->Arg(FBCLOCK_UTC);
+
+static void BM_CalculateTimeNS(benchmark::State& state) {
+  fbclock_clockdata data = bench_data();
+  fbclock_truetime truetime;
+  int64_t phc = kPHCTime;
+  for (auto _ : state) {
+    fbclock_calculate_time_ns(
+        172, 50, &data, phc++, &truetime, state.range(0));
+    benchmark::DoNotOptimize(truetime);
+  }
+}
+BENCHMARK(BM_CalculateTimeNS)
+    ->ArgName("tz")
+    ->Arg(FBCLOCK_TAI)
+    ->Arg(FBCLOCK_UTC);
+
+// header-only calculation, inlined into the caller
+static void BM_CalculateTimeInline(benchmark::State& state) {
+  fbclock_clockdata data = bench_data();
+  fbclock_truetime truetime;
+  int64_t phc = kPHCTime;
+  for (auto _ : state) {
+    fbclock_inline_truetime(&data, phc++, 10, &truetime, state.range(0));
+    benchmark::DoNotOptimize(truetime);
+  }
+}
+BENCHMARK(BM_CalculateTimeInline)
+    ->ArgName("tz")
+    ->Arg(FBCLOCK_TAI)
+    ->Arg(FBCLOCK_UTC);
+
+static void BM_LoadDataV2Inline(benchmark::State& state) {
+  fbclock_writer writer = {.shmp = &shm_v2, .size = 0, .version = 2};
+  fbclock_clockdata data = bench_data();
+  fbclock_writer_store(&writer, &data);
+  unsigned tries;
+  for (auto _ : state) {
+    fbclock_inline_load_data_v2(&shm_v2, &data, &tries);
+    benchmark::DoNotOptimize(data);
+  }
+}
+BENCHMARK(BM_LoadDataV2Inline);
+
+static void BM_ApplyUTCOffset(benchmark::State& state) {
+  fbclock_clockdata data = bench_data();
+  if (state.range(0)) {
+    // values published by the daemon
+    data.clock_smearing_start_ns = data.clock_smearing_start_s * 1000000000ULL;
+    data.clock_smearing_end_ns = data.clock_smearing_end_s * 1000000000ULL;
+    data.utc_offset_pre_ns = data.utc_offset_pre_s * 1000000000LL;
+    data.utc_offset_post_ns = data.utc_offset_post_s * 1000000000LL;
+    data.smear_step_mult = 283796062672455;
+    data.smear_step_shift = 64;
+  }
+  // inside smearing window, the most expensive case
+  int64_t phc = data.clock_smearing_start_s * 1000000000LL + 1000;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(fbclock_apply_utc_offset(&data, phc++));
+  }
+}
+BENCHMARK(BM_ApplyUTCOffset)->ArgName("precomputed")->Arg(0)->Arg(1);
+
+static void BM_ApplySmear(benchmark::State& state) {
+  uint64_t start = 1641081600ULL * 1000000000ULL;
+  uint64_t end = 1641144600ULL * 1000000000ULL;
+  // inside smearing window, the most expensive case
+  uint64_t t = start + 1000;
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(fbclock_apply_smear(
+        t++, 37000000000ULL, 38000000000ULL, start, end, 1));
+  }
+}
+BENCHMARK(BM_ApplySmear);
+
+// offline conversion of recorded PHC timestamps across a smearing window,
+// one by one vs batch
+static void BM_TrueTimeConvert(benchmark::State& state) {
+  fbclock_clockdata data = bench_data();
+  data.ingress_time_ns = data.clock_smearing_start_s * 1000000000LL;
+  data.clock_smearing_start_ns = data.clock_smearing_start_s * 1000000000ULL;
+  data.clock_smearing_end_ns = data.clock_smearing_end_s * 1000000000ULL;
+  data.utc_offset_pre_ns = data.utc_offset_pre_s * 1000000000LL;
+  data.utc_offset_post_ns = data.utc_offset_post_s * 1000000000LL;
+  data.smear_step_mult = 283796062672455;
+  data.smear_step_shift = 64;
+  std::vector<int64_t> phc(4096);
+  for (size_t i = 0; i < phc.size(); i++) {
+    phc[i] = data.ingress_time_ns + (int64_t)(i * 16000037);
+  }
+  std::vector<fbclock_truetime> tts(phc.size());
+  for (auto _ : state) {
+    if (state.range(0)) {
+      fbclock_truetime_batch(
+          &data, phc.data(), nullptr, phc.size(), tts.data(), FBCLOCK_UTC);
+    } else {
+      for (size_t i = 0; i < phc.size(); i++) {
+        fbclock_calculate_time_ns(
+            data.error_bound_ns,
+            data.holdover_multiplier_ns,
+            &data,
+            phc[i],
+            &tts[i],
+            FBCLOCK_UTC);
+      }
+    }
+    benchmark::DoNotOptimize(tts.data());
+  }
+  state.SetItemsProcessed(state.iterations() * phc.size());
+  state.SetBytesProcessed(state.iterations() * phc.size() * sizeof(int64_t));
+}
+BENCHMARK(BM_TrueTimeConvert)->ArgName("batch")->Arg(0)->Arg(1);
+
+static int mock_gettime(int fd, struct phc_time_res* res) {
+  res->ts = kPHCTime;
+  res->delay = 10;
+  return 0;
+}
+
+// full fbclock_gettime_tz path with mocked PHC backend
+static void BM_GettimeMock(benchmark::State& state) {
+  static fbclock_shmdata_v2 shm = {};
+  if (state.thread_index() == 0) {
+    fbclock_writer writer = {.shmp = &shm, .size = 0, .version = 2};
+    fbclock_clockdata data = bench_data();
+    fbclock_writer_store(&writer, &data);
+  }
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime = mock_gettime;
+  fbclock_truetime truetime;
+  Latencies latencies(state);
+  for (auto _ : state) {
+    uint64_t start = now_ns();
+    fbclock_gettime_tz(&lib, &truetime, state.range(0));
+    latencies.add(now_ns() - start);
+    benchmark::DoNotOptimize(truetime);
+  }
+}
+BENCHMARK(BM_GettimeMock)
+    ->ArgName("tz")
+    ->Arg(FBCLOCK_TAI)
+    ->Arg(FBCLOCK_UTC)
+    ->ThreadRange(1, 8);
+
+// coarse path, mocked PHC is only read once per FBCLOCK_COARSE_MAX_AGE_NS
+static void BM_GettimeCoarseMock(benchmark::State& state) {
+  static fbclock_shmdata_v2 shm = {};
+  if (state.thread_index() == 0) {
+    fbclock_writer writer = {.shmp = &shm, .size = 0, .version = 2};
+    fbclock_clockdata data = bench_data();
+    fbclock_writer_store(&writer, &data);
+  }
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime = mock_gettime;
+  fbclock_truetime truetime;
+  Latencies latencies(state);
+  for (auto _ : state) {
+    uint64_t start = now_ns();
+    fbclock_gettime_coarse(&lib, &truetime, state.range(0));
+    latencies.add(now_ns() - start);
+    benchmark::DoNotOptimize(truetime);
+  }
+}
+BENCHMARK(BM_GettimeCoarseMock)
+    ->ArgName("tz")
+    ->Arg(FBCLOCK_TAI)
+    ->Arg(FBCLOCK_UTC)
+    ->ThreadRange(1, 8);
+
+// simulated PHC with ~1us ioctl and daemon publishing every 1ms,
+// shared by all threads like the real device and shmem
+static fbclock_sim* bench_sim() {
+  static fbclock_sim* sim = [] {
+    FILE* f = tmpfile();
+    ftruncate(fileno(f), FBCLOCK_SHMDATA_V2_SIZE);
+    fbclock_sim_options opts = {};
+    opts.drift_ppb = 2000;
+    opts.delay_ns = 800;
+    opts.delay_spread_ns = 300;
+    opts.delay_dist = FBCLOCK_SIM_DELAY_EXP;
+    opts.spin = 1;
+    opts.seed = 1;
+    opts.update_interval_ns = 1000000;
+    opts.error_bound_ns = 172;
+    opts.holdover_multiplier_ns = 50 << 16;
+    opts.sysclock_error_ns = 20;
+    fbclock_sim* s = new fbclock_sim;
+    fbclock_sim_open(s, &opts, fileno(f), 2);
+    return s;
+  }();
+  return sim;
+}
+
+// full fbclock_gettime_tz path with simulated PHC and daemon, reports WOU
+static void BM_GettimeSim(benchmark::State& state) {
+  fbclock_sim* sim = bench_sim();
+  fbclock_lib lib = {};
+  lib.shmp_v2 = (fbclock_shmdata_v2*)sim->writer.shmp;
+  lib.read_mode = state.range(1) ? FBCLOCK_READ_SYSCLOCK : FBCLOCK_READ_PHC;
+  fbclock_backend backend = fbclock_sim_backend(sim);
+  fbclock_set_backend(&lib, &backend);
+  fbclock_truetime truetime;
+  uint64_t wou = 0;
+  int err = 0;
+  Latencies latencies(state);
+  for (auto _ : state) {
+    uint64_t start = now_ns();
+    err |= fbclock_gettime_tz(&lib, &truetime, state.range(0));
+    latencies.add(now_ns() - start);
+    wou += truetime.latest_ns - truetime.earliest_ns;
+  }
+  if (err) {
+    state.SkipWithError("fbclock_gettime_tz failed");
+  }
+  state.counters["wou_ns"] = benchmark::Counter(
+      (double)wou / state.iterations(), benchmark::Counter::kAvgThreads);
+}
+BENCHMARK(BM_GettimeSim)
+    ->ArgNames({"tz", "sysclock"})
+    ->ArgsProduct({{FBCLOCK_TAI, FBCLOCK_UTC}, {0, 1}})
+    ->ThreadRange(1, 8);
+
+// reader service sampling simulated PHC every 100us, like fbclock-daemon
+// with -phcring. PHC load doesn't depend on the number of readers.
+static fbclock_phc_ring* bench_phc_ring() {
+  static fbclock_phc_ring* ring = [] {
+    std::string path = std::string(P_tmpdir) + "/fbclock_bench_phc_ring";
+    fbclock_phc_ring* r = new fbclock_phc_ring;
+    fbclock_phc_ring_create(r, path.c_str(), 16, 100000);
+    // stays mapped
+    unlink(path.c_str());
+    std::thread([r] {
+      fbclock_sim* sim = bench_sim();
+      struct timespec ts;
+      for (;;) {
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        int64_t before = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        fbclock_phc_sample sample;
+        sample.phc_time_ns = fbclock_sim_phc_time(sim);
+        clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+        int64_t after = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        sample.sysclock_time_ns = before + (after - before) / 2;
+        sample.delay_ns = after - before;
+        fbclock_phc_ring_publish(r, &sample);
+        usleep(100);
+      }
+    }).detach();
+    return r;
+  }();
+  return ring;
+}
+
+// full fbclock_gettime_tz path reading PHC through the reader service
+static void BM_GettimeService(benchmark::State& state) {
+  fbclock_sim* sim = bench_sim();
+  fbclock_lib lib = {};
+  lib.shmp_v2 = (fbclock_shmdata_v2*)sim->writer.shmp;
+  lib.phc_ring = *bench_phc_ring();
+  lib.read_mode = FBCLOCK_READ_SERVICE;
+  // fallback if the sampler is late
+  fbclock_backend backend = fbclock_sim_backend(sim);
+  fbclock_set_backend(&lib, &backend);
+  fbclock_truetime truetime;
+  uint64_t wou = 0;
+  int err = 0;
+  Latencies latencies(state);
+  for (auto _ : state) {
+    uint64_t start = now_ns();
+    err |= fbclock_gettime_tz(&lib, &truetime, FBCLOCK_TAI);
+    latencies.add(now_ns() - start);
+    wou += truetime.latest_ns - truetime.earliest_ns;
+  }
+  if (err) {
+    state.SkipWithError("fbclock_gettime_tz failed");
+  }
+  state.counters["wou_ns"] = benchmark::Counter(
+      (double)wou / state.iterations(), benchmark::Counter::kAvgThreads);
+}
+BENCHMARK(BM_GettimeService)->ThreadRange(1, 8);
+
+// full fbclock_gettime_tz path against real PHC and daemon data
+static void BM_GettimePHC(benchmark::State& state) {
+  fbclock_lib lib = {};
+  if (fbclock_init(&lib, FBCLOCK_PATH) != FBCLOCK_E_NO_ERROR) {
+    state.SkipWithError("fbclock_init failed, is fbclock-daemon running?");
+    return;
+  }
+  fbclock_truetime truetime;
+  int err = 0;
+  Latencies latencies(state);
+  for (auto _ : state) {
+    uint64_t start = now_ns();
+    err |= fbclock_gettime(&lib, &truetime);
+    latencies.add(now_ns() - start);
+    benchmark::DoNotOptimize(truetime);
+  }
+  if (err) {
+    state.SkipWithError("fbclock_gettime failed");
+  }
+  fbclock_destroy(&lib);
+}
+BENCHMARK(BM_GettimePHC)->ThreadRange(1, 8);
+
+BENCHMARK_MAIN();
@@ -15,13 +15,22 @@ limitations under the License.
 */
 
 #include <gtest/gtest.h>
+#include <dirent.h>
+#include <errno.h>
+#include <linux/ptp_clock.h>
 #include <stdio.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <atomic>
 #include <cmath>
 #include <future>
+#include <string>
 #include <thread>
+#include <vector>
 
 #include "../fbclock.h"
+#include "../fbclock_cpp.h"
+#include "../fbclock_inline.h"
 
 TEST(fbclockTest, test_write_read) {
   int err;
@@ -66,6 +75,57 @@ TEST(fbclockTest, test_write_read) {
   remove(test_shm);
 }
 
+// CRC as checked by v1 readers deployed before any field was appended
+uint64_t baseline_clockdata_crc(const fbclock_clockdata* value) {
+  uint64_t counter = fbclock_crc64(0xFFFFFFFF, value->ingress_time_ns);
+  counter = fbclock_crc64(counter, value->error_bound_ns);
+  counter = fbclock_crc64(counter, value->holdover_multiplier_ns);
+  return counter ^ 0xFFFFFFFF;
+}
+
+TEST(fbclockTest, test_v1_baseline_crc) {
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269082943150996,
+      .error_bound_ns = 100,
+      .holdover_multiplier_ns = 50,
+      .clock_smearing_start_s = 1483228836,
+      .clock_smearing_end_s = 1483293836,
+      .utc_offset_pre_s = 36,
+      .utc_offset_post_s = 37,
+      .phc_time_ns = 1647269082943150996,
+      .sysclock_time_ns = 123456789,
+      .coef_ppb = -12345,
+      .sysclock_error_ns = 10,
+      .sysclock_error_ppb = 20,
+      .clock_smearing_start_ns = 1483228836000000000,
+      .clock_smearing_end_ns = 1483293836000000000,
+      .utc_offset_pre_ns = 36000000000,
+      .utc_offset_post_ns = 37000000000,
+      .smear_step_mult = 283796062672455,
+      .smear_step_shift = 64,
+      .ptp_caps = FBCLOCK_PTP_CAP_PROBED | FBCLOCK_PTP_CAP_PRECISE,
+  };
+  fbclock_shmdata shm = {};
+  fbclock_writer writer = {.shmp = &shm, .size = 0, .version = 1};
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+  EXPECT_EQ(shm.crc, baseline_clockdata_crc(&shm.data));
+  EXPECT_EQ(shm.data.ingress_time_ns, data.ingress_time_ns);
+  EXPECT_EQ(shm.data.utc_offset_post_s, 37);
+  // appended fields are left to seqlock protected layouts
+  EXPECT_EQ(shm.data.phc_time_ns, 0);
+  EXPECT_EQ(shm.data.sysclock_time_ns, 0);
+  EXPECT_EQ(shm.data.coef_ppb, 0);
+  EXPECT_EQ(shm.data.sysclock_error_ns, 0);
+  EXPECT_EQ(shm.data.sysclock_error_ppb, 0);
+  EXPECT_EQ(shm.data.smear_step_mult, 0);
+  EXPECT_EQ(shm.data.ptp_caps, 0);
+  // UTC is still converted from the baseline fields
+  int64_t t = 1483261345123456789;
+  EXPECT_EQ(
+      fbclock_apply_utc_offset(&shm.data, t),
+      fbclock_apply_utc_offset(&data, t));
+}
+
 int writer_thread(int sfd_rw, int tries) {
   int err;
   fbclock_clockdata data = {
@@ -145,6 +205,1750 @@ TEST(fbclockTest, test_concurrent) {
   remove(test_shm);
 }
 
+TEST(fbclockTest, test_write_read_v2) {
+  int err;
+  char* test_shm = std::tmpnam(nullptr);
+
+  FILE* f = fopen(test_shm, "wb+");
+  int sfd_rw = fileno(f);
+  ASSERT_NE(sfd_rw, -1);
+
+  err = ftruncate(sfd_rw, FBCLOCK_SHMDATA_V2_SIZE);
+  ASSERT_EQ(err, 0);
+
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1,
+      .error_bound_ns = 2,
+      .holdover_multiplier_ns = 3,
+      .clock_smearing_start_s = 4,
+      .clock_smearing_end_s = 5,
+      .utc_offset_pre_s = 6,
+      .utc_offset_post_s = 7};
+  err = fbclock_clockdata_store_data_v2(sfd_rw, &data);
+  ASSERT_EQ(err, 0);
+
+  fbclock_shmdata_v2* shmp = (fbclock_shmdata_v2*)mmap(
+      nullptr, FBCLOCK_SHMDATA_V2_SIZE, PROT_READ, MAP_SHARED, sfd_rw, 0);
+  ASSERT_NE(shmp, MAP_FAILED);
+  // writer is done, seq must be even
+  EXPECT_EQ(shmp->seq, 2);
+
+  fbclock_clockdata read_data;
+  err = fbclock_clockdata_load_data_v2(shmp, &read_data);
+  ASSERT_EQ(err, 0);
+
+  EXPECT_EQ(data.ingress_time_ns, read_data.ingress_time_ns);
+  EXPECT_EQ(data.error_bound_ns, read_data.error_bound_ns);
+  EXPECT_EQ(data.holdover_multiplier_ns, read_data.holdover_multiplier_ns);
+  EXPECT_EQ(data.clock_smearing_start_s, read_data.clock_smearing_start_s);
+  EXPECT_EQ(data.clock_smearing_end_s, read_data.clock_smearing_end_s);
+  EXPECT_EQ(data.utc_offset_pre_s, read_data.utc_offset_pre_s);
+  EXPECT_EQ(data.utc_offset_post_s, read_data.utc_offset_post_s);
+
+  munmap(shmp, FBCLOCK_SHMDATA_V2_SIZE);
+  fclose(f);
+  remove(test_shm);
+}
+
+TEST(fbclockTest, test_writer) {
+  int err;
+  fbclock_writer writer = {};
+  fbclock_clockdata read_data;
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1, .error_bound_ns = 2, .holdover_multiplier_ns = 3};
+
+  // not opened yet
+  err = fbclock_writer_store(&writer, &data);
+  ASSERT_EQ(err, FBCLOCK_E_INVALID_ARGUMENT);
+
+  for (int version = 1; version <= 2; version++) {
+    char* test_shm = std::tmpnam(nullptr);
+    FILE* f = fopen(test_shm, "wb+");
+    int sfd_rw = fileno(f);
+    ASSERT_NE(sfd_rw, -1);
+    err = ftruncate(sfd_rw, FBCLOCK_SHMDATA_V2_SIZE);
+    ASSERT_EQ(err, 0);
+
+    err = fbclock_writer_open(&writer, sfd_rw, version);
+    ASSERT_EQ(err, 0);
+    // same mapping is reused for every store
+    for (int i = 1; i <= 10; i++) {
+      data.ingress_time_ns = i;
+      err = fbclock_writer_store(&writer, &data);
+      ASSERT_EQ(err, 0);
+    }
+
+    void* shmp = mmap(
+        nullptr, FBCLOCK_SHMDATA_V2_SIZE, PROT_READ, MAP_SHARED, sfd_rw, 0);
+    ASSERT_NE(shmp, MAP_FAILED);
+    if (version == 1) {
+      err = fbclock_clockdata_load_data((fbclock_shmdata*)shmp, &read_data);
+    } else {
+      err = fbclock_clockdata_load_data_v2(
+          (fbclock_shmdata_v2*)shmp, &read_data);
+      EXPECT_EQ(((fbclock_shmdata_v2*)shmp)->seq, 20);
+    }
+    ASSERT_EQ(err, 0);
+    EXPECT_EQ(read_data.ingress_time_ns, 10);
+    EXPECT_EQ(read_data.error_bound_ns, 2);
+
+    err = fbclock_writer_close(&writer);
+    ASSERT_EQ(err, 0);
+    EXPECT_EQ(writer.shmp, nullptr);
+    munmap(shmp, FBCLOCK_SHMDATA_V2_SIZE);
+    fclose(f);
+    remove(test_shm);
+  }
+
+  err = fbclock_writer_open(&writer, 0, 42);
+  ASSERT_EQ(err, FBCLOCK_E_INVALID_ARGUMENT);
+}
+
+TEST(fbclockTest, test_read_v2_torn) {
+  fbclock_shmdata_v2 shm = {};
+  fbclock_clockdata read_data;
+
+  // writer never finishes, reader must not return partial data
+  shm.seq = 1;
+  int err = fbclock_clockdata_load_data_v2(&shm, &read_data);
+  ASSERT_EQ(err, FBCLOCK_E_SEQ_MISMATCH);
+}
+
+int writer_thread_v2(int sfd_rw, int tries) {
+  int err;
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1, .error_bound_ns = 2, .holdover_multiplier_ns = 3};
+  for (int i = 0; i < tries; i++) {
+    err = fbclock_clockdata_store_data_v2(sfd_rw, &data);
+    if (err != 0) {
+      return err;
+    }
+    data.ingress_time_ns = data.ingress_time_ns + 1;
+    if (data.ingress_time_ns > 10000) {
+      data.ingress_time_ns = 1;
+    }
+    data.error_bound_ns = data.ingress_time_ns * 2;
+    data.holdover_multiplier_ns = data.ingress_time_ns * 3;
+    data.utc_offset_post_s = data.ingress_time_ns * 4;
+  }
+  return 0;
+}
+
+int reader_thread_v2(fbclock_shmdata_v2* shmp, int tries) {
+  int err;
+  fbclock_clockdata data;
+  for (int i = 0; i < tries; i++) {
+    err = fbclock_clockdata_load_data_v2(shmp, &data);
+    if (err != 0) {
+      return err;
+    }
+    if (data.ingress_time_ns * 2 != data.error_bound_ns ||
+        data.ingress_time_ns * 3 != data.holdover_multiplier_ns ||
+        data.ingress_time_ns * 4 != data.utc_offset_post_s) {
+      printf("ingress_time_ns: %lu\n", data.ingress_time_ns);
+      printf("error_bound_ns: %d\n", data.error_bound_ns);
+      printf("holdover_multiplier_ns: %d\n", data.holdover_multiplier_ns);
+      printf("utc_offset_post_s: %d\n", data.utc_offset_post_s);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+TEST(fbclockTest, test_concurrent_v2) {
+  int err;
+  char* test_shm = std::tmpnam(nullptr);
+
+  FILE* f_rw = fopen(test_shm, "wb+");
+  int sfd_rw = fileno(f_rw);
+  ASSERT_NE(sfd_rw, -1);
+
+  err = ftruncate(sfd_rw, FBCLOCK_SHMDATA_V2_SIZE);
+  ASSERT_EQ(err, 0);
+
+  // make sure there is something to read
+  fbclock_clockdata data = {};
+  err = fbclock_clockdata_store_data_v2(sfd_rw, &data);
+  ASSERT_EQ(err, 0);
+
+  fbclock_shmdata_v2* shmp = (fbclock_shmdata_v2*)mmap(
+      nullptr, FBCLOCK_SHMDATA_V2_SIZE, PROT_READ, MAP_SHARED, sfd_rw, 0);
+  ASSERT_NE(shmp, MAP_FAILED);
+
+  int tries = 10000;
+
+  auto future_writer =
+      std::async(std::launch::async, writer_thread_v2, sfd_rw, tries);
+  auto future_reader =
+      std::async(std::launch::async, reader_thread_v2, shmp, tries);
+  err = future_writer.get();
+  ASSERT_EQ(err, 0);
+  err = future_reader.get();
+  ASSERT_EQ(err, 0);
+  munmap(shmp, FBCLOCK_SHMDATA_V2_SIZE);
+  fclose(f_rw);
+  remove(test_shm);
+}
+
+int failing_gettime(int fd, struct phc_time_res* res) {
+  return -1;
+}
+
+TEST(fbclockTest, test_gettime_sysclock) {
+  int err;
+  char* test_shm = std::tmpnam(nullptr);
+
+  FILE* f = fopen(test_shm, "wb+");
+  int sfd_rw = fileno(f);
+  ASSERT_NE(sfd_rw, -1);
+  // sysclock mapping is only published in seqlock protected layouts
+  err = ftruncate(sfd_rw, FBCLOCK_SHMDATA_V2_SIZE);
+  ASSERT_EQ(err, 0);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  int64_t now_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269082943150996,
+      .error_bound_ns = 100,
+      .holdover_multiplier_ns = 0,
+      .phc_time_ns = 1647269082943150996,
+      .sysclock_time_ns = now_ns,
+      .coef_ppb = 0,
+      .sysclock_error_ns = 10,
+      .sysclock_error_ppb = 0,
+  };
+  err = fbclock_clockdata_store_data_v2(sfd_rw, &data);
+  ASSERT_EQ(err, 0);
+
+  fbclock_shmdata_v2* shmp = (fbclock_shmdata_v2*)mmap(
+      nullptr, FBCLOCK_SHMDATA_V2_SIZE, PROT_READ, MAP_SHARED, sfd_rw, 0);
+  ASSERT_NE(shmp, MAP_FAILED);
+
+  fbclock_lib lib = {};
+  lib.shmp_v2 = shmp;
+  lib.gettime = failing_gettime;
+
+  // PHC read mode goes to the device
+  fbclock_truetime truetime;
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, FBCLOCK_E_PTP_READ_OFFSET);
+
+  // sysclock mode extrapolates from the mapping
+  err = fbclock_set_read_mode(&lib, FBCLOCK_READ_SYSCLOCK);
+  ASSERT_EQ(err, 0);
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, 0);
+  EXPECT_GT(truetime.earliest_ns, data.phc_time_ns - 111);
+  // we expect this test to finish within a second
+  EXPECT_LT(truetime.latest_ns, data.phc_time_ns + 1000000000LL);
+  // error bound, mapping error and rounding compensation
+  EXPECT_EQ(truetime.latest_ns - truetime.earliest_ns, 2 * (100 + 10 + 1));
+
+  err = fbclock_set_read_mode(&lib, 42);
+  ASSERT_EQ(err, FBCLOCK_E_INVALID_ARGUMENT);
+
+  munmap(shmp, FBCLOCK_SHMDATA_V2_SIZE);
+  fclose(f);
+  remove(test_shm);
+}
+
+TEST(fbclockTest, test_phc_ring) {
+  // tmpnam reuses its buffer
+  std::string test_ring = std::tmpnam(nullptr);
+  // rings are per NUMA node, stay on it
+  cpu_set_t old_cpus, cpus;
+  ASSERT_EQ(sched_getaffinity(0, sizeof(old_cpus), &old_cpus), 0);
+  unsigned cpu, node;
+  ASSERT_EQ(syscall(SYS_getcpu, &cpu, &node, nullptr), 0);
+  CPU_ZERO(&cpus);
+  CPU_SET(cpu, &cpus);
+  ASSERT_EQ(sched_setaffinity(0, sizeof(cpus), &cpus), 0);
+  char path[PATH_MAX];
+  EXPECT_EQ(
+      fbclock_phc_ring_path(path, 8, test_ring.c_str(), node),
+      FBCLOCK_E_INVALID_ARGUMENT);
+  ASSERT_EQ(
+      fbclock_phc_ring_path(path, sizeof(path), test_ring.c_str(), node), 0);
+
+  fbclock_phc_ring w;
+  ASSERT_EQ(
+      fbclock_phc_ring_create(&w, path, 4, 0), FBCLOCK_E_INVALID_ARGUMENT);
+  ASSERT_EQ(fbclock_phc_ring_create(&w, path, 4, 1000000), 0);
+  fbclock_phc_ring r;
+  ASSERT_EQ(fbclock_phc_ring_open(&r, path), 0);
+  fbclock_phc_sample sample;
+  EXPECT_EQ(fbclock_phc_ring_latest(&r, &sample), FBCLOCK_E_NO_DATA);
+  for (int64_t i = 1; i <= 10; i++) {
+    fbclock_phc_sample s = {
+        .sysclock_time_ns = i, .phc_time_ns = i * 10, .delay_ns = i};
+    ASSERT_EQ(fbclock_phc_ring_publish(&w, &s), 0);
+  }
+  ASSERT_EQ(fbclock_phc_ring_latest(&r, &sample), 0);
+  EXPECT_EQ(sample.sysclock_time_ns, 10);
+  EXPECT_EQ(sample.phc_time_ns, 100);
+  EXPECT_EQ(sample.delay_ns, 10);
+  fbclock_phc_ring_close(&r);
+
+  char* test_shm = std::tmpnam(nullptr);
+  FILE* shm_f = fopen(test_shm, "wb+");
+  ASSERT_NE(shm_f, nullptr);
+  ASSERT_EQ(ftruncate(fileno(shm_f), FBCLOCK_SHMDATA_V2_SIZE), 0);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  int64_t now_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269082943150996,
+      .error_bound_ns = 100,
+      .phc_time_ns = 1647269082943150996,
+      .sysclock_time_ns = now_ns,
+      .sysclock_error_ns = 10};
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+
+  fbclock_lib lib = {};
+  lib.shm_fd = -1;
+  lib.dev_fd = -1;
+  lib.shmp_v2 = (fbclock_shmdata_v2*)mmap(
+      nullptr,
+      FBCLOCK_SHMDATA_V2_SIZE,
+      PROT_READ,
+      MAP_SHARED,
+      fileno(shm_f),
+      0);
+  ASSERT_NE(lib.shmp_v2, MAP_FAILED);
+  lib.gettime = failing_gettime;
+  // handles open their own device for fallback reads
+  lib.ptp_path = (char*)"/dev/null";
+  EXPECT_EQ(fbclock_set_phc_ring(&lib, "/nonexistent"), FBCLOCK_E_SHMEM_OPEN);
+  EXPECT_EQ(lib.read_mode, FBCLOCK_READ_PHC);
+  ASSERT_EQ(fbclock_set_phc_ring(&lib, test_ring.c_str()), 0);
+  EXPECT_EQ(lib.read_mode, FBCLOCK_READ_SERVICE);
+
+  // service samples are too old, PHC is read instead
+  fbclock_truetime tt;
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_READ_OFFSET);
+
+  // extrapolated from the fresh sample, WOU includes its delay
+  fbclock_phc_sample fresh = {
+      .sysclock_time_ns = now_ns,
+      .phc_time_ns = data.phc_time_ns,
+      .delay_ns = 50};
+  ASSERT_EQ(fbclock_phc_ring_publish(&w, &fresh), 0);
+  ASSERT_EQ(fbclock_gettime(&lib, &tt), 0);
+  EXPECT_GT(tt.earliest_ns, data.phc_time_ns - 151);
+  // this test finishes way before the sample is stale
+  EXPECT_LT(tt.latest_ns, data.phc_time_ns + 16000000);
+  // error bound, sample delay and rounding compensation
+  EXPECT_EQ(tt.latest_ns - tt.earliest_ns, 2 * (100 + 50 + 1));
+
+  // thread handles map the ring of their node
+  fbclock_lib* handle;
+  ASSERT_EQ(fbclock_thread_handle_get(&lib, &handle), 0);
+  EXPECT_EQ(handle->phc_ring_owned, 1);
+  EXPECT_NE(handle->phc_ring.hdr, lib.phc_ring.hdr);
+  ASSERT_EQ(fbclock_gettime(handle, &tt), 0);
+  EXPECT_EQ(tt.latest_ns - tt.earliest_ns, 2 * (100 + 50 + 1));
+
+  // ring with another capacity replaces the file, old mappings stay valid
+  // but aren't read anymore
+  fbclock_phc_ring_close(&w);
+  ASSERT_EQ(fbclock_phc_ring_create(&w, path, 8, 1000000), 0);
+  ASSERT_EQ(fbclock_phc_ring_publish(&w, &fresh), 0);
+  ASSERT_EQ(fbclock_phc_ring_open(&r, path), 0);
+  EXPECT_EQ(r.capacity, 8);
+  fbclock_phc_ring_close(&r);
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_READ_OFFSET);
+  // handles re-open it on their own, the lib once asked to
+  fbclock_phc_ring_header* old_hdr = handle->phc_ring.hdr;
+  ASSERT_EQ(fbclock_gettime(handle, &tt), 0);
+  EXPECT_NE(handle->phc_ring.hdr, old_hdr);
+  EXPECT_EQ(handle->phc_ring.capacity, 8);
+  fbclock_thread_handle_release();
+  ASSERT_EQ(fbclock_set_phc_ring(&lib, test_ring.c_str()), 0);
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), 0);
+
+  fbclock_destroy(&lib);
+  EXPECT_EQ(lib.phc_ring.hdr, nullptr);
+  EXPECT_EQ(lib.phc_ring_base, nullptr);
+  fbclock_phc_ring_close(&w);
+  fclose(shm_f);
+  remove(path);
+  remove(test_shm);
+  sched_setaffinity(0, sizeof(old_cpus), &old_cpus);
+}
+
+int fake_gettime_batch_calls = 0;
+
+int fake_gettime_batch(int fd, struct phc_time_res* res, unsigned n) {
+  fake_gettime_batch_calls++;
+  for (unsigned i = 0; i < n; i++) {
+    res[i].ts = 1647269091803102957 + i * 1000;
+    res[i].delay = i;
+  }
+  return 0;
+}
+
+TEST(fbclockTest, test_gettime_batch) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime_batch = fake_gettime_batch;
+
+  fbclock_truetime truetimes[30];
+  int err = fbclock_gettime_batch(&lib, truetimes, 0, FBCLOCK_TAI);
+  ASSERT_EQ(err, FBCLOCK_E_INVALID_ARGUMENT);
+
+  // more than PTP_MAX_SAMPLES needs two requests
+  err = fbclock_gettime_batch(&lib, truetimes, 30, FBCLOCK_TAI);
+  ASSERT_EQ(err, 0);
+  EXPECT_EQ(fake_gettime_batch_calls, 2);
+  for (int i = 0; i < 30; i++) {
+    int j = i % PTP_MAX_SAMPLES;
+    uint64_t phc = 1647269091803102957 + j * 1000;
+    // every sample has its own delay added to the error bound
+    EXPECT_EQ(truetimes[i].earliest_ns, phc - 100 - j);
+    EXPECT_EQ(truetimes[i].latest_ns, phc + 100 + j);
+  }
+
+  // sysclock mode extrapolates every value, PHC is not read
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  shm.data.phc_time_ns = shm.data.ingress_time_ns;
+  shm.data.sysclock_time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  shm.data.sysclock_error_ns = 10;
+  ASSERT_EQ(fbclock_set_read_mode(&lib, FBCLOCK_READ_SYSCLOCK), 0);
+  fake_gettime_batch_calls = 0;
+  ASSERT_EQ(fbclock_gettime_batch(&lib, truetimes, 30, FBCLOCK_TAI), 0);
+  EXPECT_EQ(fake_gettime_batch_calls, 0);
+  for (int i = 0; i < 30; i++) {
+    EXPECT_GE(truetimes[i].earliest_ns, shm.data.phc_time_ns - 111);
+    // error bound, mapping error and rounding compensation
+    EXPECT_GE(truetimes[i].latest_ns - truetimes[i].earliest_ns, 2 * 111);
+    if (i > 0) {
+      EXPECT_GE(truetimes[i].earliest_ns, truetimes[i - 1].earliest_ns);
+    }
+  }
+  // without a mapping it reads PHC
+  shm.data.sysclock_time_ns = 0;
+  ASSERT_EQ(fbclock_gettime_batch(&lib, truetimes, 3, FBCLOCK_TAI), 0);
+  EXPECT_EQ(fake_gettime_batch_calls, 1);
+}
+
+unsigned fake_samples_n = 0;
+int64_t fake_samples_delay = 0;
+
+int fake_gettime_samples(int fd, struct phc_time_res* res, unsigned n) {
+  fake_samples_n = n;
+  for (unsigned i = 0; i < n; i++) {
+    res[i].ts = 1647269091803102957 + i * 1000;
+    // smallest delay is in the middle
+    res[i].delay = fake_samples_delay + (i == n / 2 ? 0 : 50);
+  }
+  return 0;
+}
+
+TEST(fbclockTest, test_gettime_samples) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime_batch = fake_gettime_samples;
+  fake_samples_delay = 1000;
+
+  int err = fbclock_set_samples(&lib, 0, 0);
+  ASSERT_EQ(err, FBCLOCK_E_INVALID_ARGUMENT);
+  err = fbclock_set_samples(&lib, PTP_MAX_SAMPLES + 1, 0);
+  ASSERT_EQ(err, FBCLOCK_E_INVALID_ARGUMENT);
+
+  // unconfigured lib uses default sample count
+  fbclock_truetime truetime;
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, 0);
+  EXPECT_EQ(fake_samples_n, FBCLOCK_DEFAULT_SAMPLES);
+
+  err = fbclock_set_samples(&lib, 9, 0);
+  ASSERT_EQ(err, 0);
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, 0);
+  EXPECT_EQ(fake_samples_n, 9);
+  // timestamp and delay of the sample with the smallest delay are used
+  uint64_t phc = 1647269091803102957 + 4 * 1000;
+  EXPECT_EQ(truetime.earliest_ns, phc - 100 - 1000);
+  EXPECT_EQ(truetime.latest_ns, phc + 100 + 1000);
+
+  // adaptive mode drops samples while min delay is stable
+  err = fbclock_set_samples(&lib, 3, 1);
+  ASSERT_EQ(err, 0);
+  for (int i = 0; i <= 2 * FBCLOCK_ADAPTIVE_STABLE_READS; i++) {
+    err = fbclock_gettime(&lib, &truetime);
+    ASSERT_EQ(err, 0);
+  }
+  EXPECT_EQ(lib.cur_samples, 1);
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, 0);
+  EXPECT_EQ(fake_samples_n, 1);
+
+  // and goes back to max samples once min delay jumps
+  fake_samples_delay = 5000;
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, 0);
+  EXPECT_EQ(lib.cur_samples, 3);
+}
+
+int thread_handle_check(fbclock_lib* lib) {
+  fbclock_lib* handle = nullptr;
+  int err = fbclock_thread_handle_get(lib, &handle);
+  if (err != 0) {
+    return err;
+  }
+  fbclock_lib* again = nullptr;
+  err = fbclock_thread_handle_get(lib, &again);
+  if (err != 0) {
+    return err;
+  }
+  // cached per thread, own fd, shared mapping
+  if (again != handle || handle == lib || handle->dev_fd == lib->dev_fd ||
+      handle->shmp_v2 != lib->shmp_v2) {
+    return -100;
+  }
+  fbclock_truetime truetime;
+  err = fbclock_gettime(handle, &truetime);
+  fbclock_thread_handle_release();
+  return err;
+}
+
+TEST(fbclockTest, test_thread_handle) {
+  char* test_dev = std::tmpnam(nullptr);
+  FILE* f = fopen(test_dev, "wb+");
+  ASSERT_NE(f, nullptr);
+
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+
+  fbclock_lib lib = {};
+  lib.ptp_path = test_dev;
+  lib.dev_fd = fileno(f);
+  lib.shmp_v2 = &shm;
+  lib.gettime_batch = fake_gettime_samples;
+  fake_samples_delay = 0;
+
+  std::vector<std::future<int>> results;
+  for (int i = 0; i < 8; i++) {
+    results.push_back(std::async(std::launch::async, thread_handle_check, &lib));
+  }
+  for (auto& r : results) {
+    ASSERT_EQ(r.get(), 0);
+  }
+
+  // device can't be opened
+  lib.ptp_path = (char*)"/nonexistent/ptp";
+  fbclock_lib* handle = nullptr;
+  int err = fbclock_thread_handle_get(&lib, &handle);
+  ASSERT_EQ(err, FBCLOCK_E_PTP_OPEN);
+  // reported like failed reads of the lib
+  EXPECT_EQ(lib.errors[FBCLOCK_ERR_PTP_READ], 1);
+
+  fclose(f);
+  remove(test_dev);
+}
+
+TEST(fbclockTest, test_thread_handle_two_libs) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+
+  fbclock_lib a = {};
+  a.ptp_path = (char*)"/dev/null";
+  a.dev_fd = -1;
+  a.shmp_v2 = &shm;
+  a.gettime_batch = fake_gettime_samples;
+  fbclock_lib b = a;
+  fake_samples_delay = 0;
+
+  fbclock_lib* ha = nullptr;
+  fbclock_lib* hb = nullptr;
+  ASSERT_EQ(fbclock_thread_handle_get(&a, &ha), 0);
+  ASSERT_EQ(fbclock_thread_handle_get(&b, &hb), 0);
+  ASSERT_NE(ha, hb);
+  // handle of a stays valid and cached while b's one is in use
+  fbclock_truetime truetime;
+  ASSERT_EQ(fbclock_gettime(ha, &truetime), 0);
+  ASSERT_EQ(fbclock_gettime(hb, &truetime), 0);
+  int fd_a = ha->dev_fd;
+  fbclock_lib* again = nullptr;
+  ASSERT_EQ(fbclock_thread_handle_get(&a, &again), 0);
+  EXPECT_EQ(again, ha);
+  EXPECT_EQ(ha->dev_fd, fd_a);
+  ASSERT_EQ(fbclock_thread_handle_get(&b, &again), 0);
+  EXPECT_EQ(again, hb);
+
+  // re-initialized lib gets a new handle, even if it mapped shmem at the
+  // same address, the other one is kept
+  hb->stable_reads = 42;
+  b.id = 7;
+  ASSERT_EQ(fbclock_thread_handle_get(&b, &again), 0);
+  EXPECT_EQ(again->stable_reads, 0);
+  EXPECT_EQ(again->shmp_v2, &shm);
+  fbclock_shmdata_v2 shm2 = shm;
+  b.shmp_v2 = &shm2;
+  b.id = 8;
+  ASSERT_EQ(fbclock_thread_handle_get(&b, &again), 0);
+  EXPECT_EQ(again->shmp_v2, &shm2);
+  ASSERT_EQ(fbclock_thread_handle_get(&a, &again), 0);
+  EXPECT_EQ(again, ha);
+  ASSERT_EQ(fbclock_gettime(ha, &truetime), 0);
+  fbclock_thread_handle_release();
+}
+
+int fake_gettime_calls = 0;
+
+int fake_gettime(int fd, struct phc_time_res* res) {
+  fake_gettime_calls++;
+  res->ts = 1647269091803102957 + fake_gettime_calls * 1000;
+  res->delay = 10;
+  return 0;
+}
+
+TEST(fbclockTest, test_gettime_both) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+  shm.data.utc_offset_pre_s = 36;
+  shm.data.utc_offset_post_s = 37;
+  shm.data.clock_smearing_start_s = 1483228836;
+  shm.data.clock_smearing_end_s = 1483293836;
+
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime = fake_gettime;
+  fake_gettime_calls = 0;
+
+  fbclock_truetime tai, utc;
+  int err = fbclock_gettime_both(&lib, &tai, &utc);
+  ASSERT_EQ(err, 0);
+  // one PHC read for both
+  EXPECT_EQ(fake_gettime_calls, 1);
+
+  uint64_t phc = 1647269091803102957 + 1000;
+  EXPECT_EQ(tai.earliest_ns, phc - 110);
+  EXPECT_EQ(tai.latest_ns, phc + 110);
+  EXPECT_EQ(utc.earliest_ns, phc - 37000000000 - 110);
+  EXPECT_EQ(utc.latest_ns, phc - 37000000000 + 110);
+
+  // no data
+  shm.data.error_bound_ns = 0;
+  err = fbclock_gettime_both(&lib, &tai, &utc);
+  ASSERT_EQ(err, FBCLOCK_E_NO_DATA);
+  EXPECT_EQ(fake_gettime_calls, 1);
+}
+
+TEST(fbclockTest, test_init_ptp_path) {
+  char* test_shm = std::tmpnam(nullptr);
+  FILE* shm_f = fopen(test_shm, "wb+");
+  ASSERT_NE(shm_f, nullptr);
+  ASSERT_EQ(ftruncate(fileno(shm_f), FBCLOCK_SHMDATA_V2_SIZE), 0);
+  // regular file instead of a PHC: probes fail, but it can be opened
+  std::string test_dev = std::string(std::tmpnam(nullptr));
+  FILE* dev_f = fopen(test_dev.c_str(), "wb+");
+  ASSERT_NE(dev_f, nullptr);
+
+  fbclock_lib lib = {};
+  fbclock_init_options opts = {};
+  opts.shm_version = 2;
+  opts.ptp_path = test_dev.c_str();
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+  EXPECT_STREQ(lib.ptp_path, test_dev.c_str());
+  EXPECT_NE(lib.ptp_path, opts.ptp_path);
+  EXPECT_EQ(fbclock_device_numa_node(lib.ptp_path), -1);
+  EXPECT_EQ(fbclock_destroy(&lib), 0);
+  EXPECT_STREQ(lib.ptp_path, FBCLOCK_PTPPATH);
+
+  opts.ptp_path = "/nonexistent/ptp";
+  fbclock_lib lib2 = {};
+  ASSERT_EQ(
+      fbclock_init_with_options(&lib2, test_shm, &opts), FBCLOCK_E_PTP_OPEN);
+
+  // no daemon for this interface
+  fbclock_lib lib3 = {};
+  ASSERT_EQ(fbclock_init_iface(&lib3, "nonexistent0"), FBCLOCK_E_SHMEM_OPEN);
+
+  EXPECT_EQ(fbclock_device_numa_node("/nonexistent/ptp"), -1);
+
+  fclose(dev_f);
+  remove(test_dev.c_str());
+  fclose(shm_f);
+  remove(test_shm);
+}
+
+static int count_open_fds() {
+  int n = 0;
+  DIR* d = opendir("/proc/self/fd");
+  while (readdir(d) != nullptr) {
+    n++;
+  }
+  closedir(d);
+  return n;
+}
+
+TEST(fbclockTest, test_init_flags) {
+  char* test_shm = std::tmpnam(nullptr);
+  FILE* shm_f = fopen(test_shm, "wb+");
+  ASSERT_NE(shm_f, nullptr);
+  ASSERT_EQ(ftruncate(fileno(shm_f), FBCLOCK_SHMDATA_V2_SIZE), 0);
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957, .error_bound_ns = 100};
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+
+  // nothing is leaked on partial init failure
+  int fds = count_open_fds();
+  fbclock_lib lib = {};
+  fbclock_init_options opts = {};
+  opts.shm_version = 2;
+  opts.ptp_path = "/nonexistent/ptp";
+  ASSERT_EQ(
+      fbclock_init_with_options(&lib, test_shm, &opts), FBCLOCK_E_PTP_OPEN);
+  EXPECT_EQ(count_open_fds(), fds);
+  EXPECT_EQ(lib.shmp_v2, nullptr);
+  EXPECT_EQ(lib.ptp_path_owned, 0);
+
+  // lazy open: device is only needed on the first PHC read
+  opts.flags = FBCLOCK_INIT_LAZY_OPEN;
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+  EXPECT_EQ(lib.dev_fd, -1);
+  EXPECT_EQ(count_open_fds(), fds + 1);
+  fbclock_truetime tt;
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_OPEN);
+  EXPECT_EQ(fbclock_error_count(&lib, FBCLOCK_ERR_PTP_READ), 1);
+  fbclock_destroy(&lib);
+  EXPECT_EQ(count_open_fds(), fds);
+
+  // shm-only: no device at all, TrueTime comes from sysclock mapping
+  opts.ptp_path = nullptr;
+  opts.flags = FBCLOCK_INIT_SHM_ONLY;
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+  EXPECT_EQ(lib.dev_fd, -1);
+  EXPECT_EQ(lib.read_mode, FBCLOCK_READ_SYSCLOCK);
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_OPEN);
+  fbclock_lib* handle;
+  ASSERT_EQ(fbclock_thread_handle_get(&lib, &handle), 0);
+  EXPECT_EQ(handle->dev_fd, -1);
+  fbclock_thread_handle_release();
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  data.sysclock_time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  data.phc_time_ns = data.ingress_time_ns;
+  data.sysclock_error_ns = 10;
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), 0);
+  EXPECT_EQ(fbclock_gettime_coarse(&lib, &tt, FBCLOCK_TAI), 0);
+  fbclock_destroy(&lib);
+  EXPECT_EQ(count_open_fds(), fds);
+
+  fclose(shm_f);
+  remove(test_shm);
+}
+
+TEST(fbclockTest, test_ptp_caps_from_shm) {
+  char* test_dev = std::tmpnam(nullptr);
+  FILE* f = fopen(test_dev, "wb+");
+  ASSERT_NE(f, nullptr);
+
+  fbclock_shmdata_v2 shm = {};
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957, .error_bound_ns = 100};
+  data.ptp_caps = FBCLOCK_PTP_CAP_PROBED | FBCLOCK_PTP_CAP_EXTENDED |
+      FBCLOCK_PTP_CAP_PRECISE;
+  fbclock_writer writer = {.shmp = &shm, .size = 0, .version = 2};
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+
+  // lazily opened device uses backend published by the daemon,
+  // even though the ioctls would fail on a regular file
+  fbclock_lib lib = {};
+  lib.ptp_path = test_dev;
+  lib.dev_fd = -1;
+  lib.shm_fd = -1;
+  lib.shmp_v2 = &shm;
+  lib.init_flags = FBCLOCK_INIT_LAZY_OPEN;
+  fbclock_truetime tt;
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_READ_OFFSET);
+  EXPECT_NE(lib.dev_fd, -1);
+  EXPECT_NE(lib.gettime, nullptr);
+  EXPECT_NE(lib.gettime_batch, nullptr);
+  close(lib.dev_fd);
+
+  // unless told to probe
+  lib.dev_fd = -1;
+  lib.gettime = nullptr;
+  lib.gettime_batch = nullptr;
+  lib.init_flags = FBCLOCK_INIT_LAZY_OPEN | FBCLOCK_INIT_PROBE;
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_READ_OFFSET);
+  EXPECT_EQ(lib.gettime, nullptr);
+  EXPECT_NE(lib.gettime_batch, nullptr);
+  close(lib.dev_fd);
+
+  // v1 readers probe, caps aren't published there
+  fbclock_shmdata shm_v1 = {};
+  writer = {.shmp = &shm_v1, .size = 0, .version = 1};
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+  EXPECT_EQ(shm_v1.data.ptp_caps, 0);
+  lib.shmp_v2 = nullptr;
+  lib.shmp = &shm_v1;
+  lib.dev_fd = -1;
+  lib.gettime = nullptr;
+  lib.gettime_batch = nullptr;
+  lib.init_flags = FBCLOCK_INIT_LAZY_OPEN;
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_READ_OFFSET);
+  EXPECT_EQ(lib.gettime, nullptr);
+  EXPECT_NE(lib.gettime_batch, nullptr);
+  close(lib.dev_fd);
+
+  // racing first reads, losers wait for the winner's backend
+  lib.dev_fd = -1;
+  lib.gettime_batch = nullptr;
+  std::vector<std::future<int>> readers;
+  for (int i = 0; i < 8; i++) {
+    readers.push_back(std::async(std::launch::async, [&lib] {
+      fbclock_truetime t;
+      return fbclock_gettime(&lib, &t);
+    }));
+  }
+  for (auto& r : readers) {
+    EXPECT_EQ(r.get(), FBCLOCK_E_PTP_READ_OFFSET);
+  }
+  EXPECT_NE(lib.gettime_batch, nullptr);
+  close(lib.dev_fd);
+
+  fclose(f);
+  remove(test_dev);
+}
+
+TEST(fbclockTest, test_shm_v3) {
+  char* test_shm = std::tmpnam(nullptr);
+  FILE* shm_f = fopen(test_shm, "wb+");
+  ASSERT_NE(shm_f, nullptr);
+  ASSERT_EQ(ftruncate(fileno(shm_f), FBCLOCK_SHMDATA_V3_SIZE), 0);
+
+  // no header yet, daemon hasn't written anything
+  int fds = count_open_fds();
+  fbclock_lib lib = {};
+  fbclock_init_options opts = {};
+  opts.shm_version = 3;
+  opts.flags = FBCLOCK_INIT_SHM_ONLY;
+  ASSERT_EQ(
+      fbclock_init_with_options(&lib, test_shm, &opts), FBCLOCK_E_NO_DATA);
+  EXPECT_EQ(count_open_fds(), fds);
+  EXPECT_EQ(lib.shmp_v3, nullptr);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957,
+      .error_bound_ns = 100,
+      .phc_time_ns = 1647269091803102957,
+      .sysclock_time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec,
+      .sysclock_error_ns = 10};
+  ASSERT_EQ(fbclock_clockdata_store_data_v3(fileno(shm_f), &data), 0);
+
+  fbclock_shmdata_v3* shmp = (fbclock_shmdata_v3*)mmap(
+      nullptr, FBCLOCK_SHMDATA_V3_SIZE, PROT_READ, MAP_SHARED, fileno(shm_f), 0);
+  ASSERT_NE(shmp, MAP_FAILED);
+  EXPECT_EQ(shmp->header.magic, FBCLOCK_SHM_MAGIC);
+  EXPECT_EQ(shmp->header.version, 3);
+  EXPECT_EQ(shmp->header.size, FBCLOCK_SHMDATA_V3_SIZE);
+  EXPECT_EQ(shmp->header.clockdata_size, sizeof(fbclock_clockdata));
+  EXPECT_EQ(shmp->v2.seq, 2);
+  EXPECT_EQ(shmp->v2.generation, 1);
+
+  // readers use v2 seqlock block inside of the page
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+  EXPECT_EQ(lib.shmp_v2, &lib.shmp_v3->v2);
+  fbclock_truetime tt;
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), 0);
+  uint32_t gen;
+  ASSERT_EQ(fbclock_get_generation(&lib, &gen), 0);
+  EXPECT_EQ(gen, 1);
+  fbclock_destroy(&lib);
+  EXPECT_EQ(count_open_fds(), fds);
+
+  munmap(shmp, FBCLOCK_SHMDATA_V3_SIZE);
+  fclose(shm_f);
+  remove(test_shm);
+}
+
+TEST(fbclockTest, test_journal) {
+  char* test_journal = std::tmpnam(nullptr);
+  fbclock_journal w;
+  ASSERT_EQ(
+      fbclock_journal_create(&w, test_journal, 1), FBCLOCK_E_INVALID_ARGUMENT);
+  ASSERT_EQ(fbclock_journal_create(&w, test_journal, 4), 0);
+  struct stat st;
+  ASSERT_EQ(stat(test_journal, &st), 0);
+  EXPECT_EQ(st.st_mode & 0777, 0644);
+
+  int fds = count_open_fds();
+  fbclock_journal r;
+  ASSERT_EQ(fbclock_journal_open(&r, test_journal), 0);
+  EXPECT_EQ(r.hdr->capacity, 4);
+  fbclock_clockdata found;
+  EXPECT_EQ(fbclock_journal_find(&r, 1000, &found), FBCLOCK_E_NO_DATA);
+
+  // error bound tells records apart
+  fbclock_clockdata data = {.ingress_time_ns = 1000, .error_bound_ns = 1};
+  ASSERT_EQ(fbclock_journal_append(&w, &data), 0);
+  data.ingress_time_ns = 2000;
+  data.error_bound_ns = 2;
+  ASSERT_EQ(fbclock_journal_append(&w, &data), 0);
+  // same ingress time is kept, the latest wins
+  data.error_bound_ns = 3;
+  ASSERT_EQ(fbclock_journal_append(&w, &data), 0);
+  data.ingress_time_ns = 1999;
+  EXPECT_EQ(fbclock_journal_append(&w, &data), FBCLOCK_E_INVALID_ARGUMENT);
+  EXPECT_EQ(w.hdr->count, 3);
+
+  EXPECT_EQ(fbclock_journal_find(&r, 999, &found), FBCLOCK_E_NO_DATA);
+  ASSERT_EQ(fbclock_journal_find(&r, 1000, &found), 0);
+  EXPECT_EQ(found.error_bound_ns, 1);
+  ASSERT_EQ(fbclock_journal_find(&r, 1999, &found), 0);
+  EXPECT_EQ(found.error_bound_ns, 1);
+  ASSERT_EQ(fbclock_journal_find(&r, 2000, &found), 0);
+  EXPECT_EQ(found.error_bound_ns, 3);
+  ASSERT_EQ(fbclock_journal_find(&r, INT64_MAX, &found), 0);
+  EXPECT_EQ(found.error_bound_ns, 3);
+
+  // wrap around, capacity - 1 latest records are searched
+  for (int i = 3; i <= 10; i++) {
+    data.ingress_time_ns = i * 1000;
+    data.error_bound_ns = i;
+    ASSERT_EQ(fbclock_journal_append(&w, &data), 0);
+  }
+  EXPECT_EQ(fbclock_journal_find(&r, 7999, &found), FBCLOCK_E_NO_DATA);
+  for (int i = 8; i <= 10; i++) {
+    ASSERT_EQ(fbclock_journal_find(&r, i * 1000 + 500, &found), 0);
+    EXPECT_EQ(found.error_bound_ns, i);
+    EXPECT_EQ(found.ingress_time_ns, i * 1000);
+  }
+
+  // TrueTime with the error bound of the record in effect
+  fbclock_truetime tt;
+  ASSERT_EQ(fbclock_journal_truetime(&r, 10000, &tt, FBCLOCK_TAI), 0);
+  EXPECT_EQ(tt.earliest_ns, 10000 - 10);
+  EXPECT_EQ(tt.latest_ns, 10000 + 10);
+  EXPECT_EQ(
+      fbclock_journal_truetime(&r, 0, &tt, FBCLOCK_TAI), FBCLOCK_E_NO_DATA);
+  fbclock_journal_close(&r);
+  EXPECT_EQ(count_open_fds(), fds);
+  fbclock_journal_close(&w);
+
+  // restarted writer keeps the journal, different capacity replaces it
+  ASSERT_EQ(fbclock_journal_create(&w, test_journal, 4), 0);
+  EXPECT_EQ(w.hdr->count, 11);
+  fbclock_journal_close(&w);
+  ASSERT_EQ(fbclock_journal_open(&r, test_journal), 0);
+  ASSERT_EQ(fbclock_journal_create(&w, test_journal, 8), 0);
+  EXPECT_EQ(w.hdr->count, 0);
+  // readers of the old file keep a valid mapping and are told to re-open
+  EXPECT_EQ(r.size, FBCLOCK_JOURNAL_SIZE(4));
+  EXPECT_EQ(fbclock_journal_find(&r, 10000, &found), FBCLOCK_E_NO_DATA);
+  fbclock_journal_close(&r);
+
+  // readers racing the writer never see a record torn or out of range
+  ASSERT_EQ(fbclock_journal_open(&r, test_journal), 0);
+  std::thread writer([&w] {
+    fbclock_clockdata d = {};
+    for (uint32_t i = 1; i <= 100000; i++) {
+      d.ingress_time_ns = i * 1000LL;
+      d.error_bound_ns = i;
+      fbclock_journal_append(&w, &d);
+    }
+  });
+  for (int i = 0; i < 100000; i++) {
+    int64_t phc = (int64_t)__atomic_load_n(&r.hdr->count, __ATOMIC_RELAXED) *
+        1000 - 1500;
+    int rcode = fbclock_journal_find(&r, phc, &found);
+    if (rcode == FBCLOCK_E_NO_DATA) {
+      continue;
+    }
+    ASSERT_EQ(rcode, 0);
+    ASSERT_EQ(found.ingress_time_ns, found.error_bound_ns * 1000LL);
+    ASSERT_LE(found.ingress_time_ns, phc);
+  }
+  writer.join();
+  fbclock_journal_close(&r);
+  fbclock_journal_close(&w);
+
+  remove(test_journal);
+  EXPECT_EQ(fbclock_journal_open(&r, test_journal), FBCLOCK_E_SHMEM_OPEN);
+}
+
+TEST(fbclockTest, test_monotonic) {
+  char* test_shm = std::tmpnam(nullptr);
+  FILE* shm_f = fopen(test_shm, "wb+");
+  ASSERT_NE(shm_f, nullptr);
+  ASSERT_EQ(ftruncate(fileno(shm_f), FBCLOCK_SHMDATA_V2_SIZE), 0);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957,
+      .error_bound_ns = 1000000,
+      .phc_time_ns = 1647269091803102957,
+      .sysclock_time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec,
+      .sysclock_error_ns = 10};
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+
+  fbclock_lib lib = {};
+  fbclock_init_options opts = {};
+  opts.shm_version = 2;
+  opts.flags = FBCLOCK_INIT_SHM_ONLY;
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+  EXPECT_EQ(lib.monotonic, 0);
+
+  // WOU shrinks by 1ms after a sync, latest goes back
+  fbclock_truetime wide, narrow, tt;
+  ASSERT_EQ(fbclock_gettime(&lib, &wide), 0);
+  data.error_bound_ns = 100;
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+  ASSERT_EQ(fbclock_gettime(&lib, &narrow), 0);
+  EXPECT_LT(narrow.latest_ns, wide.latest_ns);
+
+  ASSERT_EQ(fbclock_set_monotonic(&lib, 1), 0);
+  data.error_bound_ns = 1000000;
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+  ASSERT_EQ(fbclock_gettime(&lib, &wide), 0);
+  data.error_bound_ns = 100;
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+  ASSERT_EQ(fbclock_gettime(&lib, &tt), 0);
+  EXPECT_GE(tt.earliest_ns, wide.earliest_ns);
+  EXPECT_GE(tt.latest_ns, wide.latest_ns);
+  EXPECT_LE(tt.earliest_ns, tt.latest_ns);
+
+  // and earliest goes back when it grows again
+  narrow = tt;
+  data.error_bound_ns = 1000000;
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+  ASSERT_EQ(fbclock_gettime(&lib, &tt), 0);
+  EXPECT_GE(tt.earliest_ns, narrow.earliest_ns);
+  EXPECT_GE(tt.latest_ns, narrow.latest_ns);
+
+  // high-water mark is shared by threads and handles
+  std::vector<std::thread> threads;
+  std::atomic<int> failures{0};
+  for (int t = 0; t < 4; t++) {
+    threads.emplace_back([&lib, &data, &failures, &shm_f, t]() {
+      fbclock_lib* handle;
+      ASSERT_EQ(fbclock_thread_handle_get(&lib, &handle), 0);
+      fbclock_truetime prev = {}, cur;
+      for (int i = 0; i < 10000; i++) {
+        if (t == 0 && i % 100 == 0) {
+          fbclock_clockdata d = data;
+          d.error_bound_ns = i % 200 == 0 ? 100 : 1000000;
+          fbclock_clockdata_store_data_v2(fileno(shm_f), &d);
+        }
+        ASSERT_EQ(fbclock_gettime(handle, &cur), 0);
+        if (cur.earliest_ns < prev.earliest_ns ||
+            cur.latest_ns < prev.latest_ns || cur.earliest_ns > cur.latest_ns) {
+          failures++;
+        }
+        prev = cur;
+      }
+      fbclock_thread_handle_release();
+    });
+  }
+  for (auto& th : threads) {
+    th.join();
+  }
+  EXPECT_EQ(failures, 0);
+
+  fbclock_destroy(&lib);
+  opts.flags |= FBCLOCK_INIT_MONOTONIC;
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+  EXPECT_EQ(lib.monotonic, 1);
+  fbclock_destroy(&lib);
+  fclose(shm_f);
+  remove(test_shm);
+}
+
+TEST(fbclockTest, test_sim_backend) {
+  char* test_shm = std::tmpnam(nullptr);
+  FILE* shm_f = fopen(test_shm, "wb+");
+  ASSERT_NE(shm_f, nullptr);
+  ASSERT_EQ(ftruncate(fileno(shm_f), FBCLOCK_SHMDATA_V2_SIZE), 0);
+
+  fbclock_sim_options sim_opts = {};
+  sim_opts.drift_ppb = 10000;
+  sim_opts.delay_ns = 500;
+  sim_opts.delay_spread_ns = 200;
+  sim_opts.delay_dist = FBCLOCK_SIM_DELAY_UNIFORM;
+  sim_opts.seed = 42;
+  sim_opts.update_interval_ns = 1000000;
+  sim_opts.error_bound_ns = 100;
+  sim_opts.holdover_multiplier_ns = 50 << 16;
+  sim_opts.sysclock_error_ns = 10;
+  fbclock_sim sim;
+  ASSERT_EQ(fbclock_sim_open(&sim, &sim_opts, fileno(shm_f), 2), 0);
+  EXPECT_EQ(sim.updates, 1);
+
+  // device is never opened
+  fbclock_lib lib = {};
+  fbclock_init_options opts = {};
+  opts.shm_version = 2;
+  opts.ptp_path = "/nonexistent/ptp";
+  opts.flags = FBCLOCK_INIT_LAZY_OPEN;
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+  fbclock_backend backend = fbclock_sim_backend(&sim);
+  ASSERT_EQ(fbclock_set_backend(&lib, &backend), 0);
+
+  fbclock_truetime tt;
+  for (int mode : {FBCLOCK_READ_PHC, FBCLOCK_READ_SYSCLOCK}) {
+    ASSERT_EQ(fbclock_set_read_mode(&lib, mode), 0);
+    int64_t before = fbclock_sim_phc_time(&sim);
+    ASSERT_EQ(fbclock_gettime(&lib, &tt), 0);
+    int64_t after = fbclock_sim_phc_time(&sim);
+    EXPECT_LE(tt.earliest_ns, (uint64_t)after);
+    EXPECT_GE(tt.latest_ns, (uint64_t)before);
+  }
+  EXPECT_EQ(lib.dev_fd, -1);
+  ASSERT_EQ(fbclock_set_read_mode(&lib, FBCLOCK_READ_PHC), 0);
+  // WOU includes min delay of 5 samples
+  ASSERT_EQ(fbclock_gettime(&lib, &tt), 0);
+  EXPECT_GE(tt.latest_ns - tt.earliest_ns, 2 * (100 + 500));
+  fbclock_truetime tts[20];
+  ASSERT_EQ(fbclock_gettime_batch(&lib, tts, 20, FBCLOCK_TAI), 0);
+  fbclock_lib* handle;
+  ASSERT_EQ(fbclock_thread_handle_get(&lib, &handle), 0);
+  EXPECT_EQ(handle->dev_fd, -1);
+  EXPECT_EQ(fbclock_gettime(handle, &tt), 0);
+  fbclock_thread_handle_release();
+
+  // daemon publishes on its cadence
+  uint32_t gen;
+  ASSERT_EQ(fbclock_get_generation(&lib, &gen), 0);
+  std::this_thread::sleep_for(std::chrono::milliseconds(3));
+  ASSERT_EQ(fbclock_gettime(&lib, &tt), 0);
+  ASSERT_EQ(fbclock_wait_update(&lib, gen, 0), 0);
+  EXPECT_GE(sim.updates, 2);
+
+  // delays come from the distribution and depend on the seed only
+  fbclock_sim other;
+  ASSERT_EQ(fbclock_sim_open(&other, &sim_opts, fileno(shm_f), 2), 0);
+  fbclock_backend other_backend = fbclock_sim_backend(&other);
+  struct phc_time_res a[PTP_MAX_SAMPLES], b[PTP_MAX_SAMPLES];
+  uint64_t drawn = sim.draws;
+  sim.draws = 0;
+  ASSERT_EQ(backend.read(backend.ctx, a, PTP_MAX_SAMPLES), 0);
+  ASSERT_EQ(other_backend.read(other_backend.ctx, b, PTP_MAX_SAMPLES), 0);
+  for (int i = 0; i < PTP_MAX_SAMPLES; i++) {
+    EXPECT_EQ(a[i].delay, b[i].delay);
+    EXPECT_GE(a[i].delay, 500);
+    EXPECT_LT(a[i].delay, 700);
+  }
+  EXPECT_GT(drawn, 0);
+
+  other.opts.delay_dist = FBCLOCK_SIM_DELAY_EXP;
+  int64_t sum = 0;
+  for (int i = 0; i < 1000; i++) {
+    other_backend.read(other_backend.ctx, b, PTP_MAX_SAMPLES);
+    for (int j = 0; j < PTP_MAX_SAMPLES; j++) {
+      ASSERT_GE(b[j].delay, 500);
+      sum += b[j].delay - 500;
+    }
+  }
+  EXPECT_NEAR((double)sum / (1000 * PTP_MAX_SAMPLES), 200, 10);
+  fbclock_sim_close(&other);
+
+  fbclock_backend empty = {};
+  EXPECT_EQ(fbclock_set_backend(&lib, &empty), FBCLOCK_E_INVALID_ARGUMENT);
+  ASSERT_EQ(fbclock_set_backend(&lib, nullptr), 0);
+  EXPECT_EQ(fbclock_gettime(&lib, &tt), FBCLOCK_E_PTP_OPEN);
+
+  fbclock_destroy(&lib);
+  fbclock_sim_close(&sim);
+  fclose(shm_f);
+  remove(test_shm);
+}
+
+TEST(fbclockTest, test_gettime_multi) {
+  fbclock_shmdata_v2 shm1 = {};
+  shm1.data.ingress_time_ns = 1647269091803102957;
+  shm1.data.error_bound_ns = 1000;
+  fbclock_shmdata_v2 shm2 = shm1;
+  shm2.data.error_bound_ns = 500;
+
+  fbclock_lib lib1 = {};
+  lib1.shmp_v2 = &shm1;
+  lib1.gettime = fake_gettime;
+  fbclock_lib lib2 = lib1;
+  lib2.shmp_v2 = &shm2;
+  fbclock_lib* libs[] = {&lib1, &lib2};
+  fake_gettime_calls = 0;
+
+  // PHC time is 1000ns later on the second read
+  uint64_t phc = 1647269091803102957 + 1000;
+  fbclock_truetime tt;
+  ASSERT_EQ(fbclock_gettime_multi(libs, 2, &tt, FBCLOCK_TAI), 0);
+  EXPECT_EQ(tt.earliest_ns, phc + 1000 - 510);
+  EXPECT_EQ(tt.latest_ns, phc + 1010);
+
+  // intervals don't overlap: the gap between reads is returned
+  shm1.data.error_bound_ns = 100;
+  shm2.data.error_bound_ns = 1;
+  ASSERT_EQ(fbclock_gettime_multi(libs, 2, &tt, FBCLOCK_TAI), 0);
+  phc += 2000;
+  EXPECT_EQ(tt.earliest_ns, phc + 110);
+  EXPECT_EQ(tt.latest_ns, phc + 1000 - 11);
+
+  // failing devices are skipped
+  shm1.data.error_bound_ns = 0;
+  ASSERT_EQ(fbclock_gettime_multi(libs, 2, &tt, FBCLOCK_TAI), 0);
+  shm2.data.error_bound_ns = 0;
+  ASSERT_EQ(
+      fbclock_gettime_multi(libs, 2, &tt, FBCLOCK_TAI), FBCLOCK_E_NO_DATA);
+  ASSERT_EQ(
+      fbclock_gettime_multi(libs, 0, &tt, FBCLOCK_TAI),
+      FBCLOCK_E_INVALID_ARGUMENT);
+}
+
+TEST(fbclockTest, test_wait_update) {
+  fbclock_shmdata_v2 shm = {};
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  fbclock_writer writer = {.shmp = &shm, .size = 0, .version = 2};
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957, .error_bound_ns = 100};
+
+  uint32_t gen;
+  ASSERT_EQ(fbclock_get_generation(&lib, &gen), 0);
+  EXPECT_EQ(gen, 0);
+  EXPECT_EQ(fbclock_wait_update(&lib, gen, 1000000), FBCLOCK_E_TIMEOUT);
+  // already changed, doesn't block
+  EXPECT_EQ(fbclock_wait_update(&lib, gen + 1, -1), 0);
+
+  auto waiter = std::async(
+      std::launch::async, [&lib, gen] { return fbclock_wait_update(&lib, gen, -1); });
+  std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+  EXPECT_EQ(waiter.get(), 0);
+  ASSERT_EQ(fbclock_get_generation(&lib, &gen), 0);
+  EXPECT_EQ(gen, 1);
+  EXPECT_EQ(shm.waiters, 0);
+
+  // registered waiters are woken by the writer, which skips the syscall
+  // while there are none
+  lib.shm_waiters = &shm.waiters;
+  waiter = std::async(
+      std::launch::async, [&lib, gen] { return fbclock_wait_update(&lib, gen, -1); });
+  while (__atomic_load_n(&shm.waiters, __ATOMIC_SEQ_CST) == 0) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+  EXPECT_EQ(waiter.get(), 0);
+  EXPECT_EQ(shm.waiters, 0);
+  EXPECT_EQ(fbclock_wait_update(&lib, gen + 1, 1000000), FBCLOCK_E_TIMEOUT);
+  EXPECT_EQ(shm.waiters, 0);
+
+  // v1 shmem has no generation
+  fbclock_shmdata shm_v1 = {};
+  fbclock_lib lib_v1 = {};
+  lib_v1.shmp = &shm_v1;
+  EXPECT_EQ(fbclock_get_generation(&lib_v1, &gen), FBCLOCK_E_INVALID_ARGUMENT);
+  EXPECT_EQ(fbclock_wait_update(&lib_v1, gen, 0), FBCLOCK_E_INVALID_ARGUMENT);
+}
+
+TEST(fbclockTest, test_wait_until) {
+  char* test_shm = std::tmpnam(nullptr);
+  FILE* shm_f = fopen(test_shm, "wb+");
+  ASSERT_NE(shm_f, nullptr);
+  ASSERT_EQ(ftruncate(fileno(shm_f), FBCLOCK_SHMDATA_V2_SIZE), 0);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  // WOU grows by 1us per second of holdover
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957,
+      .error_bound_ns = 100000,
+      .holdover_multiplier_ns = 1000 << 16,
+      .phc_time_ns = 1647269091803102957,
+      .sysclock_time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec,
+      .sysclock_error_ns = 10};
+  ASSERT_EQ(fbclock_clockdata_store_data_v2(fileno(shm_f), &data), 0);
+
+  fbclock_lib lib = {};
+  fbclock_init_options opts = {};
+  opts.shm_version = 2;
+  opts.flags = FBCLOCK_INIT_SHM_ONLY;
+  ASSERT_EQ(fbclock_init_with_options(&lib, test_shm, &opts), 0);
+
+  // already in the past, one request
+  fbclock_truetime now, tt;
+  ASSERT_EQ(fbclock_gettime(&lib, &now), 0);
+  fbclock_stats before, after;
+  ASSERT_EQ(fbclock_stats_snapshot(&before), 0);
+  ASSERT_EQ(
+      fbclock_wait_until(&lib, now.earliest_ns - 1, FBCLOCK_TAI, 0, &tt), 0);
+  ASSERT_EQ(fbclock_stats_snapshot(&after), 0);
+  EXPECT_EQ(after.requests - before.requests, 1);
+  EXPECT_GT(tt.earliest_ns, now.earliest_ns - 1);
+
+  // commit wait for latest: sleeps for about 2 * WOU, not spinning
+  ASSERT_EQ(fbclock_gettime(&lib, &now), 0);
+  uint64_t commit_ts = now.latest_ns;
+  ASSERT_EQ(fbclock_stats_snapshot(&before), 0);
+  ASSERT_EQ(fbclock_wait_until(&lib, commit_ts, FBCLOCK_TAI, -1, &tt), 0);
+  ASSERT_EQ(fbclock_stats_snapshot(&after), 0);
+  EXPECT_GT(tt.earliest_ns, commit_ts);
+  EXPECT_LE(after.requests - before.requests, 5);
+  ASSERT_EQ(fbclock_gettime(&lib, &now), 0);
+  EXPECT_GT(now.earliest_ns, commit_ts);
+
+  // far in the future
+  ASSERT_EQ(fbclock_gettime(&lib, &now), 0);
+  auto start = std::chrono::steady_clock::now();
+  EXPECT_EQ(
+      fbclock_wait_until(
+          &lib, now.latest_ns + 60000000000ULL, FBCLOCK_TAI, 1000000, nullptr),
+      FBCLOCK_E_TIMEOUT);
+  EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+
+  // wake time and deadline saturate: no early timeout, no spinning
+  for (uint64_t far : {(uint64_t)INT64_MAX, UINT64_MAX}) {
+    ASSERT_EQ(fbclock_stats_snapshot(&before), 0);
+    start = std::chrono::steady_clock::now();
+    EXPECT_EQ(
+        fbclock_wait_until(&lib, far, FBCLOCK_TAI, 2000000, nullptr),
+        FBCLOCK_E_TIMEOUT);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    ASSERT_EQ(fbclock_stats_snapshot(&after), 0);
+    EXPECT_GE(elapsed, std::chrono::milliseconds(2));
+    EXPECT_LT(elapsed, std::chrono::seconds(1));
+    EXPECT_LE(after.requests - before.requests, 3);
+  }
+  ASSERT_EQ(fbclock_gettime(&lib, &now), 0);
+  EXPECT_EQ(
+      fbclock_wait_until(&lib, now.latest_ns, FBCLOCK_TAI, INT64_MAX, &tt), 0);
+  EXPECT_GT(tt.earliest_ns, now.latest_ns);
+
+  fbclock::Clock clock(lib);
+  auto r = clock.waitUntil(std::chrono::nanoseconds(commit_ts));
+  ASSERT_TRUE(r.ok());
+  EXPECT_GT(r->earliest.count(), (int64_t)commit_ts);
+  clock.reset();
+  fclose(shm_f);
+  remove(test_shm);
+}
+
+TEST(fbclockTest, test_gettime_coarse) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime = fake_gettime;
+  fake_gettime_calls = 0;
+
+  struct timespec res;
+  ASSERT_EQ(clock_getres(CLOCK_MONOTONIC_COARSE, &res), 0);
+  uint64_t res_ns = res.tv_sec * 1000000000ULL + res.tv_nsec;
+
+  // first request is exact
+  fbclock_truetime tt;
+  ASSERT_EQ(fbclock_gettime_coarse(&lib, &tt, FBCLOCK_TAI), 0);
+  EXPECT_EQ(fake_gettime_calls, 1);
+  uint64_t phc = 1647269091803102957 + 1000;
+  EXPECT_EQ(tt.earliest_ns, phc - 110);
+  EXPECT_EQ(tt.latest_ns, phc + 110);
+
+  // next ones are extrapolated from it with wider WOU
+  for (int i = 0; i < 100; i++) {
+    ASSERT_EQ(fbclock_gettime_coarse(&lib, &tt, FBCLOCK_TAI), 0);
+    EXPECT_LE(tt.earliest_ns, phc - 110 - res_ns);
+    EXPECT_GE(tt.latest_ns, phc + 110 + res_ns);
+  }
+  EXPECT_LE(fake_gettime_calls, 2);
+
+  // UTC from the same snapshot
+  ASSERT_EQ(fbclock_gettime_coarse(&lib, &tt, FBCLOCK_UTC), 0);
+  EXPECT_LE(tt.earliest_ns, phc - 37000000000 - 110 - res_ns);
+
+  // expired snapshot is refreshed by the next request
+  ASSERT_EQ(fbclock_set_coarse_max_age(&lib, 1), 0);
+  int calls = fake_gettime_calls;
+  std::this_thread::sleep_for(std::chrono::nanoseconds(2 * res_ns));
+  ASSERT_EQ(fbclock_gettime_coarse(&lib, &tt, FBCLOCK_TAI), 0);
+  EXPECT_EQ(fake_gettime_calls, calls + 1);
+  EXPECT_EQ(tt.latest_ns - tt.earliest_ns, 220);
+
+  // and it sees new shmem data
+  shm.data.error_bound_ns = 0;
+  std::this_thread::sleep_for(std::chrono::nanoseconds(2 * res_ns));
+  EXPECT_EQ(fbclock_gettime_coarse(&lib, &tt, FBCLOCK_TAI), FBCLOCK_E_NO_DATA);
+}
+
+TEST(fbclockTest, test_inline) {
+  fbclock_shmdata_v2 shm_v2 = {};
+  fbclock_shmdata shm_v1 = {};
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957,
+      .error_bound_ns = 100,
+      .holdover_multiplier_ns = 50,
+      .clock_smearing_start_s = 1483228836,
+      .clock_smearing_end_s = 1483293836,
+      .utc_offset_pre_s = 36,
+      .utc_offset_post_s = 37,
+  };
+  fbclock_writer writer = {.shmp = &shm_v2, .size = 0, .version = 2};
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+  writer = {.shmp = &shm_v1, .size = 0, .version = 1};
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+
+  fbclock_clockdata state;
+  unsigned tries = 0;
+  ASSERT_EQ(fbclock_inline_load_data_v2(&shm_v2, &state, &tries), 0);
+  EXPECT_EQ(tries, 1);
+  EXPECT_EQ(state.ingress_time_ns, data.ingress_time_ns);
+  ASSERT_EQ(fbclock_inline_load_data(&shm_v1, &state, &tries), 0);
+  EXPECT_EQ(tries, 1);
+  EXPECT_EQ(state.utc_offset_post_s, 37);
+
+  // same results as the library
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm_v2;
+  lib.gettime = fake_gettime;
+  for (int tz : {FBCLOCK_TAI, FBCLOCK_UTC}) {
+    fake_gettime_calls = 0;
+    fbclock_truetime lib_tt, inline_tt;
+    ASSERT_EQ(fbclock_gettime_tz(&lib, &lib_tt, tz), 0);
+    int64_t phc = data.ingress_time_ns + 1000;
+    ASSERT_EQ(fbclock_inline_truetime(&state, phc, 10, &inline_tt, tz), 0);
+    EXPECT_EQ(inline_tt.earliest_ns, lib_tt.earliest_ns);
+    EXPECT_EQ(inline_tt.latest_ns, lib_tt.latest_ns);
+  }
+  for (int64_t t : {1483228835000000000, 1483261345123456789}) {
+    EXPECT_EQ(
+        fbclock_inline_apply_utc_offset(&state, t),
+        fbclock_apply_utc_offset(&state, t));
+  }
+  EXPECT_EQ(
+      fbclock_inline_window_of_uncertainty_ns(3600000000000, 100, 50),
+      fbclock_window_of_uncertainty_ns(3600000000000, 100, 50));
+
+  // errors are reported as is
+  fbclock_truetime tt;
+  EXPECT_EQ(
+      fbclock_inline_truetime(&state, data.ingress_time_ns - 1, 10, &tt, 0),
+      FBCLOCK_E_PHC_IN_THE_PAST);
+  state.error_bound_ns = 0;
+  EXPECT_EQ(
+      fbclock_inline_truetime(&state, data.ingress_time_ns, 10, &tt, 0),
+      FBCLOCK_E_NO_DATA);
+  state.error_bound_ns = UINT32_MAX;
+  EXPECT_EQ(fbclock_inline_check_state(&state), FBCLOCK_E_WOU_TOO_BIG);
+
+  // unlike the library, inline v1 load does not hide CRC mismatch
+  shm_v1.crc = 42;
+  EXPECT_EQ(
+      fbclock_inline_load_data(&shm_v1, &state, &tries),
+      FBCLOCK_E_CRC_MISMATCH);
+  EXPECT_EQ(tries, FBCLOCK_MAX_READ_TRIES);
+  EXPECT_EQ(fbclock_clockdata_load_data(&shm_v1, &state), 0);
+  shm_v2.seq = 1;
+  EXPECT_EQ(
+      fbclock_inline_load_data_v2(&shm_v2, &state, &tries),
+      FBCLOCK_E_SEQ_MISMATCH);
+}
+
+TEST(fbclockTest, test_cpp_clock) {
+  char* test_dev = std::tmpnam(nullptr);
+  FILE* f = fopen(test_dev, "wb+");
+  ASSERT_NE(f, nullptr);
+  fclose(f);
+
+  // Clock unmaps it on destruction
+  fbclock_shmdata_v2* shm = (fbclock_shmdata_v2*)mmap(
+      nullptr,
+      FBCLOCK_SHMDATA_V2_SIZE,
+      PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_ANONYMOUS,
+      -1,
+      0);
+  ASSERT_NE(shm, MAP_FAILED);
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957,
+      .error_bound_ns = 100,
+      .clock_smearing_start_s = 1483228836,
+      .clock_smearing_end_s = 1483293836,
+      .utc_offset_pre_s = 36,
+      .utc_offset_post_s = 37,
+  };
+  fbclock_writer writer = {.shmp = shm, .size = 0, .version = 2};
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+
+  fbclock_lib lib = {};
+  lib.ptp_path = test_dev;
+  lib.shm_fd = -1;
+  lib.dev_fd = -1;
+  lib.shmp_v2 = shm;
+  lib.gettime = fake_gettime;
+  fake_gettime_calls = 0;
+
+  fbclock::Clock owner(lib);
+  fbclock::Clock clock(std::move(owner));
+  EXPECT_FALSE(owner.isOpen());
+  ASSERT_TRUE(clock.isOpen());
+
+  uint64_t phc = 1647269091803102957 + 1000;
+  auto tai = clock.now<fbclock::Standard::TAI>();
+  ASSERT_TRUE(tai);
+  EXPECT_EQ(tai->earliest, std::chrono::nanoseconds(phc - 110));
+  EXPECT_EQ(tai->latest, std::chrono::nanoseconds(phc + 110));
+
+  auto utc = clock.now<fbclock::Standard::UTC>();
+  ASSERT_TRUE(utc);
+  phc += 1000;
+  EXPECT_EQ(utc->earliest, std::chrono::nanoseconds(phc - 37000000000 - 110));
+
+  auto both = clock.nowBoth();
+  ASSERT_TRUE(both);
+  EXPECT_EQ(
+      both->tai.earliest - both->utc.earliest, std::chrono::seconds(37));
+
+  auto coarse = clock.nowCoarse<fbclock::Standard::UTC>();
+  ASSERT_TRUE(coarse);
+  EXPECT_LT(coarse->earliest, coarse->latest);
+
+  auto handle = clock.threadHandle();
+  ASSERT_TRUE(handle);
+  EXPECT_NE(handle->get(), clock.get());
+  EXPECT_TRUE(handle->now());
+
+  // errors are returned, not thrown
+  data.error_bound_ns = 0;
+  ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+  auto err = clock.now();
+  ASSERT_FALSE(err);
+  EXPECT_EQ(err.error(), fbclock::Error(FBCLOCK_E_NO_DATA));
+  EXPECT_STREQ(err.error().message(), fbclock_strerror(FBCLOCK_E_NO_DATA));
+  EXPECT_EQ(
+      clock.setSamples(PTP_MAX_SAMPLES + 1, false).code(),
+      FBCLOCK_E_INVALID_ARGUMENT);
+
+  auto missing = fbclock::Clock::open("/nonexistent/fbclock_data");
+  ASSERT_FALSE(missing);
+  EXPECT_EQ(missing.error().code(), FBCLOCK_E_SHMEM_OPEN);
+
+  clock.reset();
+  EXPECT_FALSE(clock.isOpen());
+  remove(test_dev);
+}
+
+TEST(fbclockTest, test_cpp_clock_two_handles) {
+  fbclock_clockdata data = {
+      .ingress_time_ns = 1647269091803102957,
+      .error_bound_ns = 100,
+  };
+  fbclock_lib libs[2];
+  for (auto& lib : libs) {
+    // Clock unmaps it on destruction
+    fbclock_shmdata_v2* shm = (fbclock_shmdata_v2*)mmap(
+        nullptr,
+        FBCLOCK_SHMDATA_V2_SIZE,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_ANONYMOUS,
+        -1,
+        0);
+    ASSERT_NE(shm, MAP_FAILED);
+    fbclock_writer writer = {.shmp = shm, .size = 0, .version = 2};
+    ASSERT_EQ(fbclock_writer_store(&writer, &data), 0);
+    lib = {};
+    lib.ptp_path = (char*)"/dev/null";
+    lib.shm_fd = -1;
+    lib.dev_fd = -1;
+    lib.shmp_v2 = shm;
+    lib.gettime = fake_gettime;
+  }
+  fake_gettime_calls = 0;
+
+  fbclock::Clock a(libs[0]);
+  auto ha = a.threadHandle();
+  ASSERT_TRUE(ha);
+  {
+    fbclock::Clock b(libs[1]);
+    auto hb = b.threadHandle();
+    ASSERT_TRUE(hb);
+    EXPECT_NE(ha->get(), hb->get());
+    // handle of a is still the cached one
+    auto again = a.threadHandle();
+    ASSERT_TRUE(again);
+    EXPECT_EQ(again->get(), ha->get());
+  }
+  // and survives destruction of b
+  EXPECT_TRUE(ha->now());
+  auto again = a.threadHandle();
+  ASSERT_TRUE(again);
+  EXPECT_EQ(again->get(), ha->get());
+  a.reset();
+}
+
+int enodev_gettime(int fd, struct phc_time_res* res) {
+  errno = ENODEV;
+  return -1;
+}
+
+int negative_delay_gettime(int fd, struct phc_time_res* res) {
+  return -2;
+}
+
+struct error_cb_record {
+  int calls;
+  int kind;
+  int err_no;
+  uint64_t count;
+};
+
+void record_error_cb(void* ctx, int kind, int err_no, uint64_t count) {
+  error_cb_record* r = (error_cb_record*)ctx;
+  r->calls++;
+  r->kind = kind;
+  r->err_no = err_no;
+  r->count = count;
+}
+
+TEST(fbclockTest, test_error_reporting) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime = enodev_gettime;
+
+  // errors are counted even without callback
+  fbclock_truetime truetime;
+  int err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, FBCLOCK_E_PTP_READ_OFFSET);
+  EXPECT_EQ(fbclock_error_count(&lib, FBCLOCK_ERR_PTP_READ), 1);
+
+  // callback is rate limited
+  error_cb_record record = {};
+  err = fbclock_set_error_callback(&lib, record_error_cb, &record, 3600e9);
+  ASSERT_EQ(err, 0);
+  for (int i = 0; i < 100; i++) {
+    err = fbclock_gettime(&lib, &truetime);
+    ASSERT_EQ(err, FBCLOCK_E_PTP_READ_OFFSET);
+  }
+  EXPECT_EQ(fbclock_error_count(&lib, FBCLOCK_ERR_PTP_READ), 101);
+  EXPECT_EQ(record.calls, 1);
+  EXPECT_EQ(record.kind, FBCLOCK_ERR_PTP_READ);
+  EXPECT_EQ(record.err_no, ENODEV);
+  EXPECT_EQ(record.count, 2);
+
+  // no rate limit
+  record = {};
+  fbclock_set_error_callback(&lib, record_error_cb, &record, 0);
+  lib.gettime = negative_delay_gettime;
+  for (int i = 0; i < 10; i++) {
+    err = fbclock_gettime(&lib, &truetime);
+    ASSERT_EQ(err, FBCLOCK_E_PTP_READ_OFFSET);
+  }
+  EXPECT_EQ(record.calls, 10);
+  EXPECT_EQ(record.kind, FBCLOCK_ERR_NEGATIVE_DELAY);
+  EXPECT_EQ(record.count, 10);
+
+  // writer never finishes the update
+  shm.seq = 1;
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, FBCLOCK_E_SEQ_MISMATCH);
+  EXPECT_EQ(fbclock_error_count(&lib, FBCLOCK_ERR_SHMEM_READ), 1);
+  EXPECT_EQ(record.kind, FBCLOCK_ERR_SHMEM_READ);
+
+  EXPECT_EQ(fbclock_error_count(&lib, FBCLOCK_ERR_KINDS), 0);
+}
+
+static fbclock_lib* late_request_lib;
+static int late_request_err = -100;
+
+static void late_request(void*) {
+  fbclock_truetime truetime;
+  late_request_err = fbclock_gettime(late_request_lib, &truetime);
+}
+
+TEST(fbclockTest, test_stats_thread_exit) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime = fake_gettime;
+  late_request_lib = &lib;
+
+  // destructor of a key created after the stats one runs after stats are
+  // freed and still makes a request
+  std::thread([] {
+    fbclock_truetime truetime;
+    ASSERT_EQ(fbclock_gettime(late_request_lib, &truetime), 0);
+    pthread_key_t key;
+    ASSERT_EQ(pthread_key_create(&key, late_request), 0);
+    pthread_setspecific(key, (void*)1);
+  }).join();
+  EXPECT_EQ(late_request_err, 0);
+}
+
+int stats_thread(fbclock_lib* lib, int n) {
+  fbclock_truetime truetime;
+  for (int i = 0; i < n; i++) {
+    int err = fbclock_gettime(lib, &truetime);
+    if (err != 0) {
+      return err;
+    }
+  }
+  return 0;
+}
+
+TEST(fbclockTest, test_stats_snapshot) {
+  fbclock_shmdata_v2 shm = {};
+  shm.data.ingress_time_ns = 1647269091803102957;
+  shm.data.error_bound_ns = 100;
+
+  fbclock_lib lib = {};
+  lib.shmp_v2 = &shm;
+  lib.gettime = fake_gettime;
+
+  fbclock_stats before, after;
+  int err = fbclock_stats_snapshot(&before);
+  ASSERT_EQ(err, 0);
+
+  // fake_gettime returns delay of 10ns
+  err = stats_thread(&lib, 5);
+  ASSERT_EQ(err, 0);
+  // stats of exited threads are kept
+  std::thread t([&lib] { stats_thread(&lib, 10); });
+  t.join();
+
+  shm.data.error_bound_ns = 0;
+  fbclock_truetime truetime;
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, FBCLOCK_E_NO_DATA);
+
+  shm.data.error_bound_ns = 100;
+  shm.data.ingress_time_ns = INT64_MAX;
+  err = fbclock_gettime(&lib, &truetime);
+  ASSERT_EQ(err, FBCLOCK_E_PHC_IN_THE_PAST);
+
+  err = fbclock_stats_snapshot(&after);
+  ASSERT_EQ(err, 0);
+  EXPECT_EQ(after.requests - before.requests, 17);
+  EXPECT_EQ(after.no_data - before.no_data, 1);
+  EXPECT_EQ(after.phc_in_the_past - before.phc_in_the_past, 1);
+  // 10ns is in [8, 16) bucket
+  EXPECT_EQ(after.delay_hist[4] - before.delay_hist[4], 16);
+}
+
 TEST(fbclockTest, test_window_of_uncertainty) {
   int64_t seconds = 0; // how long ago was the last SYNC
   double error_bound_ns = 172.0;
@@ -196,6 +2000,66 @@ TEST(fbclockTest, test_fbclock_calculate_time) {
   EXPECT_EQ(truetime.latest_ns, 1647290691804195223);
 }
 
+TEST(fbclockTest, test_window_of_uncertainty_ns) {
+  uint64_t error_bound_ns = 172;
+  uint32_t holdover_multiplier_ns = 50.5 * 65536; // 16.16 fixed point
+
+  uint64_t wou = fbclock_window_of_uncertainty_ns(
+      0, error_bound_ns, holdover_multiplier_ns);
+  EXPECT_EQ(wou, 172);
+
+  wou = fbclock_window_of_uncertainty_ns(
+      10000000000, error_bound_ns, holdover_multiplier_ns);
+  EXPECT_EQ(wou, 677);
+
+  // rounded down, 50.5 * 1.5s = 75.75
+  wou = fbclock_window_of_uncertainty_ns(
+      1500000000, error_bound_ns, holdover_multiplier_ns);
+  EXPECT_EQ(wou, 172 + 75);
+
+  // exact for large values, and saturates instead of overflowing
+  wou = fbclock_window_of_uncertainty_ns(INT64_MAX, error_bound_ns, UINT32_MAX);
+  EXPECT_EQ(wou, 604462909666749);
+  wou = fbclock_window_of_uncertainty_ns(
+      10000000000, UINT64_MAX - 1, holdover_multiplier_ns);
+  EXPECT_EQ(wou, UINT64_MAX);
+}
+
+TEST(fbclockTest, test_fbclock_calculate_time_ns) {
+  int err;
+  fbclock_truetime truetime;
+  fbclock_clockdata state = {
+      .ingress_time_ns = 1647269091803102957,
+  };
+  uint64_t error_bound = 172;
+  uint32_t h_value = 50.5 * 65536;
+  // phc time is before ingress time, error
+  int64_t phctime_ns = 1647269082943150996;
+
+  err = fbclock_calculate_time_ns(
+      error_bound, h_value, &state, phctime_ns, &truetime, FBCLOCK_TAI);
+  ASSERT_EQ(err, FBCLOCK_E_PHC_IN_THE_PAST);
+
+  // same results as the double version
+  state = {.ingress_time_ns = 1647269082943150996};
+  phctime_ns = 1647269091803102957;
+  err = fbclock_calculate_time_ns(
+      error_bound, h_value, &state, phctime_ns, &truetime, FBCLOCK_TAI);
+  ASSERT_EQ(err, 0);
+  EXPECT_EQ(truetime.earliest_ns, 1647269091803102338);
+  EXPECT_EQ(truetime.latest_ns, 1647269091803103576);
+
+  error_bound = 1000;
+  phctime_ns += 6 * 3600 * 1000000000LL; // + 6 hours
+  err = fbclock_calculate_time_ns(
+      error_bound, h_value, &state, phctime_ns, &truetime, FBCLOCK_TAI);
+  ASSERT_EQ(err, 0);
+  // same WOU as the double version, which also rounds phctime_ns to 256ns
+  EXPECT_EQ(truetime.earliest_ns, 1647290691802010710);
+  EXPECT_EQ(truetime.latest_ns, 1647290691804195204);
+  EXPECT_EQ(truetime.latest_ns - truetime.earliest_ns, 2 * 1092247);
+}
+
 TEST(fbclockTest, test_fbclock_apply_smear_after_2017_leap_second) {
   uint64_t offset_pre_ns = 36e9;
   uint64_t offset_post_ns = 37e9;
@@ -355,6 +2219,142 @@ TEST(fbclockTest, test_fbclock_apply_smear_during_future_leap_second_negative) {
   }
 }
 
+TEST(fbclockTest, test_truetime_batch) {
+  fbclock_clockdata legacy = {
+      .ingress_time_ns = 1483228800000000000,
+      .error_bound_ns = 100,
+      .holdover_multiplier_ns = 50 << 16,
+      .clock_smearing_start_s = 1483228836,
+      .clock_smearing_end_s = 1483293836,
+      .utc_offset_pre_s = 36,
+      .utc_offset_post_s = 37,
+  };
+  fbclock_clockdata precomputed = legacy;
+  precomputed.clock_smearing_start_ns = 1483228836000000000;
+  precomputed.clock_smearing_end_ns = 1483293836000000000;
+  precomputed.utc_offset_pre_ns = 36000000000;
+  precomputed.utc_offset_post_ns = 37000000000;
+  precomputed.smear_step_mult = 283796062672455;
+  precomputed.smear_step_shift = 64;
+  fbclock_clockdata fixed = legacy;
+  fixed.utc_offset_pre_s = 0;
+  fixed.utc_offset_post_s = 0;
+  fbclock_clockdata negative = legacy;
+  negative.utc_offset_pre_s = 37;
+  negative.utc_offset_post_s = 36;
+
+  // around and inside smearing window, with step boundaries
+  std::vector<int64_t> phc = {
+      1483228835000000000,
+      1483228836000000000,
+      1483228836000064999,
+      1483228836000065000,
+      1483293835999999999,
+      1483293836000000000,
+      1483293836000000001,
+      1483293837000000000};
+  std::vector<int64_t> delay;
+  uint64_t x = 1;
+  while (phc.size() < 1000) {
+    x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    phc.push_back(1483228830000000000 + (int64_t)(x % 70000000000000ULL));
+  }
+  for (size_t i = 0; i < phc.size(); i++) {
+    delay.push_back((int64_t)(i % 1000));
+  }
+
+  for (fbclock_clockdata* state : {&legacy, &precomputed, &fixed, &negative}) {
+    std::vector<uint64_t> utc(phc.size());
+    fbclock_utc_offset_batch(state, phc.data(), utc.data(), phc.size());
+    for (size_t i = 0; i < phc.size(); i++) {
+      ASSERT_EQ(utc[i], fbclock_apply_utc_offset(state, phc[i])) << phc[i];
+    }
+    for (int tz : {FBCLOCK_TAI, FBCLOCK_UTC}) {
+      std::vector<fbclock_truetime> tts(phc.size());
+      ASSERT_EQ(
+          fbclock_truetime_batch(
+              state, phc.data(), delay.data(), phc.size(), tts.data(), tz),
+          0);
+      for (size_t i = 0; i < phc.size(); i++) {
+        fbclock_truetime tt;
+        ASSERT_EQ(
+            fbclock_calculate_time_ns(
+                state->error_bound_ns + delay[i],
+                state->holdover_multiplier_ns,
+                state,
+                phc[i],
+                &tt,
+                tz),
+            0);
+        ASSERT_EQ(tts[i].earliest_ns, tt.earliest_ns) << phc[i];
+        ASSERT_EQ(tts[i].latest_ns, tt.latest_ns) << phc[i];
+      }
+    }
+  }
+
+  // no delays, and conversion stops before ingress time
+  fbclock_truetime tts[3];
+  int64_t times[] = {
+      legacy.ingress_time_ns, legacy.ingress_time_ns + 1, 1000000000};
+  EXPECT_EQ(
+      fbclock_truetime_batch(&legacy, times, nullptr, 3, tts, FBCLOCK_TAI),
+      FBCLOCK_E_PHC_IN_THE_PAST);
+  EXPECT_EQ(tts[0].earliest_ns, legacy.ingress_time_ns - 100);
+  EXPECT_EQ(tts[1].latest_ns, legacy.ingress_time_ns + 1 + 100);
+  fbclock_clockdata empty = {};
+  EXPECT_EQ(
+      fbclock_truetime_batch(&empty, times, nullptr, 3, tts, FBCLOCK_TAI),
+      FBCLOCK_E_NO_DATA);
+}
+
+TEST(fbclockTest, test_fbclock_apply_utc_offset_precomputed) {
+  fbclock_clockdata state = {
+      .clock_smearing_start_s = 1483228836,
+      .clock_smearing_end_s = 1483293836,
+      .utc_offset_pre_s = 36,
+      .utc_offset_post_s = 37,
+  };
+  fbclock_clockdata precomputed = state;
+  precomputed.clock_smearing_start_ns = 1483228836000000000;
+  precomputed.clock_smearing_end_ns = 1483293836000000000;
+  precomputed.utc_offset_pre_ns = 36000000000;
+  precomputed.utc_offset_post_ns = 37000000000;
+  // ceil(2^64 / SMEAR_STEP_NS)
+  precomputed.smear_step_mult = 283796062672455;
+  precomputed.smear_step_shift = 64;
+
+  int64_t input_times[] = {
+      1483228835000000000, // before smearing
+      1483228836000000000, // start
+      1483228836000064999,
+      1483228836000065000,
+      1483228836000130000,
+      1483261336000000000, // midpoint
+      1483261345123456789,
+      1483293835999999999,
+      1483293836000000000, // end
+      1483293837000000000, // after smearing
+  };
+  for (int64_t t : input_times) {
+    EXPECT_EQ(
+        fbclock_apply_utc_offset(&precomputed, t),
+        fbclock_apply_utc_offset(&state, t));
+  }
+
+  // negative leap second
+  state.utc_offset_pre_s = 37;
+  state.utc_offset_post_s = 36;
+  precomputed.utc_offset_pre_s = 37;
+  precomputed.utc_offset_post_s = 36;
+  precomputed.utc_offset_pre_ns = 37000000000;
+  precomputed.utc_offset_post_ns = 36000000000;
+  for (int64_t t : input_times) {
+    EXPECT_EQ(
+        fbclock_apply_utc_offset(&precomputed, t),
+        fbclock_apply_utc_offset(&state, t));
+  }
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
   return RUN_ALL_TESTS();
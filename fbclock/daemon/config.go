@@ -21,6 +21,7 @@ import (
 	"os"
 	"time"
 
+	"github.com/facebook/time/fbclock"
 	log "github.com/sirupsen/logrus"
 	"golang.org/x/sys/unix"
 	yaml "gopkg.in/yaml.v2"
@@ -37,6 +38,46 @@ type Config struct {
 	SPTP                           bool          // denotes whether we are running in sptp or ptp4l mode
 	LinearizabilityTestMaxGMOffset time.Duration // max offset between GMs before linearizability test considered failed
 	BootDelay                      time.Duration // postpone startup by this time after boot
+	PerIface                       bool          // publish to per-interface shm and device paths, to run a daemon per NIC
+	JournalCapacity                int           // records kept in the journal of published data, 0 disables it
+	PHCRingInterval                time.Duration // sample PHC this often for clients in FBCLOCK_READ_SERVICE mode, 0 disables it
+}
+
+// ShmPath returns path of v1 shm we publish to
+func (c *Config) ShmPath() string {
+	return c.path(fbclock.ShmPath)
+}
+
+// ShmPathV2 returns path of v2 shm we publish to
+func (c *Config) ShmPathV2() string {
+	return c.path(fbclock.ShmPathV2)
+}
+
+// ShmPathV3 returns path of v3 shm we publish to
+func (c *Config) ShmPathV3() string {
+	return c.path(fbclock.ShmPathV3)
+}
+
+// JournalPath returns path of the journal of published data
+func (c *Config) JournalPath() string {
+	return c.path(fbclock.JournalPath)
+}
+
+// PHCRingPath returns path of the ring of PHC samples for NUMA node
+func (c *Config) PHCRingPath(node int) string {
+	return fbclock.PHCRingNodePath(c.path(fbclock.PHCRingPath), node)
+}
+
+// DevicePath returns path of the managed PHC device
+func (c *Config) DevicePath() string {
+	return c.path(fbclock.PTPPath)
+}
+
+func (c *Config) path(p string) string {
+	if c.PerIface {
+		return fbclock.IfacePath(p, c.Iface)
+	}
+	return p
 }
 
 // EvalAndValidate makes sure config is valid and evaluates expressions for further use.
@@ -58,6 +99,18 @@ func (c *Config) EvalAndValidate() error {
 	if c.LinearizabilityTestMaxGMOffset < 0 {
 		return fmt.Errorf("bad config: 'offset' must be positive")
 	}
+
+	if c.JournalCapacity < 0 || c.JournalCapacity == 1 {
+		return fmt.Errorf("bad config: 'journalcapacity' must be 0 (disabled) or at least 2")
+	}
+
+	if c.PHCRingInterval < 0 || c.PHCRingInterval > time.Second {
+		return fmt.Errorf("bad config: 'phcringinterval' must be between 0 and 1 second")
+	}
+
+	if c.PerIface && c.Iface == "" {
+		return fmt.Errorf("bad config: 'periface' requires 'iface'")
+	}
 	return c.Math.Prepare()
 }
 
@@ -65,3 +65,66 @@ func TestPostponeStart(t *testing.T) {
 	require.True(t, time.Since(start) >= delay)
 	require.NoError(t, err)
 }
+
+func TestConfigPaths(t *testing.T) {
+	c := &Config{Iface: "eth1"}
+	require.Equal(t, "/run/fbclock_data_v1", c.ShmPath())
+	require.Equal(t, "/run/fbclock_data_v2", c.ShmPathV2())
+	require.Equal(t, "/run/fbclock_data_v3", c.ShmPathV3())
+	require.Equal(t, "/run/fbclock_journal", c.JournalPath())
+	require.Equal(t, "/run/fbclock_phc_ring.node0", c.PHCRingPath(0))
+	require.Equal(t, "/dev/fbclock/ptp", c.DevicePath())
+
+	c.PerIface = true
+	require.Equal(t, "/run/fbclock_data_v1.eth1", c.ShmPath())
+	require.Equal(t, "/run/fbclock_data_v2.eth1", c.ShmPathV2())
+	require.Equal(t, "/run/fbclock_data_v3.eth1", c.ShmPathV3())
+	require.Equal(t, "/run/fbclock_journal.eth1", c.JournalPath())
+	require.Equal(t, "/run/fbclock_phc_ring.eth1.node1", c.PHCRingPath(1))
+	require.Equal(t, "/dev/fbclock/ptp.eth1", c.DevicePath())
+
+	c = &Config{
+		PTPClientAddress:               "some address",
+		RingSize:                       42,
+		Interval:                       time.Second,
+		LinearizabilityTestMaxGMOffset: time.Microsecond,
+		Math:                           Math{M: "1", W: "1", Drift: "1"},
+		PerIface:                       true,
+	}
+	require.Equal(t, fmt.Errorf("bad config: 'periface' requires 'iface'"), c.EvalAndValidate())
+	c.Iface = "eth1"
+	require.NoError(t, c.EvalAndValidate())
+}
+
+func TestConfigJournalCapacity(t *testing.T) {
+	// disabled by default
+	c := &Config{
+		PTPClientAddress: "some address",
+		RingSize:         42,
+		Interval:         time.Second,
+		Math:             Math{M: "1", W: "1", Drift: "1"},
+	}
+	require.NoError(t, c.EvalAndValidate())
+	c.JournalCapacity = 100
+	require.NoError(t, c.EvalAndValidate())
+	for _, capacity := range []int{-1, 1} {
+		c.JournalCapacity = capacity
+		require.Equal(t, fmt.Errorf("bad config: 'journalcapacity' must be 0 (disabled) or at least 2"), c.EvalAndValidate())
+	}
+}
+
+func TestConfigPHCRingInterval(t *testing.T) {
+	c := &Config{
+		PTPClientAddress: "some address",
+		RingSize:         42,
+		Interval:         time.Second,
+		Math:             Math{M: "1", W: "1", Drift: "1"},
+		PHCRingInterval:  -time.Millisecond,
+	}
+	want := fmt.Errorf("bad config: 'phcringinterval' must be between 0 and 1 second")
+	require.Equal(t, want, c.EvalAndValidate())
+	c.PHCRingInterval = 2 * time.Second
+	require.Equal(t, want, c.EvalAndValidate())
+	c.PHCRingInterval = 100 * time.Microsecond
+	require.NoError(t, c.EvalAndValidate())
+}
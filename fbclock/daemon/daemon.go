@@ -21,6 +21,7 @@ import (
 	"errors"
 	"fmt"
 	"math"
+	"math/bits"
 	"os"
 	"sync"
 	"time"
@@ -40,6 +41,7 @@ import (
 const (
 	utcOffsetOriginalS int32  = 10    // UTC-TAI offset was 10s before leap seconds started (1972)
 	leapDurationS      uint64 = 65000 // 18.06 hours
+	smearStepNS        uint64 = 65000 // must match SMEAR_STEP_NS in fbclock.h
 	monPrefix          string = "linearizability."
 )
 
@@ -111,6 +113,21 @@ type Daemon struct {
 	getPHCTime func() (time.Time, error)
 	// function to get PHC freq from configured PHC device
 	getPHCFreqPPB func() (float64, error)
+	// function to get PHC time correlated with CLOCK_MONOTONIC_RAW
+	getPHCSysclock func() (*sysclockSample, error)
+	// PHC to CLOCK_MONOTONIC_RAW mapping we publish for clients
+	sysclock sysclockMapper
+	// PHC read methods supported by the device, published for clients
+	ptpCaps uint32
+
+	// buffers reused on every publish, only touched by doWork
+	windows   *windows
+	params    mathParams
+	ms        []float64
+	logSample LogSample
+	shmData   fbclock.Data
+	// journal of published data, nil if disabled
+	journal *fbclock.Journal
 }
 
 // minRingSize calculate how many DataPoint we need to have in a ring buffer
@@ -170,6 +187,30 @@ func leapSecondSmearing(leaps []leapsectz.LeapSecond) *clockSmearing {
 	}
 }
 
+// smearStepReciprocal returns mult and shift such that x / smearStepNS == x * mult >> shift
+// for any x within the smearing window, so readers don't need to divide
+func smearStepReciprocal() (uint64, uint32) {
+	// ceil(2^64 / smearStepNS), exact as long as x * (mult * smearStepNS - 2^64) < 2^64
+	mult, rem := bits.Div64(1, 0, smearStepNS)
+	if rem != 0 {
+		mult++
+	}
+	return mult, 64
+}
+
+// precomputeUTC fills in values readers need for UTC conversion, so they don't have to convert and divide on each request.
+// v1 writers drop them, deployed v1 readers don't cover them with their CRC, so only v2 and v3 readers get them.
+func (c *clockSmearing) precomputeUTC(d *fbclock.Data) {
+	if c.utcOffsetPreS == 0 && c.utcOffsetPostS == 0 {
+		return
+	}
+	d.SmearingStartNS = c.smearingStartS * uint64(time.Second)
+	d.SmearingEndNS = c.smearingEndS * uint64(time.Second)
+	d.UTCOffsetPreNS = int64(c.utcOffsetPreS) * int64(time.Second)
+	d.UTCOffsetPostNS = int64(c.utcOffsetPostS) * int64(time.Second)
+	d.SmearStepMult, d.SmearStepShift = smearStepReciprocal()
+}
+
 // noTestResults generates a map of error test results
 func noTestResults(targets []string) map[string]linearizability.TestResult {
 	r := map[string]linearizability.TestResult{}
@@ -179,6 +220,20 @@ func noTestResults(targets []string) map[string]linearizability.TestResult {
 	return r
 }
 
+// ptpCapsFromDevice probes which PHC read ioctls the device supports,
+// so clients can skip probing it themselves on every init.
+// Published in v2 and v3 only, deployed v1 readers don't cover it with their CRC.
+func ptpCapsFromDevice(f *os.File) uint32 {
+	caps := uint32(fbclock.PTPCapProbed)
+	if _, err := phc.ReadPTPSysOffsetExtended(f, 1); err == nil {
+		caps |= fbclock.PTPCapExtended
+	}
+	if c, err := phc.ReadPTPClockCapsFromDevice(f); err == nil && c.CrossTimestamping != 0 {
+		caps |= fbclock.PTPCapPrecise
+	}
+	return caps
+}
+
 // New creates new fbclock-daemon
 func New(cfg *Config, stats stats.Server, l Logger) (*Daemon, error) {
 	// we need at least 1m of samples for aggregate values
@@ -209,6 +264,8 @@ func New(cfg *Config, stats stats.Server, l Logger) (*Daemon, error) {
 	// function to get time from phc
 	s.getPHCTime = func() (time.Time, error) { return phc.TimeFromDevice(f) }
 	s.getPHCFreqPPB = func() (float64, error) { return phc.FrequencyPPBFromDevice(f) }
+	s.getPHCSysclock = func() (*sysclockSample, error) { return sysclockSampleFromDevice(f) }
+	s.ptpCaps = ptpCapsFromDevice(f)
 	// calculated values
 	s.stats.SetCounter("m_ns", 0)
 	s.stats.SetCounter("w_ns", 0)
@@ -230,22 +287,47 @@ func New(cfg *Config, stats stats.Server, l Logger) (*Daemon, error) {
 	return s, nil
 }
 
+// formulaWindows returns incremental stats for formulas and logged samples
+func (s *Daemon) formulaWindows() *windows {
+	if s.windows == nil {
+		s.windows = newWindows(s.cfg.Math.windowCalls, s.cfg.RingSize)
+		for _, v := range []string{"offset", "delay", "freq", "clockaccuracy", "m"} {
+			s.windows.stat(v, s.cfg.RingSize)
+		}
+	}
+	return s.windows
+}
+
+// fillLists adds lists of latest values to formula parameters,
+// for formulas with window calls we can't compute incrementally
+func (s *Daemon) fillLists(vars map[string]interface{}) {
+	s.params.fill(s.state, s.cfg.RingSize)
+	for k, v := range s.params.vars {
+		vars[k] = v
+	}
+}
+
 func (s *Daemon) calcW() (float64, error) {
-	lastN := s.state.takeDataPoint(s.cfg.RingSize)
-	params := prepareMathParameters(lastN)
-	logSample := &LogSample{
-		MasterOffsetNS:          params["offset"][0],
-		MasterOffsetMeanNS:      mean(params["offset"]),
-		MasterOffsetStddevNS:    stddev(params["offset"]),
-		PathDelayNS:             params["delay"][0],
-		PathDelayMeanNS:         mean(params["delay"]),
-		PathDelayStddevNS:       stddev(params["delay"]),
-		FreqAdjustmentPPB:       params["freq"][0],
-		FreqAdjustmentMeanPPB:   mean(params["freq"]),
-		FreqAdjustmentStddevPPB: stddev(params["freq"]),
-		ClockAccuracyMean:       mean(params["clockaccuracie"]),
-	}
-	mRaw, err := s.cfg.Math.mExpr.Evaluate(mapOfInterface(params))
+	win := s.formulaWindows()
+	latest := s.state.dataPoint(0)
+	logSample := &s.logSample
+	*logSample = LogSample{
+		MasterOffsetNS:          latest.MasterOffsetNS,
+		MasterOffsetMeanNS:      win.stat("offset", s.cfg.RingSize).Mean(),
+		MasterOffsetStddevNS:    win.stat("offset", s.cfg.RingSize).Stddev(),
+		PathDelayNS:             latest.PathDelayNS,
+		PathDelayMeanNS:         win.stat("delay", s.cfg.RingSize).Mean(),
+		PathDelayStddevNS:       win.stat("delay", s.cfg.RingSize).Stddev(),
+		FreqAdjustmentPPB:       latest.FreqAdjustmentPPB,
+		FreqAdjustmentMeanPPB:   win.stat("freq", s.cfg.RingSize).Mean(),
+		FreqAdjustmentStddevPPB: win.stat("freq", s.cfg.RingSize).Stddev(),
+		ClockAccuracyMean:       win.stat("clockaccuracy", s.cfg.RingSize).Mean(),
+	}
+	vars := win.update()
+	if s.cfg.Math.mNeedsLists {
+		s.fillLists(vars)
+	}
+	mRaw, err := s.cfg.Math.mExpr.Evaluate(vars)
 	if err != nil {
 		return 0, err
 	}
@@ -255,19 +337,24 @@ func (s *Daemon) calcW() (float64, error) {
 
 	// push m to ring buffer
 	s.state.pushM(m)
+	win.push("m", m)
 
-	ms := s.state.takeM(s.cfg.RingSize)
-	if len(ms) != s.cfg.RingSize {
-		return 0, fmt.Errorf("%w getting W: want %d, got %d", errNotEnoughData, s.cfg.RingSize, len(ms))
+	if got := s.state.mLen(s.cfg.RingSize); got != s.cfg.RingSize {
+		return 0, fmt.Errorf("%w getting W: want %d, got %d", errNotEnoughData, s.cfg.RingSize, got)
 	}
-
-	parameters := map[string]interface{}{
-		"m": ms,
+	vars = win.update()
+	if s.cfg.Math.wNeedsLists {
+		ms := s.state.takeM(s.ms[:0], s.cfg.RingSize)
+		// boxing slice into interface{} allocates, so only do it when it changes
+		if _, ok := vars["m"]; !ok || cap(ms) != cap(s.ms) {
+			vars["m"] = ms
+		}
+		s.ms = ms
 	}
-	logSample.MeasurementMeanNS = mean(ms)
-	logSample.MeasurementStddevNS = stddev(ms)
+	logSample.MeasurementMeanNS = win.stat("m", s.cfg.RingSize).Mean()
+	logSample.MeasurementStddevNS = win.stat("m", s.cfg.RingSize).Stddev()
 
-	wRaw, err := s.cfg.Math.wExpr.Evaluate(parameters)
+	wRaw, err := s.cfg.Math.wExpr.Evaluate(vars)
 	if err != nil {
 		return 0, err
 	}
@@ -281,12 +368,14 @@ func (s *Daemon) calcW() (float64, error) {
 }
 
 func (s *Daemon) calcDriftPPB() (float64, error) {
-	lastN := s.state.takeDataPoint(s.cfg.RingSize)
-	if len(lastN) != s.cfg.RingSize {
-		return 0, fmt.Errorf("%w calculating drift: want %d, got %d", errNotEnoughData, s.cfg.RingSize, len(lastN))
+	if got := s.state.dataPointsLen(s.cfg.RingSize); got != s.cfg.RingSize {
+		return 0, fmt.Errorf("%w calculating drift: want %d, got %d", errNotEnoughData, s.cfg.RingSize, got)
+	}
+	vars := s.formulaWindows().update()
+	if s.cfg.Math.driftNeedsLists {
+		s.fillLists(vars)
 	}
-	params := prepareMathParameters(lastN)
-	driftRaw, err := s.cfg.Math.driftExpr.Evaluate(mapOfInterface(params))
+	driftRaw, err := s.cfg.Math.driftExpr.Evaluate(vars)
 	if err != nil {
 		return 0, err
 	}
@@ -294,6 +383,7 @@ func (s *Daemon) calcDriftPPB() (float64, error) {
 	return drift, nil
 }
 
+// calculateSHMData returns data to publish, it's reused by the next call
 func (s *Daemon) calculateSHMData(data *DataPoint, leaps []leapsectz.LeapSecond) (*fbclock.Data, error) {
 	if err := data.SanityCheck(); err != nil {
 		s.stats.UpdateCounterBy("data_sanity_check_error", 1)
@@ -303,6 +393,7 @@ func (s *Daemon) calculateSHMData(data *DataPoint, leaps []leapsectz.LeapSecond)
 
 	// store DataPoint in ring buffer
 	s.state.pushDataPoint(data)
+	s.formulaWindows().pushDataPoint(data)
 
 	// calculate W
 	w, err := s.calcW()
@@ -324,7 +415,8 @@ func (s *Daemon) calculateSHMData(data *DataPoint, leaps []leapsectz.LeapSecond)
 	s.stats.SetCounter("drift_ppb", int64(hValue))
 
 	clockSmearing := leapSecondSmearing(leaps)
-	return &fbclock.Data{
+	d := &s.shmData
+	*d = fbclock.Data{
 		IngressTimeNS:        data.IngressTimeNS,
 		ErrorBoundNS:         wUint,
 		HoldoverMultiplierNS: hValue,
@@ -332,10 +424,28 @@ func (s *Daemon) calculateSHMData(data *DataPoint, leaps []leapsectz.LeapSecond)
 		SmearingEndS:         clockSmearing.smearingEndS,
 		UTCOffsetPreS:        clockSmearing.utcOffsetPreS,
 		UTCOffsetPostS:       clockSmearing.utcOffsetPostS,
-	}, nil
+		PTPCaps:              s.ptpCaps,
+	}
+	clockSmearing.precomputeUTC(d)
+	return d, nil
+}
+
+// updateSysclockMapping takes new PHC to CLOCK_MONOTONIC_RAW sample and returns mapping to publish
+func (s *Daemon) updateSysclockMapping() *sysclockMapping {
+	sample, err := s.getPHCSysclock()
+	if err != nil {
+		log.Warningf("Failed to get PHC to sysclock sample: %v", err)
+		return nil
+	}
+	mapping, err := s.sysclock.update(sample)
+	if err != nil {
+		log.Debugf("No PHC to sysclock mapping: %v", err)
+		return nil
+	}
+	return mapping
 }
 
-func (s *Daemon) doWork(shm *fbclock.Shm, data *DataPoint) error {
+func (s *Daemon) doWork(shms []*fbclock.Shm, data *DataPoint) error {
 	// push stats
 	s.stats.SetCounter("master_offset_ns", int64(data.MasterOffsetNS))
 	s.stats.SetCounter("path_delay_ns", int64(data.PathDelayNS))
@@ -359,6 +469,8 @@ func (s *Daemon) doWork(shm *fbclock.Shm, data *DataPoint) error {
 	} else {
 		log.Warningf("No data for time since ingress")
 	}
+	// keep sampling even if we don't publish, so the mapping is warm
+	mapping := s.updateSysclockMapping()
 	// read tzdata for leap seconds
 	leaps, err := leapSeconds()
 	if err != nil {
@@ -373,8 +485,25 @@ func (s *Daemon) doWork(shm *fbclock.Shm, data *DataPoint) error {
 		}
 		return err
 	}
-	if err := fbclock.StoreFBClockData(shm.File.Fd(), *d); err != nil {
-		return err
+	if mapping != nil {
+		d.PHCTimeNS = mapping.PHCTimeNS
+		d.SysclockTimeNS = mapping.SysclockTimeNS
+		d.CoefPPB = mapping.CoefPPB
+		d.SysclockErrorNS = mapping.ErrorNS
+		// frequency can't be trusted better than the holdover drift estimate
+		d.SysclockErrorPPB = max(mapping.ErrorPPB, uint64(math.Ceil(math.Max(d.HoldoverMultiplierNS, 0))))
+	}
+	for _, shm := range shms {
+		if err := fbclock.StoreShmData(shm, *d); err != nil {
+			return err
+		}
+	}
+	if s.journal != nil {
+		// readers of shm don't depend on it, so it's not a processing error
+		if err := s.journal.Append(d); err != nil {
+			log.Warningf("Failed to append to journal: %v", err)
+			s.stats.UpdateCounterBy("journal_error", 1)
+		}
 	}
 	// aggregated stats over 1 minute
 	maxDp := s.state.aggregateDataPointsMax(minRingSize(s.cfg.RingSize, s.cfg.Interval))
@@ -483,11 +612,52 @@ func (s *Daemon) runLinearizabilityTests(ctx context.Context) {
 
 // Run a daemon
 func (s *Daemon) Run(ctx context.Context) error {
-	shm, err := fbclock.OpenFBClockSHM()
+	shm, err := fbclock.OpenFBClockShmCustom(s.cfg.ShmPath())
 	if err != nil {
 		return fmt.Errorf("opening fbclock shm: %w", err)
 	}
 	defer shm.Close()
+	// v2 layout is published next to v1 until all clients are migrated
+	shmV2, err := fbclock.OpenFBClockShmV2Custom(s.cfg.ShmPathV2())
+	if err != nil {
+		return fmt.Errorf("opening fbclock shm v2: %w", err)
+	}
+	defer shmV2.Close()
+	shmV3, err := fbclock.OpenFBClockShmV3Custom(s.cfg.ShmPathV3())
+	if err != nil {
+		return fmt.Errorf("opening fbclock shm v3: %w", err)
+	}
+	defer shmV3.Close()
+	shms := []*fbclock.Shm{shm, shmV2, shmV3}
+	// journal lives in RAM (/run is tmpfs), only hosts feeding audits enable it
+	if s.cfg.JournalCapacity > 0 {
+		s.journal, err = fbclock.OpenJournal(s.cfg.JournalPath(), s.cfg.JournalCapacity)
+		if err != nil {
+			return fmt.Errorf("opening fbclock journal: %w", err)
+		}
+		defer func() {
+			s.journal.Close()
+			s.journal = nil
+		}()
+	}
+	if s.cfg.PHCRingInterval > 0 {
+		rings, err := openPHCRings(s.cfg)
+		if err != nil {
+			return fmt.Errorf("opening fbclock phc rings: %w", err)
+		}
+		samplerCtx, cancel := context.WithCancel(ctx)
+		done := make(chan struct{})
+		go func() {
+			s.runPHCRingSampler(samplerCtx, rings)
+			close(done)
+		}()
+		// rings are unmapped only after the sampler stopped publishing
+		defer func() {
+			cancel()
+			<-done
+			closePHCRings(rings)
+		}()
+	}
 
 	if s.cfg.LinearizabilityTestInterval != 0 {
 		go s.runLinearizabilityTests(ctx)
@@ -508,7 +678,7 @@ func (s *Daemon) Run(ctx context.Context) error {
 			return err
 		}
 		data.FreqAdjustmentPPB = freqPPB
-		if err := s.doWork(shm, data); err != nil {
+		if err := s.doWork(shms, data); err != nil {
 			if errors.Is(err, errNoPHC) {
 				return err
 			}
@@ -18,6 +18,7 @@ package daemon
 
 import (
 	"context"
+	"math/bits"
 	"os"
 	"testing"
 	"time"
@@ -48,6 +49,7 @@ func newTestDaemon(cfg *Config, stats stats.Server) *Daemon {
 		l:           &testLogger{samples: []*LogSample{}},
 		DataFetcher: &SockFetcher{},
 	}
+	s.getPHCSysclock = func() (*sysclockSample, error) { return nil, errNoPHC }
 	return s
 }
 
@@ -104,7 +106,7 @@ func TestDaemonStateAggregateMax(t *testing.T) {
 		s.pushDataPoint(tr)
 	}
 	got := s.aggregateDataPointsMax(3)
-	want := &DataPoint{
+	want := DataPoint{
 		MasterOffsetNS:    2000.0,
 		PathDelayNS:       300,
 		FreqAdjustmentPPB: 5,
@@ -112,6 +114,46 @@ func TestDaemonStateAggregateMax(t *testing.T) {
 	require.Equal(t, want, got)
 }
 
+func TestDaemonStateRingWraps(t *testing.T) {
+	s := newDaemonState(3)
+	require.Equal(t, 0, s.dataPointsLen(3))
+	require.Empty(t, s.takeM(nil, 3))
+
+	for i := 1; i <= 5; i++ {
+		s.pushDataPoint(&DataPoint{IngressTimeNS: int64(i)})
+		s.pushM(float64(i))
+	}
+	require.Equal(t, 3, s.dataPointsLen(10))
+	require.Equal(t, 2, s.dataPointsLen(2))
+	for i := 0; i < 3; i++ {
+		require.Equal(t, int64(5-i), s.dataPoint(i).IngressTimeNS)
+	}
+	require.Equal(t, []float64{5, 4, 3}, s.takeM(nil, 10))
+	require.Equal(t, []float64{5}, s.takeM(nil, 1))
+}
+
+func TestDaemonStateNoAllocs(t *testing.T) {
+	s := newDaemonState(100)
+	params := &mathParams{}
+	ms := make([]float64, 0, 100)
+	dp := &DataPoint{IngressTimeNS: 1, MasterOffsetNS: 2, FreqAdjustmentPPB: 3}
+	for i := 0; i < 100; i++ {
+		s.pushDataPoint(dp)
+	}
+	params.fill(s, 100)
+	allocs := testing.AllocsPerRun(100, func() {
+		s.pushDataPoint(dp)
+		s.pushM(1)
+		params.fill(s, 100)
+		ms = s.takeM(ms[:0], 100)
+		_ = s.aggregateDataPointsMax(100)
+	})
+	require.Equal(t, float64(0), allocs)
+	require.Equal(t, 100, params.size())
+	require.Len(t, ms, 100)
+	require.Equal(t, []float64{2, 2}, params.offset[:2])
+}
+
 func TestTargetsChange(t *testing.T) {
 	testCases := []struct {
 		name        string
@@ -383,6 +425,7 @@ func TestDaemonCalculateSHMData(t *testing.T) {
 	require.NoError(t, err)
 	stats := stats.NewStats()
 	s := newTestDaemon(cfg, stats)
+	s.ptpCaps = fbclock.PTPCapProbed | fbclock.PTPCapExtended
 	startTime := time.Duration(1647359186979431900)
 	var d *DataPoint
 	adj := 212131.0
@@ -424,6 +467,13 @@ func TestDaemonCalculateSHMData(t *testing.T) {
 		SmearingEndS:         1483293836,
 		UTCOffsetPreS:        36,
 		UTCOffsetPostS:       37,
+		SmearingStartNS:      1483228836000000000,
+		SmearingEndNS:        1483293836000000000,
+		UTCOffsetPreNS:       36000000000,
+		UTCOffsetPostNS:      37000000000,
+		SmearStepMult:        283796062672455,
+		SmearStepShift:       64,
+		PTPCaps:              fbclock.PTPCapProbed | fbclock.PTPCapExtended,
 	}
 	shmData, err := s.calculateSHMData(d, leaps)
 	require.NoError(t, err)
@@ -462,11 +512,18 @@ func TestDaemonCalculateSHMData(t *testing.T) {
 	want = &fbclock.Data{
 		IngressTimeNS:        d.IngressTimeNS,
 		ErrorBoundNS:         157,
-		HoldoverMultiplierNS: 9362.84482758621,
+		HoldoverMultiplierNS: 9362.844827586207,
 		SmearingStartS:       1483228836,
 		SmearingEndS:         1483293836,
 		UTCOffsetPreS:        36,
 		UTCOffsetPostS:       37,
+		SmearingStartNS:      1483228836000000000,
+		SmearingEndNS:        1483293836000000000,
+		UTCOffsetPreNS:       36000000000,
+		UTCOffsetPostNS:      37000000000,
+		SmearStepMult:        283796062672455,
+		SmearStepShift:       64,
+		PTPCaps:              fbclock.PTPCapProbed | fbclock.PTPCapExtended,
 	}
 	require.NoError(t, err)
 	require.Equal(t, want, shmData)
@@ -489,11 +546,29 @@ func TestDaemonCalculateSHMData(t *testing.T) {
 		SmearingEndS:         0,
 		UTCOffsetPreS:        0,
 		UTCOffsetPostS:       0,
+		PTPCaps:              fbclock.PTPCapProbed | fbclock.PTPCapExtended,
 	}
 	require.NoError(t, err)
 	require.Equal(t, want, shmData)
 }
 
+func TestSmearStepReciprocal(t *testing.T) {
+	mult, shift := smearStepReciprocal()
+	require.Equal(t, uint64(283796062672455), mult)
+	require.Equal(t, uint32(64), shift)
+	div := func(x uint64) uint64 {
+		hi, _ := bits.Mul64(x, mult)
+		return hi >> (shift - 64)
+	}
+	windowNS := leapDurationS * uint64(time.Second)
+	for _, x := range []uint64{0, 1, smearStepNS - 1, smearStepNS, smearStepNS + 1, windowNS / 2, windowNS - 1, windowNS} {
+		require.Equal(t, x/smearStepNS, div(x), "x=%d", x)
+	}
+	for x := windowNS - 10*smearStepNS; x <= windowNS; x += 997 {
+		require.Equal(t, x/smearStepNS, div(x), "x=%d", x)
+	}
+}
+
 func TestDaemonDoWork(t *testing.T) {
 	cfg := &Config{
 		Interval: time.Second,
@@ -519,6 +594,13 @@ func TestDaemonDoWork(t *testing.T) {
 	shm, err := fbclock.OpenFBClockShmCustom(tmpFile.Name())
 	require.NoError(t, err)
 	defer shm.Close()
+	tmpFileV2, err := os.CreateTemp("", "daemon_test_v2")
+	require.NoError(t, err)
+	defer os.Remove(tmpFileV2.Name())
+	shmV2, err := fbclock.OpenFBClockShmV2Custom(tmpFileV2.Name())
+	require.NoError(t, err)
+	defer shmV2.Close()
+	shms := []*fbclock.Shm{shm, shmV2}
 
 	// populate the data
 	var d *DataPoint
@@ -531,7 +613,7 @@ func TestDaemonDoWork(t *testing.T) {
 			PathDelayNS:       0,
 			FreqAdjustmentPPB: 0,
 		}
-		err = s.doWork(shm, d)
+		err = s.doWork(shms, d)
 		require.Error(t, err, "not enough data should give us error when calculating shm state")
 		c := stats.Get()
 		// not enough data for those
@@ -562,7 +644,7 @@ func TestDaemonDoWork(t *testing.T) {
 			ClockAccuracyNS:   25.0,
 		}
 		phcTime = tme + time.Microsecond
-		err = s.doWork(shm, d)
+		err = s.doWork(shms, d)
 		require.NoError(t, err, "not enough data should give us error when calculating shm state, which we log and continue")
 		// check exported stats
 		c := stats.Get()
@@ -601,7 +683,7 @@ func TestDaemonDoWork(t *testing.T) {
 	}
 	phcTime = startTime + 62*time.Second
 
-	err = s.doWork(shm, d)
+	err = s.doWork(shms, d)
 	require.NoError(t, err)
 	// check that we have proper stats reported
 	c := stats.Get()
@@ -630,6 +712,13 @@ func TestDaemonDoWork(t *testing.T) {
 	require.Equal(t, want.IngressTimeNS, got.IngressTimeNS)
 	require.Equal(t, want.ErrorBoundNS, got.ErrorBoundNS)
 	require.InDelta(t, want.HoldoverMultiplierNS, got.HoldoverMultiplierNS, 0.001)
+	shmpDataV2, err := fbclock.MmapShmpDataV2(shmV2.File.Fd())
+	require.NoError(t, err)
+	got, err = fbclock.ReadFBClockDataV2(shmpDataV2)
+	require.NoError(t, err)
+	require.Equal(t, want.IngressTimeNS, got.IngressTimeNS)
+	require.Equal(t, want.ErrorBoundNS, got.ErrorBoundNS)
+	require.InDelta(t, want.HoldoverMultiplierNS, got.HoldoverMultiplierNS, 0.001)
 
 	// ptp4l has a hiccup, but that should be okay
 	d = &DataPoint{
@@ -640,7 +729,7 @@ func TestDaemonDoWork(t *testing.T) {
 	}
 	phcTime = startTime + 63*time.Second
 
-	err = s.doWork(shm, d)
+	err = s.doWork(shms, d)
 	require.Error(t, err, "data point fails sanity check")
 	// check that we have proper stats reported
 	c = stats.Get()
@@ -722,6 +811,6 @@ func TestNoPHC(t *testing.T) {
 	s := newTestDaemon(cfg, stats)
 	s.getPHCTime = func() (time.Time, error) { return time.Time{}, errNoPHC }
 
-	err := s.doWork(&fbclock.Shm{}, &DataPoint{})
+	err := s.doWork([]*fbclock.Shm{{}}, &DataPoint{})
 	require.ErrorIs(t, err, errNoPHC)
 }
@@ -34,7 +34,11 @@ const ManagedPTPDevicePath = string(fbclock.PTPPath)
 // SetupDeviceDir creates a PHC device path from the interface name
 func SetupDeviceDir(iface string) error {
 	// explicitly convert to string to prevent GOPLS from panicking here
-	target := ManagedPTPDevicePath
+	return SetupDeviceDirCustom(iface, ManagedPTPDevicePath)
+}
+
+// SetupDeviceDirCustom links PHC device of the interface to the target path
+func SetupDeviceDirCustom(iface string, target string) error {
 	dir := filepath.Dir(target)
 	wantMode := os.ModeCharDevice | os.ModeDevice | 0644
 
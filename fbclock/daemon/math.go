@@ -60,20 +60,29 @@ type Math struct {
 	wExpr     *govaluate.EvaluableExpression
 	Drift     string // drift in PPB, for holdover multiplier calculations
 	driftExpr *govaluate.EvaluableExpression
+
+	// window calls with constant size, like mean(offset, 100), are replaced
+	// by variables computed incrementally, see windows
+	windowCalls map[string]windowCall
+	// if formulas still need lists of values, because of calls we couldn't replace
+	mNeedsLists     bool
+	wNeedsLists     bool
+	driftNeedsLists bool
 }
 
 // Prepare will prepare all math expressions
 func (m *Math) Prepare() error {
 	var err error
-	m.mExpr, err = prepareExpression(m.M)
+	m.windowCalls = map[string]windowCall{}
+	m.mExpr, m.mNeedsLists, err = prepareWindowExpression(m.M, m.windowCalls)
 	if err != nil {
 		return fmt.Errorf("evaluating M: %w", err)
 	}
-	m.wExpr, err = prepareExpression(m.W)
+	m.wExpr, m.wNeedsLists, err = prepareWindowExpression(m.W, m.windowCalls)
 	if err != nil {
 		return fmt.Errorf("evaluating W: %w", err)
 	}
-	m.driftExpr, err = prepareExpression(m.Drift)
+	m.driftExpr, m.driftNeedsLists, err = prepareWindowExpression(m.Drift, m.windowCalls)
 	if err != nil {
 		return fmt.Errorf("evaluating Drift: %w", err)
 	}
@@ -207,40 +216,65 @@ func prepareExpression(exprStr string) (*govaluate.EvaluableExpression, error) {
 	return expr, nil
 }
 
-func prepareMathParameters(lastN []*DataPoint) map[string][]float64 {
-	size := len(lastN)
-	offsets := make([]float64, size)
-	delays := make([]float64, size)
-	freqs := make([]float64, size)
-	clockAccuracies := make([]float64, size)
-	freqChanges := make([]float64, size-1)
-	freqChangesAbs := make([]float64, size-1)
-	prev := lastN[0]
+// mathParams are variables for M and Drift formulas. Buffers are reused between
+// calculations, so the zero value is ready to use and filling it doesn't
+// allocate once it has seen the biggest window.
+type mathParams struct {
+	offset        []float64
+	delay         []float64
+	freq          []float64
+	clockAccuracy []float64
+	freqChange    []float64
+	freqChangeAbs []float64
+	// formula parameters, refreshed only when window size changes
+	// as boxing slices into interface{} allocates
+	vars     map[string]interface{}
+	varsSize int
+}
+
+func growFloats(buf []float64, size int) []float64 {
+	if cap(buf) < size {
+		return make([]float64, size)
+	}
+	return buf[:size]
+}
+
+// fill takes n latest DataPoints from the state, latest first. n must be >0.
+func (p *mathParams) fill(s *daemonState, n int) {
+	size := s.dataPointsLen(n)
+	p.offset = growFloats(p.offset, size)
+	p.delay = growFloats(p.delay, size)
+	p.freq = growFloats(p.freq, size)
+	p.clockAccuracy = growFloats(p.clockAccuracy, size)
+	p.freqChange = growFloats(p.freqChange, size-1)
+	p.freqChangeAbs = growFloats(p.freqChangeAbs, size-1)
+	prev := s.dataPoint(0)
 	for i := 0; i < size; i++ {
-		offsets[i] = lastN[i].MasterOffsetNS
-		delays[i] = lastN[i].PathDelayNS
-		freqs[i] = lastN[i].FreqAdjustmentPPB
-		clockAccuracies[i] = lastN[i].ClockAccuracyNS
+		dp := s.dataPoint(i)
+		p.offset[i] = dp.MasterOffsetNS
+		p.delay[i] = dp.PathDelayNS
+		p.freq[i] = dp.FreqAdjustmentPPB
+		p.clockAccuracy[i] = dp.ClockAccuracyNS
 		if i != 0 {
-			freqChanges[i-1] = lastN[i].FreqAdjustmentPPB - prev.FreqAdjustmentPPB
-			freqChangesAbs[i-1] = math.Abs(lastN[i].FreqAdjustmentPPB - prev.FreqAdjustmentPPB)
+			p.freqChange[i-1] = dp.FreqAdjustmentPPB - prev.FreqAdjustmentPPB
+			p.freqChangeAbs[i-1] = math.Abs(dp.FreqAdjustmentPPB - prev.FreqAdjustmentPPB)
 		}
-		prev = lastN[i]
+		prev = dp
 	}
-	return map[string][]float64{
-		"offset":        offsets,
-		"delay":         delays,
-		"freq":          freqs,
-		"clockaccuracy": clockAccuracies,
-		"freqchange":    freqChanges,
-		"freqchangeabs": freqChangesAbs,
+	if p.vars == nil || p.varsSize != size {
+		p.vars = map[string]interface{}{
+			"offset":        p.offset,
+			"delay":         p.delay,
+			"freq":          p.freq,
+			"clockaccuracy": p.clockAccuracy,
+			"freqchange":    p.freqChange,
+			"freqchangeabs": p.freqChangeAbs,
+		}
+		p.varsSize = size
 	}
 }
 
-func mapOfInterface(m map[string][]float64) map[string]interface{} {
-	mm := make(map[string]interface{}, len(m))
-	for k, v := range m {
-		mm[k] = v
-	}
-	return mm
+// size returns number of DataPoints the parameters were filled from
+func (p *mathParams) size() int {
+	return len(p.offset)
 }
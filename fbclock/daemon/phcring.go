@@ -0,0 +1,169 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package daemon
+
+import (
+	"context"
+	"fmt"
+	"os"
+	"path/filepath"
+	"runtime"
+	"strconv"
+	"strings"
+	"time"
+
+	"github.com/facebook/time/fbclock"
+	log "github.com/sirupsen/logrus"
+	"golang.org/x/sys/unix"
+)
+
+// sysfs is where NUMA topology is read from, changed in tests
+var sysfs = "/sys"
+
+// phcRingNice is the nice value of the sampling thread, so ticks aren't delayed by busy CPUs
+const phcRingNice = -10
+
+// parseCPUList parses sysfs lists like "0-3,8,10-11"
+func parseCPUList(s string) ([]int, error) {
+	var res []int
+	s = strings.TrimSpace(s)
+	if s == "" {
+		return res, nil
+	}
+	for _, part := range strings.Split(s, ",") {
+		first, last, isRange := strings.Cut(part, "-")
+		from, err := strconv.Atoi(first)
+		if err != nil {
+			return nil, fmt.Errorf("bad list %q: %w", s, err)
+		}
+		to := from
+		if isRange {
+			if to, err = strconv.Atoi(last); err != nil {
+				return nil, fmt.Errorf("bad list %q: %w", s, err)
+			}
+		}
+		if to < from {
+			return nil, fmt.Errorf("bad list %q: range %q", s, part)
+		}
+		for i := from; i <= to; i++ {
+			res = append(res, i)
+		}
+	}
+	return res, nil
+}
+
+func readSysfsList(path string) ([]int, error) {
+	data, err := os.ReadFile(filepath.Join(sysfs, path))
+	if err != nil {
+		return nil, err
+	}
+	return parseCPUList(string(data))
+}
+
+// numaNodes returns online NUMA nodes, just node 0 on hosts without NUMA
+func numaNodes() []int {
+	nodes, err := readSysfsList("devices/system/node/online")
+	if err != nil || len(nodes) == 0 {
+		return []int{0}
+	}
+	return nodes
+}
+
+// ifaceNUMANode returns NUMA node of the NIC, -1 if it's unknown
+func ifaceNUMANode(iface string) int {
+	data, err := os.ReadFile(filepath.Join(sysfs, "class/net", iface, "device/numa_node"))
+	if err != nil {
+		return -1
+	}
+	node, err := strconv.Atoi(strings.TrimSpace(string(data)))
+	if err != nil {
+		return -1
+	}
+	return node
+}
+
+// pinToNode binds calling thread to CPUs of NUMA node
+func pinToNode(node int) error {
+	cpus, err := readSysfsList(fmt.Sprintf("devices/system/node/node%d/cpulist", node))
+	if err != nil {
+		return err
+	}
+	var set unix.CPUSet
+	for _, cpu := range cpus {
+		set.Set(cpu)
+	}
+	return unix.SchedSetaffinity(0, &set)
+}
+
+// openPHCRings creates PHC ring for every NUMA node
+func openPHCRings(cfg *Config) ([]*fbclock.PHCRing, error) {
+	var rings []*fbclock.PHCRing
+	for _, node := range numaNodes() {
+		r, err := fbclock.OpenPHCRing(cfg.PHCRingPath(node), fbclock.PHCRingDefaultCapacity, cfg.PHCRingInterval)
+		if err != nil {
+			closePHCRings(rings)
+			return nil, fmt.Errorf("opening phc ring for node %d: %w", node, err)
+		}
+		rings = append(rings, r)
+	}
+	return rings, nil
+}
+
+func closePHCRings(rings []*fbclock.PHCRing) {
+	for _, r := range rings {
+		r.Close()
+	}
+}
+
+// runPHCRingSampler is the reader service: it samples PHC every PHCRingInterval
+// and publishes samples to the rings of all NUMA nodes, so PHC is read at a fixed
+// rate regardless of the number of clients. It runs on its own thread pinned to
+// the node of the NIC, where PHC reads are the cheapest.
+func (s *Daemon) runPHCRingSampler(ctx context.Context, rings []*fbclock.PHCRing) {
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+	if node := ifaceNUMANode(s.cfg.Iface); node >= 0 {
+		if err := pinToNode(node); err != nil {
+			log.Warningf("Failed to pin PHC sampler to NUMA node %d: %v", node, err)
+		}
+	}
+	if err := unix.Setpriority(unix.PRIO_PROCESS, unix.Gettid(), phcRingNice); err != nil {
+		log.Warningf("Failed to raise PHC sampler priority: %v", err)
+	}
+	ticker := time.NewTicker(s.cfg.PHCRingInterval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-ctx.Done():
+			return
+		case <-ticker.C:
+		}
+		sample, err := s.getPHCSysclock()
+		if err != nil {
+			s.stats.UpdateCounterBy("phc_ring_error", 1)
+			continue
+		}
+		ps := fbclock.PHCSample{
+			SysclockTimeNS: sample.SysclockTimeNS,
+			PHCTimeNS:      sample.PHCTimeNS,
+			DelayNS:        sample.DelayNS,
+		}
+		for _, r := range rings {
+			_ = r.Publish(&ps)
+		}
+	}
+}
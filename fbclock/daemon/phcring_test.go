@@ -0,0 +1,98 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package daemon
+
+import (
+	"context"
+	"os"
+	"path/filepath"
+	"sync/atomic"
+	"testing"
+	"time"
+
+	"github.com/facebook/time/fbclock"
+	"github.com/facebook/time/fbclock/stats"
+	"github.com/stretchr/testify/require"
+)
+
+func TestParseCPUList(t *testing.T) {
+	got, err := parseCPUList("0-3,8,10-11\n")
+	require.NoError(t, err)
+	require.Equal(t, []int{0, 1, 2, 3, 8, 10, 11}, got)
+	got, err = parseCPUList("")
+	require.NoError(t, err)
+	require.Empty(t, got)
+	_, err = parseCPUList("3-1")
+	require.Error(t, err)
+	_, err = parseCPUList("a")
+	require.Error(t, err)
+}
+
+func TestNUMATopology(t *testing.T) {
+	old := sysfs
+	defer func() { sysfs = old }()
+	sysfs = t.TempDir()
+	// no NUMA info
+	require.Equal(t, []int{0}, numaNodes())
+	require.Equal(t, -1, ifaceNUMANode("eth0"))
+
+	require.NoError(t, os.MkdirAll(filepath.Join(sysfs, "devices/system/node"), 0755))
+	require.NoError(t, os.WriteFile(filepath.Join(sysfs, "devices/system/node/online"), []byte("0-1\n"), 0644))
+	require.Equal(t, []int{0, 1}, numaNodes())
+	require.NoError(t, os.MkdirAll(filepath.Join(sysfs, "class/net/eth0/device"), 0755))
+	require.NoError(t, os.WriteFile(filepath.Join(sysfs, "class/net/eth0/device/numa_node"), []byte("1\n"), 0644))
+	require.Equal(t, 1, ifaceNUMANode("eth0"))
+}
+
+func TestPHCRingSampler(t *testing.T) {
+	cfg := &Config{Iface: "eth0", PHCRingInterval: time.Millisecond}
+	s := newTestDaemon(cfg, stats.NewStats())
+	var n atomic.Int64
+	s.getPHCSysclock = func() (*sysclockSample, error) {
+		i := n.Add(1)
+		return &sysclockSample{PHCTimeNS: i * 1000, SysclockTimeNS: i, DelayNS: 10}, nil
+	}
+	dir := t.TempDir()
+	var rings []*fbclock.PHCRing
+	for node := 0; node < 2; node++ {
+		r, err := fbclock.OpenPHCRing(fbclock.PHCRingNodePath(filepath.Join(dir, "ring"), node), 4, cfg.PHCRingInterval)
+		require.NoError(t, err)
+		rings = append(rings, r)
+	}
+	defer closePHCRings(rings)
+
+	ctx, cancel := context.WithCancel(context.Background())
+	done := make(chan struct{})
+	go func() {
+		s.runPHCRingSampler(ctx, rings)
+		close(done)
+	}()
+	for deadline := time.Now().Add(5 * time.Second); n.Load() < 10 && time.Now().Before(deadline); {
+		time.Sleep(time.Millisecond)
+	}
+	require.GreaterOrEqual(t, n.Load(), int64(10))
+	cancel()
+	<-done
+
+	// every node gets the same freshest sample
+	for node := 0; node < 2; node++ {
+		got, err := fbclock.ReadPHCRingLatest(fbclock.PHCRingNodePath(filepath.Join(dir, "ring"), node))
+		require.NoError(t, err)
+		i := n.Load()
+		require.Equal(t, &fbclock.PHCSample{PHCTimeNS: i * 1000, SysclockTimeNS: i, DelayNS: 10}, got)
+	}
+}
@@ -17,88 +17,101 @@ limitations under the License.
 package daemon
 
 import (
-	"container/ring"
 	"math"
 	"sync"
 
 	"github.com/facebook/time/ptp/linearizability"
 )
 
-// state of the daemon, guarded by mutex
-type daemonState struct {
-	sync.Mutex
+// valueRing is a fixed size ring buffer of values. Storage is allocated once,
+// so pushing and reading latest values never allocates. It's not synchronized.
+type valueRing[T any] struct {
+	values []T
+	next   int // index of the next push
+	count  int // number of values pushed, up to len(values)
+}
 
-	DataPoints                 *ring.Ring // DataPoints we collected from ptp4l
-	mmms                       *ring.Ring // M values we calculated
-	linearizabilityTestResults *ring.Ring // linearizability test results
+func newValueRing[T any](size int) valueRing[T] {
+	return valueRing[T]{values: make([]T, size)}
+}
 
-	lastIngressTimeNS int64
+func (r *valueRing[T]) push(v T) {
+	r.values[r.next] = v
+	r.next++
+	if r.next == len(r.values) {
+		r.next = 0
+	}
+	if r.count < len(r.values) {
+		r.count++
+	}
 }
 
-func newDaemonState(ringSize int) *daemonState {
-	s := &daemonState{
-		DataPoints:                 ring.New(ringSize),
-		mmms:                       ring.New(ringSize),
-		linearizabilityTestResults: ring.New(ringSize),
+// len returns how many of n latest values are available
+func (r *valueRing[T]) len(n int) int {
+	if n > r.count {
+		return r.count
+	}
+	return n
+}
+
+// at returns i-th latest value, 0 is the latest one. i must be below len.
+// Pointer is only valid until the next push.
+func (r *valueRing[T]) at(i int) *T {
+	j := r.next - 1 - i
+	if j < 0 {
+		j += len(r.values)
 	}
-	// init ring buffers with nils
-	for i := 0; i < ringSize; i++ {
-		s.DataPoints.Value = nil
-		s.DataPoints = s.DataPoints.Next()
+	return &r.values[j]
+}
+
+// state of the daemon.
+// DataPoints, M values and ingress time are only used by the publishing loop
+// (doWork), so they are not locked. Linearizability test results are pushed
+// by their own goroutine and are guarded by mutex.
+type daemonState struct {
+	dataPoints valueRing[DataPoint] // DataPoints we collected from ptp4l
+	mmms       valueRing[float64]   // M values we calculated
 
-		s.mmms.Value = nil
-		s.mmms = s.mmms.Next()
+	lastIngressTimeNS int64
 
-		s.linearizabilityTestResults.Value = nil
-		s.linearizabilityTestResults = s.linearizabilityTestResults.Next()
+	sync.Mutex
+	linearizabilityTestResults valueRing[linearizability.TestResult] // linearizability test results
+}
+
+func newDaemonState(ringSize int) *daemonState {
+	return &daemonState{
+		dataPoints:                 newValueRing[DataPoint](ringSize),
+		mmms:                       newValueRing[float64](ringSize),
+		linearizabilityTestResults: newValueRing[linearizability.TestResult](ringSize),
 	}
-	return s
 }
 
 func (s *daemonState) updateIngressTimeNS(it int64) {
-	s.Lock()
-	defer s.Unlock()
 	s.lastIngressTimeNS = it
 }
 
 func (s *daemonState) ingressTimeNS() int64 {
-	s.Lock()
-	defer s.Unlock()
 	return s.lastIngressTimeNS
 }
 
 func (s *daemonState) pushDataPoint(data *DataPoint) {
-	s.Lock()
-	defer s.Unlock()
-	s.DataPoints.Value = data
-	s.DataPoints = s.DataPoints.Next()
+	s.dataPoints.push(*data)
 }
 
-func (s *daemonState) takeDataPoint(n int) []*DataPoint {
-	s.Lock()
-	defer s.Unlock()
-	result := []*DataPoint{}
-	r := s.DataPoints.Prev()
-	for j := 0; j < n; j++ {
-		if r.Value == nil {
-			continue
-		}
-		result = append(result, r.Value.(*DataPoint))
-		r = r.Prev()
-	}
-	return result
+// dataPointsLen returns how many of n latest DataPoints are available
+func (s *daemonState) dataPointsLen(n int) int {
+	return s.dataPoints.len(n)
 }
 
-func (s *daemonState) aggregateDataPointsMax(n int) *DataPoint {
-	s.Lock()
-	defer s.Unlock()
-	d := &DataPoint{}
-	r := s.DataPoints.Prev()
-	for j := 0; j < n; j++ {
-		if r.Value == nil {
-			continue
-		}
-		dp := r.Value.(*DataPoint)
+// dataPoint returns i-th latest DataPoint, valid until the next push
+func (s *daemonState) dataPoint(i int) *DataPoint {
+	return s.dataPoints.at(i)
+}
+
+func (s *daemonState) aggregateDataPointsMax(n int) DataPoint {
+	d := DataPoint{}
+	for j := 0; j < s.dataPoints.len(n); j++ {
+		dp := s.dataPoints.at(j)
 		if math.Abs(dp.MasterOffsetNS) > d.MasterOffsetNS {
 			d.MasterOffsetNS = math.Abs(dp.MasterOffsetNS)
 		}
@@ -108,51 +121,40 @@ func (s *daemonState) aggregateDataPointsMax(n int) *DataPoint {
 		if math.Abs(dp.FreqAdjustmentPPB) > d.FreqAdjustmentPPB {
 			d.FreqAdjustmentPPB = math.Abs(dp.FreqAdjustmentPPB)
 		}
-		r = r.Prev()
 	}
 	return d
 }
 
 func (s *daemonState) pushM(data float64) {
-	s.Lock()
-	defer s.Unlock()
-	s.mmms.Value = data
-	s.mmms = s.mmms.Next()
+	s.mmms.push(data)
 }
 
-func (s *daemonState) takeM(n int) []float64 {
-	s.Lock()
-	defer s.Unlock()
-	result := []float64{}
-	r := s.mmms.Prev()
-	for j := 0; j < n; j++ {
-		if r.Value == nil {
-			continue
-		}
-		result = append(result, r.Value.(float64))
-		r = r.Prev()
+// mLen returns how many of n latest M values are available
+func (s *daemonState) mLen(n int) int {
+	return s.mmms.len(n)
+}
+
+// takeM appends up to n latest M values to dst, latest first
+func (s *daemonState) takeM(dst []float64, n int) []float64 {
+	for j := 0; j < s.mmms.len(n); j++ {
+		dst = append(dst, *s.mmms.at(j))
 	}
-	return result
+	return dst
 }
 
 func (s *daemonState) pushLinearizabilityTestResult(data linearizability.TestResult) {
 	s.Lock()
 	defer s.Unlock()
-	s.linearizabilityTestResults.Value = data
-	s.linearizabilityTestResults = s.linearizabilityTestResults.Next()
+	s.linearizabilityTestResults.push(data)
 }
 
 func (s *daemonState) takeLinearizabilityTestResult(n int) []linearizability.TestResult {
 	s.Lock()
 	defer s.Unlock()
-	result := []linearizability.TestResult{}
-	r := s.linearizabilityTestResults.Prev()
-	for j := 0; j < n; j++ {
-		if r.Value == nil {
-			continue
-		}
-		result = append(result, r.Value.(linearizability.TestResult))
-		r = r.Prev()
+	r := &s.linearizabilityTestResults
+	result := make([]linearizability.TestResult, r.len(n))
+	for j := range result {
+		result[j] = *r.at(j)
 	}
 	return result
 }
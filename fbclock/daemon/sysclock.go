@@ -0,0 +1,141 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package daemon
+
+import (
+	"fmt"
+	"math"
+	"os"
+
+	"golang.org/x/sys/unix"
+
+	"github.com/facebook/time/phc"
+)
+
+// sysclockNumProbes is the number of PHC reads we do to find the best PHC to sysclock sample
+const sysclockNumProbes = 5
+
+// sysclockSample is a single PHC reading correlated with CLOCK_MONOTONIC_RAW
+type sysclockSample struct {
+	PHCTimeNS      int64
+	SysclockTimeNS int64
+	DelayNS        int64
+}
+
+// sysclockMapping is what clients need to extrapolate PHC time from CLOCK_MONOTONIC_RAW
+type sysclockMapping struct {
+	PHCTimeNS      int64
+	SysclockTimeNS int64
+	CoefPPB        int64
+	ErrorNS        uint64
+	ErrorPPB       uint64
+}
+
+// sysclockSampleFromDevice reads PHC sandwiched between two CLOCK_MONOTONIC_RAW reads,
+// sample with the smallest delay wins
+func sysclockSampleFromDevice(phcDevice *os.File) (*sysclockSample, error) {
+	clockID := phc.FDToClockID(phcDevice.Fd())
+	var before, phcTS, after unix.Timespec
+	var best *sysclockSample
+	for i := 0; i < sysclockNumProbes; i++ {
+		if err := unix.ClockGettime(unix.CLOCK_MONOTONIC_RAW, &before); err != nil {
+			return nil, fmt.Errorf("failed clock_gettime CLOCK_MONOTONIC_RAW: %w", err)
+		}
+		if err := unix.ClockGettime(clockID, &phcTS); err != nil {
+			return nil, fmt.Errorf("failed clock_gettime PHC: %w", err)
+		}
+		if err := unix.ClockGettime(unix.CLOCK_MONOTONIC_RAW, &after); err != nil {
+			return nil, fmt.Errorf("failed clock_gettime CLOCK_MONOTONIC_RAW: %w", err)
+		}
+		delay := after.Nano() - before.Nano()
+		if best == nil || delay < best.DelayNS {
+			best = &sysclockSample{
+				PHCTimeNS:      phcTS.Nano(),
+				SysclockTimeNS: before.Nano() + delay/2,
+				DelayNS:        delay,
+			}
+		}
+	}
+	return best, nil
+}
+
+// scalePPB returns ns adjusted by ppb
+func scalePPB(ns, ppb int64) int64 {
+	return (ns/1e9)*ppb + (ns%1e9)*ppb/1e9
+}
+
+// sysclockErrorWindow is the number of recent updates error of the mapping is bounded over
+const sysclockErrorWindow = 60
+
+// sysclockMapper tracks PHC frequency relative to CLOCK_MONOTONIC_RAW over consecutive samples
+type sysclockMapper struct {
+	prev    *sysclockSample
+	coefPPB int64
+	hasCoef bool
+	// prediction residuals and frequency steps of recent updates, in PPB
+	residualPPB [sysclockErrorWindow]uint64
+	stepPPB     [sysclockErrorWindow]uint64
+	updates     int
+}
+
+// update consumes new sample and returns mapping for clients.
+// We need three samples before we can estimate how well we extrapolate.
+func (m *sysclockMapper) update(cur *sysclockSample) (*sysclockMapping, error) {
+	prev := m.prev
+	m.prev = cur
+	if prev == nil {
+		return nil, fmt.Errorf("%w for sysclock mapping: no previous sample", errNotEnoughData)
+	}
+	dSys := cur.SysclockTimeNS - prev.SysclockTimeNS
+	if dSys <= 0 {
+		m.hasCoef = false
+		return nil, fmt.Errorf("CLOCK_MONOTONIC_RAW didn't advance between samples")
+	}
+	dPHC := cur.PHCTimeNS - prev.PHCTimeNS
+	coefPPB := int64(math.Round(float64(dPHC-dSys) * 1e9 / float64(dSys)))
+	prevCoefPPB, hasCoef := m.coefPPB, m.hasCoef
+	m.coefPPB, m.hasCoef = coefPPB, true
+	if !hasCoef {
+		return nil, fmt.Errorf("%w for sysclock mapping: no frequency estimate", errNotEnoughData)
+	}
+	// how far off we would have been if clients extrapolated previous mapping till now
+	predicted := prev.PHCTimeNS + dSys + scalePPB(dSys, prevCoefPPB)
+	residual := math.Abs(float64(predicted - cur.PHCTimeNS))
+	i := m.updates % sysclockErrorWindow
+	m.residualPPB[i] = uint64(math.Ceil(residual * 1e9 / float64(dSys)))
+	m.stepPPB[i] = uint64(math.Abs(float64(coefPPB - prevCoefPPB)))
+	m.updates++
+	return &sysclockMapping{
+		PHCTimeNS:      cur.PHCTimeNS,
+		SysclockTimeNS: cur.SysclockTimeNS,
+		CoefPPB:        coefPPB,
+		ErrorNS:        uint64(cur.DelayNS),
+		ErrorPPB:       m.errorPPB(),
+	}, nil
+}
+
+// errorPPB bounds how far the current coefficient can be off until the next update:
+// the worst residual of the window, plus the biggest frequency step the servo made in it,
+// as frequency may change that much again right after we publish. +1 for coefficient rounding.
+func (m *sysclockMapper) errorPPB() uint64 {
+	var maxResidual, maxStep uint64
+	for i := 0; i < m.updates && i < sysclockErrorWindow; i++ {
+		maxResidual = max(maxResidual, m.residualPPB[i])
+		maxStep = max(maxStep, m.stepPPB[i])
+	}
+	return maxResidual + maxStep + 1
+}
@@ -0,0 +1,90 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package daemon
+
+import (
+	"testing"
+
+	"github.com/stretchr/testify/require"
+)
+
+func TestScalePPB(t *testing.T) {
+	require.Equal(t, int64(0), scalePPB(999, 1000))
+	require.Equal(t, int64(1), scalePPB(1000000, 1000))
+	require.Equal(t, int64(-3500000), scalePPB(3500000000000, -1000))
+}
+
+func TestSysclockMapper(t *testing.T) {
+	m := &sysclockMapper{}
+	// first sample, nothing to compare with
+	got, err := m.update(&sysclockSample{PHCTimeNS: 1000000000000, SysclockTimeNS: 5000000000, DelayNS: 30})
+	require.ErrorIs(t, err, errNotEnoughData)
+	require.Nil(t, got)
+
+	// second sample gives us frequency, PHC runs 100 PPB faster
+	got, err = m.update(&sysclockSample{PHCTimeNS: 1001000000100, SysclockTimeNS: 6000000000, DelayNS: 30})
+	require.ErrorIs(t, err, errNotEnoughData)
+	require.Nil(t, got)
+
+	// third sample allows to check how well we extrapolate, we are 50ns off
+	// and frequency moved by 50 PPB
+	got, err = m.update(&sysclockSample{PHCTimeNS: 1002000000250, SysclockTimeNS: 7000000000, DelayNS: 20})
+	require.NoError(t, err)
+	want := &sysclockMapping{
+		PHCTimeNS:      1002000000250,
+		SysclockTimeNS: 7000000000,
+		CoefPPB:        150,
+		ErrorNS:        20,
+		ErrorPPB:       101,
+	}
+	require.Equal(t, want, got)
+
+	// sysclock went back, start over
+	got, err = m.update(&sysclockSample{PHCTimeNS: 1003000000250, SysclockTimeNS: 6000000000, DelayNS: 20})
+	require.Error(t, err)
+	require.Nil(t, got)
+	require.False(t, m.hasCoef)
+}
+
+func TestSysclockMapperFrequencyStep(t *testing.T) {
+	m := &sysclockMapper{}
+	phc, sys := int64(1000000000000), int64(5000000000)
+	tick := func(ppb int64) *sysclockMapping {
+		phc += 1000000000 + ppb
+		sys += 1000000000
+		got, _ := m.update(&sysclockSample{PHCTimeNS: phc, SysclockTimeNS: sys, DelayNS: 20})
+		return got
+	}
+	tick(100)
+	tick(100)
+	// stable frequency, only rounding
+	got := tick(100)
+	require.Equal(t, uint64(1), got.ErrorPPB)
+
+	// servo steps frequency by 1000 PPB: we were 1000 PPB off and it may step again
+	got = tick(1100)
+	require.Equal(t, int64(1100), got.CoefPPB)
+	require.Equal(t, uint64(2001), got.ErrorPPB)
+
+	// error stays bounded by the step as long as it's in the window
+	for i := 0; i < sysclockErrorWindow-1; i++ {
+		got = tick(1100)
+		require.Equal(t, uint64(2001), got.ErrorPPB)
+	}
+	got = tick(1100)
+	require.Equal(t, uint64(1), got.ErrorPPB)
+}
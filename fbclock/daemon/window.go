@@ -0,0 +1,233 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package daemon
+
+import (
+	"fmt"
+	"math"
+	"regexp"
+	"strconv"
+
+	"github.com/Knetic/govaluate"
+)
+
+// windowStat is mean and variance of the latest values of a stream,
+// updated in O(1) per value. Sliding updates accumulate rounding errors,
+// so every len(values) replacements the stats are recomputed from scratch.
+type windowStat struct {
+	values   valueRing[float64]
+	mean     float64
+	m2       float64 // sum of squared differences from mean
+	replaced int
+}
+
+func newWindowStat(size int) *windowStat {
+	return &windowStat{values: newValueRing[float64](size)}
+}
+
+func (w *windowStat) push(v float64) {
+	size := len(w.values.values)
+	if w.values.count < size {
+		w.values.push(v)
+		d := v - w.mean
+		w.mean += d / float64(w.values.count)
+		w.m2 += d * (v - w.mean)
+		return
+	}
+	old := *w.values.at(size - 1)
+	w.values.push(v)
+	w.replaced++
+	if w.replaced == size {
+		w.recompute()
+		return
+	}
+	mean := w.mean + (v-old)/float64(size)
+	w.m2 += (v - old) * (v - mean + old - w.mean)
+	w.mean = mean
+}
+
+func (w *windowStat) recompute() {
+	w.replaced = 0
+	w.mean = 0
+	w.m2 = 0
+	for i := w.values.count - 1; i >= 0; i-- {
+		v := *w.values.at(i)
+		d := v - w.mean
+		w.mean += d / float64(w.values.count-i)
+		w.m2 += d * (v - w.mean)
+	}
+}
+
+// Mean returns mean of values in the window, 0 if there are none
+func (w *windowStat) Mean() float64 {
+	return w.mean
+}
+
+// Variance returns sample variance of values in the window, 0 if there are less than 2
+func (w *windowStat) Variance() float64 {
+	if w.values.count < 2 || w.m2 < 0 {
+		return 0
+	}
+	return w.m2 / float64(w.values.count-1)
+}
+
+// Stddev returns sample standard deviation of values in the window
+func (w *windowStat) Stddev() float64 {
+	return math.Sqrt(w.Variance())
+}
+
+// windowCall is a call of a window function with constant size found in a formula,
+// like mean(offset, 100). Formulas get its result as variable, so they don't
+// need lists of values.
+type windowCall struct {
+	name     string // variable replacing the call in the formula
+	function string
+	variable string
+	size     int
+}
+
+var windowCallRe = regexp.MustCompile(`\b(mean|variance|stddev)\(\s*([a-z]+)\s*,\s*([0-9]+)\s*\)`)
+
+// prepareWindowExpression compiles formula with window calls replaced by variables,
+// adding them to calls. It also tells if the formula still needs lists of values.
+func prepareWindowExpression(exprStr string, calls map[string]windowCall) (*govaluate.EvaluableExpression, bool, error) {
+	// formula as written must be valid, errors refer to it
+	if _, err := prepareExpression(exprStr); err != nil {
+		return nil, false, err
+	}
+	rewritten := windowCallRe.ReplaceAllStringFunc(exprStr, func(s string) string {
+		match := windowCallRe.FindStringSubmatch(s)
+		size, err := strconv.Atoi(match[3])
+		if err != nil || size <= 0 || !isSupportedVar(match[2]) {
+			return s
+		}
+		c := windowCall{function: match[1], variable: match[2], size: size}
+		c.name = fmt.Sprintf("%s_%s_%d", c.function, c.variable, c.size)
+		calls[c.name] = c
+		return c.name
+	})
+	expr, err := govaluate.NewEvaluableExpressionWithFunctions(rewritten, functions)
+	if err != nil {
+		return nil, false, err
+	}
+	needsLists := false
+	for _, v := range expr.Vars() {
+		if isSupportedVar(v) {
+			needsLists = true
+		}
+	}
+	return expr, needsLists, nil
+}
+
+type windowKey struct {
+	variable string
+	size     int
+}
+
+type boundCall struct {
+	windowCall
+	stat *windowStat
+}
+
+// windows keeps incremental stats of formula variables for all window calls,
+// so evaluating formulas costs the same regardless of window sizes.
+type windows struct {
+	ringSize int
+	stats    map[windowKey]*windowStat
+	byVar    map[string][]*windowStat
+	calls    []boundCall
+	// formula parameters, window call results and lists of values if needed
+	vars map[string]interface{}
+
+	prevFreq float64
+	hasPrev  bool
+}
+
+// newWindows returns windows for calls, values beyond ringSize latest
+// samples are never used, same as with lists of values
+func newWindows(calls map[string]windowCall, ringSize int) *windows {
+	w := &windows{
+		ringSize: ringSize,
+		stats:    map[windowKey]*windowStat{},
+		byVar:    map[string][]*windowStat{},
+		vars:     map[string]interface{}{},
+	}
+	for _, c := range calls {
+		w.calls = append(w.calls, boundCall{windowCall: c, stat: w.stat(c.variable, c.size)})
+	}
+	return w
+}
+
+// stat returns windowStat of size latest values of variable
+func (w *windows) stat(variable string, size int) *windowStat {
+	limit := w.ringSize
+	// changes are between consecutive samples
+	if variable == "freqchange" || variable == "freqchangeabs" {
+		limit--
+	}
+	if size > limit {
+		size = limit
+	}
+	if size < 1 {
+		size = 1
+	}
+	k := windowKey{variable: variable, size: size}
+	if s, ok := w.stats[k]; ok {
+		return s
+	}
+	s := newWindowStat(size)
+	w.stats[k] = s
+	w.byVar[variable] = append(w.byVar[variable], s)
+	return s
+}
+
+func (w *windows) push(variable string, v float64) {
+	for _, s := range w.byVar[variable] {
+		s.push(v)
+	}
+}
+
+func (w *windows) pushDataPoint(d *DataPoint) {
+	w.push("offset", d.MasterOffsetNS)
+	w.push("delay", d.PathDelayNS)
+	w.push("freq", d.FreqAdjustmentPPB)
+	w.push("clockaccuracy", d.ClockAccuracyNS)
+	if w.hasPrev {
+		change := w.prevFreq - d.FreqAdjustmentPPB
+		w.push("freqchange", change)
+		w.push("freqchangeabs", math.Abs(change))
+	}
+	w.prevFreq = d.FreqAdjustmentPPB
+	w.hasPrev = true
+}
+
+// update stores current results of window calls in vars
+func (w *windows) update() map[string]interface{} {
+	for _, c := range w.calls {
+		var r float64
+		switch c.function {
+		case "mean":
+			r = c.stat.Mean()
+		case "variance":
+			r = c.stat.Variance()
+		case "stddev":
+			r = c.stat.Stddev()
+		}
+		w.vars[c.name] = r
+	}
+	return w.vars
+}
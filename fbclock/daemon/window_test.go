@@ -0,0 +1,100 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package daemon
+
+import (
+	"math/rand"
+	"testing"
+
+	"github.com/stretchr/testify/require"
+)
+
+func TestWindowStat(t *testing.T) {
+	w := newWindowStat(10)
+	require.Equal(t, float64(0), w.Mean())
+	require.Equal(t, float64(0), w.Variance())
+
+	r := rand.New(rand.NewSource(1))
+	values := []float64{}
+	for i := 0; i < 1000; i++ {
+		v := 212131 + r.NormFloat64()*100
+		values = append(values, v)
+		w.push(v)
+		window := values
+		if len(window) > 10 {
+			window = window[len(window)-10:]
+		}
+		require.InDelta(t, mean(window), w.Mean(), 1e-6)
+		require.InDelta(t, variance(window), w.Variance(), 1e-4)
+		require.InDelta(t, stddev(window), w.Stddev(), 1e-6)
+	}
+}
+
+func TestPrepareWindowExpression(t *testing.T) {
+	calls := map[string]windowCall{}
+	expr, needsLists, err := prepareWindowExpression("mean(clockaccuracy, 30) + abs(mean(offset, 30)) + 1.0 * stddev(offset,30)", calls)
+	require.NoError(t, err)
+	require.False(t, needsLists)
+	require.Equal(t, map[string]windowCall{
+		"mean_clockaccuracy_30": {name: "mean_clockaccuracy_30", function: "mean", variable: "clockaccuracy", size: 30},
+		"mean_offset_30":        {name: "mean_offset_30", function: "mean", variable: "offset", size: 30},
+		"stddev_offset_30":      {name: "stddev_offset_30", function: "stddev", variable: "offset", size: 30},
+	}, calls)
+	got, err := expr.Evaluate(map[string]interface{}{
+		"mean_clockaccuracy_30": 100.0,
+		"mean_offset_30":        -20.0,
+		"stddev_offset_30":      3.0,
+	})
+	require.NoError(t, err)
+	require.Equal(t, 123.0, got)
+
+	// size is not a constant, evaluated over list of values
+	_, needsLists, err = prepareWindowExpression("mean(offset, 2 * 5) + variance(delay, 5)", calls)
+	require.NoError(t, err)
+	require.True(t, needsLists)
+	require.Contains(t, calls, "variance_delay_5")
+
+	_, _, err = prepareWindowExpression("mean(missing, 5)", calls)
+	require.Error(t, err)
+}
+
+func TestWindowsMatchLists(t *testing.T) {
+	calls := map[string]windowCall{}
+	_, _, err := prepareWindowExpression("mean(freqchangeabs, 99) + stddev(freq, 5) + variance(delay, 200)", calls)
+	require.NoError(t, err)
+	win := newWindows(calls, 30)
+	state := newDaemonState(30)
+	params := &mathParams{}
+
+	r := rand.New(rand.NewSource(1))
+	for i := 0; i < 100; i++ {
+		d := &DataPoint{
+			IngressTimeNS:     int64(i + 1),
+			MasterOffsetNS:    r.NormFloat64() * 10,
+			PathDelayNS:       200 + r.NormFloat64(),
+			FreqAdjustmentPPB: 212131 + r.NormFloat64()*100,
+			ClockAccuracyNS:   100,
+		}
+		state.pushDataPoint(d)
+		win.pushDataPoint(d)
+		params.fill(state, 30)
+		vars := win.update()
+		require.InDelta(t, mean(params.freqChangeAbs), vars["mean_freqchangeabs_99"], 1e-6)
+		require.InDelta(t, stddev(params.freq[:min(5, len(params.freq))]), vars["stddev_freq_5"], 1e-6)
+		require.InDelta(t, variance(params.delay), vars["variance_delay_200"], 1e-6)
+	}
+}
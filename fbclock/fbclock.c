@@ -15,267 +15,2319 @@ limitations under the License.
 */
 
 #include "fbclock.h"
+#include "fbclock_inline.h"
 #include <fcntl.h> // For O_* constants
+#include <limits.h> // PATH_MAX
 #include <linux/ptp_clock.h>
 #include <math.h> // pow
+#include <pthread.h>
+#include <sched.h> // sched_yield
 #include <stdint.h>
 #include <stdio.h> // for printf and perror
+#include <stdlib.h> // malloc
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h> // SYS_futex
+#include <sys/sysmacros.h> // major, minor
 #include <sys/types.h>
+#include <errno.h>
+#include <linux/futex.h>
+#include <time.h> // clock_gettime
 #include <unistd.h> // close
 #include "missing.h"
 
-#if defined(__GNUC__) && !defined(__OPTIMIZE__)
+// debug output is opt-in with -DFBCLOCK_DEBUG and never in optimized builds
+#if defined(FBCLOCK_DEBUG) && !defined(__OPTIMIZE__)
 #define fbclock_debug_print(fmt, ...)  \
   do {                                 \
     fprintf(stderr, fmt, __VA_ARGS__); \
   } while (0)
 #else
-#define fbclock_debug_print(fmt, ...)
+#define fbclock_debug_print(fmt, ...) \
+  do {                                \
+  } while (0)
 #endif
 
-#define FBCLOCK_CLOCKDATA_SIZE sizeof(fbclock_clockdata)
-#define FBCLOCK_MAX_READ_TRIES 1000
-#define NANOSECONDS_IN_SECONDS 1e9
+#define FBCLOCK_CLOCKDATA_SIZE sizeof(fbclock_clockdata)
+#define NANOSECONDS_IN_SECONDS 1e9
+#define NANOSECONDS_IN_SECONDS_I64 FBCLOCK_NSEC_PER_SEC
+
+// per-thread stats block, only written by its owner thread, so counters
+// are updated with plain relaxed stores and readers never see torn values
+typedef struct fbclock_thread_stats {
+  fbclock_stats stats;
+  struct fbclock_thread_stats* next;
+  struct fbclock_thread_stats* prev;
+} __attribute__((aligned(64))) fbclock_thread_stats;
+
+static pthread_mutex_t fbclock_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+// all live threads that touched the stats
+static fbclock_thread_stats* fbclock_stats_threads = NULL;
+// stats of threads that already exited
+static fbclock_stats fbclock_stats_retired;
+static pthread_key_t fbclock_stats_key;
+static pthread_once_t fbclock_stats_once = PTHREAD_ONCE_INIT;
+static __thread fbclock_thread_stats* fbclock_stats_local_p = NULL;
+// used if per-thread block can't be allocated
+static __thread fbclock_thread_stats fbclock_stats_fallback;
+
+static void fbclock_stats_add_all(fbclock_stats* dst, fbclock_stats* src) {
+  uint64_t* d = (uint64_t*)dst;
+  uint64_t* s = (uint64_t*)src;
+  for (size_t i = 0; i < sizeof(fbclock_stats) / sizeof(uint64_t); i++) {
+    d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+  }
+}
+
+static void fbclock_stats_thread_exit(void* p) {
+  fbclock_thread_stats* ts = (fbclock_thread_stats*)p;
+  pthread_mutex_lock(&fbclock_stats_mutex);
+  fbclock_stats_add_all(&fbclock_stats_retired, &ts->stats);
+  if (ts->prev != NULL) {
+    ts->prev->next = ts->next;
+  } else {
+    fbclock_stats_threads = ts->next;
+  }
+  if (ts->next != NULL) {
+    ts->next->prev = ts->prev;
+  }
+  pthread_mutex_unlock(&fbclock_stats_mutex);
+  // destructors of other keys may still make requests, their stats are lost
+  fbclock_stats_local_p = &fbclock_stats_fallback;
+  free(ts);
+}
+
+static void fbclock_stats_key_create(void) {
+  pthread_key_create(&fbclock_stats_key, fbclock_stats_thread_exit);
+}
+
+// slow path, runs once per thread
+static fbclock_thread_stats* fbclock_stats_register(void) {
+  pthread_once(&fbclock_stats_once, fbclock_stats_key_create);
+  fbclock_thread_stats* ts = NULL;
+  if (posix_memalign((void**)&ts, 64, sizeof(fbclock_thread_stats))) {
+    fbclock_stats_local_p = &fbclock_stats_fallback;
+    return fbclock_stats_local_p;
+  }
+  memset(ts, 0, sizeof(fbclock_thread_stats));
+  pthread_mutex_lock(&fbclock_stats_mutex);
+  ts->next = fbclock_stats_threads;
+  if (ts->next != NULL) {
+    ts->next->prev = ts;
+  }
+  fbclock_stats_threads = ts;
+  pthread_mutex_unlock(&fbclock_stats_mutex);
+  pthread_setspecific(fbclock_stats_key, ts);
+  fbclock_stats_local_p = ts;
+  return ts;
+}
+
+static inline fbclock_stats* fbclock_stats_local(void) {
+  fbclock_thread_stats* ts = fbclock_stats_local_p;
+  if (__builtin_expect(ts == NULL, 0)) {
+    ts = fbclock_stats_register();
+  }
+  return &ts->stats;
+}
+
+static inline void fbclock_stats_add(uint64_t* counter, uint64_t n) {
+  __atomic_store_n(
+      counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+#define FBCLOCK_STATS_INC(field) fbclock_stats_add(&fbclock_stats_local()->field, 1)
+
+// log2 bucket: bucket i holds delays in [2^(i-1), 2^i)
+static inline void fbclock_stats_delay(int64_t delay) {
+  unsigned bucket =
+      delay <= 0 ? 0 : 64 - __builtin_clzll((unsigned long long)delay);
+  if (bucket >= FBCLOCK_STATS_DELAY_BUCKETS) {
+    bucket = FBCLOCK_STATS_DELAY_BUCKETS - 1;
+  }
+  fbclock_stats_add(&fbclock_stats_local()->delay_hist[bucket], 1);
+}
+
+int fbclock_stats_snapshot(fbclock_stats* stats) {
+  memset(stats, 0, sizeof(fbclock_stats));
+  pthread_mutex_lock(&fbclock_stats_mutex);
+  fbclock_stats_add_all(stats, &fbclock_stats_retired);
+  for (fbclock_thread_stats* ts = fbclock_stats_threads; ts != NULL;
+       ts = ts->next) {
+    fbclock_stats_add_all(stats, &ts->stats);
+  }
+  pthread_mutex_unlock(&fbclock_stats_mutex);
+  return FBCLOCK_E_NO_ERROR;
+}
+
+static inline uint64_t fbclock_clockdata_crc(fbclock_clockdata* value) {
+  return fbclock_inline_clockdata_crc(value);
+}
+
+// Deployed v1 readers check the CRC of the baseline fields only, and v1 has
+// no room for another CRC word. Fields added since are published in seqlock
+// protected layouts only, v1 readers see them as not published.
+static void fbclock_clockdata_strip_v1(fbclock_clockdata* data) {
+  data->phc_time_ns = 0;
+  data->sysclock_time_ns = 0;
+  data->coef_ppb = 0;
+  data->sysclock_error_ns = 0;
+  data->sysclock_error_ppb = 0;
+  data->clock_smearing_start_ns = 0;
+  data->clock_smearing_end_ns = 0;
+  data->utc_offset_pre_ns = 0;
+  data->utc_offset_post_ns = 0;
+  data->smear_step_mult = 0;
+  data->smear_step_shift = 0;
+  data->ptp_caps = 0;
+}
+
+static void fbclock_shmdata_store(
+    fbclock_shmdata* shmp,
+    fbclock_clockdata* data) {
+  fbclock_clockdata v1 = *data;
+  fbclock_clockdata_strip_v1(&v1);
+  uint64_t crc = fbclock_clockdata_crc(&v1);
+  memcpy(&shmp->data, &v1, FBCLOCK_CLOCKDATA_SIZE);
+  atomic_store(&shmp->crc, crc);
+}
+
+static void fbclock_shmdata_v2_store(
+    fbclock_shmdata_v2* shmp,
+    fbclock_clockdata* data) {
+  uint64_t seq = __atomic_load_n(&shmp->seq, __ATOMIC_RELAXED);
+  // odd seq tells readers the data is being updated
+  __atomic_store_n(&shmp->seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(&shmp->data, data, FBCLOCK_CLOCKDATA_SIZE);
+  __atomic_store_n(&shmp->seq, seq + 2, __ATOMIC_RELEASE);
+  // waiters register before checking generation, both sides are seq_cst,
+  // so either they see the new generation or we see them
+  __atomic_add_fetch(&shmp->generation, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&shmp->waiters, __ATOMIC_SEQ_CST) != 0) {
+    // not a private futex, waiters live in other processes
+    syscall(SYS_futex, &shmp->generation, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+// header is published with release, so readers seeing magic see the rest
+static void fbclock_shm_header_init(
+    fbclock_shm_header* header,
+    uint32_t version) {
+  header->version = version;
+  header->size = FBCLOCK_SHMDATA_V3_SIZE;
+  header->clockdata_size = FBCLOCK_CLOCKDATA_SIZE;
+  __atomic_store_n(&header->magic, FBCLOCK_SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+int fbclock_clockdata_store_data(uint32_t fd, fbclock_clockdata* data) {
+  fbclock_shmdata* shmp = mmap(
+      NULL, FBCLOCK_SHMDATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shmp == MAP_FAILED) {
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  fbclock_shmdata_store(shmp, data);
+  munmap(shmp, FBCLOCK_SHMDATA_SIZE);
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_clockdata_load_data(
+    fbclock_shmdata* shmp,
+    fbclock_clockdata* data) {
+  unsigned tries;
+  int rcode = fbclock_inline_load_data(shmp, data, &tries);
+  if (tries > 1) {
+    fbclock_stats_add(&fbclock_stats_local()->load_retries, tries - 1);
+  }
+  if (rcode == FBCLOCK_E_NO_ERROR) {
+    fbclock_debug_print("reading clock data took %u tries\n", tries);
+    return FBCLOCK_E_NO_ERROR;
+  }
+  fbclock_debug_print(
+      "failed to read clock data after %d tries\n", FBCLOCK_MAX_READ_TRIES);
+  // TODO: Enable mismatch error.
+  // return FBCLOCK_E_CRC_MISMATCH;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_clockdata_store_data_v2(uint32_t fd, fbclock_clockdata* data) {
+  fbclock_shmdata_v2* shmp = mmap(
+      NULL, FBCLOCK_SHMDATA_V2_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shmp == MAP_FAILED) {
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  fbclock_shmdata_v2_store(shmp, data);
+  munmap(shmp, FBCLOCK_SHMDATA_V2_SIZE);
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_writer_open(fbclock_writer* writer, uint32_t fd, int version) {
+  size_t size;
+  switch (version) {
+    case 1:
+      size = FBCLOCK_SHMDATA_SIZE;
+      break;
+    case 2:
+      size = FBCLOCK_SHMDATA_V2_SIZE;
+      break;
+    case 3:
+      size = FBCLOCK_SHMDATA_V3_SIZE;
+      break;
+    default:
+      return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  void* shmp = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (shmp == MAP_FAILED) {
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  if (version == 3) {
+    fbclock_shm_header_init(&((fbclock_shmdata_v3*)shmp)->header, 3);
+  }
+  writer->shmp = shmp;
+  writer->size = size;
+  writer->version = version;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_writer_store(fbclock_writer* writer, fbclock_clockdata* data) {
+  if (writer->shmp == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  if (writer->version == 3) {
+    fbclock_shmdata_v2_store(&((fbclock_shmdata_v3*)writer->shmp)->v2, data);
+  } else if (writer->version == 2) {
+    fbclock_shmdata_v2_store((fbclock_shmdata_v2*)writer->shmp, data);
+  } else {
+    fbclock_shmdata_store((fbclock_shmdata*)writer->shmp, data);
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_writer_close(fbclock_writer* writer) {
+  if (writer->shmp == NULL) {
+    return FBCLOCK_E_NO_ERROR;
+  }
+  munmap(writer->shmp, writer->size);
+  writer->shmp = NULL;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_clockdata_store_data_v3(uint32_t fd, fbclock_clockdata* data) {
+  fbclock_writer writer;
+  int rcode = fbclock_writer_open(&writer, fd, 3);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  fbclock_writer_store(&writer, data);
+  return fbclock_writer_close(&writer);
+}
+
+static int fbclock_journal_header_valid(
+    const fbclock_journal_header* hdr,
+    size_t size) {
+  return __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) ==
+      FBCLOCK_JOURNAL_MAGIC &&
+      hdr->version == FBCLOCK_JOURNAL_VERSION && hdr->capacity > 1 &&
+      hdr->record_size == sizeof(fbclock_journal_record) &&
+      FBCLOCK_JOURNAL_SIZE(hdr->capacity) <= size;
+}
+
+static void fbclock_journal_map(fbclock_journal* j, void* p, size_t size) {
+  j->hdr = (fbclock_journal_header*)p;
+  j->records =
+      (fbclock_journal_record*)((char*)p + sizeof(fbclock_journal_header));
+  j->size = size;
+}
+
+// Writers never resize a mapped file, readers touching pages past its new end
+// would get SIGBUS. New layout is built in a temporary file next to path
+// instead, which fbclock_shm_replace renames over it.
+static int fbclock_shm_create_tmp(
+    const char* path,
+    size_t size,
+    char* tmp,
+    size_t len) {
+  int n = snprintf(tmp, len, "%s.XXXXXX", path);
+  if (n < 0 || (size_t)n >= len) {
+    return -1;
+  }
+  int fd = mkstemp(tmp);
+  if (fd == -1) {
+    return -1;
+  }
+  // readable by all clients, regardless of umask
+  if (fchmod(fd, 0644) != 0 || ftruncate(fd, size) != 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  return fd;
+}
+
+// rename tmp over path and clear magic of the file it replaces, so readers
+// still mapping it stop trusting it and re-open path
+static int fbclock_shm_replace(const char* tmp, const char* path) {
+  int old_fd = open(path, O_RDWR, 0);
+  if (rename(tmp, path) != 0) {
+    if (old_fd != -1) {
+      close(old_fd);
+    }
+    unlink(tmp);
+    return -1;
+  }
+  if (old_fd != -1) {
+    struct stat st;
+    uint32_t magic = 0;
+    if (fstat(old_fd, &st) == 0 && (size_t)st.st_size >= sizeof(magic)) {
+      // magic is the first word of all headers
+      ssize_t n = pwrite(old_fd, &magic, sizeof(magic), 0);
+      (void)n;
+    }
+    close(old_fd);
+  }
+  return 0;
+}
+
+// open path for writing if it has the given size, -1 if it has to be replaced
+static int fbclock_shm_open_sized(const char* path, size_t size) {
+  int fd = open(path, O_RDWR, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size != size) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int fbclock_journal_create(
+    fbclock_journal* j,
+    const char* path,
+    uint32_t capacity) {
+  // readers skip the slot being overwritten, so they need at least 2
+  if (capacity < 2) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  size_t size = FBCLOCK_JOURNAL_SIZE(capacity);
+  char tmp[PATH_MAX];
+  int replace = 0;
+  int fd = fbclock_shm_open_sized(path, size);
+  if (fd == -1) {
+    fd = fbclock_shm_create_tmp(path, size, tmp, sizeof(tmp));
+    if (fd == -1) {
+      return FBCLOCK_E_SHMEM_OPEN;
+    }
+    replace = 1;
+  }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    if (replace) {
+      unlink(tmp);
+    }
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  fbclock_journal_map(j, p, size);
+  j->fd = fd;
+  if (!replace && fbclock_journal_header_valid(j->hdr, size) &&
+      j->hdr->capacity == capacity) {
+    return FBCLOCK_E_NO_ERROR;
+  }
+  // magic goes last, so readers seeing it see an empty journal
+  __atomic_store_n(&j->hdr->magic, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&j->hdr->count, 0, __ATOMIC_RELAXED);
+  j->hdr->version = FBCLOCK_JOURNAL_VERSION;
+  j->hdr->capacity = capacity;
+  j->hdr->record_size = sizeof(fbclock_journal_record);
+  __atomic_store_n(&j->hdr->magic, FBCLOCK_JOURNAL_MAGIC, __ATOMIC_RELEASE);
+  if (replace && fbclock_shm_replace(tmp, path) != 0) {
+    fbclock_journal_close(j);
+    return FBCLOCK_E_SHMEM_OPEN;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_journal_append(fbclock_journal* j, const fbclock_clockdata* data) {
+  if (j->hdr == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  uint64_t count = __atomic_load_n(&j->hdr->count, __ATOMIC_RELAXED);
+  uint32_t capacity = j->hdr->capacity;
+  // lookups binary search by ingress time
+  if (count > 0 &&
+      data->ingress_time_ns <
+          j->records[(count - 1) % capacity].data.ingress_time_ns) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  // slot of the oldest record, which readers don't search
+  memcpy(&j->records[count % capacity].data, data, FBCLOCK_CLOCKDATA_SIZE);
+  __atomic_store_n(&j->hdr->count, count + 1, __ATOMIC_RELEASE);
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_journal_open(fbclock_journal* j, const char* path) {
+  memset(j, 0, sizeof(fbclock_journal));
+  j->fd = -1;
+  int fd = open(path, O_RDONLY, 0);
+  if (fd == -1) {
+    return FBCLOCK_E_SHMEM_OPEN;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(fbclock_journal_header)) {
+    close(fd);
+    return FBCLOCK_E_NO_DATA;
+  }
+  size_t size = (size_t)st.st_size;
+  void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  if (!fbclock_journal_header_valid((fbclock_journal_header*)p, size)) {
+    munmap(p, size);
+    close(fd);
+    return FBCLOCK_E_NO_DATA;
+  }
+  fbclock_journal_map(j, p, size);
+  j->fd = fd;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+// Appends only write the slot of the oldest record before publishing count,
+// so records [count - capacity + 1, count) stay intact until count changes.
+// Search and copy are validated by count like a seqlock.
+int fbclock_journal_find(
+    const fbclock_journal* j,
+    int64_t phc_ns,
+    fbclock_clockdata* data) {
+  if (j->hdr == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  uint32_t capacity = j->hdr->capacity;
+  for (unsigned i = 0; i < FBCLOCK_MAX_READ_TRIES; i++) {
+    uint64_t count = __atomic_load_n(&j->hdr->count, __ATOMIC_ACQUIRE);
+    // replaced by a journal of another capacity, records stopped here
+    if (__atomic_load_n(&j->hdr->magic, __ATOMIC_RELAXED) !=
+        FBCLOCK_JOURNAL_MAGIC) {
+      return FBCLOCK_E_NO_DATA;
+    }
+    uint64_t first = count >= capacity ? count - capacity + 1 : 0;
+    // first record with ingress time after phc_ns
+    uint64_t lo = first, hi = count;
+    while (lo < hi) {
+      uint64_t mid = lo + (hi - lo) / 2;
+      int64_t ingress = __atomic_load_n(
+          &j->records[mid % capacity].data.ingress_time_ns, __ATOMIC_RELAXED);
+      if (ingress <= phc_ns) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo > first) {
+      memcpy(
+          data,
+          &j->records[(lo - 1) % capacity].data,
+          FBCLOCK_CLOCKDATA_SIZE);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&j->hdr->count, __ATOMIC_RELAXED) != count) {
+      continue;
+    }
+    return lo > first ? FBCLOCK_E_NO_ERROR : FBCLOCK_E_NO_DATA;
+  }
+  return FBCLOCK_E_SEQ_MISMATCH;
+}
+
+int fbclock_journal_truetime(
+    const fbclock_journal* j,
+    int64_t phc_ns,
+    fbclock_truetime* truetime,
+    int timezone) {
+  fbclock_clockdata state;
+  int rcode = fbclock_journal_find(j, phc_ns, &state);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  return fbclock_calculate_time_ns(
+      state.error_bound_ns,
+      state.holdover_multiplier_ns,
+      &state,
+      phc_ns,
+      truetime,
+      timezone);
+}
+
+int fbclock_journal_close(fbclock_journal* j) {
+  if (j->hdr != NULL) {
+    munmap(j->hdr, j->size);
+    j->hdr = NULL;
+    j->records = NULL;
+  }
+  if (j->fd != -1) {
+    close(j->fd);
+    j->fd = -1;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+static void fbclock_phc_ring_map(fbclock_phc_ring* r, void* p, size_t size) {
+  r->hdr = (fbclock_phc_ring_header*)p;
+  r->samples =
+      (fbclock_phc_sample*)((char*)p + sizeof(fbclock_phc_ring_header));
+  r->size = size;
+  r->capacity = r->hdr->capacity;
+}
+
+int fbclock_phc_ring_create(
+    fbclock_phc_ring* r,
+    const char* path,
+    uint32_t capacity,
+    uint64_t interval_ns) {
+  // the latest sample must not be the one being overwritten
+  if (capacity < 2 || interval_ns == 0) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  size_t size = FBCLOCK_PHC_RING_SIZE(capacity);
+  char tmp[PATH_MAX];
+  int replace = 0;
+  int fd = fbclock_shm_open_sized(path, size);
+  if (fd == -1) {
+    fd = fbclock_shm_create_tmp(path, size, tmp, sizeof(tmp));
+    if (fd == -1) {
+      return FBCLOCK_E_SHMEM_OPEN;
+    }
+    replace = 1;
+  }
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    if (replace) {
+      unlink(tmp);
+    }
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  fbclock_phc_ring_header* hdr = (fbclock_phc_ring_header*)p;
+  // magic goes last, so readers seeing it see an empty ring
+  __atomic_store_n(&hdr->magic, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&hdr->count, 0, __ATOMIC_RELAXED);
+  hdr->version = FBCLOCK_PHC_RING_VERSION;
+  __atomic_store_n(&hdr->capacity, capacity, __ATOMIC_RELAXED);
+  hdr->sample_size = sizeof(fbclock_phc_sample);
+  hdr->interval_ns = interval_ns;
+  __atomic_store_n(&hdr->magic, FBCLOCK_PHC_RING_MAGIC, __ATOMIC_RELEASE);
+  fbclock_phc_ring_map(r, p, size);
+  r->fd = fd;
+  if (replace && fbclock_shm_replace(tmp, path) != 0) {
+    fbclock_phc_ring_close(r);
+    return FBCLOCK_E_SHMEM_OPEN;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_phc_ring_publish(
+    fbclock_phc_ring* r,
+    const fbclock_phc_sample* s) {
+  if (r->hdr == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  uint64_t count = __atomic_load_n(&r->hdr->count, __ATOMIC_RELAXED);
+  // slot of the oldest sample, readers only read the latest one
+  memcpy(&r->samples[count % r->capacity], s, sizeof(fbclock_phc_sample));
+  __atomic_store_n(&r->hdr->count, count + 1, __ATOMIC_RELEASE);
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_phc_ring_open(fbclock_phc_ring* r, const char* path) {
+  memset(r, 0, sizeof(fbclock_phc_ring));
+  r->fd = -1;
+  int fd = open(path, O_RDONLY, 0);
+  if (fd == -1) {
+    return FBCLOCK_E_SHMEM_OPEN;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(fbclock_phc_ring_header)) {
+    close(fd);
+    return FBCLOCK_E_NO_DATA;
+  }
+  size_t size = (size_t)st.st_size;
+  void* p = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    close(fd);
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  fbclock_phc_ring_header* hdr = (fbclock_phc_ring_header*)p;
+  if (__atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) !=
+          FBCLOCK_PHC_RING_MAGIC ||
+      hdr->version != FBCLOCK_PHC_RING_VERSION || hdr->capacity < 2 ||
+      hdr->sample_size != sizeof(fbclock_phc_sample) ||
+      FBCLOCK_PHC_RING_SIZE(hdr->capacity) > size) {
+    munmap(p, size);
+    close(fd);
+    return FBCLOCK_E_NO_DATA;
+  }
+  fbclock_phc_ring_map(r, p, size);
+  r->fd = fd;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+// The writer overwrites the slot of the latest sample count only after
+// capacity - 1 more publishes, so the copy is validated by count moving less
+int fbclock_phc_ring_latest(
+    const fbclock_phc_ring* r,
+    fbclock_phc_sample* s) {
+  if (r->hdr == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  for (unsigned i = 0; i < FBCLOCK_MAX_READ_TRIES; i++) {
+    uint64_t count = __atomic_load_n(&r->hdr->count, __ATOMIC_ACQUIRE);
+    // ring was replaced, or recreated with another size and samples may be
+    // out of mapping
+    if (__atomic_load_n(&r->hdr->magic, __ATOMIC_RELAXED) !=
+            FBCLOCK_PHC_RING_MAGIC ||
+        __atomic_load_n(&r->hdr->capacity, __ATOMIC_RELAXED) != r->capacity ||
+        count == 0) {
+      return FBCLOCK_E_NO_DATA;
+    }
+    memcpy(s, &r->samples[(count - 1) % r->capacity], sizeof(*s));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t now = __atomic_load_n(&r->hdr->count, __ATOMIC_RELAXED);
+    // also catches reset of the ring to count 0
+    if (now - count < r->capacity - 1) {
+      return FBCLOCK_E_NO_ERROR;
+    }
+  }
+  return FBCLOCK_E_SEQ_MISMATCH;
+}
+
+int fbclock_phc_ring_close(fbclock_phc_ring* r) {
+  if (r->hdr != NULL) {
+    munmap(r->hdr, r->size);
+    r->hdr = NULL;
+    r->samples = NULL;
+  }
+  if (r->fd != -1) {
+    close(r->fd);
+    r->fd = -1;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_phc_ring_path(char* buf, size_t len, const char* base, int node) {
+  if (base == NULL) {
+    base = FBCLOCK_PATH_PHC_RING;
+  }
+  int n = snprintf(buf, len, "%s.node%d", base, node);
+  if (n < 0 || (size_t)n >= len) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+// map ring of the NUMA node the calling thread runs on
+static int fbclock_phc_ring_open_local(fbclock_phc_ring* r, const char* base) {
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0) {
+    node = 0;
+  }
+  char path[PATH_MAX];
+  int rcode = fbclock_phc_ring_path(path, sizeof(path), base, (int)node);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  return fbclock_phc_ring_open(r, path);
+}
+
+int fbclock_clockdata_load_data_v2(
+    fbclock_shmdata_v2* shmp,
+    fbclock_clockdata* data) {
+  unsigned tries;
+  int rcode = fbclock_inline_load_data_v2(shmp, data, &tries);
+  if (tries > 1) {
+    fbclock_stats_add(&fbclock_stats_local()->load_retries, tries - 1);
+  }
+  if (rcode == FBCLOCK_E_NO_ERROR) {
+    fbclock_debug_print("reading clock data took %u tries\n", tries);
+  } else {
+    fbclock_debug_print(
+        "failed to read clock data after %d tries\n", FBCLOCK_MAX_READ_TRIES);
+  }
+  return rcode;
+}
+
+static inline int64_t fbclock_pct2ns(const struct ptp_clock_time* ptc) {
+  return ptc->sec * NANOSECONDS_IN_SECONDS_I64 + (int64_t)ptc->nsec;
+}
+
+// cross-timestamping done by hardware, there is no PCIe round trip
+// between system and PHC reads, so there is no delay to account for
+static int fbclock_read_ptp_offset_precise(int fd, struct phc_time_res* res) {
+  struct ptp_sys_offset_precise psop = {};
+
+  int r = ioctl(fd, PTP_SYS_OFFSET_PRECISE, &psop);
+  if (r) {
+    return FBCLOCK_READ_E_IOCTL;
+  }
+  res->ts = fbclock_pct2ns(&psop.device);
+  res->delay = 0;
+  return 0;
+}
+
+static int fbclock_read_ptp_offset_batch(
+    int fd,
+    struct phc_time_res* res,
+    unsigned n) {
+  struct ptp_sys_offset pso = {.n_samples = n};
+
+  int r = ioctl(fd, PTP_SYS_OFFSET, &pso);
+  if (r) {
+    return FBCLOCK_READ_E_IOCTL;
+  }
+
+  for (unsigned i = 0; i < n; ++i) {
+    res[i].ts = fbclock_pct2ns(&pso.ts[2 * i + 1]);
+    res[i].delay =
+        fbclock_pct2ns(&pso.ts[2 * i + 2]) - fbclock_pct2ns(&pso.ts[2 * i]);
+    if (res[i].delay < 0) {
+      return FBCLOCK_READ_E_NEGATIVE_DELAY;
+    }
+  }
+  return 0;
+}
+
+static int fbclock_read_ptp_offset_extended_batch(
+    int fd,
+    struct phc_time_res* res,
+    unsigned n) {
+  struct ptp_sys_offset_extended psoe = {.n_samples = n};
+
+  int r = ioctl(fd, PTP_SYS_OFFSET_EXTENDED, &psoe);
+  if (r) {
+    return FBCLOCK_READ_E_IOCTL;
+  }
+
+  for (unsigned i = 0; i < n; ++i) {
+    res[i].ts = fbclock_pct2ns(&psoe.ts[i][1]);
+    res[i].delay =
+        fbclock_pct2ns(&psoe.ts[i][2]) - fbclock_pct2ns(&psoe.ts[i][0]);
+    if (res[i].delay < 0) {
+      return FBCLOCK_READ_E_NEGATIVE_DELAY;
+    }
+  }
+  return 0;
+}
+
+// scale ns by ppb avoiding overflow for long intervals
+static inline int64_t fbclock_scale_ppb(int64_t ns, int64_t ppb) {
+  return (ns / NANOSECONDS_IN_SECONDS_I64) * ppb +
+      (ns % NANOSECONDS_IN_SECONDS_I64) * ppb / NANOSECONDS_IN_SECONDS_I64;
+}
+
+// extrapolate PHC time from CLOCK_MONOTONIC_RAW using mapping from shmem,
+// extrapolation error is returned as delay
+static int fbclock_extrapolate_phc(
+    fbclock_clockdata* state,
+    struct phc_time_res* res) {
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) {
+    return -1;
+  }
+  int64_t now_ns = ts.tv_sec * NANOSECONDS_IN_SECONDS_I64 + ts.tv_nsec;
+  int64_t elapsed_ns = now_ns - state->sysclock_time_ns;
+  if (elapsed_ns < 0) {
+    return -2;
+  }
+  res->ts = state->phc_time_ns + elapsed_ns +
+      fbclock_scale_ppb(elapsed_ns, state->coef_ppb);
+  // +1 to compensate for rounding down
+  res->delay = (int64_t)state->sysclock_error_ns +
+      fbclock_scale_ppb(elapsed_ns, state->sysclock_error_ppb) + 1;
+  return 0;
+}
+
+// extrapolate PHC time from the freshest sample of the reader service, the
+// same way as from the daemon mapping. Fails if the service stopped sampling.
+static int fbclock_extrapolate_ring(
+    fbclock_lib* lib,
+    fbclock_clockdata* state,
+    struct phc_time_res* res) {
+  fbclock_phc_sample sample;
+  if (fbclock_phc_ring_latest(&lib->phc_ring, &sample) != FBCLOCK_E_NO_ERROR) {
+    return -1;
+  }
+  struct timespec ts;
+  if (clock_gettime(CLOCK_MONOTONIC_RAW, &ts)) {
+    return -1;
+  }
+  int64_t now_ns = ts.tv_sec * NANOSECONDS_IN_SECONDS_I64 + ts.tv_nsec;
+  // sample may be taken after our clock read
+  int64_t elapsed_ns = now_ns - sample.sysclock_time_ns;
+  int64_t age_ns = elapsed_ns < 0 ? -elapsed_ns : elapsed_ns;
+  uint64_t interval_ns =
+      __atomic_load_n(&lib->phc_ring.hdr->interval_ns, __ATOMIC_RELAXED);
+  if ((uint64_t)age_ns > FBCLOCK_PHC_RING_STALE_INTERVALS * interval_ns) {
+    return -2;
+  }
+  // frequency of PHC vs CLOCK_MONOTONIC_RAW comes from the daemon mapping,
+  // without it elapsed time is trusted as much as in coarse mode
+  int64_t coef_ppb = 0;
+  int64_t error_ppb = FBCLOCK_COARSE_DRIFT_PPB;
+  if (state->sysclock_time_ns != 0) {
+    coef_ppb = state->coef_ppb;
+    error_ppb = state->sysclock_error_ppb;
+  }
+  res->ts = sample.phc_time_ns + elapsed_ns +
+      fbclock_scale_ppb(elapsed_ns, coef_ppb);
+  // +1 to compensate for rounding down
+  res->delay = sample.delay_ns + fbclock_scale_ppb(age_ns, error_ppb) + 1;
+  return 0;
+}
+
+// update running estimate of the min delay (the same way TCP estimates RTT)
+// and use fewer samples while it stays stable.
+// delay_avg_ns is scaled by 8 and delay_dev_ns by 4 to keep precision.
+static void fbclock_adapt_samples(fbclock_lib* lib, int64_t min_delay) {
+  if (lib->delay_avg_ns == 0) {
+    lib->delay_avg_ns = min_delay << 3;
+    lib->delay_dev_ns = min_delay << 1;
+    return;
+  }
+  int64_t err = min_delay - (lib->delay_avg_ns >> 3);
+  lib->delay_avg_ns += err;
+  lib->delay_dev_ns += (err < 0 ? -err : err) - (lib->delay_dev_ns >> 2);
+
+  // twice the deviation, but at least 1/8 of the average
+  int64_t limit = lib->delay_dev_ns >> 1;
+  if (limit < lib->delay_avg_ns >> 6) {
+    limit = lib->delay_avg_ns >> 6;
+  }
+  if (err > limit) {
+    // fewer samples don't catch the minimum anymore, go back to max
+    lib->cur_samples = lib->n_samples;
+    lib->stable_reads = 0;
+    return;
+  }
+  if (++lib->stable_reads >= FBCLOCK_ADAPTIVE_STABLE_READS &&
+      lib->cur_samples > 1) {
+    lib->cur_samples--;
+    lib->stable_reads = 0;
+  }
+}
+
+// count the error and pass it to the callback, at most once per interval.
+// Never blocks: counters are atomic and only one thread wins the callback slot.
+static void fbclock_report_error(fbclock_lib* lib, int kind, int err_no) {
+  uint64_t count =
+      __atomic_add_fetch(&lib->errors[kind], 1, __ATOMIC_RELAXED);
+  if (lib->error_cb == NULL) {
+    return;
+  }
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  uint64_t now_ns = ts.tv_sec * NANOSECONDS_IN_SECONDS_I64 + ts.tv_nsec;
+  uint64_t last_ns = __atomic_load_n(&lib->error_cb_last_ns, __ATOMIC_RELAXED);
+  if (last_ns != 0 && now_ns - last_ns < lib->error_cb_interval_ns) {
+    return;
+  }
+  if (__atomic_compare_exchange_n(
+          &lib->error_cb_last_ns,
+          &last_ns,
+          now_ns,
+          0,
+          __ATOMIC_RELAXED,
+          __ATOMIC_RELAXED)) {
+    lib->error_cb(lib->error_cb_ctx, kind, err_no, count);
+  }
+}
+
+// turn PHC read backend failure into error report
+static void fbclock_report_read_error(fbclock_lib* lib, int r) {
+  // first stats update of the thread allocates and locks, clobbering errno
+  int err = errno;
+  FBCLOCK_STATS_INC(ptp_read_errors);
+  if (r == FBCLOCK_READ_E_NEGATIVE_DELAY) {
+    fbclock_report_error(lib, FBCLOCK_ERR_NEGATIVE_DELAY, 0);
+  } else {
+    fbclock_report_error(lib, FBCLOCK_ERR_PTP_READ, err);
+  }
+}
+
+static uint32_t fbclock_probe_ptp_caps(int fd) {
+  uint32_t caps = FBCLOCK_PTP_CAP_PROBED;
+  struct ptp_sys_offset_extended psoe = {.n_samples = 1};
+  if (!ioctl(fd, PTP_SYS_OFFSET_EXTENDED, &psoe)) {
+    caps |= FBCLOCK_PTP_CAP_EXTENDED;
+  }
+  struct ptp_sys_offset_precise psop = {};
+  if (!ioctl(fd, PTP_SYS_OFFSET_PRECISE, &psop)) {
+    caps |= FBCLOCK_PTP_CAP_PRECISE;
+  }
+  return caps;
+}
+
+// capabilities of the daemon's PHC device, 0 if not published
+static uint32_t fbclock_shm_ptp_caps(fbclock_lib* lib) {
+  fbclock_clockdata state;
+  unsigned tries;
+  int r = lib->shmp_v2 != NULL
+      ? fbclock_inline_load_data_v2(lib->shmp_v2, &state, &tries)
+      : fbclock_inline_load_data(lib->shmp, &state, &tries);
+  return r == FBCLOCK_E_NO_ERROR ? state.ptp_caps : 0;
+}
+
+// pick read backend for opened device, gettime_batch is set last
+// as it tells lazy readers the device is ready
+static void fbclock_select_backend(fbclock_lib* lib, int fd) {
+  uint32_t caps = 0;
+  if (!(lib->init_flags & FBCLOCK_INIT_PROBE)) {
+    caps = fbclock_shm_ptp_caps(lib);
+  }
+  if (!(caps & FBCLOCK_PTP_CAP_PROBED)) {
+    caps = fbclock_probe_ptp_caps(fd);
+  }
+  // single reads are done with gettime_batch and lib->n_samples samples,
+  // unless hardware cross-timestamping (ART/PTM) is supported
+  lib->gettime = (caps & FBCLOCK_PTP_CAP_PRECISE)
+      ? fbclock_read_ptp_offset_precise
+      : NULL;
+  int (*gettime_batch)(int, struct phc_time_res*, unsigned) =
+      (caps & FBCLOCK_PTP_CAP_EXTENDED) ? fbclock_read_ptp_offset_extended_batch
+                                        : fbclock_read_ptp_offset_batch;
+  __atomic_store_n(&lib->gettime_batch, gettime_batch, __ATOMIC_RELEASE);
+}
+
+// Open PTP device on the first read for lazily initialized libs.
+// Racing threads all open it, but only one publishes its fd and backend.
+static int fbclock_open_device(fbclock_lib* lib) {
+  if (lib->backend.read != NULL ||
+      __atomic_load_n(&lib->gettime_batch, __ATOMIC_ACQUIRE) != NULL) {
+    return 0;
+  }
+  if (lib->init_flags & FBCLOCK_INIT_SHM_ONLY) {
+    return FBCLOCK_READ_E_OPEN;
+  }
+  int fd = open(lib->ptp_path, O_RDONLY);
+  if (fd == -1) {
+    return FBCLOCK_READ_E_OPEN;
+  }
+  int expected = -1;
+  if (!__atomic_compare_exchange_n(
+          &lib->dev_fd, &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    close(fd);
+    // the winner is probing the device, a few ioctls, don't take its CPU
+    while (__atomic_load_n(&lib->gettime_batch, __ATOMIC_ACQUIRE) == NULL) {
+      sched_yield();
+    }
+    return 0;
+  }
+  fbclock_select_backend(lib, fd);
+  return 0;
+}
+
+// read n samples from opened device or the backend replacing it
+static inline int
+fbclock_read_samples(fbclock_lib* lib, struct phc_time_res* res, unsigned n) {
+  if (lib->backend.read != NULL) {
+    return lib->backend.read(lib->backend.ctx, res, n);
+  }
+  return lib->gettime_batch(lib->dev_fd, res, n);
+}
+
+// read PHC, taking the sample with the smallest delay out of n_samples
+static int fbclock_read_phc(fbclock_lib* lib, struct phc_time_res* res) {
+  int r;
+  if (lib->gettime == NULL) {
+    r = fbclock_open_device(lib);
+    if (r) {
+      fbclock_report_read_error(lib, r);
+      return r;
+    }
+  }
+  if (lib->gettime != NULL && lib->backend.read == NULL) {
+    r = lib->gettime(lib->dev_fd, res);
+    if (r) {
+      fbclock_report_read_error(lib, r);
+    } else {
+      fbclock_stats_delay(res->delay);
+    }
+    return r;
+  }
+  struct phc_time_res samples[PTP_MAX_SAMPLES];
+  unsigned n = lib->adaptive_samples ? lib->cur_samples : lib->n_samples;
+  if (n == 0) {
+    n = FBCLOCK_DEFAULT_SAMPLES;
+  }
+  r = fbclock_read_samples(lib, samples, n);
+  if (r) {
+    fbclock_report_read_error(lib, r);
+    return r;
+  }
+  unsigned best = 0;
+  for (unsigned i = 1; i < n; i++) {
+    if (samples[i].delay < samples[best].delay) {
+      best = i;
+    }
+  }
+  *res = samples[best];
+  fbclock_stats_delay(res->delay);
+  if (lib->adaptive_samples) {
+    fbclock_adapt_samples(lib, res->delay);
+  }
+  return 0;
+}
+
+// header is written by the daemon when it creates the object, before any data
+static int fbclock_shm_header_valid(
+    const fbclock_shm_header* header,
+    uint32_t version) {
+  return header->magic == FBCLOCK_SHM_MAGIC && header->version == version &&
+      header->size >= FBCLOCK_SHMDATA_V3_SIZE;
+}
+
+// waiters are registered through a writable mapping, if we're allowed one
+static void fbclock_map_shm_rw(fbclock_lib* lib, const char* shm_path) {
+  int fd = open(shm_path, O_RDWR, 0);
+  if (fd == -1) {
+    return;
+  }
+  size_t size = lib->shmp_v3 != NULL ? FBCLOCK_SHMDATA_V3_SIZE
+                                     : FBCLOCK_SHMDATA_V2_SIZE;
+  void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    return;
+  }
+  lib->shm_rw = p;
+  lib->shm_waiters = lib->shmp_v3 != NULL
+      ? &((fbclock_shmdata_v3*)p)->v2.waiters
+      : &((fbclock_shmdata_v2*)p)->waiters;
+}
+
+static void fbclock_unmap_shm(fbclock_lib* lib) {
+  if (lib->shm_rw != NULL) {
+    munmap(
+        lib->shm_rw,
+        lib->shmp_v3 != NULL ? FBCLOCK_SHMDATA_V3_SIZE
+                             : FBCLOCK_SHMDATA_V2_SIZE);
+    lib->shm_rw = NULL;
+    lib->shm_waiters = NULL;
+  }
+  if (lib->shmp_v3 != NULL) {
+    munmap(lib->shmp_v3, FBCLOCK_SHMDATA_V3_SIZE);
+    lib->shmp_v3 = NULL;
+    lib->shmp_v2 = NULL;
+  }
+  if (lib->shmp_v2 != NULL) {
+    munmap(lib->shmp_v2, FBCLOCK_SHMDATA_V2_SIZE);
+    lib->shmp_v2 = NULL;
+  }
+  if (lib->shmp != NULL) {
+    munmap(lib->shmp, FBCLOCK_SHMDATA_SIZE);
+    lib->shmp = NULL;
+  }
+}
+
+static void fbclock_release_phc_ring(fbclock_lib* lib) {
+  if (lib->phc_ring_owned) {
+    fbclock_phc_ring_close(&lib->phc_ring);
+  }
+  memset(&lib->phc_ring, 0, sizeof(lib->phc_ring));
+  lib->phc_ring.fd = -1;
+  lib->phc_ring_owned = 0;
+}
+
+// swap in the ring the daemon replaced the mapped one with, only done by
+// libs read by one thread, as others may still read the old mapping
+static void fbclock_reopen_phc_ring(fbclock_lib* lib) {
+  fbclock_phc_ring ring;
+  if (fbclock_phc_ring_open_local(&ring, lib->phc_ring_base) !=
+      FBCLOCK_E_NO_ERROR) {
+    return;
+  }
+  fbclock_release_phc_ring(lib);
+  lib->phc_ring = ring;
+  lib->phc_ring_owned = 1;
+}
+
+static void fbclock_free_ptp_path(fbclock_lib* lib) {
+  if (lib->ptp_path_owned) {
+    free(lib->ptp_path);
+    lib->ptp_path = FBCLOCK_PTPPATH;
+    lib->ptp_path_owned = 0;
+  }
+}
+
+// source of fbclock_lib ids, 0 is never handed out
+static uint64_t fbclock_lib_last_id;
+
+static uint64_t fbclock_lib_new_id(void) {
+  return __atomic_add_fetch(&fbclock_lib_last_id, 1, __ATOMIC_RELAXED);
+}
+
+// on error everything opened so far is closed again
+static int fbclock_init_shm(
+    fbclock_lib* lib,
+    const char* shm_path,
+    const char* ptp_path,
+    int version,
+    unsigned flags) {
+  lib->ptp_path = FBCLOCK_PTPPATH;
+  lib->ptp_path_owned = 0;
+  lib->init_flags = flags;
+  lib->read_mode = FBCLOCK_READ_PHC;
+  lib->monotonic = (flags & FBCLOCK_INIT_MONOTONIC) != 0;
+  memset(&lib->backend, 0, sizeof(lib->backend));
+  fbclock_set_samples(lib, FBCLOCK_DEFAULT_SAMPLES, 0);
+  lib->coarse_max_age_ns = 0;
+  memset(&lib->coarse, 0, sizeof(lib->coarse));
+  lib->shmp = NULL;
+  lib->shmp_v2 = NULL;
+  lib->shmp_v3 = NULL;
+  lib->gettime = NULL;
+  lib->gettime_batch = NULL;
+  lib->dev_fd = -1;
+  lib->shm_fd = -1;
+  memset(&lib->phc_ring, 0, sizeof(lib->phc_ring));
+  lib->phc_ring.fd = -1;
+  lib->phc_ring_owned = 0;
+  lib->phc_ring_base = NULL;
+  lib->phc_ring_private = 0;
+  lib->shm_rw = NULL;
+  lib->shm_waiters = NULL;
+  // mappings of a re-initialized lib may land at the same addresses,
+  // so thread handles tell it apart by id
+  lib->id = fbclock_lib_new_id();
+
+  int sfd = open(shm_path, O_RDONLY, 0);
+  if (sfd == -1) {
+    perror("open shmem device");
+    return FBCLOCK_E_SHMEM_OPEN;
+  }
+  lib->shm_fd = sfd;
+
+  // mapped first, so the device can be set up with capabilities from it
+  if (version == 3) {
+    fbclock_shmdata_v3* shmp_v3 = mmap(
+        NULL, FBCLOCK_SHMDATA_V3_SIZE, PROT_READ, MAP_SHARED, lib->shm_fd, 0);
+    if (shmp_v3 != MAP_FAILED) {
+      if (!fbclock_shm_header_valid(&shmp_v3->header, 3)) {
+        munmap(shmp_v3, FBCLOCK_SHMDATA_V3_SIZE);
+        close(lib->shm_fd);
+        lib->shm_fd = -1;
+        return FBCLOCK_E_NO_DATA;
+      }
+      lib->shmp_v3 = shmp_v3;
+      // readers only need the seqlock block, same as v2
+      lib->shmp_v2 = &shmp_v3->v2;
+    }
+  } else if (version == 2) {
+    fbclock_shmdata_v2* shmp_v2 = mmap(
+        NULL, FBCLOCK_SHMDATA_V2_SIZE, PROT_READ, MAP_SHARED, lib->shm_fd, 0);
+    if (shmp_v2 != MAP_FAILED) {
+      lib->shmp_v2 = shmp_v2;
+    }
+  } else {
+    fbclock_shmdata* shmp =
+        mmap(NULL, FBCLOCK_SHMDATA_SIZE, PROT_READ, MAP_SHARED, lib->shm_fd, 0);
+    if (shmp != MAP_FAILED) {
+      lib->shmp = shmp;
+    }
+  }
+  if (lib->shmp == NULL && lib->shmp_v2 == NULL) {
+    close(lib->shm_fd);
+    lib->shm_fd = -1;
+    return FBCLOCK_E_SHMEM_MAP_FAILED;
+  }
+  if (lib->shmp_v2 != NULL) {
+    fbclock_map_shm_rw(lib, shm_path);
+  }
+
+  if (flags & FBCLOCK_INIT_SHM_ONLY) {
+    lib->read_mode = FBCLOCK_READ_SYSCLOCK;
+    return FBCLOCK_E_NO_ERROR;
+  }
+
+  int rcode = FBCLOCK_E_NO_ERROR;
+  int ffd;
+  if (ptp_path != NULL) {
+    // thread handles reopen it, so caller's string can't be used
+    lib->ptp_path = strdup(ptp_path);
+    if (lib->ptp_path == NULL) {
+      lib->ptp_path = FBCLOCK_PTPPATH;
+      rcode = FBCLOCK_E_INVALID_ARGUMENT;
+      goto fail;
+    }
+    lib->ptp_path_owned = 1;
+  }
+  if (flags & FBCLOCK_INIT_LAZY_OPEN) {
+    return FBCLOCK_E_NO_ERROR;
+  }
+
+  ffd = open(lib->ptp_path, O_RDONLY);
+  if (ffd == -1) {
+    perror("open PTP device");
+    rcode = FBCLOCK_E_PTP_OPEN;
+    goto fail;
+  }
+  lib->dev_fd = ffd;
+  fbclock_select_backend(lib, ffd);
+  return FBCLOCK_E_NO_ERROR;
+
+fail:
+  fbclock_free_ptp_path(lib);
+  fbclock_unmap_shm(lib);
+  close(lib->shm_fd);
+  lib->shm_fd = -1;
+  return rcode;
+}
+
+int fbclock_init(fbclock_lib* lib, const char* shm_path) {
+  return fbclock_init_shm(lib, shm_path, NULL, 1, 0);
+}
+
+int fbclock_init_v2(fbclock_lib* lib, const char* shm_path) {
+  return fbclock_init_shm(lib, shm_path, NULL, 2, 0);
+}
+
+int fbclock_init_v3(fbclock_lib* lib, const char* shm_path) {
+  return fbclock_init_shm(lib, shm_path, NULL, 3, 0);
+}
+
+int fbclock_init_with_options(
+    fbclock_lib* lib,
+    const char* shm_path,
+    const fbclock_init_options* opts) {
+  if (opts->shm_version < 1 || opts->shm_version > 3) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  unsigned n_samples =
+      opts->n_samples == 0 ? FBCLOCK_DEFAULT_SAMPLES : opts->n_samples;
+  if (n_samples > PTP_MAX_SAMPLES) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  unsigned flags = opts->flags;
+  if (opts->ptp_path != NULL) {
+    flags |= FBCLOCK_INIT_PROBE;
+  }
+  int rcode = fbclock_init_shm(
+      lib, shm_path, opts->ptp_path, opts->shm_version, flags);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  return fbclock_set_samples(lib, n_samples, opts->adaptive_samples);
+}
+
+int fbclock_init_iface(fbclock_lib* lib, const char* iface) {
+  char shm_path[PATH_MAX];
+  char ptp_path[PATH_MAX];
+  int n = snprintf(shm_path, sizeof(shm_path), "%s.%s", FBCLOCK_PATH_V2, iface);
+  int m = snprintf(ptp_path, sizeof(ptp_path), "%s.%s", FBCLOCK_PTPPATH, iface);
+  if (n < 0 || n >= (int)sizeof(shm_path) || m < 0 ||
+      m >= (int)sizeof(ptp_path)) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  // device is the one of the daemon, so its capabilities can be used
+  return fbclock_init_shm(lib, shm_path, ptp_path, 2, 0);
+}
+
+int fbclock_device_numa_node(const char* ptp_path) {
+  struct stat st;
+  if (stat(ptp_path, &st) != 0 || !S_ISCHR(st.st_mode)) {
+    return -1;
+  }
+  // works for managed device links too, as they are hard links
+  char path[64];
+  snprintf(
+      path,
+      sizeof(path),
+      "/sys/dev/char/%u:%u/device/numa_node",
+      major(st.st_rdev),
+      minor(st.st_rdev));
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    return -1;
+  }
+  int node;
+  if (fscanf(f, "%d", &node) != 1) {
+    node = -1;
+  }
+  fclose(f);
+  return node;
+}
+
+int fbclock_destroy(fbclock_lib* lib) {
+  fbclock_unmap_shm(lib);
+  if (lib->dev_fd != -1) {
+    close(lib->dev_fd);
+    lib->dev_fd = -1;
+  }
+  close(lib->shm_fd);
+  lib->shm_fd = -1;
+  fbclock_free_ptp_path(lib);
+  fbclock_release_phc_ring(lib);
+  free(lib->phc_ring_base);
+  lib->phc_ring_base = NULL;
+  return FBCLOCK_E_NO_ERROR;
+  // we don't want to unlink it, others might still use it
+}
+
+double fbclock_window_of_uncertainty(
+    double seconds,
+    double error_bound_ns,
+    double holdover_multiplier_ns) {
+  double h = holdover_multiplier_ns * seconds;
+  double w = error_bound_ns + h;
+  fbclock_debug_print("error_bound=%f\n", error_bound_ns);
+  fbclock_debug_print("holdover_multiplier=%f\n", holdover_multiplier_ns);
+  fbclock_debug_print("%.3f seconds holdover, h=%f\n", seconds, h);
+  fbclock_debug_print("w = %f ns\n", w);
+  fbclock_debug_print("w = %f ms\n", w / 1000000.0);
+  return w;
+}
+
+uint64_t fbclock_window_of_uncertainty_ns(
+    int64_t elapsed_ns,
+    uint64_t error_bound_ns,
+    uint32_t holdover_multiplier_ns) {
+  uint64_t w = fbclock_inline_window_of_uncertainty_ns(
+      elapsed_ns, error_bound_ns, holdover_multiplier_ns);
+  fbclock_debug_print("w = %lu ns\n", w);
+  return w;
+}
+
+int fbclock_calculate_time_ns(
+    uint64_t error_bound_ns,
+    uint32_t holdover_multiplier_ns,
+    fbclock_clockdata* state,
+    int64_t phctime_ns,
+    fbclock_truetime* truetime,
+    int time_standard) {
+  int rcode = fbclock_inline_calculate_time_ns(
+      error_bound_ns,
+      holdover_multiplier_ns,
+      state,
+      phctime_ns,
+      truetime,
+      time_standard);
+  if (rcode == FBCLOCK_E_PHC_IN_THE_PAST) {
+    FBCLOCK_STATS_INC(phc_in_the_past);
+  }
+  return rcode;
+}
+
+int fbclock_calculate_time(
+    double error_bound_ns,
+    double h_value_ns,
+    fbclock_clockdata* state,
+    int64_t phctime_ns,
+    fbclock_truetime* truetime,
+    int time_standard) {
+  // check how far back since last SYNC message from GM (in seconds)
+  double seconds =
+      (double)(phctime_ns - state->ingress_time_ns) / NANOSECONDS_IN_SECONDS;
+
+  if (seconds < 0) {
+    FBCLOCK_STATS_INC(phc_in_the_past);
+    return FBCLOCK_E_PHC_IN_THE_PAST;
+  }
+
+  // UTC offset applied if time standard used is UTC (and not TAI)
+  if (time_standard == FBCLOCK_UTC) {
+    phctime_ns = fbclock_apply_utc_offset(state, phctime_ns);
+  }
+
+  // calculate the Window of Uncertainty (WOU) (in nanoseconds)
+  double wou_ns =
+      fbclock_window_of_uncertainty(seconds, error_bound_ns, h_value_ns);
+  truetime->earliest_ns = phctime_ns - (uint64_t)wou_ns;
+  truetime->latest_ns = phctime_ns + (uint64_t)wou_ns;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+// Process-wide high-water marks of monotonic mode, TAI and UTC in separate
+// cache lines. Latest is raised before earliest, so anyone who sees an earliest
+// also sees a latest at least as high and never returns a crossed interval.
+typedef struct fbclock_hwm {
+  uint64_t earliest_ns;
+  uint64_t latest_ns;
+} __attribute__((aligned(64))) fbclock_hwm;
+
+static fbclock_hwm fbclock_hwms[2];
+
+// raise *hwm to v, returns the new high-water mark
+static inline uint64_t fbclock_hwm_raise(uint64_t* hwm, uint64_t v) {
+  uint64_t cur = __atomic_load_n(hwm, __ATOMIC_ACQUIRE);
+  while (cur < v) {
+    if (__atomic_compare_exchange_n(
+            hwm, &cur, v, 1, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      return v;
+    }
+  }
+  return cur;
+}
+
+static void fbclock_apply_monotonic(fbclock_truetime* truetime, int timezone) {
+  fbclock_hwm* hwm = &fbclock_hwms[timezone == FBCLOCK_UTC];
+  uint64_t latest = fbclock_hwm_raise(&hwm->latest_ns, truetime->latest_ns);
+  uint64_t earliest =
+      fbclock_hwm_raise(&hwm->earliest_ns, truetime->earliest_ns);
+  // earliest came from a caller which raised latest past it before
+  if (earliest > latest) {
+    latest = __atomic_load_n(&hwm->latest_ns, __ATOMIC_ACQUIRE);
+  }
+  truetime->earliest_ns = earliest;
+  truetime->latest_ns = latest;
+}
+
+// calculate TrueTime for a request, clamped in monotonic mode
+static int fbclock_request_time(
+    fbclock_lib* lib,
+    uint64_t error_bound_ns,
+    fbclock_clockdata* state,
+    int64_t phctime_ns,
+    fbclock_truetime* truetime,
+    int timezone) {
+  int rcode = fbclock_calculate_time_ns(
+      error_bound_ns,
+      state->holdover_multiplier_ns,
+      state,
+      phctime_ns,
+      truetime,
+      timezone);
+  if (rcode == FBCLOCK_E_NO_ERROR && lib->monotonic) {
+    fbclock_apply_monotonic(truetime, timezone);
+  }
+  return rcode;
+}
+
+// load state from shmem and make sure it's usable for TrueTime calculation
+static int fbclock_load_state(fbclock_lib* lib, fbclock_clockdata* state) {
+  int rcode = lib->shmp_v2 != NULL
+      ? fbclock_clockdata_load_data_v2(lib->shmp_v2, state)
+      : fbclock_clockdata_load_data(lib->shmp, state);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    fbclock_report_error(lib, FBCLOCK_ERR_SHMEM_READ, 0);
+    return rcode;
+  }
+
+  rcode = fbclock_inline_check_state(state);
+  if (rcode == FBCLOCK_E_NO_DATA) {
+    FBCLOCK_STATS_INC(no_data);
+  } else if (rcode == FBCLOCK_E_WOU_TOO_BIG) {
+    FBCLOCK_STATS_INC(wou_too_big);
+  }
+  return rcode;
+}
+
+// extrapolate PHC time as the read mode says, non-zero if PHC has to be read
+// instead: FBCLOCK_READ_PHC mode, no mapping or stale reader service samples
+static int fbclock_extrapolate_mode(
+    fbclock_lib* lib,
+    fbclock_clockdata* state,
+    struct phc_time_res* res) {
+  if (lib->read_mode == FBCLOCK_READ_SERVICE) {
+    if (lib->phc_ring_private &&
+        (lib->phc_ring.hdr == NULL ||
+         __atomic_load_n(&lib->phc_ring.hdr->magic, __ATOMIC_RELAXED) !=
+             FBCLOCK_PHC_RING_MAGIC)) {
+      fbclock_reopen_phc_ring(lib);
+    }
+    return lib->phc_ring.hdr != NULL ? fbclock_extrapolate_ring(lib, state, res)
+                                     : -1;
+  }
+  if (lib->read_mode == FBCLOCK_READ_SYSCLOCK && state->sysclock_time_ns != 0) {
+    return fbclock_extrapolate_phc(state, res);
+  }
+  return -1;
+}
+
+// load state and read PHC (or extrapolate it) for a single TrueTime request
+static int fbclock_read_state_phc(
+    fbclock_lib* lib,
+    fbclock_clockdata* state,
+    struct phc_time_res* res) {
+  FBCLOCK_STATS_INC(requests);
+  int rcode = fbclock_load_state(lib, state);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+
+  // fall back to PHC read if there is no mapping or it can't be used
+  if (fbclock_extrapolate_mode(lib, state, res)) {
+    int r = fbclock_read_phc(lib, res);
+    if (r) {
+      return r == FBCLOCK_READ_E_OPEN ? FBCLOCK_E_PTP_OPEN
+                                      : FBCLOCK_E_PTP_READ_OFFSET;
+    }
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+int fbclock_gettime_tz(
+    fbclock_lib* lib,
+    fbclock_truetime* truetime,
+    int timezone) {
+  struct phc_time_res res;
+  fbclock_clockdata state = {};
+  int rcode = fbclock_read_state_phc(lib, &state, &res);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+
+  uint64_t error_bound = (uint64_t)state.error_bound_ns + (uint64_t)res.delay;
+
+  return fbclock_request_time(
+      lib, error_bound, &state, res.ts, truetime, timezone);
+}
+
+int fbclock_gettime_both(
+    fbclock_lib* lib,
+    fbclock_truetime* truetime_tai,
+    fbclock_truetime* truetime_utc) {
+  struct phc_time_res res;
+  fbclock_clockdata state = {};
+  int rcode = fbclock_read_state_phc(lib, &state, &res);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+
+  // same sample and state for both, so they describe the same instant
+  uint64_t error_bound = (uint64_t)state.error_bound_ns + (uint64_t)res.delay;
+  rcode = fbclock_request_time(
+      lib, error_bound, &state, res.ts, truetime_tai, FBCLOCK_TAI);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  return fbclock_request_time(
+      lib, error_bound, &state, res.ts, truetime_utc, FBCLOCK_UTC);
+}
+
+int fbclock_gettime_batch(
+    fbclock_lib* lib,
+    fbclock_truetime* truetimes,
+    unsigned n,
+    int timezone) {
+  if (n == 0) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  struct phc_time_res res[PTP_MAX_SAMPLES];
+  fbclock_clockdata state = {};
+  FBCLOCK_STATS_INC(requests);
+  int rcode = fbclock_load_state(lib, &state);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+
+  // extrapolation needs no syscall, each value gets its own clock read;
+  // whatever can't be extrapolated is read from PHC below
+  unsigned done = 0;
+  for (; done < n && fbclock_extrapolate_mode(lib, &state, &res[0]) == 0;
+       done++) {
+    uint64_t error_bound =
+        (uint64_t)state.error_bound_ns + (uint64_t)res[0].delay;
+    rcode = fbclock_request_time(
+        lib, error_bound, &state, res[0].ts, &truetimes[done], timezone);
+    if (rcode != FBCLOCK_E_NO_ERROR) {
+      return rcode;
+    }
+  }
+  if (done == n) {
+    return FBCLOCK_E_NO_ERROR;
+  }
+
+  int r = fbclock_open_device(lib);
+  if (r) {
+    fbclock_report_read_error(lib, r);
+    return FBCLOCK_E_PTP_OPEN;
+  }
+
+  // kernel limits number of samples per request
+  while (done < n) {
+    unsigned count = n - done;
+    if (count > PTP_MAX_SAMPLES) {
+      count = PTP_MAX_SAMPLES;
+    }
+    r = fbclock_read_samples(lib, res, count);
+    if (r) {
+      fbclock_report_read_error(lib, r);
+      return FBCLOCK_E_PTP_READ_OFFSET;
+    }
+    // each sample carries its own delay, so the error bound stays per-sample
+    for (unsigned i = 0; i < count; i++) {
+      uint64_t error_bound =
+          (uint64_t)state.error_bound_ns + (uint64_t)res[i].delay;
+      rcode = fbclock_request_time(
+          lib, error_bound, &state, res[i].ts, &truetimes[done + i], timezone);
+      if (rcode != FBCLOCK_E_NO_ERROR) {
+        return rcode;
+      }
+    }
+    done += count;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
 
-#ifdef __x86_64__
-#define fbclock_crc64 __builtin_ia32_crc32di
-#endif
+int fbclock_gettime(fbclock_lib* lib, fbclock_truetime* truetime) {
+  return fbclock_gettime_tz(lib, truetime, FBCLOCK_TAI);
+}
 
-#ifdef __aarch64__
-#ifdef __SSE4_2__
-#define fbclock_crc64 _mm_crc32_u64
-#endif
-#endif
+int fbclock_gettime_utc(fbclock_lib* lib, fbclock_truetime* truetime) {
+  return fbclock_gettime_tz(lib, truetime, FBCLOCK_UTC);
+}
 
-// dumb replacement for platforms we don't fully support
-#ifndef fbclock_crc64
-#define fbclock_crc64(a, b) ({ a ^ b; })
-#endif
+int fbclock_gettime_multi(
+    fbclock_lib** libs,
+    unsigned n,
+    fbclock_truetime* truetime,
+    int timezone) {
+  if (n == 0) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  int rcode = FBCLOCK_E_NO_ERROR;
+  int ok = 0;
+  int monotonic = 0;
+  uint64_t earliest = 0;
+  uint64_t latest = UINT64_MAX;
+  for (unsigned i = 0; i < n; i++) {
+    fbclock_truetime tt;
+    int r = fbclock_gettime_tz(libs[i], &tt, timezone);
+    if (r != FBCLOCK_E_NO_ERROR) {
+      rcode = r;
+      continue;
+    }
+    ok = 1;
+    monotonic |= libs[i]->monotonic;
+    if (tt.earliest_ns > earliest) {
+      earliest = tt.earliest_ns;
+    }
+    if (tt.latest_ns < latest) {
+      latest = tt.latest_ns;
+    }
+  }
+  if (!ok) {
+    return rcode;
+  }
+  // Devices are read one after another, at t1 <= ... <= tn. Each earliest is
+  // <= tn and each latest is >= t1, so if the bounds cross, [latest, earliest]
+  // still lies within [t1, tn], i.e. within this call.
+  if (earliest > latest) {
+    uint64_t t = earliest;
+    earliest = latest;
+    latest = t;
+  }
+  truetime->earliest_ns = earliest;
+  truetime->latest_ns = latest;
+  if (monotonic) {
+    fbclock_apply_monotonic(truetime, timezone);
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
 
-struct phc_time_res {
-  int64_t ts; // last ts got from PHC
-  int64_t delay; // mean delay of several requests
-};
+static int64_t fbclock_coarse_res_ns;
+static pthread_once_t fbclock_coarse_once = PTHREAD_ONCE_INIT;
 
-static inline uint64_t fbclock_clockdata_crc(fbclock_clockdata* value) {
-  uint64_t counter = fbclock_crc64(0xFFFFFFFF, value->ingress_time_ns);
-  counter = fbclock_crc64(counter, value->error_bound_ns);
-  counter = fbclock_crc64(counter, value->holdover_multiplier_ns);
-  return counter ^ 0xFFFFFFFF;
+static void fbclock_coarse_res_init(void) {
+  struct timespec ts;
+  if (clock_getres(CLOCK_MONOTONIC_COARSE, &ts) == 0) {
+    fbclock_coarse_res_ns = ts.tv_sec * NANOSECONDS_IN_SECONDS_I64 + ts.tv_nsec;
+  } else {
+    // tick of HZ=100 kernels, the slowest one
+    fbclock_coarse_res_ns = 10000000;
+  }
 }
 
-int fbclock_clockdata_store_data(uint32_t fd, fbclock_clockdata* data) {
-  fbclock_shmdata* shmp = mmap(
-      NULL, FBCLOCK_SHMDATA_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (shmp == MAP_FAILED) {
-    return FBCLOCK_E_SHMEM_MAP_FAILED;
+static inline int64_t fbclock_monotonic_coarse_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * NANOSECONDS_IN_SECONDS_I64 + ts.tv_nsec;
+}
+
+// seqlock read of the snapshot, returns non-zero if it's being updated
+static int fbclock_coarse_load(fbclock_coarse* coarse, fbclock_coarse* snap) {
+  uint64_t seq = __atomic_load_n(&coarse->seq, __ATOMIC_ACQUIRE);
+  if (seq & 1) {
+    return -1;
   }
-  uint64_t crc = fbclock_clockdata_crc(data);
-  memcpy(&shmp->data, data, FBCLOCK_CLOCKDATA_SIZE);
-  atomic_store(&shmp->crc, crc);
-  munmap(shmp, FBCLOCK_SHMDATA_SIZE);
-  return FBCLOCK_E_NO_ERROR;
+  memcpy(snap, coarse, sizeof(fbclock_coarse));
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(&coarse->seq, __ATOMIC_RELAXED) != seq;
 }
 
-int fbclock_clockdata_load_data(
-    fbclock_shmdata* shmp,
-    fbclock_clockdata* data) {
-  for (int i = 0; i < FBCLOCK_MAX_READ_TRIES; i++) {
-    memcpy(data, &shmp->data, FBCLOCK_CLOCKDATA_SIZE);
-    uint64_t crc = atomic_load(&shmp->crc);
-    uint64_t our_crc = fbclock_clockdata_crc(data);
-    if (our_crc == crc) {
-      fbclock_debug_print("reading clock data took %d tries\n", i + 1);
-      return FBCLOCK_E_NO_ERROR;
+// only one thread updates the snapshot at a time, others just skip the update
+static void fbclock_coarse_store(
+    fbclock_coarse* coarse,
+    int64_t monotonic_ns,
+    int64_t delay_ns,
+    fbclock_clockdata* state,
+    struct phc_time_res* res) {
+  uint64_t seq = __atomic_load_n(&coarse->seq, __ATOMIC_RELAXED);
+  if ((seq & 1) ||
+      !__atomic_compare_exchange_n(
+          &coarse->seq,
+          &seq,
+          seq + 1,
+          0,
+          __ATOMIC_RELAXED,
+          __ATOMIC_RELAXED)) {
+    return;
+  }
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  coarse->monotonic_ns = monotonic_ns;
+  coarse->phc_time_ns = res->ts;
+  coarse->delay_ns = delay_ns;
+  memcpy(&coarse->state, state, FBCLOCK_CLOCKDATA_SIZE);
+  __atomic_store_n(&coarse->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+int fbclock_gettime_coarse(
+    fbclock_lib* lib,
+    fbclock_truetime* truetime,
+    int timezone) {
+  pthread_once(&fbclock_coarse_once, fbclock_coarse_res_init);
+  int64_t now_ns = fbclock_monotonic_coarse_ns();
+  uint64_t max_age_ns = lib->coarse_max_age_ns != 0 ? lib->coarse_max_age_ns
+                                                    : FBCLOCK_COARSE_MAX_AGE_NS;
+  fbclock_coarse snap;
+  if (fbclock_coarse_load(&lib->coarse, &snap) == 0 && snap.phc_time_ns != 0) {
+    int64_t elapsed_ns = now_ns - snap.monotonic_ns;
+    if (elapsed_ns >= 0 && (uint64_t)elapsed_ns < max_age_ns) {
+      FBCLOCK_STATS_INC(requests);
+      // coarse clock lags real time by up to its resolution,
+      // and runs at a slightly different rate than PHC
+      uint64_t error_bound = (uint64_t)snap.state.error_bound_ns +
+          (uint64_t)snap.delay_ns + (uint64_t)fbclock_coarse_res_ns +
+          (uint64_t)fbclock_scale_ppb(elapsed_ns, FBCLOCK_COARSE_DRIFT_PPB) + 1;
+      return fbclock_request_time(
+          lib,
+          error_bound,
+          &snap.state,
+          snap.phc_time_ns + elapsed_ns,
+          truetime,
+          timezone);
     }
   }
-  fbclock_debug_print(
-      "failed to read clock data after %d tries\n", FBCLOCK_MAX_READ_TRIES);
-  // TODO: Enable mismatch error.
-  // return FBCLOCK_E_CRC_MISMATCH;
+
+  // no fresh snapshot, do an exact request and save it
+  struct phc_time_res res;
+  fbclock_clockdata state = {};
+  int rcode = fbclock_read_state_phc(lib, &state, &res);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  // PHC was read between now_ns and after_ns, so snapshot time is off by
+  // at most the difference in addition to the resolution
+  int64_t after_ns = fbclock_monotonic_coarse_ns();
+  if ((uint64_t)(after_ns - now_ns) < max_age_ns) {
+    fbclock_coarse_store(
+        &lib->coarse, now_ns, res.delay + (after_ns - now_ns), &state, &res);
+  }
+
+  return fbclock_request_time(
+      lib,
+      (uint64_t)state.error_bound_ns + (uint64_t)res.delay,
+      &state,
+      res.ts,
+      truetime,
+      timezone);
+}
+
+int fbclock_set_read_mode(fbclock_lib* lib, int read_mode) {
+  if (read_mode != FBCLOCK_READ_PHC && read_mode != FBCLOCK_READ_SYSCLOCK &&
+      read_mode != FBCLOCK_READ_SERVICE) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  lib->read_mode = read_mode;
   return FBCLOCK_E_NO_ERROR;
 }
 
-static inline int64_t fbclock_pct2ns(const struct ptp_clock_time* ptc) {
-  return (int64_t)(ptc->sec * NANOSECONDS_IN_SECONDS) + (int64_t)ptc->nsec;
+int fbclock_set_phc_ring(fbclock_lib* lib, const char* base) {
+  if (base == NULL) {
+    base = FBCLOCK_PATH_PHC_RING;
+  }
+  // thread handles reopen it, so caller's string can't be used
+  char* owned_base = strdup(base);
+  if (owned_base == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  fbclock_phc_ring ring;
+  int rcode = fbclock_phc_ring_open_local(&ring, owned_base);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    free(owned_base);
+    return rcode;
+  }
+  fbclock_release_phc_ring(lib);
+  free(lib->phc_ring_base);
+  lib->phc_ring = ring;
+  lib->phc_ring_owned = 1;
+  lib->phc_ring_base = owned_base;
+  lib->read_mode = FBCLOCK_READ_SERVICE;
+  // thread handles map the ring of the new base
+  lib->id = fbclock_lib_new_id();
+  return FBCLOCK_E_NO_ERROR;
 }
 
-static int fbclock_read_ptp_offset(int fd, struct phc_time_res* res) {
-  struct ptp_sys_offset pso = {.n_samples = 5};
-  int64_t min_delay = INT64_MAX, last_ts;
+int fbclock_set_error_callback(
+    fbclock_lib* lib,
+    fbclock_error_callback cb,
+    void* ctx,
+    uint64_t interval_ns) {
+  lib->error_cb = NULL;
+  lib->error_cb_ctx = ctx;
+  lib->error_cb_interval_ns = interval_ns;
+  lib->error_cb_last_ns = 0;
+  lib->error_cb = cb;
+  return FBCLOCK_E_NO_ERROR;
+}
 
-  int r = ioctl(fd, PTP_SYS_OFFSET, &pso);
-  if (r) {
-    perror("PTP_SYS_OFFSET");
-    return -1;
+uint64_t fbclock_error_count(fbclock_lib* lib, int kind) {
+  if (kind < 0 || kind >= FBCLOCK_ERR_KINDS) {
+    return 0;
   }
+  return __atomic_load_n(&lib->errors[kind], __ATOMIC_RELAXED);
+}
 
-  for (unsigned i = 0; i < pso.n_samples; ++i) {
-    int64_t delay =
-        fbclock_pct2ns(&pso.ts[2 * i + 2]) - fbclock_pct2ns(&pso.ts[2 * i]);
-    min_delay = (delay < min_delay) ? delay : min_delay;
-    last_ts = fbclock_pct2ns(&pso.ts[2 * i + 1]);
+int fbclock_set_backend(fbclock_lib* lib, const fbclock_backend* backend) {
+  if (backend == NULL) {
+    memset(&lib->backend, 0, sizeof(lib->backend));
+    return FBCLOCK_E_NO_ERROR;
   }
-  res->ts = last_ts;
-  res->delay = min_delay;
-  if (min_delay < 0) {
-    perror("Negative request delay");
-    return -2;
+  if (backend->read == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
   }
-  return 0;
+  lib->backend = *backend;
+  return FBCLOCK_E_NO_ERROR;
 }
 
-static int fbclock_read_ptp_offset_extended(int fd, struct phc_time_res* res) {
-  struct ptp_sys_offset_extended psoe = {.n_samples = 5};
-  int64_t min_delay = INT64_MAX;
+static inline int64_t fbclock_monotonic_raw_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+  return ts.tv_sec * NANOSECONDS_IN_SECONDS_I64 + ts.tv_nsec;
+}
 
-  int r = ioctl(fd, PTP_SYS_OFFSET_EXTENDED, &psoe);
-  if (r) {
-    perror("PTP_SYS_OFFSET_EXTENDED");
-    return -1;
-  }
+static inline uint64_t fbclock_splitmix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
 
-  for (unsigned i = 0; i < psoe.n_samples; ++i) {
-    int64_t delay =
-        fbclock_pct2ns(&psoe.ts[i][2]) - fbclock_pct2ns(&psoe.ts[i][0]);
-    min_delay = (delay < min_delay) ? delay : min_delay;
+// -ln(r / 2^64) with log2 of the mantissa approximated by a quadratic
+// (error < 0.002), good enough for a delay model and doesn't need libm
+static double fbclock_sim_neg_log(uint64_t r) {
+  r |= 1;
+  int lz = __builtin_clzll(r);
+  double x = (double)(r << lz) / 9223372036854775808.0 - 1.0;
+  double log2m = x * (1.3465 - 0.3465 * x);
+  return ((double)(lz + 1) - log2m) * 0.6931471805599453;
+}
+
+// n-th delay, the same for the same seed no matter which thread draws it
+static int64_t fbclock_sim_delay(fbclock_sim* sim) {
+  const fbclock_sim_options* opts = &sim->opts;
+  if (opts->delay_dist == FBCLOCK_SIM_DELAY_FIXED ||
+      opts->delay_spread_ns <= 0) {
+    return opts->delay_ns;
   }
-  res->ts = fbclock_pct2ns(&psoe.ts[psoe.n_samples - 1][1]);
-  res->delay = min_delay;
-  if (min_delay < 0) {
-    perror("Negative request delay");
-    return -2;
+  uint64_t n = __atomic_fetch_add(&sim->draws, 1, __ATOMIC_RELAXED);
+  uint64_t r = fbclock_splitmix64(opts->seed + n);
+  if (opts->delay_dist == FBCLOCK_SIM_DELAY_UNIFORM) {
+    return opts->delay_ns + (int64_t)(r % (uint64_t)opts->delay_spread_ns);
   }
-  return 0;
+  return opts->delay_ns +
+      (int64_t)(fbclock_sim_neg_log(r) * (double)opts->delay_spread_ns);
 }
 
-int fbclock_init(fbclock_lib* lib, const char* shm_path) {
-  lib->ptp_path = FBCLOCK_PTPPATH;
-  int sfd = open(shm_path, O_RDONLY, 0);
-  if (sfd == -1) {
-    perror("open shmem device");
-    return FBCLOCK_E_SHMEM_OPEN;
+static inline int64_t fbclock_sim_phc_at(fbclock_sim* sim, int64_t raw_ns) {
+  int64_t elapsed_ns = raw_ns - sim->start_ns;
+  return sim->phc_start_ns + elapsed_ns +
+      fbclock_scale_ppb(elapsed_ns, sim->opts.drift_ppb);
+}
+
+int64_t fbclock_sim_phc_time(fbclock_sim* sim) {
+  return fbclock_sim_phc_at(sim, fbclock_monotonic_raw_ns());
+}
+
+// what the daemon publishes right after a sync, with exact sysclock mapping
+static int fbclock_sim_publish(fbclock_sim* sim, int64_t raw_ns) {
+  int64_t phc_ns = fbclock_sim_phc_at(sim, raw_ns);
+  fbclock_clockdata data = {
+      .ingress_time_ns = phc_ns,
+      .error_bound_ns = sim->opts.error_bound_ns,
+      .holdover_multiplier_ns = sim->opts.holdover_multiplier_ns,
+      .utc_offset_pre_s = 37,
+      .utc_offset_post_s = 37,
+      .phc_time_ns = phc_ns,
+      .sysclock_time_ns = raw_ns,
+      .coef_ppb = sim->opts.drift_ppb,
+      .sysclock_error_ns = sim->opts.sysclock_error_ns};
+  __atomic_add_fetch(&sim->updates, 1, __ATOMIC_RELAXED);
+  return fbclock_writer_store(&sim->writer, &data);
+}
+
+int fbclock_sim_update(fbclock_sim* sim) {
+  int64_t raw_ns = fbclock_monotonic_raw_ns();
+  __atomic_store_n(
+      &sim->next_update_ns,
+      raw_ns + (int64_t)sim->opts.update_interval_ns,
+      __ATOMIC_RELAXED);
+  return fbclock_sim_publish(sim, raw_ns);
+}
+
+// publish if it's due, the reader which claims the slot does it
+static void fbclock_sim_tick(fbclock_sim* sim, int64_t raw_ns) {
+  if (sim->opts.update_interval_ns == 0) {
+    return;
   }
-  lib->shm_fd = sfd;
+  int64_t next = __atomic_load_n(&sim->next_update_ns, __ATOMIC_RELAXED);
+  if (raw_ns < next) {
+    return;
+  }
+  if (__atomic_compare_exchange_n(
+          &sim->next_update_ns,
+          &next,
+          raw_ns + (int64_t)sim->opts.update_interval_ns,
+          0,
+          __ATOMIC_RELAXED,
+          __ATOMIC_RELAXED)) {
+    fbclock_sim_publish(sim, raw_ns);
+  }
+}
 
-  int ffd = open(lib->ptp_path, O_RDONLY);
-  if (ffd == -1) {
-    perror("open PTP device");
-    return FBCLOCK_E_PTP_OPEN;
+static int fbclock_sim_read(void* ctx, struct phc_time_res* res, unsigned n) {
+  fbclock_sim* sim = (fbclock_sim*)ctx;
+  int64_t raw_ns = fbclock_monotonic_raw_ns();
+  fbclock_sim_tick(sim, raw_ns);
+  for (unsigned i = 0; i < n; i++) {
+    int64_t delay = fbclock_sim_delay(sim);
+    if (sim->opts.spin) {
+      while (fbclock_monotonic_raw_ns() - raw_ns < delay) {
+      }
+    }
+    // PHC is sampled somewhere within the delay, middle is the best guess
+    res[i].ts = fbclock_sim_phc_at(sim, raw_ns + delay / 2);
+    res[i].delay = delay;
+    raw_ns += delay;
   }
-  lib->dev_fd = ffd;
+  return 0;
+}
 
-  struct ptp_sys_offset_extended psoe = {.n_samples = 1};
+fbclock_backend fbclock_sim_backend(fbclock_sim* sim) {
+  fbclock_backend backend = {.read = fbclock_sim_read, .ctx = sim};
+  return backend;
+}
 
-  int r = ioctl(ffd, PTP_SYS_OFFSET_EXTENDED, &psoe);
-  if (!r) {
-    lib->gettime = fbclock_read_ptp_offset_extended;
-  } else {
-    lib->gettime = fbclock_read_ptp_offset;
+int fbclock_sim_open(
+    fbclock_sim* sim,
+    const fbclock_sim_options* opts,
+    uint32_t fd,
+    int version) {
+  memset(sim, 0, sizeof(*sim));
+  sim->opts = *opts;
+  int rcode = fbclock_writer_open(&sim->writer, fd, version);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
   }
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  sim->start_ns = fbclock_monotonic_raw_ns();
+  sim->phc_start_ns =
+      ts.tv_sec * NANOSECONDS_IN_SECONDS_I64 + ts.tv_nsec - UTC_TAI_OFFSET_NS;
+  return fbclock_sim_update(sim);
+}
 
-  fbclock_shmdata* shmp =
-      mmap(NULL, FBCLOCK_SHMDATA_SIZE, PROT_READ, MAP_SHARED, lib->shm_fd, 0);
-  if (shmp == MAP_FAILED) {
-    return FBCLOCK_E_SHMEM_MAP_FAILED;
-  }
-  lib->shmp = shmp;
-  return FBCLOCK_E_NO_ERROR;
+int fbclock_sim_close(fbclock_sim* sim) {
+  return fbclock_writer_close(&sim->writer);
 }
 
-int fbclock_destroy(fbclock_lib* lib) {
-  munmap(lib->shmp, FBCLOCK_SHMDATA_SIZE);
-  close(lib->dev_fd);
-  close(lib->shm_fd);
+int fbclock_set_monotonic(fbclock_lib* lib, int enable) {
+  lib->monotonic = enable != 0;
   return FBCLOCK_E_NO_ERROR;
-  // we don't want to unlink it, others might still use it
 }
 
-double fbclock_window_of_uncertainty(
-    double seconds,
-    double error_bound_ns,
-    double holdover_multiplier_ns) {
-  double h = holdover_multiplier_ns * seconds;
-  double w = error_bound_ns + h;
-  fbclock_debug_print("error_bound=%f\n", error_bound_ns);
-  fbclock_debug_print("holdover_multiplier=%f\n", holdover_multiplier_ns);
-  fbclock_debug_print("%.3f seconds holdover, h=%f\n", seconds, h);
-  fbclock_debug_print("w = %f ns\n", w);
-  fbclock_debug_print("w = %f ms\n", w / 1000000.0);
-  return w;
+int fbclock_set_coarse_max_age(fbclock_lib* lib, uint64_t max_age_ns) {
+  lib->coarse_max_age_ns = max_age_ns;
+  return FBCLOCK_E_NO_ERROR;
 }
 
-int fbclock_calculate_time(
-    double error_bound_ns,
-    double h_value_ns,
-    fbclock_clockdata* state,
-    int64_t phctime_ns,
-    fbclock_truetime* truetime,
-    int time_standard) {
-  // check how far back since last SYNC message from GM (in seconds)
-  double seconds =
-      (double)(phctime_ns - state->ingress_time_ns) / NANOSECONDS_IN_SECONDS;
-
-  if (seconds < 0) {
-    return FBCLOCK_E_PHC_IN_THE_PAST;
+int fbclock_get_generation(fbclock_lib* lib, uint32_t* generation) {
+  if (lib->shmp_v2 == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
   }
+  *generation = __atomic_load_n(&lib->shmp_v2->generation, __ATOMIC_ACQUIRE);
+  return FBCLOCK_E_NO_ERROR;
+}
 
-  // UTC offset applied if time standard used is UTC (and not TAI)
-  if (time_standard == FBCLOCK_UTC) {
-    phctime_ns = fbclock_apply_utc_offset(state, phctime_ns);
+int fbclock_wait_update(
+    fbclock_lib* lib,
+    uint32_t generation,
+    int64_t timeout_ns) {
+  if (lib->shmp_v2 == NULL) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
+  }
+  uint32_t* word = &lib->shmp_v2->generation;
+  uint32_t* waiters = lib->shm_waiters;
+  struct timespec ts;
+  int64_t deadline = 0;
+  if (timeout_ns >= 0) {
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    deadline = ts.tv_sec * FBCLOCK_NSEC_PER_SEC + ts.tv_nsec + timeout_ns;
+  }
+  // before checking generation, see fbclock_shmdata_v2_store
+  if (waiters != NULL) {
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+  }
+  int rcode = FBCLOCK_E_NO_ERROR;
+  while (__atomic_load_n(word, __ATOMIC_SEQ_CST) == generation) {
+    int64_t left = INT64_MAX;
+    if (timeout_ns >= 0) {
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      left = deadline - (ts.tv_sec * FBCLOCK_NSEC_PER_SEC + ts.tv_nsec);
+      if (left <= 0) {
+        rcode = FBCLOCK_E_TIMEOUT;
+        break;
+      }
+    }
+    // unregistered waiters aren't woken, they re-check on their own
+    if (waiters == NULL && left > FBCLOCK_WAIT_POLL_NS) {
+      left = FBCLOCK_WAIT_POLL_NS;
+    }
+    struct timespec* rel = NULL;
+    if (left != INT64_MAX) {
+      ts.tv_sec = left / FBCLOCK_NSEC_PER_SEC;
+      ts.tv_nsec = left % FBCLOCK_NSEC_PER_SEC;
+      rel = &ts;
+    }
+    // returns right away if generation already changed,
+    // timeouts and signals are handled by the loop
+    if (syscall(SYS_futex, word, FUTEX_WAIT, generation, rel, NULL, 0) == -1 &&
+        errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+      rcode = FBCLOCK_E_INVALID_ARGUMENT;
+      break;
+    }
+  }
+  if (waiters != NULL) {
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
   }
+  return rcode;
+}
 
-  // calculate the Window of Uncertainty (WOU) (in nanoseconds)
-  double wou_ns =
-      fbclock_window_of_uncertainty(seconds, error_bound_ns, h_value_ns);
-  truetime->earliest_ns = phctime_ns - (uint64_t)wou_ns;
-  truetime->latest_ns = phctime_ns + (uint64_t)wou_ns;
-  return FBCLOCK_E_NO_ERROR;
+static inline int64_t fbclock_monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * FBCLOCK_NSEC_PER_SEC + ts.tv_nsec;
 }
 
-int fbclock_gettime_tz(
+int fbclock_wait_until(
     fbclock_lib* lib,
-    fbclock_truetime* truetime,
-    int timezone) {
-  struct phc_time_res res;
-  fbclock_clockdata state = {};
-  int rcode = fbclock_clockdata_load_data(lib->shmp, &state);
-  if (rcode != FBCLOCK_E_NO_ERROR) {
-    return rcode;
+    uint64_t ts_ns,
+    int timezone,
+    int64_t timeout_ns,
+    fbclock_truetime* truetime) {
+  int64_t deadline = 0;
+  if (timeout_ns >= 0) {
+    int64_t start = fbclock_monotonic_ns();
+    deadline = timeout_ns < INT64_MAX - start ? start + timeout_ns : INT64_MAX;
   }
+  for (;;) {
+    struct phc_time_res res;
+    fbclock_clockdata state = {};
+    fbclock_truetime tt;
+    int rcode = fbclock_read_state_phc(lib, &state, &res);
+    if (rcode == FBCLOCK_E_NO_ERROR) {
+      rcode = fbclock_request_time(
+          lib,
+          (uint64_t)state.error_bound_ns + (uint64_t)res.delay,
+          &state,
+          res.ts,
+          &tt,
+          timezone);
+    }
+    if (rcode != FBCLOCK_E_NO_ERROR) {
+      return rcode;
+    }
+    if (tt.earliest_ns > ts_ns) {
+      if (truetime != NULL) {
+        *truetime = tt;
+      }
+      return FBCLOCK_E_NO_ERROR;
+    }
 
-  // cannot determine Truetime without these values
-  if (state.error_bound_ns == 0 || state.ingress_time_ns == 0) {
-    return FBCLOCK_E_NO_DATA;
+    // earliest grows slower than real time by holdover multiplier (16.16
+    // ns per second), until the next update shrinks the WOU
+    double rate = 1.0 -
+        (double)state.holdover_multiplier_ns / FBCLOCK_POW2_16 /
+            FBCLOCK_NSEC_PER_SEC;
+    double wait_ns = ((double)(ts_ns - tt.earliest_ns) + 1) / rate;
+    int64_t now = fbclock_monotonic_ns();
+    // far future ts_ns saturates the wake time instead of wrapping it into
+    // the past, half of the range still leaves room for hundreds of years
+    int64_t wake = INT64_MAX;
+    if (wait_ns < (double)(INT64_MAX / 2) && now < INT64_MAX / 2) {
+      wake = now + (int64_t)wait_ns;
+    }
+    if (timeout_ns >= 0) {
+      if (now >= deadline) {
+        return FBCLOCK_E_TIMEOUT;
+      }
+      if (wake > deadline) {
+        wake = deadline;
+      }
+    }
+    // early wakeups by signals or a slightly wrong rate just cost a request
+    struct timespec ts = {
+        .tv_sec = wake / FBCLOCK_NSEC_PER_SEC,
+        .tv_nsec = wake % FBCLOCK_NSEC_PER_SEC};
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
   }
+}
 
-  // if the value is stored as UINT32_MAX then it's too big
-  if (state.error_bound_ns == UINT32_MAX ||
-      state.holdover_multiplier_ns == UINT32_MAX) {
-    return FBCLOCK_E_WOU_TOO_BIG;
+int fbclock_set_samples(fbclock_lib* lib, unsigned n_samples, int adaptive) {
+  if (n_samples == 0 || n_samples > PTP_MAX_SAMPLES) {
+    return FBCLOCK_E_INVALID_ARGUMENT;
   }
+  lib->n_samples = n_samples;
+  lib->adaptive_samples = adaptive;
+  lib->cur_samples = n_samples;
+  lib->stable_reads = 0;
+  lib->delay_avg_ns = 0;
+  lib->delay_dev_ns = 0;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+// per-thread copy of fbclock_lib with its own PTP device fd
+typedef struct fbclock_thread_handle {
+  fbclock_lib* parent;
+  uint64_t parent_id; // id of parent when the handle was made
+  struct fbclock_thread_handle* next;
+  fbclock_lib lib;
+} fbclock_thread_handle;
+
+static pthread_key_t fbclock_thread_key;
+static pthread_once_t fbclock_thread_once = PTHREAD_ONCE_INIT;
+// fast path lookup, one handle per parent lib, most recently created first.
+// The key holds the same list and is only used to clean up on thread exit
+static __thread fbclock_thread_handle* fbclock_thread_handle_p = NULL;
 
-  if (lib->gettime(lib->dev_fd, &res)) {
-    return FBCLOCK_E_PTP_READ_OFFSET;
+static void fbclock_thread_handle_free(fbclock_thread_handle* h) {
+  if (h->lib.dev_fd != -1) {
+    close(h->lib.dev_fd);
   }
+  if (h->lib.phc_ring_owned) {
+    fbclock_phc_ring_close(&h->lib.phc_ring);
+  }
+  free(h);
+}
 
-  double error_bound = (double)state.error_bound_ns + (double)res.delay;
-  double h_value = (double)state.holdover_multiplier_ns / FBCLOCK_POW2_16;
+static void fbclock_thread_handles_free(void* p) {
+  fbclock_thread_handle* h = (fbclock_thread_handle*)p;
+  // destructors of other keys may still call fbclock_thread_handle_get
+  fbclock_thread_handle_p = NULL;
+  while (h != NULL) {
+    fbclock_thread_handle* next = h->next;
+    fbclock_thread_handle_free(h);
+    h = next;
+  }
+}
 
-  return fbclock_calculate_time(
-      error_bound, h_value, &state, res.ts, truetime, timezone);
+static void fbclock_thread_key_create(void) {
+  pthread_key_create(&fbclock_thread_key, fbclock_thread_handles_free);
 }
 
-int fbclock_gettime(fbclock_lib* lib, fbclock_truetime* truetime) {
-  return fbclock_gettime_tz(lib, truetime, FBCLOCK_TAI);
+int fbclock_thread_handle_get(fbclock_lib* lib, fbclock_lib** handle) {
+  fbclock_thread_handle** hp = &fbclock_thread_handle_p;
+  for (; *hp != NULL; hp = &(*hp)->next) {
+    fbclock_thread_handle* h = *hp;
+    if (h->parent != lib) {
+      continue;
+    }
+    if (h->parent_id == lib->id) {
+      *handle = &h->lib;
+      return FBCLOCK_E_NO_ERROR;
+    }
+    // lib was re-initialized (or got a new ring), the handle is stale
+    *hp = h->next;
+    pthread_setspecific(fbclock_thread_key, fbclock_thread_handle_p);
+    fbclock_thread_handle_free(h);
+    break;
+  }
+
+  pthread_once(&fbclock_thread_once, fbclock_thread_key_create);
+  fbclock_thread_handle* h =
+      (fbclock_thread_handle*)malloc(sizeof(fbclock_thread_handle));
+  if (h == NULL) {
+    return FBCLOCK_E_NO_MEMORY;
+  }
+  // device of lazy (or shm-only) lib may not be opened yet,
+  // the handle then opens its own on the first read as well
+  int ffd = -1;
+  if (lib->backend.read == NULL &&
+      (lib->gettime != NULL ||
+       __atomic_load_n(&lib->gettime_batch, __ATOMIC_ACQUIRE) != NULL)) {
+    ffd = open(lib->ptp_path, O_RDONLY);
+    if (ffd == -1) {
+      // counted on the parent, callers of the handle are its callers
+      fbclock_report_read_error(lib, FBCLOCK_READ_E_OPEN);
+      free(h);
+      return FBCLOCK_E_PTP_OPEN;
+    }
+  }
+  h->parent = lib;
+  h->parent_id = lib->id;
+  h->lib = *lib;
+  h->lib.dev_fd = ffd;
+  // path is owned by parent
+  h->lib.ptp_path_owned = 0;
+  // don't share adaptive sampling state with other threads
+  h->lib.cur_samples = h->lib.n_samples;
+  h->lib.stable_reads = 0;
+  h->lib.delay_avg_ns = 0;
+  h->lib.delay_dev_ns = 0;
+  memset(h->lib.errors, 0, sizeof(h->lib.errors));
+  h->lib.error_cb_last_ns = 0;
+  memset(&h->lib.coarse, 0, sizeof(h->lib.coarse));
+  // ring of the node this thread runs on, parent's one if there is none
+  h->lib.phc_ring_owned = 0;
+  h->lib.phc_ring_private = lib->phc_ring_base != NULL;
+  if (lib->phc_ring_base != NULL) {
+    fbclock_phc_ring ring;
+    if (fbclock_phc_ring_open_local(&ring, lib->phc_ring_base) ==
+        FBCLOCK_E_NO_ERROR) {
+      h->lib.phc_ring = ring;
+      h->lib.phc_ring_owned = 1;
+    }
+  }
+  h->next = fbclock_thread_handle_p;
+  fbclock_thread_handle_p = h;
+  pthread_setspecific(fbclock_thread_key, h);
+  *handle = &h->lib;
+  return FBCLOCK_E_NO_ERROR;
 }
 
-int fbclock_gettime_utc(fbclock_lib* lib, fbclock_truetime* truetime) {
-  return fbclock_gettime_tz(lib, truetime, FBCLOCK_UTC);
+void fbclock_thread_handle_release(void) {
+  fbclock_thread_handle* h = fbclock_thread_handle_p;
+  if (h == NULL) {
+    return;
+  }
+  pthread_setspecific(fbclock_thread_key, NULL);
+  fbclock_thread_handles_free(h);
+}
+
+void fbclock_thread_handle_release_lib(fbclock_lib* lib) {
+  fbclock_thread_handle** hp = &fbclock_thread_handle_p;
+  for (; *hp != NULL; hp = &(*hp)->next) {
+    fbclock_thread_handle* h = *hp;
+    if (h->parent == lib) {
+      *hp = h->next;
+      pthread_setspecific(fbclock_thread_key, fbclock_thread_handle_p);
+      fbclock_thread_handle_free(h);
+      return;
+    }
+  }
 }
 
 uint64_t fbclock_apply_smear(
@@ -285,51 +2337,42 @@ uint64_t fbclock_apply_smear(
     uint64_t smear_start_ns,
     uint64_t smear_end_ns,
     int multiplier) {
-  if (time > smear_end_ns) {
-    time -= offset_post_ns;
-  } else if (time < smear_start_ns) {
-    time -= offset_pre_ns;
-  } else if (smear_start_ns <= time && time <= smear_end_ns) {
-    uint64_t smear = multiplier * ((time - smear_start_ns) / SMEAR_STEP_NS);
-    time -= (offset_pre_ns + smear);
-  }
-  return time;
+  return fbclock_inline_apply_smear(
+      time,
+      offset_pre_ns,
+      offset_post_ns,
+      smear_start_ns,
+      smear_end_ns,
+      multiplier);
 }
 
 uint64_t fbclock_apply_utc_offset(
     fbclock_clockdata* state,
     int64_t phctime_ns) {
-  // Fixed offset is applied if tzdata information not in shared memory
-  if (state->utc_offset_pre_s == 0 && state->utc_offset_post_s == 0) {
-    phctime_ns += UTC_TAI_OFFSET_NS;
-    return (uint64_t)phctime_ns;
-  }
-
   fbclock_debug_print(
       "UTC-TAI Offset Before Leap Second Event: %d\n", state->utc_offset_pre_s);
   fbclock_debug_print(
       "UTC-TAI Offset After Leap Second Event: %d\n", state->utc_offset_post_s);
-  fbclock_debug_print(
-      "Clock Smearing Start Time (TAI): %lu\n", state->clock_smearing_start_s);
-  fbclock_debug_print(
-      "Clock Smearing End Time (TAI): %lu\n", state->clock_smearing_end_s);
-
-  // Multipler may be negative (if a negative leap second is applied)
-  int multiplier = state->utc_offset_post_s - state->utc_offset_pre_s;
+  return fbclock_inline_apply_utc_offset(state, phctime_ns);
+}
 
-  // Switch to nanoseconds
-  uint64_t smear_end_ns = state->clock_smearing_end_s * 1e9;
-  uint64_t smear_start_ns = state->clock_smearing_start_s * 1e9;
-  uint64_t offset_post_ns = state->utc_offset_post_s * 1e9;
-  uint64_t offset_pre_ns = state->utc_offset_pre_s * 1e9;
+void fbclock_utc_offset_batch(
+    const fbclock_clockdata* state,
+    const int64_t* tai_ns,
+    uint64_t* utc_ns,
+    size_t n) {
+  fbclock_inline_utc_offset_batch(state, tai_ns, utc_ns, n);
+}
 
-  return fbclock_apply_smear(
-      phctime_ns,
-      offset_pre_ns,
-      offset_post_ns,
-      smear_start_ns,
-      smear_end_ns,
-      multiplier);
+int fbclock_truetime_batch(
+    const fbclock_clockdata* state,
+    const int64_t* phc_ns,
+    const int64_t* delay_ns,
+    size_t n,
+    fbclock_truetime* truetimes,
+    int time_standard) {
+  return fbclock_inline_truetime_batch(
+      state, phc_ns, delay_ns, n, truetimes, time_standard);
 }
 
 const char* fbclock_strerror(int err_code) {
@@ -342,7 +2385,7 @@ const char* fbclock_strerror(int err_code) {
       err_info = "shmem open error";
       break;
     case FBCLOCK_E_PTP_READ_OFFSET:
-      err_info = "PTP PTP_SYS_OFFSET_EXTENDED ioctl error";
+      err_info = "PTP PTP_SYS_OFFSET* ioctl error";
       break;
     case FBCLOCK_E_PTP_OPEN:
       err_info = "PTP device open error";
@@ -359,6 +2402,18 @@ const char* fbclock_strerror(int err_code) {
     case FBCLOCK_E_CRC_MISMATCH:
       err_info = "CRC check failed all tries";
       break;
+    case FBCLOCK_E_INVALID_ARGUMENT:
+      err_info = "invalid argument";
+      break;
+    case FBCLOCK_E_SEQ_MISMATCH:
+      err_info = "data kept changing during all read tries";
+      break;
+    case FBCLOCK_E_TIMEOUT:
+      err_info = "timed out";
+      break;
+    case FBCLOCK_E_NO_MEMORY:
+      err_info = "out of memory";
+      break;
     case FBCLOCK_E_NO_ERROR:
       err_info = "no error";
       break;
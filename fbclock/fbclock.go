@@ -17,7 +17,7 @@ limitations under the License.
 package fbclock
 
 /*
-#cgo LDFLAGS: -lrt
+#cgo LDFLAGS: -lrt -lpthread
 #cgo amd64 CFLAGS: -msse4.2
 
 #include "fbclock.h" // @oss-only
@@ -66,6 +66,36 @@ func NewFBClock() (*FBClock, error) {
 	return NewFBClockCustom(C.FBCLOCK_PATH)
 }
 
+// NewFBClockV2Custom returns new FBClock wrapper reading v2 (seqlock) shm with custom path
+func NewFBClockV2Custom(path string) (*FBClock, error) {
+	cFBClock := &C.fbclock_lib{}
+	cPath := C.CString(path)
+	defer C.free(unsafe.Pointer(cPath))
+	errCode := C.fbclock_init_v2(cFBClock, cPath)
+	if errCode != 0 {
+		return nil, fmt.Errorf("initializing FBClock: %s", strerror(errCode))
+	}
+	return &FBClock{cFBClock: cFBClock}, nil
+}
+
+// NewFBClockV2 returns new FBClock wrapper reading v2 (seqlock) shm
+func NewFBClockV2() (*FBClock, error) {
+	return NewFBClockV2Custom(C.FBCLOCK_PATH_V2)
+}
+
+// NewFBClockIface returns new FBClock wrapper reading v2 shm and PHC device
+// published for the given interface by a daemon running with PerIface
+func NewFBClockIface(iface string) (*FBClock, error) {
+	cFBClock := &C.fbclock_lib{}
+	cIface := C.CString(iface)
+	defer C.free(unsafe.Pointer(cIface))
+	errCode := C.fbclock_init_iface(cFBClock, cIface)
+	if errCode != 0 {
+		return nil, fmt.Errorf("initializing FBClock for %q: %s", iface, strerror(errCode))
+	}
+	return &FBClock{cFBClock: cFBClock}, nil
+}
+
 // Close destroys fbclock wrapper
 func (f *FBClock) Close() error {
 	errCode := C.fbclock_destroy(f.cFBClock)
@@ -102,3 +132,86 @@ func (f *FBClock) GetTimeUTC() (*TrueTime, error) {
 
 	return &TrueTime{Earliest: earliest, Latest: latest}, nil
 }
+
+// GetTimeBoth returns TrueTime in TAI and UTC, both from the same PHC read
+func (f *FBClock) GetTimeBoth() (tai *TrueTime, utc *TrueTime, err error) {
+	ttTAI := &C.fbclock_truetime{}
+	ttUTC := &C.fbclock_truetime{}
+	errCode := C.fbclock_gettime_both(f.cFBClock, ttTAI, ttUTC)
+	if errCode != 0 {
+		return nil, nil, fmt.Errorf("reading FBClock TrueTime TAI and UTC: %s", strerror(errCode))
+	}
+
+	tai = &TrueTime{Earliest: time.Unix(0, int64(ttTAI.earliest_ns)), Latest: time.Unix(0, int64(ttTAI.latest_ns))}
+	utc = &TrueTime{Earliest: time.Unix(0, int64(ttUTC.earliest_ns)), Latest: time.Unix(0, int64(ttUTC.latest_ns))}
+	return tai, utc, nil
+}
+
+// GetTimeCoarse returns TrueTime in TAI extrapolated from a recent exact request,
+// it's much cheaper than GetTime but has WOU wider by the kernel tick
+func (f *FBClock) GetTimeCoarse() (*TrueTime, error) {
+	tt := &C.fbclock_truetime{}
+	errCode := C.fbclock_gettime_coarse(f.cFBClock, tt, C.FBCLOCK_TAI)
+	if errCode != 0 {
+		return nil, fmt.Errorf("reading FBClock coarse TrueTime: %s", strerror(errCode))
+	}
+
+	earliest := time.Unix(0, int64(tt.earliest_ns))
+	latest := time.Unix(0, int64(tt.latest_ns))
+
+	return &TrueTime{Earliest: earliest, Latest: latest}, nil
+}
+
+// WaitUntil blocks the calling OS thread until TAI TrueTime Earliest is after ts (commit wait),
+// sleeping for most of the predicted time instead of polling. Negative timeout waits forever.
+// Returns TrueTime that proved ts is in the past.
+func (f *FBClock) WaitUntil(ts time.Time, timeout time.Duration) (*TrueTime, error) {
+	tt := &C.fbclock_truetime{}
+	errCode := C.fbclock_wait_until(f.cFBClock, C.uint64_t(ts.UnixNano()), C.FBCLOCK_TAI, C.int64_t(timeout), tt)
+	if errCode != 0 {
+		return nil, fmt.Errorf("waiting for FBClock TrueTime: %s", strerror(errCode))
+	}
+	return &TrueTime{Earliest: time.Unix(0, int64(tt.earliest_ns)), Latest: time.Unix(0, int64(tt.latest_ns))}, nil
+}
+
+// Generation returns generation of data published by the daemon, it changes on every update.
+// Requires v2 shm.
+func (f *FBClock) Generation() (uint32, error) {
+	var gen C.uint32_t
+	errCode := C.fbclock_get_generation(f.cFBClock, &gen)
+	if errCode != 0 {
+		return 0, fmt.Errorf("reading FBClock generation: %s", strerror(errCode))
+	}
+	return uint32(gen), nil
+}
+
+// WaitUpdate blocks the calling OS thread until generation differs from gen or timeout passes,
+// negative timeout waits forever. Requires v2 shm.
+func (f *FBClock) WaitUpdate(gen uint32, timeout time.Duration) error {
+	errCode := C.fbclock_wait_update(f.cFBClock, C.uint32_t(gen), C.int64_t(timeout))
+	if errCode != 0 {
+		return fmt.Errorf("waiting for FBClock update: %s", strerror(errCode))
+	}
+	return nil
+}
+
+// GetTimeBatch returns n TrueTime values obtained from a single shm read and as few PHC reads as possible
+func (f *FBClock) GetTimeBatch(n int) ([]TrueTime, error) {
+	if n <= 0 {
+		return nil, fmt.Errorf("reading FBClock TrueTime batch: n must be >0")
+	}
+	tts := make([]C.fbclock_truetime, n)
+	errCode := C.fbclock_gettime_batch(f.cFBClock, &tts[0], C.uint(n), C.FBCLOCK_TAI)
+	if errCode != 0 {
+		return nil, fmt.Errorf("reading FBClock TrueTime batch: %s", strerror(errCode))
+	}
+
+	result := make([]TrueTime, n)
+	for i, tt := range tts {
+		result[i] = TrueTime{
+			Earliest: time.Unix(0, int64(tt.earliest_ns)),
+			Latest:   time.Unix(0, int64(tt.latest_ns)),
+		}
+	}
+	return result, nil
+}
@@ -24,6 +24,7 @@ typedef std::atomic_uint_fast64_t atomic_uint64;
 typedef atomic_uint_fast64_t atomic_uint64;
 #endif
 
+#include <stddef.h> /* for size_t */
 #include <stdint.h> /* for proper fixed width types */
 
 // error codes
@@ -36,6 +37,10 @@ typedef atomic_uint_fast64_t atomic_uint64;
 #define FBCLOCK_E_WOU_TOO_BIG -6
 #define FBCLOCK_E_PHC_IN_THE_PAST -7
 #define FBCLOCK_E_CRC_MISMATCH -8
+#define FBCLOCK_E_INVALID_ARGUMENT -9
+#define FBCLOCK_E_SEQ_MISMATCH -10
+#define FBCLOCK_E_TIMEOUT -11
+#define FBCLOCK_E_NO_MEMORY -12
 
 // Fixed UTC-TAI offset - used when data not present in shared memory
 #define UTC_TAI_OFFSET_NS (int64_t)(-37e9)
@@ -46,7 +51,17 @@ typedef atomic_uint_fast64_t atomic_uint64;
 extern "C" {
 #endif
 
-struct phc_time_res;
+// PHC sample
+struct phc_time_res {
+  int64_t ts; // last ts got from PHC
+  int64_t delay; // mean delay of several requests
+};
+
+// return codes of PHC read backends, errno is preserved on ioctl error
+#define FBCLOCK_READ_E_IOCTL -1
+#define FBCLOCK_READ_E_NEGATIVE_DELAY -2
+// device is not opened and can't be, errno is preserved
+#define FBCLOCK_READ_E_OPEN -3
 
 typedef struct fbclock_clockdata {
   // PHC time when ptp client last time received sync message
@@ -64,7 +79,31 @@ typedef struct fbclock_clockdata {
   int32_t utc_offset_pre_s;
   // UTC offset after latest published leap second (tzdata)
   int32_t utc_offset_post_s;
-
+  // fields below are appended after v1 readers were deployed, whose CRC
+  // doesn't cover them, so they are zero in v1 shmem
+  // PHC time of the latest PHC to CLOCK_MONOTONIC_RAW mapping
+  int64_t phc_time_ns;
+  // CLOCK_MONOTONIC_RAW time of the latest PHC to CLOCK_MONOTONIC_RAW mapping
+  int64_t sysclock_time_ns;
+  // PHC frequency relative to CLOCK_MONOTONIC_RAW in PPB
+  int64_t coef_ppb;
+  // error of the PHC to CLOCK_MONOTONIC_RAW mapping at sysclock_time_ns
+  uint32_t sysclock_error_ns;
+  // how fast the mapping error grows with extrapolation, in PPB
+  uint32_t sysclock_error_ppb;
+  // UTC conversion values precomputed by the daemon from the *_s fields above,
+  // all zero if there is no tzdata information or daemon is too old
+  uint64_t clock_smearing_start_ns;
+  uint64_t clock_smearing_end_ns;
+  int64_t utc_offset_pre_ns;
+  int64_t utc_offset_post_ns;
+  // x / SMEAR_STEP_NS == (x * smear_step_mult) >> smear_step_shift
+  // for any x within the smearing window
+  uint64_t smear_step_mult;
+  uint32_t smear_step_shift;
+  // FBCLOCK_PTP_CAP_* of the PHC device, probed by the daemon,
+  // so readers don't have to probe it on init
+  uint32_t ptp_caps;
 } fbclock_clockdata;
 
 // fbclock shared memory object
@@ -73,32 +112,378 @@ typedef struct fbclock_shmdata {
   fbclock_clockdata data;
 } fbclock_shmdata;
 
+// fbclock shared memory object, v2.
+// Protected by seqlock: seq is odd while writer updates the data.
+// seq is accessed with __atomic builtins so the layout is the same in C and C++.
+typedef struct fbclock_shmdata_v2 {
+  uint64_t seq;
+  fbclock_clockdata data;
+  // incremented by the writer after every store and used as a futex word,
+  // so readers can block in fbclock_wait_update instead of polling seq.
+  // Stays 0 if the daemon doesn't support it.
+  uint32_t generation;
+  // fbclock_wait_update callers blocked on generation, the writer only makes
+  // the FUTEX_WAKE syscall if it's non-zero. Registered through a writable
+  // mapping, readers without write access to shmem wait in bounded slices.
+  uint32_t waiters;
+} __attribute__((aligned(64))) fbclock_shmdata_v2;
+
+// first bytes of v3 and later shared memory objects, written once by the daemon
+typedef struct fbclock_shm_header {
+  uint32_t magic; // FBCLOCK_SHM_MAGIC
+  uint32_t version; // layout version
+  uint32_t size; // size of the whole object, including reserved space
+  uint32_t clockdata_size; // sizeof(fbclock_clockdata) the writer knows about
+} fbclock_shm_header;
+
+#define FBCLOCK_SHM_MAGIC 0x6662636bU // "fbck"
+
+// fbclock shared memory object, v3. One page, so it never shares a TLB entry
+// or a cache line with anything else. Header is read once on init, v2 block
+// (seq and data, read on every request) is in its own 128-byte aligned line
+// pair, as adjacent-line prefetchers pull in pairs, and v2 generation futex
+// word is in the next pair. The rest is reserved for new blocks.
+typedef struct fbclock_shmdata_v3 {
+  fbclock_shm_header header;
+  fbclock_shmdata_v2 v2 __attribute__((aligned(128)));
+} __attribute__((aligned(4096))) fbclock_shmdata_v3;
+
+// journal of clockdata published by the daemon, a ring of fixed-size records
+// appended in ingress_time_ns order, so readers can find the data that was
+// in effect at a past PHC time. Single writer, count is the number of records
+// ever appended and record i lives in records[i % capacity].
+// Mapped files are never resized: a journal of another capacity is written
+// to a new file renamed over the old one, which gets magic cleared, so
+// readers still mapping it get FBCLOCK_E_NO_DATA and know to re-open.
+typedef struct fbclock_journal_header {
+  uint32_t magic; // FBCLOCK_JOURNAL_MAGIC
+  uint32_t version; // FBCLOCK_JOURNAL_VERSION
+  uint32_t capacity; // number of records
+  uint32_t record_size; // sizeof(fbclock_journal_record)
+  uint64_t count; // published with release after the record is written
+} __attribute__((aligned(128))) fbclock_journal_header;
+
+typedef struct fbclock_journal_record {
+  fbclock_clockdata data;
+} __attribute__((aligned(64))) fbclock_journal_record;
+
+#define FBCLOCK_JOURNAL_MAGIC 0x6662636aU // "fbcj"
+#define FBCLOCK_JOURNAL_VERSION 1
+#define FBCLOCK_JOURNAL_SIZE(capacity)  \
+  (sizeof(fbclock_journal_header) + \
+   (size_t)(capacity) * sizeof(fbclock_journal_record))
+
+// PHC samples published by a reader service, so clients extrapolate from the
+// freshest one instead of issuing their own ioctls and PHC load doesn't grow
+// with the number of clients. There is a ring per NUMA node
+// (FBCLOCK_PATH_PHC_RING.node<N>), written by the same thread, so readers
+// poll memory local to their node. Single writer, count is the number of
+// samples ever published and sample i lives in samples[i % capacity].
+// A ring of another capacity replaces the file like the journal does.
+typedef struct fbclock_phc_ring_header {
+  uint32_t magic; // FBCLOCK_PHC_RING_MAGIC
+  uint32_t version; // FBCLOCK_PHC_RING_VERSION
+  uint32_t capacity; // number of samples
+  uint32_t sample_size; // sizeof(fbclock_phc_sample)
+  uint64_t interval_ns; // how often the service samples PHC
+  uint64_t count; // published with release after the sample is written
+} __attribute__((aligned(128))) fbclock_phc_ring_header;
+
+// PHC read sandwiched between two CLOCK_MONOTONIC_RAW reads
+typedef struct fbclock_phc_sample {
+  int64_t sysclock_time_ns; // CLOCK_MONOTONIC_RAW in the middle of the read
+  int64_t phc_time_ns;
+  int64_t delay_ns; // between CLOCK_MONOTONIC_RAW reads
+} __attribute__((aligned(32))) fbclock_phc_sample;
+
+#define FBCLOCK_PHC_RING_MAGIC 0x66626372U // "fbcr"
+#define FBCLOCK_PHC_RING_VERSION 1
+#define FBCLOCK_PHC_RING_DEFAULT_CAPACITY 16
+// samples older than this many intervals mean the service is gone,
+// readers go back to reading PHC themselves
+#define FBCLOCK_PHC_RING_STALE_INTERVALS 16
+#define FBCLOCK_PHC_RING_SIZE(capacity) \
+  (sizeof(fbclock_phc_ring_header) +   \
+   (size_t)(capacity) * sizeof(fbclock_phc_sample))
+
 #define FBCLOCK_SHMDATA_SIZE sizeof(fbclock_shmdata)
+#define FBCLOCK_SHMDATA_V2_SIZE sizeof(fbclock_shmdata_v2)
+#define FBCLOCK_SHMDATA_V3_SIZE sizeof(fbclock_shmdata_v3)
 #define FBCLOCK_PATH "/run/fbclock_data_v1"
+#define FBCLOCK_PATH_V2 "/run/fbclock_data_v2"
+#define FBCLOCK_PATH_V3 "/run/fbclock_data_v3"
+#define FBCLOCK_PATH_JOURNAL "/run/fbclock_journal"
+#define FBCLOCK_PATH_PHC_RING "/run/fbclock_phc_ring"
 #define FBCLOCK_POW2_16 ((double)(1ULL << 16))
 #define FBCLOCK_PTPPATH "/dev/fbclock/ptp"
 
+// PHC capabilities published by the daemon
+#define FBCLOCK_PTP_CAP_PROBED (1 << 0) // set if the other bits are valid
+#define FBCLOCK_PTP_CAP_EXTENDED (1 << 1) // PTP_SYS_OFFSET_EXTENDED works
+#define FBCLOCK_PTP_CAP_PRECISE (1 << 2) // PTP_SYS_OFFSET_PRECISE works
+
+// fbclock_init_options flags
+// open PTP device on the first PHC read instead of during init
+#define FBCLOCK_INIT_LAZY_OPEN (1 << 0)
+// never open PTP device, TrueTime is extrapolated from the PHC to sysclock
+// mapping published by the daemon (FBCLOCK_READ_SYSCLOCK), so requests fail
+// with FBCLOCK_E_PTP_OPEN if there is none. Enough for fbclock_gettime_coarse.
+#define FBCLOCK_INIT_SHM_ONLY (1 << 1)
+// probe PTP device instead of using capabilities published by the daemon,
+// implied by custom ptp_path as it may not be the device of the daemon
+#define FBCLOCK_INIT_PROBE (1 << 2)
+// enable monotonic mode right away, see fbclock_set_monotonic
+#define FBCLOCK_INIT_MONOTONIC (1 << 3)
+
 // supported time standards
 #define FBCLOCK_TAI 0
 #define FBCLOCK_UTC 1
 
+// supported PHC read modes
+// read PHC with PTP_SYS_OFFSET* ioctl on every request
+#define FBCLOCK_READ_PHC 0
+// extrapolate PHC from CLOCK_MONOTONIC_RAW mapping published by the daemon,
+// falls back to FBCLOCK_READ_PHC if there is no mapping (always on v1 shmem)
+#define FBCLOCK_READ_SYSCLOCK 1
+// extrapolate PHC from the freshest sample of the reader service
+// (fbclock_set_phc_ring), falls back to FBCLOCK_READ_PHC if it's stale
+#define FBCLOCK_READ_SERVICE 2
+
+// number of PHC samples per read, the one with the smallest delay is used
+#define FBCLOCK_DEFAULT_SAMPLES 5
+// adaptive mode drops one sample after this many reads with stable min delay
+#define FBCLOCK_ADAPTIVE_STABLE_READS 16
+
+// fbclock_wait_update without a writable waiters word re-checks generation
+// this often, as the writer doesn't know to wake it
+#define FBCLOCK_WAIT_POLL_NS 1000000
+
+// coarse TrueTime snapshot is refreshed with an exact read after this age
+#define FBCLOCK_COARSE_MAX_AGE_NS 10000000
+// bound of CLOCK_MONOTONIC_COARSE frequency error vs PHC, 500ppm of max kernel
+// frequency adjustment plus 500ppm of oscillator error
+#define FBCLOCK_COARSE_DRIFT_PPB 1000000
+
 // response to fbclock_gettime request
 typedef struct fbclock_truetime {
   uint64_t earliest_ns;
   uint64_t latest_ns;
 } fbclock_truetime;
 
+// kinds of errors counted in fbclock_lib and reported to error callback
+#define FBCLOCK_ERR_PTP_READ 0 // PTP_SYS_OFFSET* ioctl failed
+#define FBCLOCK_ERR_NEGATIVE_DELAY 1 // PHC sample with negative delay
+#define FBCLOCK_ERR_SHMEM_READ 2 // no consistent data in shared memory
+#define FBCLOCK_ERR_KINDS 3
+
+// error callback, called at most once per interval from the thread that hit
+// the error, err_no is errno if available, count is total errors of this kind.
+// It runs on the hot path, so it must not block.
+typedef void (*fbclock_error_callback)(
+    void* ctx,
+    int error_kind,
+    int err_no,
+    uint64_t count);
+
+// number of log2 buckets in PHC read delay histogram
+#define FBCLOCK_STATS_DELAY_BUCKETS 24
+
+// client side stats, aggregated over all threads of the process
+typedef struct fbclock_stats {
+  uint64_t requests; // TrueTime requests
+  uint64_t load_retries; // extra shmem reads caused by concurrent writer
+  uint64_t no_data; // FBCLOCK_E_NO_DATA
+  uint64_t wou_too_big; // FBCLOCK_E_WOU_TOO_BIG
+  uint64_t phc_in_the_past; // FBCLOCK_E_PHC_IN_THE_PAST
+  uint64_t ptp_read_errors; // failed PHC reads
+  // PHC read delay histogram, bucket i counts delays in [2^(i-1), 2^i) ns,
+  // bucket 0 counts zero delays and the last one everything above
+  uint64_t delay_hist[FBCLOCK_STATS_DELAY_BUCKETS];
+} fbclock_stats;
+
+// fbclock shared memory writer, keeps shared memory mapped between stores
+typedef struct fbclock_writer {
+  void* shmp; // mmap-ed fbclock_shmdata or fbclock_shmdata_v2
+  size_t size; // size of the mapping
+  int version; // layout version of shmp
+} fbclock_writer;
+
+// mapping of fbclock_journal_header and records, see fbclock_journal_*
+typedef struct fbclock_journal {
+  fbclock_journal_header* hdr;
+  fbclock_journal_record* records;
+  size_t size; // size of the mapping
+  int fd; // of the mapped file, -1 if not mapped
+} fbclock_journal;
+
+// mapping of fbclock_phc_ring_header and samples, see fbclock_phc_ring_*
+typedef struct fbclock_phc_ring {
+  fbclock_phc_ring_header* hdr;
+  fbclock_phc_sample* samples;
+  size_t size; // size of the mapping
+  uint32_t capacity; // capacity the mapping was made for
+  int fd; // of the mapped file, -1 if not mapped
+} fbclock_phc_ring;
+
+// PHC read backend used instead of the PTP device, see fbclock_set_backend
+typedef struct fbclock_backend {
+  // read n (1 to PTP_MAX_SAMPLES) samples, 0 or FBCLOCK_READ_E_* on failure.
+  // Called concurrently by all threads using the lib and its handles.
+  int (*read)(void* ctx, struct phc_time_res* res, unsigned n);
+  void* ctx;
+} fbclock_backend;
+
+// delay distributions of fbclock_sim
+#define FBCLOCK_SIM_DELAY_FIXED 0 // always delay_ns
+#define FBCLOCK_SIM_DELAY_UNIFORM 1 // delay_ns + [0, delay_spread_ns)
+#define FBCLOCK_SIM_DELAY_EXP 2 // delay_ns + exponential with mean spread
+
+typedef struct fbclock_sim_options {
+  int64_t drift_ppb; // PHC frequency error relative to CLOCK_MONOTONIC_RAW
+  int64_t delay_ns; // min PHC read delay
+  int64_t delay_spread_ns; // scale of delay distribution above delay_ns
+  int delay_dist; // FBCLOCK_SIM_DELAY_*
+  int spin; // non-zero to busy wait for the delay, like the ioctl would
+  uint64_t seed; // same seed gives the same sequence of delays
+  uint64_t update_interval_ns; // daemon cadence, 0 to only publish on demand
+  uint32_t error_bound_ns; // published error bound
+  uint32_t holdover_multiplier_ns; // published, 16.16 fixed point
+  uint32_t sysclock_error_ns; // error of published PHC to sysclock mapping
+} fbclock_sim_options;
+
+// Deterministic PHC and daemon simulator for tests and benchmarks on hosts
+// without PTP hardware. PHC runs off CLOCK_MONOTONIC_RAW with the configured
+// drift, reads take sampled delays. Data is published with the real shmem
+// writer every update_interval_ns by whichever reader notices it's due.
+typedef struct fbclock_sim {
+  fbclock_sim_options opts;
+  fbclock_writer writer;
+  int64_t start_ns; // CLOCK_MONOTONIC_RAW when PHC time was TAI
+  int64_t phc_start_ns; // PHC time at start_ns
+  int64_t next_update_ns; // CLOCK_MONOTONIC_RAW of the next publish
+  uint64_t draws; // delays sampled so far
+  uint64_t updates; // data published so far
+} fbclock_sim;
+
+// result of an exact TrueTime request and CLOCK_MONOTONIC_COARSE time after it,
+// fbclock_gettime_coarse extrapolates from it. seq is the seqlock counter.
+typedef struct fbclock_coarse {
+  uint64_t seq;
+  int64_t monotonic_ns; // CLOCK_MONOTONIC_COARSE right after PHC read
+  int64_t phc_time_ns; // PHC time, 0 if there is no snapshot yet
+  int64_t delay_ns; // delay of PHC read
+  fbclock_clockdata state; // shmem data used for the request
+} fbclock_coarse;
+
 // fbclock library
+//
+// Thread safety: shared memory is mapped read-only and can be read by any
+// number of threads. All threads calling fbclock_gettime* on the same lib share
+// one PTP device fd, so ioctls are serialized by the kernel driver, and the
+// adaptive sampling state is updated without synchronization. Threads
+// doing many requests should use their own handle from
+// fbclock_thread_handle_get instead.
 typedef struct fbclock_lib {
   char* ptp_path; // path to PHC clock device
+  int ptp_path_owned; // non-zero if ptp_path is allocated by fbclock_init*
+  unsigned init_flags; // FBCLOCK_INIT_* flags lib was initialized with
   int shm_fd; // file descriptor of opened shared memory object
   int dev_fd; // file descriptor of opened /dev/ptpN
   fbclock_shmdata* shmp; // mmap-ed data
+  fbclock_shmdata_v2* shmp_v2; // mmap-ed v2 data, used instead of shmp if set
   int (*gettime)(int, struct phc_time_res*); // pointer to gettime function
+  // pointer to function reading N samples in one request
+  int (*gettime_batch)(int, struct phc_time_res*, unsigned);
+  int read_mode; // one of FBCLOCK_READ_* modes
+  unsigned n_samples; // PHC samples per read, up to PTP_MAX_SAMPLES
+  int adaptive_samples; // non-zero to use fewer samples if delay is stable
+  unsigned cur_samples; // samples used by the next read in adaptive mode
+  unsigned stable_reads; // reads in a row with stable min delay
+  int64_t delay_avg_ns; // smoothed min delay, scaled by 8
+  int64_t delay_dev_ns; // smoothed min delay deviation, scaled by 4
+  uint64_t errors[FBCLOCK_ERR_KINDS]; // error counters, updated atomically
+  fbclock_error_callback error_cb; // optional error callback
+  void* error_cb_ctx; // passed to error_cb
+  uint64_t error_cb_interval_ns; // min interval between error_cb calls
+  uint64_t error_cb_last_ns; // CLOCK_MONOTONIC time of the last error_cb call
+  uint64_t coarse_max_age_ns; // 0 for FBCLOCK_COARSE_MAX_AGE_NS
+  fbclock_coarse coarse; // snapshot for fbclock_gettime_coarse
+  fbclock_shmdata_v3* shmp_v3; // mmap-ed v3 data, shmp_v2 points into it
+  int monotonic; // non-zero to clamp TrueTime to the process high-water mark
+  fbclock_backend backend; // read instead of the PTP device if set
+  fbclock_phc_ring phc_ring; // samples of the reader service, if hdr is set
+  int phc_ring_owned; // non-zero if phc_ring is mapped by this lib
+  char* phc_ring_base; // ring path without node, for thread handles
+  void* shm_rw; // writable mapping of v2 or v3 shmem, if we have write access
+  uint32_t* shm_waiters; // waiters word of v2 data in shm_rw, or NULL
+  int phc_ring_private; // non-zero if only one thread reads phc_ring,
+                        // so it's re-opened once the daemon replaces it
+  uint64_t id; // unique per fbclock_init* and fbclock_set_phc_ring call,
+               // thread handles made for another id are stale
 } fbclock_lib;
 
+// options for fbclock_init_with_options
+typedef struct fbclock_init_options {
+  int shm_version; // shared memory layout version, 1, 2 or 3
+  unsigned n_samples; // PHC samples per read, 0 for FBCLOCK_DEFAULT_SAMPLES
+  int adaptive_samples; // non-zero to enable adaptive sample count
+  const char* ptp_path; // PHC device, NULL for FBCLOCK_PTPPATH
+  unsigned flags; // FBCLOCK_INIT_* flags
+} fbclock_init_options;
+
 int fbclock_clockdata_store_data(uint32_t fd, fbclock_clockdata* data);
 int fbclock_clockdata_load_data(fbclock_shmdata* shm, fbclock_clockdata* data);
+int fbclock_clockdata_store_data_v2(uint32_t fd, fbclock_clockdata* data);
+// writes the v3 header too, readers see v3 data only after the first store
+int fbclock_clockdata_store_data_v3(uint32_t fd, fbclock_clockdata* data);
+int fbclock_clockdata_load_data_v2(
+    fbclock_shmdata_v2* shmp,
+    fbclock_clockdata* data);
+// methods for the daemon to publish data without remapping on every store
+int fbclock_writer_open(fbclock_writer* writer, uint32_t fd, int version);
+int fbclock_writer_store(fbclock_writer* writer, fbclock_clockdata* data);
+int fbclock_writer_close(fbclock_writer* writer);
+// journal of published data, see fbclock_journal_header. create maps path for
+// appending, keeping records of a journal with the same capacity and
+// replacing it otherwise. Appends must come in ingress_time_ns order.
+int fbclock_journal_create(
+    fbclock_journal* j,
+    const char* path,
+    uint32_t capacity);
+int fbclock_journal_append(fbclock_journal* j, const fbclock_clockdata* data);
+// read-only mapping of the journal written by the daemon
+int fbclock_journal_open(fbclock_journal* j, const char* path);
+// data in effect at phc_ns: the latest record with ingress_time_ns <= phc_ns.
+// FBCLOCK_E_NO_DATA if phc_ns is older than the oldest record still kept,
+// or if the journal was replaced and has to be re-opened.
+// The oldest slot is skipped as the next append overwrites it, so readers
+// never block the writer and see capacity - 1 records.
+int fbclock_journal_find(
+    const fbclock_journal* j,
+    int64_t phc_ns,
+    fbclock_clockdata* data);
+// TrueTime of PHC time phc_ns computed from the data in effect at the time
+int fbclock_journal_truetime(
+    const fbclock_journal* j,
+    int64_t phc_ns,
+    fbclock_truetime* truetime,
+    int timezone);
+int fbclock_journal_close(fbclock_journal* j);
+// ring of PHC samples of the reader service, see fbclock_phc_ring_header.
+// create resets the ring at path (replacing it if capacity changed) and maps
+// it for publishing.
+int fbclock_phc_ring_create(
+    fbclock_phc_ring* r,
+    const char* path,
+    uint32_t capacity,
+    uint64_t interval_ns);
+int fbclock_phc_ring_publish(fbclock_phc_ring* r, const fbclock_phc_sample* s);
+int fbclock_phc_ring_open(fbclock_phc_ring* r, const char* path);
+// freshest sample, FBCLOCK_E_NO_DATA if there is none or the ring was replaced
+int fbclock_phc_ring_latest(const fbclock_phc_ring* r, fbclock_phc_sample* s);
+int fbclock_phc_ring_close(fbclock_phc_ring* r);
+// path of the ring of NUMA node, base NULL for FBCLOCK_PATH_PHC_RING
+int fbclock_phc_ring_path(char* buf, size_t len, const char* base, int node);
 double fbclock_window_of_uncertainty(
     double seconds,
     double error_bound_ns,
@@ -110,6 +495,19 @@ int fbclock_calculate_time(
     int64_t phctime_ns,
     fbclock_truetime* truetime,
     int timezone);
+// integer versions of the above, holdover_multiplier_ns is 16.16 fixed point
+// as stored in shared memory, results are rounded down
+uint64_t fbclock_window_of_uncertainty_ns(
+    int64_t elapsed_ns,
+    uint64_t error_bound_ns,
+    uint32_t holdover_multiplier_ns);
+int fbclock_calculate_time_ns(
+    uint64_t error_bound_ns,
+    uint32_t holdover_multiplier_ns,
+    fbclock_clockdata* state,
+    int64_t phctime_ns,
+    fbclock_truetime* truetime,
+    int timezone);
 uint64_t fbclock_apply_utc_offset(fbclock_clockdata* state, int64_t phctime_ns);
 uint64_t fbclock_apply_smear(
     uint64_t time,
@@ -118,6 +516,20 @@ uint64_t fbclock_apply_smear(
     uint64_t smear_start_ns,
     uint64_t smear_end_ns,
     int multiplier);
+// Offline conversion of recorded timestamps with one state snapshot, same
+// results as converting them one by one (see fbclock_inline_*_batch)
+void fbclock_utc_offset_batch(
+    const fbclock_clockdata* state,
+    const int64_t* tai_ns,
+    uint64_t* utc_ns,
+    size_t n);
+int fbclock_truetime_batch(
+    const fbclock_clockdata* state,
+    const int64_t* phc_ns,
+    const int64_t* delay_ns,
+    size_t n,
+    fbclock_truetime* truetimes,
+    int time_standard);
 int fbclock_gettime_tz(
     fbclock_lib* lib,
     fbclock_truetime* truetime,
@@ -125,9 +537,144 @@ int fbclock_gettime_tz(
 
 // methods we provide to end users
 int fbclock_init(fbclock_lib* lib, const char* shm_path);
+int fbclock_init_v2(fbclock_lib* lib, const char* shm_path);
+int fbclock_init_v3(fbclock_lib* lib, const char* shm_path);
+int fbclock_init_with_options(
+    fbclock_lib* lib,
+    const char* shm_path,
+    const fbclock_init_options* opts);
+// Hosts with several NICs run a daemon per interface (see -periface daemon
+// flag), publishing to FBCLOCK_PATH_V2.<iface> with FBCLOCK_PTPPATH.<iface>
+// device. This inits lib with v2 data and device of the given interface.
+int fbclock_init_iface(fbclock_lib* lib, const char* iface);
+// NUMA node of PHC device, -1 if unknown
+int fbclock_device_numa_node(const char* ptp_path);
 int fbclock_destroy(fbclock_lib* lib);
 int fbclock_gettime(fbclock_lib* lib, fbclock_truetime* truetime);
 int fbclock_gettime_utc(fbclock_lib* lib, fbclock_truetime* truetime);
+// TAI and UTC TrueTime from one shmem read and one PHC read
+int fbclock_gettime_both(
+    fbclock_lib* lib,
+    fbclock_truetime* truetime_tai,
+    fbclock_truetime* truetime_utc);
+// TrueTime from several devices (each lib is read in turn), combined into the
+// tightest interval consistent with all of them. Libs that fail are skipped,
+// the last error is returned if all of them fail.
+int fbclock_gettime_multi(
+    fbclock_lib** libs,
+    unsigned n,
+    fbclock_truetime* truetime,
+    int timezone);
+// Fill n TrueTime values from one shmem read. Values are consecutive instants
+// during the call, they are not interpolated to caller supplied event times
+// (fbclock_truetime_batch converts PHC timestamps recorded by the caller).
+// In FBCLOCK_READ_PHC mode each value is one back-to-back sample of as few
+// PTP_SYS_OFFSET(_EXTENDED) reads as possible, with the WOU of its own delay;
+// PTP_SYS_OFFSET_PRECISE is never used here, it takes one ioctl per sample.
+// In sysclock and service modes each value is extrapolated on its own
+// CLOCK_MONOTONIC_RAW read, falling back to PHC reads like fbclock_gettime.
+int fbclock_gettime_batch(
+    fbclock_lib* lib,
+    fbclock_truetime* truetimes,
+    unsigned n,
+    int timezone);
+int fbclock_set_read_mode(fbclock_lib* lib, int read_mode);
+// read PHC through the reader service: maps the ring of the NUMA node the
+// caller runs on (base NULL for FBCLOCK_PATH_PHC_RING) and switches to
+// FBCLOCK_READ_SERVICE. Thread handles map the ring of their own node and
+// re-open it when the daemon replaces it, the lib itself reads PHC until
+// this is called again.
+int fbclock_set_phc_ring(fbclock_lib* lib, const char* base);
+// Coarse TrueTime for callers that need many cheap reads rather than precise
+// ones: it's extrapolated with CLOCK_MONOTONIC_COARSE from a snapshot taken by
+// an exact request at most max age ago, WOU is widened by the coarse clock
+// resolution (kernel tick) and drift. Expired snapshot is refreshed by the
+// caller which finds it, so one request per max age reads PHC.
+int fbclock_gettime_coarse(
+    fbclock_lib* lib,
+    fbclock_truetime* truetime,
+    int timezone);
+// 0 restores FBCLOCK_COARSE_MAX_AGE_NS
+int fbclock_set_coarse_max_age(fbclock_lib* lib, uint64_t max_age_ns);
+// Generation of data published in v2 shmem, it changes on every daemon update,
+// so callers caching values derived from it only need to compare it.
+int fbclock_get_generation(fbclock_lib* lib, uint32_t* generation);
+// Block until generation differs from the given one, or fail with
+// FBCLOCK_E_TIMEOUT after timeout_ns (negative waits forever).
+// Needs v2 shmem.
+int fbclock_wait_update(
+    fbclock_lib* lib,
+    uint32_t generation,
+    int64_t timeout_ns);
+// Read PHC with backend instead of the PTP device, NULL goes back to it.
+// Set it before sharing lib with other threads, handles copy it.
+int fbclock_set_backend(fbclock_lib* lib, const fbclock_backend* backend);
+
+// Open simulator publishing to shmem fd with layout version, PHC time starts
+// at current TAI. Data is published right away. Not thread safe, unlike reads.
+int fbclock_sim_open(
+    fbclock_sim* sim,
+    const fbclock_sim_options* opts,
+    uint32_t fd,
+    int version);
+// PHC time of the simulator now
+int64_t fbclock_sim_phc_time(fbclock_sim* sim);
+// publish data now, as if the daemon got a sync
+int fbclock_sim_update(fbclock_sim* sim);
+// backend reading the simulated PHC
+fbclock_backend fbclock_sim_backend(fbclock_sim* sim);
+int fbclock_sim_close(fbclock_sim* sim);
+
+// In monotonic mode earliest_ns and latest_ns returned by gettime calls never
+// decrease within the process: they are raised to the highest values handed out
+// so far by any lib in this mode, per time standard. The result still contains
+// true time, as it only moves forward. FBCLOCK_E_PHC_IN_THE_PAST is still
+// returned, there is no TrueTime to clamp then.
+int fbclock_set_monotonic(fbclock_lib* lib, int enable);
+// Commit wait: block until earliest_ns of TrueTime is past ts_ns, so ts_ns is
+// in the past for every observer. Time to sleep is predicted from the WOU and
+// holdover multiplier of the current request, most of it is slept on
+// CLOCK_MONOTONIC and the prediction is checked with one more request, so the
+// wait costs a few PHC reads rather than a spin. truetime (if not NULL) gets
+// the request that proved it. Fails with FBCLOCK_E_TIMEOUT after timeout_ns
+// (negative waits forever), with errors of requests otherwise.
+int fbclock_wait_until(
+    fbclock_lib* lib,
+    uint64_t ts_ns,
+    int timezone,
+    int64_t timeout_ns,
+    fbclock_truetime* truetime);
+// trade speed for uncertainty: more samples give smaller min delay
+int fbclock_set_samples(fbclock_lib* lib, unsigned n_samples, int adaptive);
+
+// Errors on read path are never printed, they are counted per lib (or handle)
+// and passed to the callback rate limited to one call per interval_ns.
+// Set the callback before sharing lib with other threads, NULL disables it.
+int fbclock_set_error_callback(
+    fbclock_lib* lib,
+    fbclock_error_callback cb,
+    void* ctx,
+    uint64_t interval_ns);
+uint64_t fbclock_error_count(fbclock_lib* lib, int kind);
+
+// Stats are kept in per-thread cache line aligned blocks, updating them is a
+// plain load and store without locked instructions. Snapshot sums all threads.
+int fbclock_stats_snapshot(fbclock_stats* stats);
+
+// Per-thread handle: a copy of lib with its own PTP device fd and sampling
+// state, sharing the shared memory mapping of lib. Handles are cached per
+// thread and lib, so subsequent calls on the same thread are cheap, getting a
+// handle of another lib keeps them valid, and they must only be used by the
+// calling thread. They're released on thread exit or by
+// fbclock_thread_handle_release (all handles of the thread) or
+// fbclock_thread_handle_release_lib (handle of lib only), which must happen
+// before lib is destroyed. Handles made before lib was re-initialized or got
+// a new PHC ring are replaced. Failing to open the device is counted as
+// FBCLOCK_ERR_PTP_READ of lib, like failed reads.
+// Never call fbclock_destroy on a handle.
+int fbclock_thread_handle_get(fbclock_lib* lib, fbclock_lib** handle);
+void fbclock_thread_handle_release(void);
+void fbclock_thread_handle_release_lib(fbclock_lib* lib);
 
 // turn error code into err msg
 const char* fbclock_strerror(int err_code);
@@ -0,0 +1,390 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// C++17 wrapper around fbclock C API. It is header-only, doesn't allocate
+// and doesn't throw: every call is a direct call into the C library.
+//
+//   auto clock = fbclock::Clock::open();
+//   if (!clock) { ... clock.error().message() ... }
+//   auto tt = clock->now<fbclock::Standard::UTC>();
+//   if (tt) { use(tt->earliest, tt->latest); }
+
+#pragma once
+
+#include <chrono>
+#include <type_traits>
+#include <utility>
+
+#include "fbclock.h"
+
+namespace fbclock {
+
+// time standard of returned TrueTime, selected at compile time
+enum class Standard : int {
+  TAI = FBCLOCK_TAI,
+  UTC = FBCLOCK_UTC,
+};
+
+struct TrueTime {
+  std::chrono::nanoseconds earliest;
+  std::chrono::nanoseconds latest;
+};
+
+// TAI and UTC TrueTime of the same instant
+struct TrueTimeBoth {
+  TrueTime tai;
+  TrueTime utc;
+};
+
+// FBCLOCK_E_* code of a call, evaluates to true on error
+class Error {
+ public:
+  constexpr Error() noexcept = default;
+  constexpr explicit Error(int code) noexcept : code_(code) {}
+
+  constexpr int code() const noexcept {
+    return code_;
+  }
+
+  constexpr explicit operator bool() const noexcept {
+    return code_ != FBCLOCK_E_NO_ERROR;
+  }
+
+  const char* message() const noexcept {
+    return fbclock_strerror(code_);
+  }
+
+  constexpr bool operator==(Error other) const noexcept {
+    return code_ == other.code_;
+  }
+
+  constexpr bool operator!=(Error other) const noexcept {
+    return code_ != other.code_;
+  }
+
+ private:
+  int code_{FBCLOCK_E_NO_ERROR};
+};
+
+// value or error, evaluates to true if value is set
+template <typename T>
+class Result {
+  static_assert(std::is_nothrow_move_constructible_v<T>);
+  static_assert(std::is_nothrow_default_constructible_v<T>);
+
+ public:
+  constexpr Result(T value) noexcept : value_(std::move(value)) {}
+  constexpr Result(Error error) noexcept : error_(error) {}
+
+  constexpr bool ok() const noexcept {
+    return !error_;
+  }
+
+  constexpr explicit operator bool() const noexcept {
+    return ok();
+  }
+
+  constexpr Error error() const noexcept {
+    return error_;
+  }
+
+  // only valid if ok()
+  constexpr T& value() & noexcept {
+    return value_;
+  }
+  constexpr const T& value() const& noexcept {
+    return value_;
+  }
+  constexpr T&& value() && noexcept {
+    return std::move(value_);
+  }
+  constexpr T* operator->() noexcept {
+    return &value_;
+  }
+  constexpr const T* operator->() const noexcept {
+    return &value_;
+  }
+  constexpr T& operator*() & noexcept {
+    return value_;
+  }
+  constexpr const T& operator*() const& noexcept {
+    return value_;
+  }
+
+ private:
+  T value_{};
+  Error error_;
+};
+
+namespace detail {
+
+constexpr TrueTime toTrueTime(const fbclock_truetime& tt) noexcept {
+  return TrueTime{
+      std::chrono::nanoseconds(tt.earliest_ns),
+      std::chrono::nanoseconds(tt.latest_ns)};
+}
+
+template <Standard S>
+inline Result<TrueTime> now(fbclock_lib* lib) noexcept {
+  fbclock_truetime tt;
+  int rcode;
+  if constexpr (S == Standard::UTC) {
+    rcode = fbclock_gettime_utc(lib, &tt);
+  } else {
+    rcode = fbclock_gettime(lib, &tt);
+  }
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return Error(rcode);
+  }
+  return toTrueTime(tt);
+}
+
+template <Standard S>
+inline Result<TrueTime> nowCoarse(fbclock_lib* lib) noexcept {
+  fbclock_truetime tt;
+  int rcode = fbclock_gettime_coarse(lib, &tt, static_cast<int>(S));
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return Error(rcode);
+  }
+  return toTrueTime(tt);
+}
+
+template <Standard S>
+inline Result<TrueTime> waitUntil(
+    fbclock_lib* lib,
+    std::chrono::nanoseconds ts,
+    std::chrono::nanoseconds timeout) noexcept {
+  fbclock_truetime tt;
+  int rcode = fbclock_wait_until(
+      lib, ts.count(), static_cast<int>(S), timeout.count(), &tt);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return Error(rcode);
+  }
+  return toTrueTime(tt);
+}
+
+inline Result<TrueTimeBoth> nowBoth(fbclock_lib* lib) noexcept {
+  fbclock_truetime tai;
+  fbclock_truetime utc;
+  int rcode = fbclock_gettime_both(lib, &tai, &utc);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return Error(rcode);
+  }
+  return TrueTimeBoth{toTrueTime(tai), toTrueTime(utc)};
+}
+
+} // namespace detail
+
+// Non-owning per-thread handle of a Clock, see fbclock_thread_handle_get.
+// Only usable on the thread that got it and while the Clock is alive,
+// handles of other Clocks and their destruction don't affect it.
+class ThreadHandle {
+ public:
+  constexpr ThreadHandle() noexcept = default;
+
+  template <Standard S = Standard::TAI>
+  Result<TrueTime> now() noexcept {
+    return detail::now<S>(lib_);
+  }
+
+  Result<TrueTimeBoth> nowBoth() noexcept {
+    return detail::nowBoth(lib_);
+  }
+
+  // see fbclock_gettime_coarse
+  template <Standard S = Standard::TAI>
+  Result<TrueTime> nowCoarse() noexcept {
+    return detail::nowCoarse<S>(lib_);
+  }
+
+  // see fbclock_wait_until, negative timeout waits forever
+  template <Standard S = Standard::TAI>
+  Result<TrueTime> waitUntil(
+      std::chrono::nanoseconds ts,
+      std::chrono::nanoseconds timeout =
+          std::chrono::nanoseconds(-1)) noexcept {
+    return detail::waitUntil<S>(lib_, ts, timeout);
+  }
+
+  fbclock_lib* get() const noexcept {
+    return lib_;
+  }
+
+ private:
+  friend class Clock;
+  constexpr explicit ThreadHandle(fbclock_lib* lib) noexcept : lib_(lib) {}
+
+  fbclock_lib* lib_{nullptr};
+};
+
+// Owns an initialized fbclock_lib, move-only.
+class Clock {
+ public:
+  // not opened, only useful as a move target
+  constexpr Clock() noexcept = default;
+
+  // take ownership of lib initialized with one of fbclock_init* functions
+  explicit Clock(const fbclock_lib& lib) noexcept : lib_(lib), open_(true) {}
+
+  static Result<Clock> open(
+      const char* shm_path,
+      const fbclock_init_options& opts) noexcept {
+    Clock clock;
+    int rcode = fbclock_init_with_options(&clock.lib_, shm_path, &opts);
+    if (rcode != FBCLOCK_E_NO_ERROR) {
+      return Error(rcode);
+    }
+    clock.open_ = true;
+    return Result<Clock>(std::move(clock));
+  }
+
+  static Result<Clock> open(const char* shm_path = FBCLOCK_PATH_V2) noexcept {
+    fbclock_init_options opts{};
+    opts.shm_version = 2;
+    return open(shm_path, opts);
+  }
+
+  // data and device of a per-interface daemon, see fbclock_init_iface
+  static Result<Clock> openIface(const char* iface) noexcept {
+    Clock clock;
+    int rcode = fbclock_init_iface(&clock.lib_, iface);
+    if (rcode != FBCLOCK_E_NO_ERROR) {
+      return Error(rcode);
+    }
+    clock.open_ = true;
+    return Result<Clock>(std::move(clock));
+  }
+
+  Clock(const Clock&) = delete;
+  Clock& operator=(const Clock&) = delete;
+
+  Clock(Clock&& other) noexcept : lib_(other.lib_), open_(other.open_) {
+    other.open_ = false;
+  }
+
+  Clock& operator=(Clock&& other) noexcept {
+    if (this != &other) {
+      reset();
+      lib_ = other.lib_;
+      open_ = other.open_;
+      other.open_ = false;
+    }
+    return *this;
+  }
+
+  ~Clock() {
+    reset();
+  }
+
+  bool isOpen() const noexcept {
+    return open_;
+  }
+
+  template <Standard S = Standard::TAI>
+  Result<TrueTime> now() noexcept {
+    return detail::now<S>(&lib_);
+  }
+
+  Result<TrueTimeBoth> nowBoth() noexcept {
+    return detail::nowBoth(&lib_);
+  }
+
+  // see fbclock_gettime_coarse
+  template <Standard S = Standard::TAI>
+  Result<TrueTime> nowCoarse() noexcept {
+    return detail::nowCoarse<S>(&lib_);
+  }
+
+  // see fbclock_wait_until, negative timeout waits forever
+  template <Standard S = Standard::TAI>
+  Result<TrueTime> waitUntil(
+      std::chrono::nanoseconds ts,
+      std::chrono::nanoseconds timeout =
+          std::chrono::nanoseconds(-1)) noexcept {
+    return detail::waitUntil<S>(&lib_, ts, timeout);
+  }
+
+  // Handle of the calling thread with its own PTP device fd. The handle is
+  // cached per thread, so after the first call this is a lock-free lookup.
+  // Clock must not be moved while handles are in use.
+  Result<ThreadHandle> threadHandle() noexcept {
+    fbclock_lib* handle;
+    int rcode = fbclock_thread_handle_get(&lib_, &handle);
+    if (rcode != FBCLOCK_E_NO_ERROR) {
+      return Error(rcode);
+    }
+    return ThreadHandle(handle);
+  }
+
+  // see fbclock_get_generation, needs v2 shmem
+  Result<uint32_t> generation() noexcept {
+    uint32_t gen;
+    int rcode = fbclock_get_generation(&lib_, &gen);
+    if (rcode != FBCLOCK_E_NO_ERROR) {
+      return Error(rcode);
+    }
+    return gen;
+  }
+
+  // block until generation changes, negative timeout waits forever
+  Error waitUpdate(
+      uint32_t generation,
+      std::chrono::nanoseconds timeout = std::chrono::nanoseconds(-1)) noexcept {
+    return Error(fbclock_wait_update(&lib_, generation, timeout.count()));
+  }
+
+  Error setReadMode(int read_mode) noexcept {
+    return Error(fbclock_set_read_mode(&lib_, read_mode));
+  }
+
+  // read PHC through the reader service, nullptr for FBCLOCK_PATH_PHC_RING
+  Error setPhcRing(const char* base = nullptr) noexcept {
+    return Error(fbclock_set_phc_ring(&lib_, base));
+  }
+
+  Error setSamples(unsigned n_samples, bool adaptive) noexcept {
+    return Error(fbclock_set_samples(&lib_, n_samples, adaptive));
+  }
+
+  Error setMonotonic(bool enable) noexcept {
+    return Error(fbclock_set_monotonic(&lib_, enable));
+  }
+
+  Error setCoarseMaxAge(std::chrono::nanoseconds max_age) noexcept {
+    return Error(fbclock_set_coarse_max_age(&lib_, max_age.count()));
+  }
+
+  fbclock_lib* get() noexcept {
+    return &lib_;
+  }
+
+  // Close the lib. Like fbclock_destroy, handles of other threads must be
+  // released before, handle of the calling thread is released here. Handles
+  // of other Clocks stay valid.
+  void reset() noexcept {
+    if (open_) {
+      fbclock_thread_handle_release_lib(&lib_);
+      fbclock_destroy(&lib_);
+      open_ = false;
+    }
+  }
+
+ private:
+  fbclock_lib lib_{};
+  bool open_{false};
+};
+
+} // namespace fbclock
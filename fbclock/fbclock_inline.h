@@ -0,0 +1,411 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+// Header-only read side of fbclock: shmem load and TrueTime math as static
+// inline functions, so callers can inline the whole calculation instead of
+// going through PLT calls into fbclock.so. fbclock.c is built on top of them,
+// so both give the same results. Reading PHC itself is left to the caller
+// (or to fbclock_gettime*), as it needs an open device.
+// Build with -msse4.2 on x86_64 to match CRC used by the daemon.
+
+#pragma once
+
+#include <string.h> /* for memcpy */
+
+#include "fbclock.h"
+
+#ifdef __x86_64__
+#define fbclock_crc64 __builtin_ia32_crc32di
+#endif
+
+#ifdef __aarch64__
+#ifdef __SSE4_2__
+#define fbclock_crc64 _mm_crc32_u64
+#endif
+#endif
+
+// dumb replacement for platforms we don't fully support
+#ifndef fbclock_crc64
+#define fbclock_crc64(a, b) ({ a ^ b; })
+#endif
+
+#define FBCLOCK_MAX_READ_TRIES 1000
+#define FBCLOCK_NSEC_PER_SEC 1000000000LL
+
+// shmem layout is shared with readers built against older headers,
+// fields can only be appended
+#ifdef __cplusplus
+#define FBCLOCK_ABI_ASSERT(cond, msg) static_assert(cond, msg)
+#else
+#define FBCLOCK_ABI_ASSERT(cond, msg) _Static_assert(cond, msg)
+#endif
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, ingress_time_ns) == 0,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, error_bound_ns) == 8,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, holdover_multiplier_ns) == 12,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, clock_smearing_start_s) == 16,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, clock_smearing_end_s) == 24,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, utc_offset_pre_s) == 32,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, utc_offset_post_s) == 36,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, phc_time_ns) == 40,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, clock_smearing_start_ns) == 72,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_clockdata, ptp_caps) == 116,
+    "fbclock_clockdata ABI");
+FBCLOCK_ABI_ASSERT(
+    sizeof(fbclock_clockdata) == 120,
+    "fbclock_clockdata ABI, update when appending fields");
+FBCLOCK_ABI_ASSERT(offsetof(fbclock_shmdata, data) == 8, "fbclock_shmdata ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_shmdata_v2, data) == 8,
+    "fbclock_shmdata_v2 ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_shmdata_v2, generation) == 128,
+    "fbclock_shmdata_v2 ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_shmdata_v2, waiters) == 132,
+    "fbclock_shmdata_v2 ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_shmdata_v3, header.clockdata_size) == 12,
+    "fbclock_shmdata_v3 ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_shmdata_v3, v2) == 128,
+    "fbclock_shmdata_v3 ABI");
+FBCLOCK_ABI_ASSERT(
+    sizeof(fbclock_shmdata_v3) == 4096,
+    "fbclock_shmdata_v3 ABI");
+FBCLOCK_ABI_ASSERT(
+    offsetof(fbclock_journal_header, count) == 16,
+    "fbclock_journal_header ABI");
+FBCLOCK_ABI_ASSERT(
+    sizeof(fbclock_journal_header) == 128,
+    "fbclock_journal_header ABI");
+FBCLOCK_ABI_ASSERT(
+    sizeof(fbclock_journal_record) == 128,
+    "fbclock_journal_record ABI");
+
+// v1 CRC covers the fields deployed readers check, appended fields
+// are not published in v1 (fbclock_clockdata_strip_v1)
+static inline uint64_t fbclock_inline_clockdata_crc(
+    const fbclock_clockdata* value) {
+  uint64_t counter = fbclock_crc64(0xFFFFFFFF, value->ingress_time_ns);
+  counter = fbclock_crc64(counter, value->error_bound_ns);
+  counter = fbclock_crc64(counter, value->holdover_multiplier_ns);
+  return counter ^ 0xFFFFFFFF;
+}
+
+// load v1 (CRC protected) data, number of reads done is stored in tries
+static inline int fbclock_inline_load_data(
+    fbclock_shmdata* shmp,
+    fbclock_clockdata* data,
+    unsigned* tries) {
+  for (unsigned i = 0; i < FBCLOCK_MAX_READ_TRIES; i++) {
+    memcpy(data, &shmp->data, sizeof(fbclock_clockdata));
+    uint64_t crc = atomic_load(&shmp->crc);
+    if (fbclock_inline_clockdata_crc(data) == crc) {
+      *tries = i + 1;
+      return FBCLOCK_E_NO_ERROR;
+    }
+  }
+  *tries = FBCLOCK_MAX_READ_TRIES;
+  return FBCLOCK_E_CRC_MISMATCH;
+}
+
+// load v2 (seqlock protected) data, number of reads done is stored in tries
+static inline int fbclock_inline_load_data_v2(
+    fbclock_shmdata_v2* shmp,
+    fbclock_clockdata* data,
+    unsigned* tries) {
+  for (unsigned i = 0; i < FBCLOCK_MAX_READ_TRIES; i++) {
+    uint64_t seq = __atomic_load_n(&shmp->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) {
+      continue;
+    }
+    memcpy(data, &shmp->data, sizeof(fbclock_clockdata));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&shmp->seq, __ATOMIC_RELAXED) == seq) {
+      *tries = i + 1;
+      return FBCLOCK_E_NO_ERROR;
+    }
+  }
+  *tries = FBCLOCK_MAX_READ_TRIES;
+  return FBCLOCK_E_SEQ_MISMATCH;
+}
+
+// make sure loaded state is usable for TrueTime calculation
+static inline int fbclock_inline_check_state(const fbclock_clockdata* state) {
+  // cannot determine Truetime without these values
+  if (state->error_bound_ns == 0 || state->ingress_time_ns == 0) {
+    return FBCLOCK_E_NO_DATA;
+  }
+  // if the value is stored as UINT32_MAX then it's too big
+  if (state->error_bound_ns == UINT32_MAX ||
+      state->holdover_multiplier_ns == UINT32_MAX) {
+    return FBCLOCK_E_WOU_TOO_BIG;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
+
+static inline uint64_t fbclock_inline_window_of_uncertainty_ns(
+    int64_t elapsed_ns,
+    uint64_t error_bound_ns,
+    uint32_t holdover_multiplier_ns) {
+  // h = holdover_multiplier_ns (16.16 fixed point) * elapsed seconds, so
+  // h = elapsed_ns * holdover_multiplier_ns / (2^16 * 2^9 * 5^9).
+  // Shifting out powers of 2 first keeps the division by a constant 64 bit
+  // (multiply and shift), floor of nested divisions is the floor of the whole.
+  unsigned __int128 p =
+      (unsigned __int128)(uint64_t)elapsed_ns * holdover_multiplier_ns;
+  uint64_t h;
+  if (p >> 89) {
+    // more than 9s of holdover error, rare enough for a slow 128 bit division
+    unsigned __int128 h128 = p / (65536 * FBCLOCK_NSEC_PER_SEC);
+    h = h128 >> 64 ? UINT64_MAX : (uint64_t)h128;
+  } else {
+    h = (uint64_t)(p >> 25) / 1953125;
+  }
+  uint64_t w = error_bound_ns + h;
+  return w < error_bound_ns ? UINT64_MAX : w;
+}
+
+static inline uint64_t fbclock_inline_apply_smear(
+    uint64_t time,
+    uint64_t offset_pre_ns,
+    uint64_t offset_post_ns,
+    uint64_t smear_start_ns,
+    uint64_t smear_end_ns,
+    int multiplier) {
+  if (time > smear_end_ns) {
+    time -= offset_post_ns;
+  } else if (time < smear_start_ns) {
+    time -= offset_pre_ns;
+  } else if (smear_start_ns <= time && time <= smear_end_ns) {
+    uint64_t smear = multiplier * ((time - smear_start_ns) / SMEAR_STEP_NS);
+    time -= (offset_pre_ns + smear);
+  }
+  return time;
+}
+
+static inline uint64_t fbclock_inline_apply_utc_offset(
+    const fbclock_clockdata* state,
+    int64_t phctime_ns) {
+  // Fixed offset is applied if tzdata information not in shared memory
+  if (state->utc_offset_pre_s == 0 && state->utc_offset_post_s == 0) {
+    phctime_ns += UTC_TAI_OFFSET_NS;
+    return (uint64_t)phctime_ns;
+  }
+
+  // Multipler may be negative (if a negative leap second is applied)
+  int multiplier = state->utc_offset_post_s - state->utc_offset_pre_s;
+
+  // use values precomputed by the daemon, no divisions needed
+  if (state->smear_step_mult != 0) {
+    uint64_t time = (uint64_t)phctime_ns;
+    if (time > state->clock_smearing_end_ns) {
+      return time - state->utc_offset_post_ns;
+    }
+    if (time < state->clock_smearing_start_ns) {
+      return time - state->utc_offset_pre_ns;
+    }
+    uint64_t since_start = time - state->clock_smearing_start_ns;
+    uint64_t steps = (uint64_t)(((unsigned __int128)since_start *
+                                 state->smear_step_mult) >>
+                                state->smear_step_shift);
+    return time - (state->utc_offset_pre_ns + multiplier * steps);
+  }
+
+  // Switch to nanoseconds
+  uint64_t smear_end_ns = state->clock_smearing_end_s * FBCLOCK_NSEC_PER_SEC;
+  uint64_t smear_start_ns =
+      state->clock_smearing_start_s * FBCLOCK_NSEC_PER_SEC;
+  uint64_t offset_post_ns =
+      (int64_t)state->utc_offset_post_s * FBCLOCK_NSEC_PER_SEC;
+  uint64_t offset_pre_ns =
+      (int64_t)state->utc_offset_pre_s * FBCLOCK_NSEC_PER_SEC;
+
+  return fbclock_inline_apply_smear(
+      phctime_ns,
+      offset_pre_ns,
+      offset_post_ns,
+      smear_start_ns,
+      smear_end_ns,
+      multiplier);
+}
+
+static inline int fbclock_inline_calculate_time_ns(
+    uint64_t error_bound_ns,
+    uint32_t holdover_multiplier_ns,
+    const fbclock_clockdata* state,
+    int64_t phctime_ns,
+    fbclock_truetime* truetime,
+    int time_standard) {
+  // check how far back since last SYNC message from GM
+  int64_t elapsed_ns = phctime_ns - state->ingress_time_ns;
+  if (elapsed_ns < 0) {
+    return FBCLOCK_E_PHC_IN_THE_PAST;
+  }
+
+  // UTC offset applied if time standard used is UTC (and not TAI)
+  if (time_standard == FBCLOCK_UTC) {
+    phctime_ns = fbclock_inline_apply_utc_offset(state, phctime_ns);
+  }
+
+  uint64_t wou_ns = fbclock_inline_window_of_uncertainty_ns(
+      elapsed_ns, error_bound_ns, holdover_multiplier_ns);
+  truetime->earliest_ns = phctime_ns - wou_ns;
+  truetime->latest_ns = phctime_ns + wou_ns;
+  return FBCLOCK_E_NO_ERROR;
+}
+
+// full TrueTime calculation from loaded state and PHC read with given delay
+static inline int fbclock_inline_truetime(
+    const fbclock_clockdata* state,
+    int64_t phctime_ns,
+    int64_t delay_ns,
+    fbclock_truetime* truetime,
+    int time_standard) {
+  int rcode = fbclock_inline_check_state(state);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  return fbclock_inline_calculate_time_ns(
+      (uint64_t)state->error_bound_ns + (uint64_t)delay_ns,
+      state->holdover_multiplier_ns,
+      state,
+      phctime_ns,
+      truetime,
+      time_standard);
+}
+
+// UTC offset of a state in one form for all three cases handled by
+// fbclock_inline_apply_utc_offset (fixed offset, precomputed and seconds),
+// so batch conversion picks values with selects instead of branches
+typedef struct fbclock_inline_utc_params {
+  uint64_t start_ns; // smearing window, UINT64_MAX for fixed offset
+  uint64_t end_ns;
+  uint64_t pre_ns;
+  uint64_t post_ns;
+  uint64_t step_mult; // 0 to divide by SMEAR_STEP_NS
+  uint32_t step_shift;
+  int64_t multiplier;
+} fbclock_inline_utc_params;
+
+static inline void fbclock_inline_utc_prepare(
+    const fbclock_clockdata* state,
+    fbclock_inline_utc_params* p) {
+  p->multiplier = state->utc_offset_post_s - state->utc_offset_pre_s;
+  p->step_mult = 0;
+  p->step_shift = 0;
+  if (state->utc_offset_pre_s == 0 && state->utc_offset_post_s == 0) {
+    p->start_ns = UINT64_MAX;
+    p->end_ns = UINT64_MAX;
+    p->pre_ns = (uint64_t)-UTC_TAI_OFFSET_NS;
+    p->post_ns = p->pre_ns;
+  } else if (state->smear_step_mult != 0) {
+    p->start_ns = state->clock_smearing_start_ns;
+    p->end_ns = state->clock_smearing_end_ns;
+    p->pre_ns = state->utc_offset_pre_ns;
+    p->post_ns = state->utc_offset_post_ns;
+    p->step_mult = state->smear_step_mult;
+    p->step_shift = state->smear_step_shift;
+  } else {
+    p->start_ns = state->clock_smearing_start_s * FBCLOCK_NSEC_PER_SEC;
+    p->end_ns = state->clock_smearing_end_s * FBCLOCK_NSEC_PER_SEC;
+    p->pre_ns = (int64_t)state->utc_offset_pre_s * FBCLOCK_NSEC_PER_SEC;
+    p->post_ns = (int64_t)state->utc_offset_post_s * FBCLOCK_NSEC_PER_SEC;
+  }
+}
+
+// same result as fbclock_inline_apply_utc_offset, the smearing window is a
+// clamp and the offset a select, which compile to conditional moves
+static inline uint64_t fbclock_inline_apply_utc_prepared(
+    const fbclock_inline_utc_params* p,
+    uint64_t time) {
+  uint64_t since_start = time < p->start_ns ? 0 : time - p->start_ns;
+  uint64_t steps = p->step_mult != 0
+      ? (uint64_t)(((unsigned __int128)since_start * p->step_mult) >>
+                   p->step_shift)
+      : since_start / SMEAR_STEP_NS;
+  uint64_t offset = p->pre_ns + p->multiplier * steps;
+  return time - (time > p->end_ns ? p->post_ns : offset);
+}
+
+// convert n TAI timestamps to UTC with one state snapshot
+static inline void fbclock_inline_utc_offset_batch(
+    const fbclock_clockdata* state,
+    const int64_t* tai_ns,
+    uint64_t* utc_ns,
+    size_t n) {
+  fbclock_inline_utc_params p;
+  fbclock_inline_utc_prepare(state, &p);
+  for (size_t i = 0; i < n; i++) {
+    utc_ns[i] = fbclock_inline_apply_utc_prepared(&p, (uint64_t)tai_ns[i]);
+  }
+}
+
+// TrueTime of n recorded PHC timestamps with one state snapshot, each read
+// with delay_ns[i] (NULL for no delay). Stops at the first timestamp before
+// ingress time with FBCLOCK_E_PHC_IN_THE_PAST, earlier ones are converted.
+static inline int fbclock_inline_truetime_batch(
+    const fbclock_clockdata* state,
+    const int64_t* phc_ns,
+    const int64_t* delay_ns,
+    size_t n,
+    fbclock_truetime* truetimes,
+    int time_standard) {
+  int rcode = fbclock_inline_check_state(state);
+  if (rcode != FBCLOCK_E_NO_ERROR) {
+    return rcode;
+  }
+  fbclock_inline_utc_params p;
+  fbclock_inline_utc_prepare(state, &p);
+  int utc = time_standard == FBCLOCK_UTC;
+  for (size_t i = 0; i < n; i++) {
+    int64_t elapsed_ns = phc_ns[i] - state->ingress_time_ns;
+    if (elapsed_ns < 0) {
+      return FBCLOCK_E_PHC_IN_THE_PAST;
+    }
+    uint64_t delay = delay_ns != NULL ? (uint64_t)delay_ns[i] : 0;
+    uint64_t wou_ns = fbclock_inline_window_of_uncertainty_ns(
+        elapsed_ns,
+        (uint64_t)state->error_bound_ns + delay,
+        state->holdover_multiplier_ns);
+    uint64_t time = (uint64_t)phc_ns[i];
+    if (utc) {
+      time = fbclock_inline_apply_utc_prepared(&p, time);
+    }
+    truetimes[i].earliest_ns = time - wou_ns;
+    truetimes[i].latest_ns = time + wou_ns;
+  }
+  return FBCLOCK_E_NO_ERROR;
+}
@@ -0,0 +1,155 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package fbclock
+
+import (
+	"fmt"
+	"math"
+	"os"
+	"sync/atomic"
+	"unsafe"
+
+	"golang.org/x/sys/unix"
+)
+
+// Layout of fbclock_journal_header and fbclock_journal_record from fbclock.h,
+// checked against the C headers in shmem.go.
+const (
+	journalHeaderSize    = 128
+	journalRecordSize    = 128
+	journalMagic         = 0x6662636a
+	journalVersion       = 1
+	offJournalVersion    = 4
+	offJournalCapacity   = 8
+	offJournalRecordSize = 12
+	offJournalCount      = 16
+	journalMinCapacity   = 2 // readers skip the slot the next append overwrites
+	journalMaxCapacity   = math.MaxUint32
+	journalPermissions   = 0644
+)
+
+// Journal is a ring of Data published by the daemon, appended in IngressTimeNS order,
+// so readers can look up data that was in effect at a past PHC time (fbclock_journal_find).
+// Records are written from Go without cgo, the same way as fbclock_journal_append.
+// Not safe for concurrent use.
+type Journal struct {
+	Path     string
+	File     *os.File
+	mem      []byte
+	capacity uint64
+}
+
+// OpenJournal opens journal at path for appending. Records of a journal with the same
+// capacity are kept, so lookups work across daemon restarts, otherwise it is replaced.
+func OpenJournal(path string, capacity int) (*Journal, error) {
+	if capacity < journalMinCapacity || uint64(capacity) > journalMaxCapacity {
+		return nil, fmt.Errorf("journal capacity must be between %d and %d", journalMinCapacity, journalMaxCapacity)
+	}
+	j := &Journal{Path: path, capacity: uint64(capacity)}
+	size := journalHeaderSize + capacity*journalRecordSize
+	// a journal of another size is built aside, old one's readers keep their mapping
+	tmp := ""
+	if j.File = openShmSized(path, size); j.File == nil {
+		f, err := createShmTemp(path, size, journalPermissions)
+		if err != nil {
+			return nil, err
+		}
+		j.File, tmp = f, f.Name()
+	}
+	var err error
+	j.mem, err = unix.Mmap(int(j.File.Fd()), 0, size, unix.PROT_READ|unix.PROT_WRITE, unix.MAP_SHARED)
+	if err != nil {
+		j.Close()
+		if tmp != "" {
+			os.Remove(tmp)
+		}
+		return nil, fmt.Errorf("failed to map journal: %w", err)
+	}
+	if tmp != "" || !j.headerMatches() {
+		j.initHeader()
+	}
+	if tmp != "" {
+		if err := replaceShm(tmp, path); err != nil {
+			j.Close()
+			return nil, err
+		}
+	}
+	return j, nil
+}
+
+func (j *Journal) u64(off int) *uint64 {
+	return (*uint64)(unsafe.Pointer(&j.mem[off]))
+}
+
+func (j *Journal) u32(off int) *uint32 {
+	return (*uint32)(unsafe.Pointer(&j.mem[off]))
+}
+
+func (j *Journal) headerMatches() bool {
+	return atomic.LoadUint32(j.u32(0)) == journalMagic &&
+		atomic.LoadUint32(j.u32(offJournalVersion)) == journalVersion &&
+		atomic.LoadUint32(j.u32(offJournalCapacity)) == uint32(j.capacity) &&
+		atomic.LoadUint32(j.u32(offJournalRecordSize)) == journalRecordSize
+}
+
+// initHeader resets the journal, magic goes last so readers seeing it see it empty
+func (j *Journal) initHeader() {
+	atomic.StoreUint32(j.u32(0), 0)
+	atomic.StoreUint64(j.u64(offJournalCount), 0)
+	atomic.StoreUint32(j.u32(offJournalVersion), journalVersion)
+	atomic.StoreUint32(j.u32(offJournalCapacity), uint32(j.capacity))
+	atomic.StoreUint32(j.u32(offJournalRecordSize), journalRecordSize)
+	atomic.StoreUint32(j.u32(0), journalMagic)
+}
+
+func (j *Journal) record(i uint64) int {
+	return journalHeaderSize + int(i%j.capacity)*journalRecordSize
+}
+
+// Count returns the number of records ever appended, readers can look up the latest capacity-1 of them
+func (j *Journal) Count() uint64 {
+	return atomic.LoadUint64(j.u64(offJournalCount))
+}
+
+// Append adds d to the journal. It fails if d is older than the latest record,
+// as lookups binary search by IngressTimeNS.
+func (j *Journal) Append(d *Data) error {
+	if j.mem == nil {
+		return fmt.Errorf("journal is closed")
+	}
+	count := j.Count()
+	if count > 0 {
+		last := int64(atomic.LoadUint64(j.u64(j.record(count-1) + offIngressTime)))
+		if d.IngressTimeNS < last {
+			return fmt.Errorf("ingress time %d is before the latest journal record %d", d.IngressTimeNS, last)
+		}
+	}
+	c := toClockData(d)
+	// slot of the oldest record, which readers don't search
+	storeClockData(j.mem, j.record(count), &c)
+	atomic.StoreUint64(j.u64(offJournalCount), count+1)
+	return nil
+}
+
+// Close unmaps and closes the journal
+func (j *Journal) Close() error {
+	if j.mem != nil {
+		_ = unix.Munmap(j.mem)
+		j.mem = nil
+	}
+	return j.File.Close()
+}
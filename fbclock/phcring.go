@@ -0,0 +1,148 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package fbclock
+
+import (
+	"fmt"
+	"math"
+	"os"
+	"sync/atomic"
+	"time"
+	"unsafe"
+
+	"golang.org/x/sys/unix"
+)
+
+// Layout of fbclock_phc_ring_header and fbclock_phc_sample from fbclock.h,
+// checked against the C headers in shmem.go.
+const (
+	phcRingHeaderSize     = 128
+	phcSampleSize         = 32
+	phcRingMagic          = 0x66626372
+	phcRingVersion        = 1
+	offPHCRingVersion     = 4
+	offPHCRingCapacity    = 8
+	offPHCRingSampleSize  = 12
+	offPHCRingInterval    = 16
+	offPHCRingCount       = 24
+	offSampleSysclockTime = 0
+	offSamplePHCTime      = 8
+	offSampleDelay        = 16
+	phcRingMinCapacity    = 2 // latest sample must not be the one being overwritten
+	phcRingPermissions    = 0644
+)
+
+// PHCSample is PHC read sandwiched between two CLOCK_MONOTONIC_RAW reads
+type PHCSample struct {
+	SysclockTimeNS int64 // CLOCK_MONOTONIC_RAW in the middle of the read
+	PHCTimeNS      int64
+	DelayNS        int64 // between CLOCK_MONOTONIC_RAW reads
+}
+
+// PHCRingNodePath returns path of the ring of NUMA node
+func PHCRingNodePath(base string, node int) string {
+	return fmt.Sprintf("%s.node%d", base, node)
+}
+
+// PHCRing is a ring of PHC samples published by the reader service, so clients in
+// FBCLOCK_READ_SERVICE mode extrapolate from the freshest one instead of reading PHC.
+// Samples are written from Go without cgo, the same way as fbclock_phc_ring_publish.
+// Not safe for concurrent use.
+type PHCRing struct {
+	Path     string
+	File     *os.File
+	mem      []byte
+	capacity uint64
+}
+
+// OpenPHCRing creates ring at path for publishing samples taken every interval,
+// resetting samples of any previous ring there, or replacing it if its capacity differs
+func OpenPHCRing(path string, capacity int, interval time.Duration) (*PHCRing, error) {
+	if capacity < phcRingMinCapacity || uint64(capacity) > math.MaxUint32 {
+		return nil, fmt.Errorf("phc ring capacity must be between %d and %d", phcRingMinCapacity, uint64(math.MaxUint32))
+	}
+	if interval <= 0 {
+		return nil, fmt.Errorf("phc ring interval must be positive")
+	}
+	r := &PHCRing{Path: path, capacity: uint64(capacity)}
+	size := phcRingHeaderSize + capacity*phcSampleSize
+	// a ring of another size is built aside, old one's readers keep their mapping
+	tmp := ""
+	if r.File = openShmSized(path, size); r.File == nil {
+		f, err := createShmTemp(path, size, phcRingPermissions)
+		if err != nil {
+			return nil, err
+		}
+		r.File, tmp = f, f.Name()
+	}
+	var err error
+	r.mem, err = unix.Mmap(int(r.File.Fd()), 0, size, unix.PROT_READ|unix.PROT_WRITE, unix.MAP_SHARED)
+	if err != nil {
+		r.Close()
+		if tmp != "" {
+			os.Remove(tmp)
+		}
+		return nil, fmt.Errorf("failed to map phc ring: %w", err)
+	}
+	// magic goes last, so readers seeing it see an empty ring
+	atomic.StoreUint32(r.u32(0), 0)
+	atomic.StoreUint64(r.u64(offPHCRingCount), 0)
+	atomic.StoreUint32(r.u32(offPHCRingVersion), phcRingVersion)
+	atomic.StoreUint32(r.u32(offPHCRingCapacity), uint32(capacity))
+	atomic.StoreUint32(r.u32(offPHCRingSampleSize), phcSampleSize)
+	atomic.StoreUint64(r.u64(offPHCRingInterval), uint64(interval.Nanoseconds()))
+	atomic.StoreUint32(r.u32(0), phcRingMagic)
+	if tmp != "" {
+		if err := replaceShm(tmp, path); err != nil {
+			r.Close()
+			return nil, err
+		}
+	}
+	return r, nil
+}
+
+func (r *PHCRing) u64(off int) *uint64 {
+	return (*uint64)(unsafe.Pointer(&r.mem[off]))
+}
+
+func (r *PHCRing) u32(off int) *uint32 {
+	return (*uint32)(unsafe.Pointer(&r.mem[off]))
+}
+
+// Publish makes s the freshest sample of the ring
+func (r *PHCRing) Publish(s *PHCSample) error {
+	if r.mem == nil {
+		return fmt.Errorf("phc ring is closed")
+	}
+	count := atomic.LoadUint64(r.u64(offPHCRingCount))
+	// slot of the oldest sample, readers only read the latest one
+	base := phcRingHeaderSize + int(count%r.capacity)*phcSampleSize
+	atomic.StoreUint64(r.u64(base+offSampleSysclockTime), uint64(s.SysclockTimeNS))
+	atomic.StoreUint64(r.u64(base+offSamplePHCTime), uint64(s.PHCTimeNS))
+	atomic.StoreUint64(r.u64(base+offSampleDelay), uint64(s.DelayNS))
+	atomic.StoreUint64(r.u64(offPHCRingCount), count+1)
+	return nil
+}
+
+// Close unmaps and closes the ring
+func (r *PHCRing) Close() error {
+	if r.mem != nil {
+		_ = unix.Munmap(r.mem)
+		r.mem = nil
+	}
+	return r.File.Close()
+}
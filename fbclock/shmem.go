@@ -17,7 +17,7 @@ limitations under the License.
 package fbclock
 
 /*
-#cgo LDFLAGS: -lrt
+#cgo LDFLAGS: -lrt -lpthread
 
 #include "fbclock.h" // @oss-only
 // @fb-only: #include "time/fbclock/fbclock.h"
@@ -42,12 +42,104 @@ import (
 // PTPPath is the path we set for PTP device
 const PTPPath = C.FBCLOCK_PTPPATH
 
+// ShmPath is the path of v1 shm
+const ShmPath = C.FBCLOCK_PATH
+
+// ShmPathV2 is the path of v2 shm
+const ShmPathV2 = C.FBCLOCK_PATH_V2
+
+// ShmPathV3 is the path of v3 shm
+const ShmPathV3 = C.FBCLOCK_PATH_V3
+
+// JournalPath is the path of the journal of published data
+const JournalPath = C.FBCLOCK_PATH_JOURNAL
+
+// PHCRingPath is the path of rings of PHC samples of the reader service, without NUMA node
+const PHCRingPath = C.FBCLOCK_PATH_PHC_RING
+
+// PHCRingDefaultCapacity is the default number of samples in PHC ring
+const PHCRingDefaultCapacity = C.FBCLOCK_PHC_RING_DEFAULT_CAPACITY
+
+// PHC read methods published in Data.PTPCaps, so readers don't probe the device themselves
+const (
+	PTPCapProbed   = C.FBCLOCK_PTP_CAP_PROBED
+	PTPCapExtended = C.FBCLOCK_PTP_CAP_EXTENDED
+	PTPCapPrecise  = C.FBCLOCK_PTP_CAP_PRECISE
+)
+
+// IfacePath returns per-interface version of shm or PTP device path,
+// as used on multi-NIC hosts running a daemon per interface
+func IfacePath(path string, iface string) string {
+	return path + "." + iface
+}
+
 // Shm is POSIX shared memory
 type Shm struct {
-	Path string
-	File *os.File
+	Path    string
+	File    *os.File
+	Version int // layout version of fbclock data in this shm
+	// writer keeps shm mapped between stores, so we don't mmap/munmap on every publish
+	writer *shmWriter
 }
 
+// layout used by shmWriter must match fbclock.h
+var (
+	_ [shmDataSize - C.FBCLOCK_SHMDATA_SIZE]struct{}
+	_ [C.FBCLOCK_SHMDATA_SIZE - shmDataSize]struct{}
+	_ [shmDataV2Size - C.FBCLOCK_SHMDATA_V2_SIZE]struct{}
+	_ [C.FBCLOCK_SHMDATA_V2_SIZE - shmDataV2Size]struct{}
+	_ [shmDataV3Size - C.FBCLOCK_SHMDATA_V3_SIZE]struct{}
+	_ [C.FBCLOCK_SHMDATA_V3_SIZE - shmDataV3Size]struct{}
+	_ [shmV3Offset - unsafe.Offsetof(C.fbclock_shmdata_v3{}.v2)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_shmdata_v3{}.v2) - shmV3Offset]struct{}
+	_ [shmMagic - C.FBCLOCK_SHM_MAGIC]struct{}
+	_ [C.FBCLOCK_SHM_MAGIC - shmMagic]struct{}
+	_ [shmHeaderCDSize - unsafe.Offsetof(C.fbclock_shm_header{}.clockdata_size)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_shm_header{}.clockdata_size) - shmHeaderCDSize]struct{}
+	_ [clockDataSize - unsafe.Sizeof(C.fbclock_clockdata{})]struct{}
+	_ [unsafe.Sizeof(C.fbclock_clockdata{}) - clockDataSize]struct{}
+	_ [shmDataOffset - unsafe.Offsetof(C.fbclock_shmdata{}.data)]struct{}
+	_ [shmDataOffset - unsafe.Offsetof(C.fbclock_shmdata_v2{}.data)]struct{}
+	_ [shmGenerationV2 - unsafe.Offsetof(C.fbclock_shmdata_v2{}.generation)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_shmdata_v2{}.generation) - shmGenerationV2]struct{}
+	_ [shmWaitersV2 - unsafe.Offsetof(C.fbclock_shmdata_v2{}.waiters)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_shmdata_v2{}.waiters) - shmWaitersV2]struct{}
+	_ [offSysclockTime - unsafe.Offsetof(C.fbclock_clockdata{}.sysclock_time_ns)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_clockdata{}.sysclock_time_ns) - offSysclockTime]struct{}
+	_ [offSysclockErrPPB - unsafe.Offsetof(C.fbclock_clockdata{}.sysclock_error_ppb)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_clockdata{}.sysclock_error_ppb) - offSysclockErrPPB]struct{}
+	_ [offSmearStepShift - unsafe.Offsetof(C.fbclock_clockdata{}.smear_step_shift)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_clockdata{}.smear_step_shift) - offSmearStepShift]struct{}
+	_ [offPTPCaps - unsafe.Offsetof(C.fbclock_clockdata{}.ptp_caps)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_clockdata{}.ptp_caps) - offPTPCaps]struct{}
+	_ [journalHeaderSize - unsafe.Sizeof(C.fbclock_journal_header{})]struct{}
+	_ [unsafe.Sizeof(C.fbclock_journal_header{}) - journalHeaderSize]struct{}
+	_ [journalRecordSize - unsafe.Sizeof(C.fbclock_journal_record{})]struct{}
+	_ [unsafe.Sizeof(C.fbclock_journal_record{}) - journalRecordSize]struct{}
+	_ [journalMagic - C.FBCLOCK_JOURNAL_MAGIC]struct{}
+	_ [C.FBCLOCK_JOURNAL_MAGIC - journalMagic]struct{}
+	_ [journalVersion - C.FBCLOCK_JOURNAL_VERSION]struct{}
+	_ [C.FBCLOCK_JOURNAL_VERSION - journalVersion]struct{}
+	_ [offJournalCapacity - unsafe.Offsetof(C.fbclock_journal_header{}.capacity)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_journal_header{}.capacity) - offJournalCapacity]struct{}
+	_ [offJournalCount - unsafe.Offsetof(C.fbclock_journal_header{}.count)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_journal_header{}.count) - offJournalCount]struct{}
+	_ [phcRingHeaderSize - unsafe.Sizeof(C.fbclock_phc_ring_header{})]struct{}
+	_ [unsafe.Sizeof(C.fbclock_phc_ring_header{}) - phcRingHeaderSize]struct{}
+	_ [phcSampleSize - unsafe.Sizeof(C.fbclock_phc_sample{})]struct{}
+	_ [unsafe.Sizeof(C.fbclock_phc_sample{}) - phcSampleSize]struct{}
+	_ [phcRingMagic - C.FBCLOCK_PHC_RING_MAGIC]struct{}
+	_ [C.FBCLOCK_PHC_RING_MAGIC - phcRingMagic]struct{}
+	_ [phcRingVersion - C.FBCLOCK_PHC_RING_VERSION]struct{}
+	_ [C.FBCLOCK_PHC_RING_VERSION - phcRingVersion]struct{}
+	_ [offPHCRingInterval - unsafe.Offsetof(C.fbclock_phc_ring_header{}.interval_ns)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_phc_ring_header{}.interval_ns) - offPHCRingInterval]struct{}
+	_ [offPHCRingCount - unsafe.Offsetof(C.fbclock_phc_ring_header{}.count)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_phc_ring_header{}.count) - offPHCRingCount]struct{}
+	_ [offSampleDelay - unsafe.Offsetof(C.fbclock_phc_sample{}.delay_ns)]struct{}
+	_ [unsafe.Offsetof(C.fbclock_phc_sample{}.delay_ns) - offSampleDelay]struct{}
+)
+
 // OpenShm opens POSIX shared memory
 func OpenShm(path string, flags int, permissions os.FileMode) (*Shm, error) {
 	var err error
@@ -61,11 +153,24 @@ func OpenShm(path string, flags int, permissions os.FileMode) (*Shm, error) {
 	if err != nil {
 		return nil, err
 	}
-	return &Shm{File: file, Path: path}, nil
+	return &Shm{File: file, Path: path, Version: 1}, nil
+}
+
+// openWriter maps shm for writing once, it is reused by StoreShmData until Close
+func (s *Shm) openWriter() error {
+	w, err := newShmWriter(int(s.File.Fd()), s.Version)
+	if err != nil {
+		return fmt.Errorf("failed to map shm for writing: %w", err)
+	}
+	s.writer = w
+	return nil
 }
 
 // Close cleans up open POSIX shm resources
 func (s *Shm) Close() error {
+	if s.writer != nil {
+		s.writer.close()
+	}
 	if err := s.File.Close(); err != nil {
 		return err
 	}
@@ -84,6 +189,18 @@ type Data struct {
 	SmearingEndS         uint64  // Smearing ends after the Leap Second Event Time (midnight on June-30 or Dec-31)
 	UTCOffsetPreS        int32   // UTC Offset before Leap Second Event
 	UTCOffsetPostS       int32   // UTC Offset after Leap Second Event
+	PHCTimeNS            int64   // PHC time of the latest PHC to CLOCK_MONOTONIC_RAW mapping
+	SysclockTimeNS       int64   // CLOCK_MONOTONIC_RAW time of the latest PHC to CLOCK_MONOTONIC_RAW mapping
+	CoefPPB              int64   // PHC frequency relative to CLOCK_MONOTONIC_RAW
+	SysclockErrorNS      uint64  // error of the mapping at SysclockTimeNS
+	SysclockErrorPPB     uint64  // how fast mapping error grows with extrapolation
+	SmearingStartNS      uint64  // SmearingStartS in ns, precomputed for readers
+	SmearingEndNS        uint64  // SmearingEndS in ns, precomputed for readers
+	UTCOffsetPreNS       int64   // UTCOffsetPreS in ns, precomputed for readers
+	UTCOffsetPostNS      int64   // UTCOffsetPostS in ns, precomputed for readers
+	SmearStepMult        uint64  // x / SMEAR_STEP_NS == x * SmearStepMult >> SmearStepShift
+	SmearStepShift       uint32
+	PTPCaps              uint32 // PTPCap* flags, PHC read methods supported by the device
 }
 
 // OpenFBClockShmCustom returns opened POSIX shared mem used by fbclock,
@@ -101,6 +218,10 @@ func OpenFBClockShmCustom(path string) (*Shm, error) {
 		shm.Close()
 		return nil, err
 	}
+	if err := shm.openWriter(); err != nil {
+		shm.Close()
+		return nil, err
+	}
 	return shm, nil
 }
 
@@ -109,6 +230,62 @@ func OpenFBClockSHM() (*Shm, error) {
 	return OpenFBClockShmCustom(C.FBCLOCK_PATH)
 }
 
+// OpenFBClockShmV2Custom returns opened POSIX shared mem with v2 (seqlock) layout,
+// with custom path
+func OpenFBClockShmV2Custom(path string) (*Shm, error) {
+	shm, err := OpenShm(
+		path,
+		C.O_CREAT|C.O_RDWR,
+		C.S_IRUSR|C.S_IWUSR|C.S_IRGRP|C.S_IROTH,
+	)
+	if err != nil {
+		return nil, err
+	}
+	if err := shm.File.Truncate(C.FBCLOCK_SHMDATA_V2_SIZE); err != nil {
+		shm.Close()
+		return nil, err
+	}
+	shm.Version = 2
+	if err := shm.openWriter(); err != nil {
+		shm.Close()
+		return nil, err
+	}
+	return shm, nil
+}
+
+// OpenFBClockSHMV2 returns opened POSIX shared mem with v2 (seqlock) layout used by fbclock
+func OpenFBClockSHMV2() (*Shm, error) {
+	return OpenFBClockShmV2Custom(C.FBCLOCK_PATH_V2)
+}
+
+// OpenFBClockShmV3Custom returns opened POSIX shared mem with v3 (page sized, with header) layout,
+// with custom path
+func OpenFBClockShmV3Custom(path string) (*Shm, error) {
+	shm, err := OpenShm(
+		path,
+		C.O_CREAT|C.O_RDWR,
+		C.S_IRUSR|C.S_IWUSR|C.S_IRGRP|C.S_IROTH,
+	)
+	if err != nil {
+		return nil, err
+	}
+	if err := shm.File.Truncate(C.FBCLOCK_SHMDATA_V3_SIZE); err != nil {
+		shm.Close()
+		return nil, err
+	}
+	shm.Version = 3
+	if err := shm.openWriter(); err != nil {
+		shm.Close()
+		return nil, err
+	}
+	return shm, nil
+}
+
+// OpenFBClockSHMV3 returns opened POSIX shared mem with v3 layout used by fbclock
+func OpenFBClockSHMV3() (*Shm, error) {
+	return OpenFBClockShmV3Custom(C.FBCLOCK_PATH_V3)
+}
+
 // FloatAsUint32 stores float as multiplier of 2**16.
 // Effectively this means we can store max 65k like this.
 func FloatAsUint32(val float64) uint32 {
@@ -133,26 +310,107 @@ func Uint64ToUint32(val uint64) uint32 {
 	return uint32(val)
 }
 
+func toCClockData(d *Data) C.fbclock_clockdata {
+	return C.fbclock_clockdata{
+		ingress_time_ns:         C.int64_t(d.IngressTimeNS),
+		error_bound_ns:          C.uint32_t(Uint64ToUint32(d.ErrorBoundNS)),
+		holdover_multiplier_ns:  C.uint32_t(FloatAsUint32(d.HoldoverMultiplierNS)),
+		clock_smearing_start_s:  C.uint64_t(d.SmearingStartS),
+		clock_smearing_end_s:    C.uint64_t(d.SmearingEndS),
+		utc_offset_pre_s:        C.int32_t(d.UTCOffsetPreS),
+		utc_offset_post_s:       C.int32_t(d.UTCOffsetPostS),
+		phc_time_ns:             C.int64_t(d.PHCTimeNS),
+		sysclock_time_ns:        C.int64_t(d.SysclockTimeNS),
+		coef_ppb:                C.int64_t(d.CoefPPB),
+		sysclock_error_ns:       C.uint32_t(Uint64ToUint32(d.SysclockErrorNS)),
+		sysclock_error_ppb:      C.uint32_t(Uint64ToUint32(d.SysclockErrorPPB)),
+		clock_smearing_start_ns: C.uint64_t(d.SmearingStartNS),
+		clock_smearing_end_ns:   C.uint64_t(d.SmearingEndNS),
+		utc_offset_pre_ns:       C.int64_t(d.UTCOffsetPreNS),
+		utc_offset_post_ns:      C.int64_t(d.UTCOffsetPostNS),
+		smear_step_mult:         C.uint64_t(d.SmearStepMult),
+		smear_step_shift:        C.uint32_t(d.SmearStepShift),
+		ptp_caps:                C.uint32_t(d.PTPCaps),
+	}
+}
+
+func fromCClockData(cData *C.fbclock_clockdata) *Data {
+	return &Data{
+		IngressTimeNS:        int64(cData.ingress_time_ns),
+		ErrorBoundNS:         uint64(cData.error_bound_ns),
+		HoldoverMultiplierNS: Uint32AsFloat(uint32(cData.holdover_multiplier_ns)),
+		SmearingStartS:       uint64(cData.clock_smearing_start_s),
+		SmearingEndS:         uint64(cData.clock_smearing_end_s),
+		UTCOffsetPreS:        int32(cData.utc_offset_pre_s),
+		UTCOffsetPostS:       int32(cData.utc_offset_post_s),
+		PHCTimeNS:            int64(cData.phc_time_ns),
+		SysclockTimeNS:       int64(cData.sysclock_time_ns),
+		CoefPPB:              int64(cData.coef_ppb),
+		SysclockErrorNS:      uint64(cData.sysclock_error_ns),
+		SysclockErrorPPB:     uint64(cData.sysclock_error_ppb),
+		SmearingStartNS:      uint64(cData.clock_smearing_start_ns),
+		SmearingEndNS:        uint64(cData.clock_smearing_end_ns),
+		UTCOffsetPreNS:       int64(cData.utc_offset_pre_ns),
+		UTCOffsetPostNS:      int64(cData.utc_offset_post_ns),
+		SmearStepMult:        uint64(cData.smear_step_mult),
+		SmearStepShift:       uint32(cData.smear_step_shift),
+		PTPCaps:              uint32(cData.ptp_caps),
+	}
+}
+
 // StoreFBClockData will store fbclock data in shared mem,
 // fd param should be open file descriptor of that shared mem.
 func StoreFBClockData(fd uintptr, d Data) error {
-	cData := &C.fbclock_clockdata{
-		ingress_time_ns:        C.int64_t(d.IngressTimeNS),
-		error_bound_ns:         C.uint32_t(Uint64ToUint32(d.ErrorBoundNS)),
-		holdover_multiplier_ns: C.uint32_t(FloatAsUint32(d.HoldoverMultiplierNS)),
-		clock_smearing_start_s: C.uint64_t(d.SmearingStartS),
-		clock_smearing_end_s:   C.uint64_t(d.SmearingEndS),
-		utc_offset_pre_s:       C.int32_t(d.UTCOffsetPreS),
-		utc_offset_post_s:      C.int32_t(d.UTCOffsetPostS),
-	}
 	// fbclock_clockdata_store_data comes from fbclock.c
-	res := C.fbclock_clockdata_store_data(C.uint(fd), cData)
+	cData := toCClockData(&d)
+	res := C.fbclock_clockdata_store_data(C.uint(fd), &cData)
 	if res != 0 {
 		return fmt.Errorf("failed to store data: %s", strerror(res))
 	}
 	return nil
 }
 
+// StoreFBClockDataV2 will store fbclock data in shared mem with v2 (seqlock) layout,
+// fd param should be open file descriptor of that shared mem.
+func StoreFBClockDataV2(fd uintptr, d Data) error {
+	// fbclock_clockdata_store_data_v2 comes from fbclock.c
+	cData := toCClockData(&d)
+	res := C.fbclock_clockdata_store_data_v2(C.uint(fd), &cData)
+	if res != 0 {
+		return fmt.Errorf("failed to store data: %s", strerror(res))
+	}
+	return nil
+}
+
+// StoreFBClockDataV3 will store fbclock data in shared mem with v3 layout,
+// fd param should be open file descriptor of that shared mem.
+func StoreFBClockDataV3(fd uintptr, d Data) error {
+	// fbclock_clockdata_store_data_v3 comes from fbclock.c
+	cData := toCClockData(&d)
+	res := C.fbclock_clockdata_store_data_v3(C.uint(fd), &cData)
+	if res != 0 {
+		return fmt.Errorf("failed to store data: %s", strerror(res))
+	}
+	return nil
+}
+
+// StoreShmData will store fbclock data in shared mem using layout matching shm version.
+// Mapping opened by OpenFBClockShm*Custom is reused if available,
+// then the data is written from Go without going through cgo.
+func StoreShmData(shm *Shm, d Data) error {
+	if shm.writer != nil {
+		// plain memory stores, no cgo call
+		return shm.writer.store(&d)
+	}
+	switch shm.Version {
+	case 2:
+		return StoreFBClockDataV2(shm.File.Fd(), d)
+	case 3:
+		return StoreFBClockDataV3(shm.File.Fd(), d)
+	}
+	return StoreFBClockData(shm.File.Fd(), d)
+}
+
 // MmapShmpData mmaps open file as fbclock shared memory. Used in tests only.
 func MmapShmpData(fd uintptr) (unsafe.Pointer, error) {
 	data, err := unix.Mmap(int(fd), 0, C.FBCLOCK_SHMDATA_SIZE, unix.PROT_READ, unix.MAP_SHARED)
@@ -171,9 +429,63 @@ func ReadFBClockData(shmp unsafe.Pointer) (*Data, error) {
 	if res != 0 {
 		return nil, fmt.Errorf("failed to store data: %s", strerror(res))
 	}
-	return &Data{
-		IngressTimeNS:        int64(cData.ingress_time_ns),
-		ErrorBoundNS:         uint64(cData.error_bound_ns),
-		HoldoverMultiplierNS: Uint32AsFloat(uint32(cData.holdover_multiplier_ns)),
+	return fromCClockData(cData), nil
+}
+
+// MmapShmpDataV2 mmaps open file as fbclock shared memory with v2 layout. Used in tests only.
+func MmapShmpDataV2(fd uintptr) (unsafe.Pointer, error) {
+	data, err := unix.Mmap(int(fd), 0, C.FBCLOCK_SHMDATA_V2_SIZE, unix.PROT_READ, unix.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+	return unsafe.Pointer(&data[0]), nil
+}
+
+// ReadFBClockDataV2 will read Data from mmaped fbclock shared memory with v2 layout. Used in tests only
+func ReadFBClockDataV2(shmp unsafe.Pointer) (*Data, error) {
+	cData := &C.fbclock_clockdata{}
+	shmpData := (*C.fbclock_shmdata_v2)(shmp)
+	// fbclock_clockdata_load_data_v2 comes from fbclock.c
+	res := C.fbclock_clockdata_load_data_v2(shmpData, cData)
+	if res != 0 {
+		return nil, fmt.Errorf("failed to read data: %s", strerror(res))
+	}
+	return fromCClockData(cData), nil
+}
+
+// FindJournalData returns Data in effect at PHC time phcTimeNS according to the journal at path,
+// looked up by fbclock_journal_find
+func FindJournalData(path string, phcTimeNS int64) (*Data, error) {
+	cPath := C.CString(path)
+	defer C.free(unsafe.Pointer(cPath))
+	var j C.fbclock_journal
+	if res := C.fbclock_journal_open(&j, cPath); res != 0 {
+		return nil, fmt.Errorf("failed to open journal: %s", strerror(res))
+	}
+	defer C.fbclock_journal_close(&j)
+	cData := &C.fbclock_clockdata{}
+	if res := C.fbclock_journal_find(&j, C.int64_t(phcTimeNS), cData); res != 0 {
+		return nil, fmt.Errorf("failed to find journal data: %s", strerror(res))
+	}
+	return fromCClockData(cData), nil
+}
+
+// ReadPHCRingLatest returns the freshest sample of the ring at path, read by fbclock_phc_ring_latest
+func ReadPHCRingLatest(path string) (*PHCSample, error) {
+	cPath := C.CString(path)
+	defer C.free(unsafe.Pointer(cPath))
+	var r C.fbclock_phc_ring
+	if res := C.fbclock_phc_ring_open(&r, cPath); res != 0 {
+		return nil, fmt.Errorf("failed to open phc ring: %s", strerror(res))
+	}
+	defer C.fbclock_phc_ring_close(&r)
+	var s C.fbclock_phc_sample
+	if res := C.fbclock_phc_ring_latest(&r, &s); res != 0 {
+		return nil, fmt.Errorf("failed to read phc ring: %s", strerror(res))
+	}
+	return &PHCSample{
+		SysclockTimeNS: int64(s.sysclock_time_ns),
+		PHCTimeNS:      int64(s.phc_time_ns),
+		DelayNS:        int64(s.delay_ns),
 	}, nil
 }
@@ -0,0 +1,324 @@
+/*
+Copyright (c) Facebook, Inc. and its affiliates.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+*/
+
+package fbclock
+
+import (
+	"encoding/binary"
+	"fmt"
+	"hash/crc32"
+	"math"
+	"os"
+	"path/filepath"
+	"runtime"
+	"sync/atomic"
+	"unsafe"
+
+	"golang.org/x/sys/unix"
+)
+
+// Layout of fbclock_shmdata, fbclock_shmdata_v2 and fbclock_shmdata_v3 from fbclock.h,
+// checked against the C headers in shmem.go.
+const (
+	shmDataSize       = 128
+	shmDataV2Size     = 192
+	shmDataV3Size     = 4096
+	shmV3Offset       = 128 // of fbclock_shmdata_v2 inside of v3
+	shmMagic          = 0x6662636b
+	shmHeaderVersion  = 4
+	shmHeaderSize     = 8
+	shmHeaderCDSize   = 12
+	shmCRCOffset      = 0
+	shmSeqOffset      = 0
+	shmDataOffset     = 8
+	shmGenerationV2   = 128
+	shmWaitersV2      = 132
+	clockDataSize     = 120
+	offIngressTime    = 0
+	offErrorBound     = 8
+	offHoldoverMult   = 12
+	offSmearingStartS = 16
+	offSmearingEndS   = 24
+	offUTCOffsetPreS  = 32
+	offUTCOffsetPostS = 36
+	offPHCTime        = 40
+	offSysclockTime   = 48
+	offCoefPPB        = 56
+	offSysclockErrNS  = 64
+	offSysclockErrPPB = 68
+	offSmearStartNS   = 72
+	offSmearEndNS     = 80
+	offUTCPreNS       = 88
+	offUTCPostNS      = 96
+	offSmearStepMult  = 104
+	offSmearStepShift = 112
+	offPTPCaps        = 116
+
+	futexWake = 1
+)
+
+var castagnoli = crc32.MakeTable(crc32.Castagnoli)
+
+// shmWriter stores Data in fbclock shm mapped once with unix.Mmap, without cgo.
+// Memory ordering matches fbclock.c writers, so C readers can't tell them apart.
+// Not safe for concurrent use.
+type shmWriter struct {
+	mem     []byte
+	version int
+	base    int     // offset of v1 or v2 layout in mem
+	buf     [8]byte // crc input, kept here so stores don't allocate
+}
+
+func newShmWriter(fd int, version int) (*shmWriter, error) {
+	size := shmDataSize
+	switch version {
+	case 1:
+	case 2:
+		size = shmDataV2Size
+	case 3:
+		size = shmDataV3Size
+	default:
+		return nil, fmt.Errorf("unsupported shm version %d", version)
+	}
+	mem, err := unix.Mmap(fd, 0, size, unix.PROT_READ|unix.PROT_WRITE, unix.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+	w := &shmWriter{mem: mem, version: version}
+	if version == 3 {
+		w.base = shmV3Offset
+		w.initHeader()
+	}
+	return w, nil
+}
+
+// initHeader is fbclock_shm_header_init, magic goes last so readers seeing it see the rest
+func (w *shmWriter) initHeader() {
+	atomic.StoreUint32(w.u32(shmHeaderVersion), uint32(w.version))
+	atomic.StoreUint32(w.u32(shmHeaderSize), shmDataV3Size)
+	atomic.StoreUint32(w.u32(shmHeaderCDSize), clockDataSize)
+	atomic.StoreUint32(w.u32(0), shmMagic)
+}
+
+func (w *shmWriter) close() error {
+	if w.mem == nil {
+		return nil
+	}
+	err := unix.Munmap(w.mem)
+	w.mem = nil
+	return err
+}
+
+func (w *shmWriter) u64(off int) *uint64 {
+	return (*uint64)(unsafe.Pointer(&w.mem[off]))
+}
+
+func (w *shmWriter) u32(off int) *uint32 {
+	return (*uint32)(unsafe.Pointer(&w.mem[off]))
+}
+
+// crcStep is fbclock_crc64: CRC32C instruction on x86_64, xor elsewhere
+func (w *shmWriter) crcStep(crc uint64, v uint64) uint64 {
+	if runtime.GOARCH != "amd64" {
+		return crc ^ v
+	}
+	binary.LittleEndian.PutUint64(w.buf[:], v)
+	return uint64(^crc32.Update(^uint32(crc), castagnoli, w.buf[:]))
+}
+
+// crc is fbclock_inline_clockdata_crc over data as stored in shm
+func (w *shmWriter) crc(c *clockData) uint64 {
+	crc := w.crcStep(0xFFFFFFFF, uint64(c.ingressTimeNS))
+	crc = w.crcStep(crc, uint64(c.errorBoundNS))
+	crc = w.crcStep(crc, uint64(c.holdoverMultiplierNS))
+	return crc ^ 0xFFFFFFFF
+}
+
+// clockData is fbclock_clockdata with values converted the same way as for C writers
+type clockData struct {
+	ingressTimeNS        int64
+	errorBoundNS         uint32
+	holdoverMultiplierNS uint32
+	smearingStartS       uint64
+	smearingEndS         uint64
+	utcOffsetPreS        int32
+	utcOffsetPostS       int32
+	phcTimeNS            int64
+	sysclockTimeNS       int64
+	coefPPB              int64
+	sysclockErrorNS      uint32
+	sysclockErrorPPB     uint32
+	smearingStartNS      uint64
+	smearingEndNS        uint64
+	utcOffsetPreNS       int64
+	utcOffsetPostNS      int64
+	smearStepMult        uint64
+	smearStepShift       uint32
+	ptpCaps              uint32
+}
+
+func toClockData(d *Data) clockData {
+	return clockData{
+		ingressTimeNS:        d.IngressTimeNS,
+		errorBoundNS:         Uint64ToUint32(d.ErrorBoundNS),
+		holdoverMultiplierNS: FloatAsUint32(d.HoldoverMultiplierNS),
+		smearingStartS:       d.SmearingStartS,
+		smearingEndS:         d.SmearingEndS,
+		utcOffsetPreS:        d.UTCOffsetPreS,
+		utcOffsetPostS:       d.UTCOffsetPostS,
+		phcTimeNS:            d.PHCTimeNS,
+		sysclockTimeNS:       d.SysclockTimeNS,
+		coefPPB:              d.CoefPPB,
+		sysclockErrorNS:      Uint64ToUint32(d.SysclockErrorNS),
+		sysclockErrorPPB:     Uint64ToUint32(d.SysclockErrorPPB),
+		smearingStartNS:      d.SmearingStartNS,
+		smearingEndNS:        d.SmearingEndNS,
+		utcOffsetPreNS:       d.UTCOffsetPreNS,
+		utcOffsetPostNS:      d.UTCOffsetPostNS,
+		smearStepMult:        d.SmearStepMult,
+		smearStepShift:       d.SmearStepShift,
+		ptpCaps:              d.PTPCaps,
+	}
+}
+
+// stripV1 clears fields deployed v1 readers don't cover with their CRC,
+// like fbclock_clockdata_strip_v1, they are only published in v2 and v3
+func (c *clockData) stripV1() {
+	c.phcTimeNS = 0
+	c.sysclockTimeNS = 0
+	c.coefPPB = 0
+	c.sysclockErrorNS = 0
+	c.sysclockErrorPPB = 0
+	c.smearingStartNS = 0
+	c.smearingEndNS = 0
+	c.utcOffsetPreNS = 0
+	c.utcOffsetPostNS = 0
+	c.smearStepMult = 0
+	c.smearStepShift = 0
+	c.ptpCaps = 0
+}
+
+// storeData writes fields with atomic stores, so on weakly ordered CPUs
+// they can't become visible before the seq or crc store preceding them
+func (w *shmWriter) storeData(c *clockData) {
+	storeClockData(w.mem, w.base+shmDataOffset, c)
+}
+
+// storeClockData writes fbclock_clockdata at mem[base:] with atomic stores
+func storeClockData(mem []byte, base int, c *clockData) {
+	u64 := func(off int) *uint64 { return (*uint64)(unsafe.Pointer(&mem[base+off])) }
+	u32 := func(off int) *uint32 { return (*uint32)(unsafe.Pointer(&mem[base+off])) }
+	atomic.StoreUint64(u64(offIngressTime), uint64(c.ingressTimeNS))
+	atomic.StoreUint32(u32(offErrorBound), c.errorBoundNS)
+	atomic.StoreUint32(u32(offHoldoverMult), c.holdoverMultiplierNS)
+	atomic.StoreUint64(u64(offSmearingStartS), c.smearingStartS)
+	atomic.StoreUint64(u64(offSmearingEndS), c.smearingEndS)
+	atomic.StoreUint32(u32(offUTCOffsetPreS), uint32(c.utcOffsetPreS))
+	atomic.StoreUint32(u32(offUTCOffsetPostS), uint32(c.utcOffsetPostS))
+	atomic.StoreUint64(u64(offPHCTime), uint64(c.phcTimeNS))
+	atomic.StoreUint64(u64(offSysclockTime), uint64(c.sysclockTimeNS))
+	atomic.StoreUint64(u64(offCoefPPB), uint64(c.coefPPB))
+	atomic.StoreUint32(u32(offSysclockErrNS), c.sysclockErrorNS)
+	atomic.StoreUint32(u32(offSysclockErrPPB), c.sysclockErrorPPB)
+	atomic.StoreUint64(u64(offSmearStartNS), c.smearingStartNS)
+	atomic.StoreUint64(u64(offSmearEndNS), c.smearingEndNS)
+	atomic.StoreUint64(u64(offUTCPreNS), uint64(c.utcOffsetPreNS))
+	atomic.StoreUint64(u64(offUTCPostNS), uint64(c.utcOffsetPostNS))
+	atomic.StoreUint64(u64(offSmearStepMult), c.smearStepMult)
+	atomic.StoreUint32(u32(offSmearStepShift), c.smearStepShift)
+	atomic.StoreUint32(u32(offPTPCaps), c.ptpCaps)
+}
+
+// store publishes d like fbclock_writer_store
+func (w *shmWriter) store(d *Data) error {
+	if w.mem == nil {
+		return fmt.Errorf("shm writer is closed")
+	}
+	c := toClockData(d)
+	if w.version == 1 {
+		// CRC is stored last, readers retry until it matches the data
+		c.stripV1()
+		w.storeData(&c)
+		atomic.StoreUint64(w.u64(shmCRCOffset), w.crc(&c))
+		return nil
+	}
+	// odd seq tells readers the data is being updated
+	seqp := w.u64(w.base + shmSeqOffset)
+	seq := atomic.LoadUint64(seqp)
+	atomic.StoreUint64(seqp, seq+1)
+	w.storeData(&c)
+	atomic.StoreUint64(seqp, seq+2)
+	gen := w.u32(w.base + shmGenerationV2)
+	// waiters register before checking generation, Go atomics are seq_cst like the
+	// C side, so either they see the new generation or we see them
+	atomic.AddUint32(gen, 1)
+	if atomic.LoadUint32(w.u32(w.base+shmWaitersV2)) != 0 {
+		// not a private futex, waiters live in other processes
+		_, _, _ = unix.Syscall6(unix.SYS_FUTEX, uintptr(unsafe.Pointer(gen)), futexWake, math.MaxInt32, 0, 0, 0)
+	}
+	return nil
+}
+
+// Mapped files are never resized, readers touching pages past the new end would
+// get SIGBUS. createShmTemp creates a file of size next to path instead, which
+// replaceShm renames over it, like fbclock_shm_create_tmp and fbclock_shm_replace.
+func createShmTemp(path string, size int, permissions os.FileMode) (*os.File, error) {
+	f, err := os.CreateTemp(filepath.Dir(path), filepath.Base(path)+".*")
+	if err != nil {
+		return nil, err
+	}
+	// CreateTemp makes it private, readers run as other users
+	if err = f.Chmod(permissions); err == nil {
+		err = f.Truncate(int64(size))
+	}
+	if err != nil {
+		f.Close()
+		os.Remove(f.Name())
+		return nil, err
+	}
+	return f, nil
+}
+
+// replaceShm renames tmp over path and clears magic of the file it replaces,
+// so readers still mapping it stop trusting it and re-open path
+func replaceShm(tmp, path string) error {
+	old, _ := os.OpenFile(path, os.O_RDWR, 0)
+	err := os.Rename(tmp, path)
+	if old != nil {
+		// magic is the first word of all headers
+		if fi, serr := old.Stat(); err == nil && serr == nil && fi.Size() >= 4 {
+			_, _ = old.WriteAt(make([]byte, 4), 0)
+		}
+		old.Close()
+	}
+	if err != nil {
+		os.Remove(tmp)
+	}
+	return err
+}
+
+// openShmSized opens path for writing in place if it has size, nil if it has to be replaced
+func openShmSized(path string, size int) *os.File {
+	f, err := os.OpenFile(path, os.O_RDWR, 0)
+	if err != nil {
+		return nil
+	}
+	if fi, err := f.Stat(); err != nil || fi.Size() != int64(size) {
+		f.Close()
+		return nil
+	}
+	return f
+}
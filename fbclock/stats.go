@@ -16,10 +16,18 @@ limitations under the License.
 
 package fbclock
 
+/*
+#include "fbclock.h" // @oss-only
+// @fb-only: #include "time/fbclock/fbclock.h"
+*/
 import "C"
 
 import (
+	"context"
+	"fmt"
 	"time"
+
+	"github.com/facebook/time/fbclock/stats"
 )
 
 // Stats aggregate stats for fbclock GetTime results
@@ -69,3 +77,70 @@ func (s *StatsCollector) Update(tt *TrueTime, err error) {
 func (s *StatsCollector) Stats() Stats {
 	return s.stats
 }
+
+// DelayHistogramBuckets is the number of log2 buckets in LibStats.DelayHistogram
+const DelayHistogramBuckets = C.FBCLOCK_STATS_DELAY_BUCKETS
+
+// LibStats is a snapshot of fbclock C library hot path stats, aggregated over all threads of the process
+type LibStats struct {
+	Requests      int64
+	LoadRetries   int64
+	NoData        int64
+	WOUTooBig     int64
+	PHCInThePast  int64
+	PTPReadErrors int64
+	// bucket i counts PHC read delays in [2^(i-1), 2^i) ns, bucket 0 counts zero delays and the last one everything above
+	DelayHistogram [DelayHistogramBuckets]int64
+}
+
+// GetLibStats returns snapshot of C library stats
+func GetLibStats() LibStats {
+	cStats := C.fbclock_stats{}
+	C.fbclock_stats_snapshot(&cStats)
+	s := LibStats{
+		Requests:      int64(cStats.requests),
+		LoadRetries:   int64(cStats.load_retries),
+		NoData:        int64(cStats.no_data),
+		WOUTooBig:     int64(cStats.wou_too_big),
+		PHCInThePast:  int64(cStats.phc_in_the_past),
+		PTPReadErrors: int64(cStats.ptp_read_errors),
+	}
+	for i := range s.DelayHistogram {
+		s.DelayHistogram[i] = int64(cStats.delay_hist[i])
+	}
+	return s
+}
+
+// Counters returns stats as counters with keys prefixed by prefix
+func (s LibStats) Counters(prefix string) map[string]int64 {
+	c := map[string]int64{
+		prefix + "requests":        s.Requests,
+		prefix + "load_retries":    s.LoadRetries,
+		prefix + "no_data":         s.NoData,
+		prefix + "wou_too_big":     s.WOUTooBig,
+		prefix + "phc_in_the_past": s.PHCInThePast,
+		prefix + "ptp_read_errors": s.PTPReadErrors,
+	}
+	last := len(s.DelayHistogram) - 1
+	for i := 0; i < last; i++ {
+		c[fmt.Sprintf("%sdelay_ns.lt_%d", prefix, uint64(1)<<i)] = s.DelayHistogram[i]
+	}
+	c[fmt.Sprintf("%sdelay_ns.ge_%d", prefix, uint64(1)<<(last-1))] = s.DelayHistogram[last]
+	return c
+}
+
+// ExportLibStats sets C library stats as counters of stats server every interval, until ctx is done
+func ExportLibStats(ctx context.Context, server stats.Server, prefix string, interval time.Duration) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		for k, v := range GetLibStats().Counters(prefix) {
+			server.SetCounter(k, v)
+		}
+		select {
+		case <-ctx.Done():
+			return
+		case <-ticker.C:
+		}
+	}
+}
@@ -17,8 +17,11 @@ limitations under the License.
 package test
 
 import (
+	"encoding/binary"
+	"hash/crc32"
 	"math"
 	"os"
+	"runtime"
 	"testing"
 
 	lib "github.com/facebook/time/fbclock"
@@ -58,6 +61,11 @@ func TestShmem(t *testing.T) {
 		IngressTimeNS:        1648137249050666302,
 		ErrorBoundNS:         314000000, // over 65k, our old limit
 		HoldoverMultiplierNS: 1.001,
+		PHCTimeNS:            1648137249050666302,
+		SysclockTimeNS:       3424242424242,
+		CoefPPB:              -1234,
+		SysclockErrorNS:      42,
+		SysclockErrorPPB:     3,
 	}
 	err = lib.StoreFBClockData(shm.File.Fd(), d)
 	require.NoError(t, err)
@@ -70,4 +78,251 @@ func TestShmem(t *testing.T) {
 	require.Equal(t, d.IngressTimeNS, readD.IngressTimeNS)
 	require.Equal(t, d.ErrorBoundNS, readD.ErrorBoundNS)
 	require.InDelta(t, d.HoldoverMultiplierNS, readD.HoldoverMultiplierNS, 0.001)
+	// sysclock mapping is only published in v2 and v3
+	require.Equal(t, int64(0), readD.PHCTimeNS)
+	require.Equal(t, int64(0), readD.SysclockTimeNS)
+	require.Equal(t, int64(0), readD.CoefPPB)
+	require.Equal(t, uint64(0), readD.SysclockErrorNS)
+	require.Equal(t, uint64(0), readD.SysclockErrorPPB)
+}
+
+// baselineCRC is the CRC v1 readers deployed before any field was appended check
+func baselineCRC(mem []byte) uint64 {
+	crc := uint64(0xFFFFFFFF)
+	for _, v := range []uint64{
+		binary.LittleEndian.Uint64(mem[8:]),
+		uint64(binary.LittleEndian.Uint32(mem[16:])),
+		uint64(binary.LittleEndian.Uint32(mem[20:])),
+	} {
+		if runtime.GOARCH != "amd64" {
+			crc ^= v
+			continue
+		}
+		var b [8]byte
+		binary.LittleEndian.PutUint64(b[:], v)
+		crc = uint64(^crc32.Update(^uint32(crc), crc32.MakeTable(crc32.Castagnoli), b[:]))
+	}
+	return crc ^ 0xFFFFFFFF
+}
+
+func TestShmemV1BaselineCRC(t *testing.T) {
+	tmpfile, err := os.CreateTemp("", "shmemtest")
+	require.NoError(t, err)
+	defer os.Remove(tmpfile.Name())
+	shm, err := lib.OpenFBClockShmCustom(tmpfile.Name())
+	require.NoError(t, err)
+	defer shm.Close()
+	// everything the daemon publishes
+	d := lib.Data{
+		IngressTimeNS:        1648137249050666302,
+		ErrorBoundNS:         172,
+		HoldoverMultiplierNS: 43.562,
+		SmearingStartS:       1483228836,
+		SmearingEndS:         1483293836,
+		UTCOffsetPreS:        36,
+		UTCOffsetPostS:       37,
+		PHCTimeNS:            1648137249050666302,
+		SysclockTimeNS:       3424242424242,
+		CoefPPB:              -1234,
+		SysclockErrorNS:      42,
+		SysclockErrorPPB:     3,
+		SmearingStartNS:      1483228836000000000,
+		SmearingEndNS:        1483293836000000000,
+		UTCOffsetPreNS:       36000000000,
+		UTCOffsetPostNS:      37000000000,
+		SmearStepMult:        283796062672455,
+		SmearStepShift:       64,
+		PTPCaps:              lib.PTPCapProbed | lib.PTPCapExtended,
+	}
+	require.NoError(t, lib.StoreShmData(shm, d))
+	mem, err := os.ReadFile(tmpfile.Name())
+	require.NoError(t, err)
+	require.Equal(t, baselineCRC(mem), binary.LittleEndian.Uint64(mem))
+}
+
+func TestShmemV2(t *testing.T) {
+	tmpfile, err := os.CreateTemp("", "shmemtest")
+	require.NoError(t, err)
+	defer os.Remove(tmpfile.Name())
+	shm, err := lib.OpenFBClockShmV2Custom(tmpfile.Name())
+	require.NoError(t, err)
+	defer shm.Close()
+	require.Equal(t, 2, shm.Version)
+	d := lib.Data{
+		IngressTimeNS:        1648137249050666302,
+		ErrorBoundNS:         314000000,
+		HoldoverMultiplierNS: 1.001,
+		SmearingStartS:       1483228836,
+		SmearingEndS:         1483293836,
+		UTCOffsetPreS:        36,
+		UTCOffsetPostS:       37,
+		SmearingStartNS:      1483228836000000000,
+		SmearingEndNS:        1483293836000000000,
+		UTCOffsetPreNS:       36000000000,
+		UTCOffsetPostNS:      37000000000,
+		SmearStepMult:        283796062672455,
+		SmearStepShift:       64,
+		PTPCaps:              lib.PTPCapProbed | lib.PTPCapExtended,
+	}
+	err = lib.StoreShmData(shm, d)
+	require.NoError(t, err)
+
+	shmdata, err := lib.MmapShmpDataV2(shm.File.Fd())
+	require.NoError(t, err)
+
+	readD, err := lib.ReadFBClockDataV2(shmdata)
+	require.NoError(t, err)
+	require.Equal(t, d.IngressTimeNS, readD.IngressTimeNS)
+	require.Equal(t, d.ErrorBoundNS, readD.ErrorBoundNS)
+	require.InDelta(t, d.HoldoverMultiplierNS, readD.HoldoverMultiplierNS, 0.001)
+	require.Equal(t, d.SmearingStartS, readD.SmearingStartS)
+	require.Equal(t, d.SmearingEndS, readD.SmearingEndS)
+	require.Equal(t, d.UTCOffsetPreS, readD.UTCOffsetPreS)
+	require.Equal(t, d.UTCOffsetPostS, readD.UTCOffsetPostS)
+	require.Equal(t, d.SmearingStartNS, readD.SmearingStartNS)
+	require.Equal(t, d.SmearingEndNS, readD.SmearingEndNS)
+	require.Equal(t, d.UTCOffsetPreNS, readD.UTCOffsetPreNS)
+	require.Equal(t, d.UTCOffsetPostNS, readD.UTCOffsetPostNS)
+	require.Equal(t, d.SmearStepMult, readD.SmearStepMult)
+	require.Equal(t, d.SmearStepShift, readD.SmearStepShift)
+	require.Equal(t, d.PTPCaps, readD.PTPCaps)
+}
+
+func TestShmemWriterReuse(t *testing.T) {
+	tmpfile, err := os.CreateTemp("", "shmemtest")
+	require.NoError(t, err)
+	defer os.Remove(tmpfile.Name())
+	shm, err := lib.OpenFBClockShmV2Custom(tmpfile.Name())
+	require.NoError(t, err)
+	defer shm.Close()
+
+	shmdata, err := lib.MmapShmpDataV2(shm.File.Fd())
+	require.NoError(t, err)
+	for i := int64(1); i <= 100; i++ {
+		d := lib.Data{
+			IngressTimeNS: i,
+			ErrorBoundNS:  uint64(i * 2),
+		}
+		err = lib.StoreShmData(shm, d)
+		require.NoError(t, err)
+		readD, err := lib.ReadFBClockDataV2(shmdata)
+		require.NoError(t, err)
+		require.Equal(t, d.IngressTimeNS, readD.IngressTimeNS)
+		require.Equal(t, d.ErrorBoundNS, readD.ErrorBoundNS)
+	}
+}
+
+func TestShmemGoWriterMatchesC(t *testing.T) {
+	d := lib.Data{
+		IngressTimeNS:        1647269091803102957,
+		ErrorBoundNS:         172,
+		HoldoverMultiplierNS: 43.562,
+		SmearingStartS:       1483228836,
+		SmearingEndS:         1483293836,
+		UTCOffsetPreS:        36,
+		UTCOffsetPostS:       37,
+		PHCTimeNS:            1647269091803102000,
+		SysclockTimeNS:       123456789,
+		CoefPPB:              -12345,
+		SysclockErrorNS:      20,
+		SysclockErrorPPB:     30,
+		SmearingStartNS:      1483228836000000000,
+		SmearingEndNS:        1483293836000000000,
+		UTCOffsetPreNS:       36000000000,
+		UTCOffsetPostNS:      37000000000,
+		SmearStepMult:        283796062672455,
+		SmearStepShift:       64,
+		PTPCaps:              lib.PTPCapProbed | lib.PTPCapPrecise,
+	}
+	for _, version := range []int{1, 2, 3} {
+		open := lib.OpenFBClockShmCustom
+		storeC := lib.StoreFBClockData
+		switch version {
+		case 2:
+			open = lib.OpenFBClockShmV2Custom
+			storeC = lib.StoreFBClockDataV2
+		case 3:
+			open = lib.OpenFBClockShmV3Custom
+			storeC = lib.StoreFBClockDataV3
+		}
+		goFile, err := os.CreateTemp("", "shmemtest")
+		require.NoError(t, err)
+		defer os.Remove(goFile.Name())
+		cFile, err := os.CreateTemp("", "shmemtest")
+		require.NoError(t, err)
+		defer os.Remove(cFile.Name())
+
+		goShm, err := open(goFile.Name())
+		require.NoError(t, err)
+		defer goShm.Close()
+		require.NoError(t, lib.StoreShmData(goShm, d))
+
+		cShm, err := open(cFile.Name())
+		require.NoError(t, err)
+		defer cShm.Close()
+		require.NoError(t, storeC(cShm.File.Fd(), d))
+
+		// same bytes, including CRC or seq, generation and v3 header
+		goBytes, err := os.ReadFile(goFile.Name())
+		require.NoError(t, err)
+		cBytes, err := os.ReadFile(cFile.Name())
+		require.NoError(t, err)
+		require.Equal(t, cBytes, goBytes, "shm v%d", version)
+	}
+}
+
+func TestJournal(t *testing.T) {
+	f, err := os.CreateTemp("", "journaltest")
+	require.NoError(t, err)
+	defer os.Remove(f.Name())
+	f.Close()
+
+	_, err = lib.OpenJournal(f.Name(), 1)
+	require.Error(t, err)
+	j, err := lib.OpenJournal(f.Name(), 4)
+	require.NoError(t, err)
+	_, err = lib.FindJournalData(f.Name(), 1000)
+	require.Error(t, err)
+
+	// written from Go, read with fbclock_journal_find
+	for i := 1; i <= 6; i++ {
+		d := lib.Data{IngressTimeNS: int64(i * 1000), ErrorBoundNS: uint64(i), PTPCaps: lib.PTPCapProbed}
+		require.NoError(t, j.Append(&d))
+	}
+	require.Error(t, j.Append(&lib.Data{IngressTimeNS: 5999}))
+	require.Equal(t, uint64(6), j.Count())
+	for i := 4; i <= 6; i++ {
+		got, err := lib.FindJournalData(f.Name(), int64(i*1000+999))
+		require.NoError(t, err)
+		require.Equal(t, &lib.Data{IngressTimeNS: int64(i * 1000), ErrorBoundNS: uint64(i), PTPCaps: lib.PTPCapProbed}, got)
+	}
+	// oldest records are overwritten
+	_, err = lib.FindJournalData(f.Name(), 3999)
+	require.Error(t, err)
+	require.NoError(t, j.Close())
+
+	// records survive reopening with the same capacity only
+	j, err = lib.OpenJournal(f.Name(), 4)
+	require.NoError(t, err)
+	require.Equal(t, uint64(6), j.Count())
+	require.NoError(t, j.Close())
+	// other capacity replaces the file, the old one is never resized under its readers
+	old, err := os.Open(f.Name())
+	require.NoError(t, err)
+	defer old.Close()
+	j, err = lib.OpenJournal(f.Name(), 8)
+	require.NoError(t, err)
+	require.Equal(t, uint64(0), j.Count())
+	require.NoError(t, j.Close())
+	fi, err := old.Stat()
+	require.NoError(t, err)
+	require.Equal(t, int64(128+4*128), fi.Size())
+	magic := make([]byte, 4)
+	_, err = old.ReadAt(magic, 0)
+	require.NoError(t, err)
+	require.Equal(t, []byte{0, 0, 0, 0}, magic)
+	fi, err = os.Stat(f.Name())
+	require.NoError(t, err)
+	require.Equal(t, int64(128+8*128), fi.Size())
+	require.Equal(t, os.FileMode(0644), fi.Mode().Perm())
 }
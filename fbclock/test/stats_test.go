@@ -17,11 +17,13 @@ limitations under the License.
 package test
 
 import (
+	"context"
 	"fmt"
 	"testing"
 	"time"
 
 	lib "github.com/facebook/time/fbclock"
+	"github.com/facebook/time/fbclock/stats"
 
 	"github.com/stretchr/testify/require"
 )
@@ -118,3 +120,30 @@ func TestStatsUpdate(t *testing.T) {
 		})
 	}
 }
+
+func TestLibStatsCounters(t *testing.T) {
+	s := lib.LibStats{Requests: 10, LoadRetries: 2, PTPReadErrors: 1}
+	s.DelayHistogram[0] = 3
+	s.DelayHistogram[4] = 5
+	s.DelayHistogram[lib.DelayHistogramBuckets-1] = 7
+
+	c := s.Counters("fbclock.")
+	require.Len(t, c, 6+lib.DelayHistogramBuckets)
+	require.Equal(t, int64(10), c["fbclock.requests"])
+	require.Equal(t, int64(2), c["fbclock.load_retries"])
+	require.Equal(t, int64(1), c["fbclock.ptp_read_errors"])
+	require.Equal(t, int64(3), c["fbclock.delay_ns.lt_1"])
+	require.Equal(t, int64(5), c["fbclock.delay_ns.lt_16"])
+	require.Equal(t, int64(7), c["fbclock.delay_ns.ge_4194304"])
+}
+
+func TestExportLibStats(t *testing.T) {
+	server := stats.NewStats()
+	ctx, cancel := context.WithCancel(context.Background())
+	cancel()
+	// exports once even if ctx is already done
+	lib.ExportLibStats(ctx, server, "fbclock.", time.Second)
+	c := server.Get()
+	require.Contains(t, c, "fbclock.requests")
+	require.Contains(t, c, "fbclock.delay_ns.lt_1")
+}